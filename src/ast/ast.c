@@ -30,14 +30,14 @@ bool ast_node_is_grammar(AST *ast, NodeID node_id) {
 }
 
 // Mutable version of ast_node_get_token
-Token *_ast_node_get_token_mut(AST *ast, NodeID node_id) {
+Token *ast_node_get_token_mut(AST *ast, NodeID node_id) {
   DZ_ASSERT(ast_node_is_token(ast, node_id));
   ASTNode *node = _get_node(ast, node_id);
   return &(node->node.token);
 }
 
 const Token *ast_node_get_token(AST *ast, NodeID node_id) {
-  return _ast_node_get_token_mut(ast, node_id);
+  return ast_node_get_token_mut(ast, node_id);
 }
 
 // Mutable version of ast_node_get_grammar
@@ -136,6 +136,20 @@ NodeID ast_node_add_child_grammar(AST *ast, NodeID parent_id,
   return new_node_id;
 }
 
+NodeID ast_node_detach_children(AST *ast, NodeID parent_id) {
+  GrammarNode *parent_node = ast_node_get_grammar_mut(ast, parent_id);
+  const NodeID first_child = parent_node->first_child;
+  parent_node->first_child = NO_NODE;
+  parent_node->last_child = NO_NODE;
+  return first_child;
+}
+
+void ast_node_append_child(AST *ast, NodeID parent_id, NodeID child_id) {
+  GrammarNode *parent_node = ast_node_get_grammar_mut(ast, parent_id);
+  _get_node(ast, child_id)->next_sibling = NO_NODE;
+  _ast_add_node_to_linked_list(ast, parent_node, child_id);
+}
+
 const char *grammar_type_to_string(GRAMMAR_TYPE type) {
   switch (type) {
   case GRAMMAR_TYPE_PROGRAM:
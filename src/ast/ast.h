@@ -92,8 +92,16 @@ NodeID ast_node_add_child_token(AST *ast, NodeID parent_id, Token token);
 // method
 NodeID ast_node_add_child_grammar(AST *ast, NodeID parent_id,
                                   GRAMMAR_TYPE grammar_type);
+// Empties a grammar node's list of children, and returns the first of them.
+// The detached children stay linked to each other through their siblings, so
+// they can be walked and appended back with ast_node_append_child
+NodeID ast_node_detach_children(AST *ast, NodeID parent_id);
+// Moves an existing node to the end of a grammar node's children. The node's
+// old next sibling is forgotten, so read it first when walking a list
+void ast_node_append_child(AST *ast, NodeID parent_id, NodeID child_id);
 // If the node is a Token node, it gets the Token. Otherwise, it panics
 const Token *ast_node_get_token(AST *ast, NodeID node_id);
+Token *ast_node_get_token_mut(AST *ast, NodeID node_id);
 // If the node is a grammar node, retrives the grammar type. Otherwise, it
 // panics.
 GRAMMAR_TYPE ast_node_get_grammar(AST *ast, NodeID node_id);
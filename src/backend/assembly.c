@@ -1,4 +1,10 @@
 #include "assembly.h"
+#include "../common/string_util.h"
+#include <signal.h>
+#include <sys/stat.h>
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <unistd.h>
+#endif
 
 bool assembler_init(AssemblerInfo *cmd, const CompilerConfig *config) {
   const PlatformInfo *target = &config->target;
@@ -8,6 +14,7 @@ bool assembler_init(AssemblerInfo *cmd, const CompilerConfig *config) {
         .assembler_flags = "",
         .linker_flags = "",
         .output_ext = "",
+        .freestanding = config->freestanding,
     };
     return true;
   }
@@ -15,7 +22,8 @@ bool assembler_init(AssemblerInfo *cmd, const CompilerConfig *config) {
     *cmd = (AssemblerInfo){.output_ext = "",
                            .linker_flags = "-m64",
                            .assembler_flags = "-m64",
-                           .gcc_command = "x86_64-linux-gnu-gcc"};
+                           .gcc_command = "x86_64-linux-gnu-gcc",
+                           .freestanding = config->freestanding};
     return true;
   } else if (target->os == OS_WINDOWS && target->arch == ARCH_X86_64) {
     *cmd = (AssemblerInfo){
@@ -30,22 +38,239 @@ bool assembler_init(AssemblerInfo *cmd, const CompilerConfig *config) {
   return false;
 }
 
-bool assembler_invoke(AssemblerInfo *cmd, const char *asm_file,
-                      const char *output_file) {
-  char command[PATH_MAX * 2];
-  snprintf(command, sizeof(command), "%s %s %s -x assembler \"%s\" -o \"%s\"",
-           cmd->gcc_command, cmd->assembler_flags, cmd->linker_flags, asm_file,
-           output_file);
-  return system(command) == EXIT_SUCCESS;
+#define ASSEMBLER_MAX_ARGS 16
+
+typedef enum {
+  ASSEMBLER_STEP_BUILD,    // Assembly to executable
+  ASSEMBLER_STEP_ASSEMBLE, // Assembly to object file
+  ASSEMBLER_STEP_LINK,     // Object file to executable
+} AssemblerStep;
+
+// Builds the argv for running step on input (a file, or "-" for stdin) into
+// output_file. Empty flags are left out, since there's no shell to drop them
+static void _build_argv(const AssemblerInfo *cmd, AssemblerStep step,
+                        const char *input, const char *output_file,
+                        const char *argv[ASSEMBLER_MAX_ARGS]) {
+  DZ_ASSERT(cmd->gcc_path[0] != '\0',
+            "assembler_is_available() must be called first");
+  uint32_t argc = 0;
+  argv[argc++] = cmd->gcc_path;
+  if (step != ASSEMBLER_STEP_LINK && cmd->assembler_flags[0])
+    argv[argc++] = cmd->assembler_flags;
+  if (step != ASSEMBLER_STEP_ASSEMBLE && cmd->linker_flags[0])
+    argv[argc++] = cmd->linker_flags;
+  if (step != ASSEMBLER_STEP_ASSEMBLE && cmd->freestanding) {
+    argv[argc++] = "-static";
+    argv[argc++] = "-nostdlib";
+  }
+  if (step == ASSEMBLER_STEP_ASSEMBLE)
+    argv[argc++] = "-c";
+  if (step != ASSEMBLER_STEP_LINK) {
+    argv[argc++] = "-x";
+    argv[argc++] = "assembler";
+  }
+  argv[argc++] = input;
+  argv[argc++] = "-o";
+  argv[argc++] = output_file;
+  argv[argc] = NULL;
+}
+
+static bool _run_step(const AssemblerInfo *cmd, AssemblerStep step,
+                      const char *input, const char *output_file) {
+  const char *argv[ASSEMBLER_MAX_ARGS];
+  _build_argv(cmd, step, input, output_file, argv);
+  ChildProcess child;
+  // Nothing is written, closing the input right away just waits
+  FILE *child_input = system_spawn_with_input(argv, &child);
+  return child_input && system_close_and_wait(child_input, &child);
+}
+
+bool assembler_assemble_object(AssemblerInfo *cmd, const char *asm_file,
+                               const char *object_file) {
+  return _run_step(cmd, ASSEMBLER_STEP_ASSEMBLE, asm_file, object_file);
+}
+
+bool assembler_link(AssemblerInfo *cmd, const char *object_file,
+                    const char *output_file) {
+  return _run_step(cmd, ASSEMBLER_STEP_LINK, object_file, output_file);
+}
+
+bool assembler_spawn(AssemblerInfo *cmd, const char *output_file,
+                     AssemblerProcess *process) {
+  const char *argv[ASSEMBLER_MAX_ARGS];
+  _build_argv(cmd, ASSEMBLER_STEP_BUILD, "-", output_file, argv);
+#if !defined(_WIN32) && !defined(_WIN64)
+  // If the assembler dies early, writing to it should fail with EPIPE so it
+  // can be reported, instead of killing us. Only while it runs, the rest of
+  // the process keeps its own handler
+  struct sigaction ignore = {.sa_handler = SIG_IGN};
+  sigemptyset(&ignore.sa_mask);
+  sigaction(SIGPIPE, &ignore, &process->previous_sigpipe);
+#endif
+  process->input = system_spawn_with_input(argv, &process->process);
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (!process->input) {
+    sigaction(SIGPIPE, &process->previous_sigpipe, NULL);
+  }
+#endif
+  return process->input != NULL;
+}
+
+bool assembler_wait(AssemblerProcess *process) {
+  const bool ok = system_close_and_wait(process->input, &process->process);
+  process->input = NULL;
+#if !defined(_WIN32) && !defined(_WIN64)
+  sigaction(SIGPIPE, &process->previous_sigpipe, NULL);
+#endif
+  return ok;
+}
+
+// ----------------------
+// Probe Cache
+//
+// One line per toolchain, "<available> <mtime> <path>". Probing a toolchain
+// costs a gcc startup, while the cache costs a stat and a small read. Only
+// successful probes are recorded, since a probe can fail for reasons that
+// don't last (e.g. running out of processes), and a cached failure would
+// disable the toolchain until it's reinstalled
+// ----------------------
+
+#define PROBE_CACHE_DIR "teeny"
+#define PROBE_CACHE_FILE "toolchains"
+#define PROBE_CACHE_MAX_LINE (PATH_MAX + 64)
+
+// Puts the path of the cache file inside path. Returns false if there's
+// nowhere to put one
+static bool _probe_cache_path(char *path, size_t path_size, bool create) {
+  char root[PATH_MAX];
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  const char *local_app_data = getenv("LOCALAPPDATA");
+  if (xdg && xdg[0]) {
+    snprintf(root, sizeof(root), "%s", xdg);
+  } else if (home && home[0]) {
+    snprintf(root, sizeof(root), "%s/.cache", home);
+  } else if (local_app_data && local_app_data[0]) {
+    snprintf(root, sizeof(root), "%s", local_app_data);
+  } else {
+    return false;
+  }
+  const int len = snprintf(path, path_size, "%s/" PROBE_CACHE_DIR, root);
+  if (len < 0 || (size_t)len >= path_size) {
+    return false;
+  }
+  if (create) {
+#if defined(_WIN32) || defined(_WIN64)
+    mkdir(root);
+    mkdir(path);
+#else
+    mkdir(root, 0755);
+    mkdir(path, 0755);
+#endif
+  }
+  const int full_len =
+      snprintf(path, path_size, "%s/" PROBE_CACHE_DIR "/" PROBE_CACHE_FILE, root);
+  return full_len > 0 && (size_t)full_len < path_size;
+}
+
+// Looks up a toolchain in the cache. Returns if it's recorded as available
+// for this modification time. Lines that don't parse are skipped, as are
+// failures recorded by older versions of the cache
+static bool _probe_cache_lookup(const char *gcc_path, long long mtime) {
+  char cache_path[PATH_MAX];
+  if (!_probe_cache_path(cache_path, sizeof(cache_path), false)) {
+    return false;
+  }
+  FILE *cache = fopen(cache_path, "r");
+  if (!cache) {
+    return false;
+  }
+  char line[PROBE_CACHE_MAX_LINE];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), cache)) {
+    int cached_available = 0;
+    long long cached_mtime = 0;
+    int path_start = 0;
+    if (sscanf(line, "%d %lld %n", &cached_available, &cached_mtime,
+               &path_start) != 2) {
+      continue;
+    }
+    strip_trailing_newlines(line, sizeof(line));
+    found = cached_available == 1 && cached_mtime == mtime &&
+            strcmp(line + path_start, gcc_path) == 0;
+  }
+  fclose(cache);
+  return found;
+}
+
+// Records a toolchain that probed successfully, replacing any older entry for
+// the same path. The new cache is written beside the old one and renamed over
+// it, so concurrent compiles only ever see a whole file
+static void _probe_cache_store(const char *gcc_path, long long mtime) {
+  char cache_path[PATH_MAX];
+  if (!_probe_cache_path(cache_path, sizeof(cache_path), true)) {
+    return;
+  }
+  char tmp_path[PATH_MAX + 32];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", cache_path,
+#if defined(_WIN32) || defined(_WIN64)
+           (long)GetCurrentProcessId()
+#else
+           (long)getpid()
+#endif
+  );
+  FILE *tmp = fopen(tmp_path, "w");
+  if (!tmp) {
+    return;
+  }
+  FILE *old = fopen(cache_path, "r");
+  if (old) {
+    char line[PROBE_CACHE_MAX_LINE];
+    while (fgets(line, sizeof(line), old)) {
+      int path_start = 0;
+      int cached_available = 0;
+      long long cached_mtime = 0;
+      if (sscanf(line, "%d %lld %n", &cached_available, &cached_mtime,
+                 &path_start) != 2 ||
+          cached_available != 1) {
+        continue;
+      }
+      char cached_path[PROBE_CACHE_MAX_LINE];
+      strip_newline(line + path_start, cached_path, sizeof(cached_path));
+      if (strcmp(cached_path, gcc_path) != 0) {
+        fputs(line, tmp);
+      }
+    }
+    fclose(old);
+  }
+  fprintf(tmp, "1 %lld %s\n", mtime, gcc_path);
+  if (fclose(tmp) != 0 || rename(tmp_path, cache_path) != 0) {
+    remove(tmp_path);
+  }
 }
 
 bool assembler_is_available(AssemblerInfo *cmd) {
   if (!cmd || !cmd->gcc_command)
     return false;
-  char command[100];
-  snprintf(command, sizeof(command), "%s --version > /dev/null 2>&1",
-           cmd->gcc_command);
-  return system(command) == EXIT_SUCCESS;
+  if (!system_find_executable(cmd->gcc_command, cmd->gcc_path,
+                              sizeof(cmd->gcc_path))) {
+    cmd->gcc_path[0] = '\0';
+    return false;
+  }
+  struct stat st;
+  if (stat(cmd->gcc_path, &st) != 0) {
+    return false;
+  }
+  const long long mtime = (long long)st.st_mtime;
+  if (_probe_cache_lookup(cmd->gcc_path, mtime)) {
+    return true;
+  }
+  const char *argv[] = {cmd->gcc_path, "--version", NULL};
+  if (!system_run_quiet(argv)) {
+    return false;
+  }
+  _probe_cache_store(cmd->gcc_path, mtime);
+  return true;
 }
 
 void assembler_print_help(AssemblerInfo *cmd) {
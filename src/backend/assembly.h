@@ -8,25 +8,59 @@
 // --------------------------------
 
 #include "../core/core.h"
+#include "../core/system.h"
 #include "compiler.h"
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <signal.h>
+#endif
 
 typedef struct {
   const char *gcc_command;
   const char *assembler_flags;
   const char *linker_flags;
   const char *output_ext;
+  bool freestanding;       // Link a static executable without libc
+  char gcc_path[PATH_MAX]; // Where gcc_command was found, once available
 } AssemblerInfo;
 
+// A running assembler, started with assembler_spawn
+typedef struct {
+  FILE *input; // Assembly written here gets assembled
+  ChildProcess process;
+#if !defined(_WIN32) && !defined(_WIN64)
+  struct sigaction previous_sigpipe; // Put back by assembler_wait
+#endif
+} AssemblerProcess;
+
 // Initializes an asm command inside cmd based off a compiler config.
 bool assembler_init(AssemblerInfo *cmd, const CompilerConfig *config);
 
-// Invokes the compiler command on the system
-// Compiles asm_file into the output_file
+// Assembles asm_file into a relocatable object_file, without linking it
+// Returns if it succeeds
+bool assembler_assemble_object(AssemblerInfo *cmd, const char *asm_file,
+                               const char *object_file);
+
+// Links an object_file into the output_file
+// Returns if it succeeds
+bool assembler_link(AssemblerInfo *cmd, const char *object_file,
+                    const char *output_file);
+
+// Starts the assembler on the command, reading assembly from
+// process->input and assembling it into output_file as it arrives.
+// Returns false if it couldn't be started
+bool assembler_spawn(AssemblerInfo *cmd, const char *output_file,
+                     AssemblerProcess *process);
+
+// Closes the assembler's input, and waits for it to finish. SIGPIPE is
+// ignored from assembler_spawn until then, so writes to an assembler that
+// died fail with EPIPE
 // Returns if it succeeds
-bool assembler_invoke(AssemblerInfo *cmd, const char *asm_file,
-                      const char *output_file);
+bool assembler_wait(AssemblerProcess *process);
 
-// Checks if the command is installed on the host platform
+// Checks if the command is installed on the host platform. Must be called
+// before the assembler is invoked or spawned. Toolchains that are found are
+// cached, keyed by the compiler's path and modification time, so the compiler
+// only has to be run once. Failures are always probed again
 bool assembler_is_available(AssemblerInfo *cmd);
 
 // Prints a help message based off the command
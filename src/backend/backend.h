@@ -3,9 +3,12 @@
 // -----------------------------
 // BACKEND
 //
-// Handles transforming an AST into assembly, and
-// compiling it to machine code
+// Handles lowering an AST into IR, optimizing it,
+// transforming it into assembly, and compiling it to
+// machine code
 // -----------------------------
 
 #include "assembly.h"
 #include "emitter-x86.h"
+#include "ir.h"
+#include "ir_optimizer.h"
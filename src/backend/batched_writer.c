@@ -1,39 +1,416 @@
 #include "batched_writer.h"
 #include "dz_debug.h"
+#include "timer.h"
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// ----------------------
+// Pipelined Output
+// ----------------------
+
+#ifndef _WIN32
+#define BATCHED_WRITER_HAS_PIPELINE 1
+
+// A ring of buffers shared with a background thread. Buffers are queued in
+// ring order starting at head, and the caller fills the one right after the
+// queue, so nothing but the lengths needs to be handed across
+struct BatchedWriterPipeline {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;  // Signaled when a buffer is queued, or on close
+  pthread_cond_t drained; // Signaled when a buffer has been written
+  FILE *output_file;
+  char *buffers[BATCHED_WRITER_PIPELINE_DEPTH];
+  size_t lengths[BATCHED_WRITER_PIPELINE_DEPTH];
+  uint32_t head;  // Next buffer to be written
+  uint32_t count; // Buffers queued or being written
+  uint32_t fill;  // Buffer the caller is filling
+  bool closing;
+  int error; // errno of the first failed write
+};
+
+static void *_pipeline_thread(void *arg) {
+  BatchedWriterPipeline *pipeline = arg;
+  pthread_mutex_lock(&pipeline->lock);
+  for (;;) {
+    while (pipeline->count == 0 && !pipeline->closing) {
+      pthread_cond_wait(&pipeline->queued, &pipeline->lock);
+    }
+    if (pipeline->count == 0) {
+      break;
+    }
+    const char *buffer = pipeline->buffers[pipeline->head];
+    const size_t len = pipeline->lengths[pipeline->head];
+    const bool skip = pipeline->error != 0;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    // Once a write has failed, the rest are dropped
+    const size_t written =
+        skip ? len : fwrite(buffer, 1, len, pipeline->output_file);
+    const int error = errno;
+
+    pthread_mutex_lock(&pipeline->lock);
+    if (written != len) {
+      pipeline->error = error ? error : EIO;
+    }
+    pipeline->head = (pipeline->head + 1) % BATCHED_WRITER_PIPELINE_DEPTH;
+    pipeline->count--;
+    pthread_cond_signal(&pipeline->drained);
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+  return NULL;
+}
+
+static BatchedWriterPipeline *_pipeline_create(FILE *output_file) {
+  BatchedWriterPipeline *pipeline = calloc(1, sizeof(BatchedWriterPipeline));
+  if (pipeline == NULL) {
+    return NULL;
+  }
+  pipeline->output_file = output_file;
+  for (uint32_t i = 0; i < BATCHED_WRITER_PIPELINE_DEPTH; i++) {
+    pipeline->buffers[i] = malloc(BATCHED_WRITER_BUFFER_SIZE);
+    if (pipeline->buffers[i] == NULL) {
+      DZ_THROW("batched_writer_init() failed to allocate output buffers");
+    }
+  }
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->queued, NULL);
+  pthread_cond_init(&pipeline->drained, NULL);
+  if (pthread_create(&pipeline->thread, NULL, _pipeline_thread, pipeline) !=
+      0) {
+    // Without a thread, the writer just stays synchronous
+    DZ_WARN("Could not start output thread, writing synchronously");
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->queued);
+    pthread_cond_destroy(&pipeline->drained);
+    for (uint32_t i = 0; i < BATCHED_WRITER_PIPELINE_DEPTH; i++) {
+      free(pipeline->buffers[i]);
+    }
+    free(pipeline);
+    return NULL;
+  }
+  return pipeline;
+}
+
+// Queues the buffer being filled, and returns the next one to fill. Only
+// blocks when every other buffer is still waiting to be written
+static char *_pipeline_submit(BatchedWriter *writer) {
+  BatchedWriterPipeline *pipeline = writer->pipeline;
+  pthread_mutex_lock(&pipeline->lock);
+  if (pipeline->error) {
+    writer->error = pipeline->error;
+  }
+  pipeline->lengths[pipeline->fill] = writer->buffer_pos;
+  pipeline->count++;
+  pthread_cond_signal(&pipeline->queued);
+  if (pipeline->count == BATCHED_WRITER_PIPELINE_DEPTH) {
+    Timer stall;
+    timer_init(&stall);
+    timer_start(&stall);
+    while (pipeline->count == BATCHED_WRITER_PIPELINE_DEPTH) {
+      pthread_cond_wait(&pipeline->drained, &pipeline->lock);
+    }
+    timer_stop(&stall);
+    writer->stats.stalls++;
+    writer->stats.stall_ms += timer_elapsed_ms(&stall);
+  }
+  pipeline->fill = (pipeline->fill + 1) % BATCHED_WRITER_PIPELINE_DEPTH;
+  pthread_mutex_unlock(&pipeline->lock);
+  return pipeline->buffers[pipeline->fill];
+}
+
+// Waits for every queued buffer to be written, and tears the pipeline down
+static void _pipeline_destroy(BatchedWriter *writer) {
+  BatchedWriterPipeline *pipeline = writer->pipeline;
+  Timer stall;
+  timer_init(&stall);
+  timer_start(&stall);
+  pthread_mutex_lock(&pipeline->lock);
+  const bool waited = pipeline->count > 0;
+  pipeline->closing = true;
+  pthread_cond_signal(&pipeline->queued);
+  pthread_mutex_unlock(&pipeline->lock);
+  pthread_join(pipeline->thread, NULL);
+  timer_stop(&stall);
+  if (waited) {
+    writer->stats.stalls++;
+    writer->stats.stall_ms += timer_elapsed_ms(&stall);
+  }
+
+  if (pipeline->error) {
+    writer->error = pipeline->error;
+  }
+  pthread_mutex_destroy(&pipeline->lock);
+  pthread_cond_destroy(&pipeline->queued);
+  pthread_cond_destroy(&pipeline->drained);
+  for (uint32_t i = 0; i < BATCHED_WRITER_PIPELINE_DEPTH; i++) {
+    free(pipeline->buffers[i]);
+  }
+  free(pipeline);
+  writer->pipeline = NULL;
+  writer->buffer = NULL;
+}
+#else
+#define BATCHED_WRITER_HAS_PIPELINE 0
+#endif
+
+// ----------------------
+// Memory Mapped Output
+// ----------------------
+
+// Mapped files are only written where their space can be reserved up front
+// (macOS has no posix_fallocate). Storing into a hole of a shared mapping on a
+// full disk raises SIGBUS, where a reservation just fails
+#if !defined(_WIN32) && !defined(__APPLE__)
+#define BATCHED_WRITER_HAS_MAPPING 1
+
+// The file starts small, so short outputs don't reserve much disk, and doubles
+// whenever it fills up, so remapping stays rare. Space is reserved as the file
+// grows, and whatever wasn't written is trimmed on close
+#define BATCHED_WRITER_MAPPING_MIN_SIZE (1024 * 1024) // 1MB
+
+// Reserves disk space for the file from reserved up to size, growing it to
+// size. Returns false on failure, with the reason in errno
+static bool _mapping_reserve(int fd, size_t reserved, size_t size) {
+  const int error =
+      posix_fallocate(fd, (off_t)reserved, (off_t)(size - reserved));
+  errno = error;
+  return error == 0;
+}
+
+// Maps the first size bytes of the file. Returns NULL on failure
+static char *_mapping_map(int fd, size_t size) {
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+// Maps output_file for writing. Returns false if it can't be mapped (pipes,
+// terminals, files opened write only, no space to reserve, ...)
+static bool _mapping_create(BatchedWriter *writer) {
+  // Anything already sitting in stdio's buffer has to land before the mapping
+  if (fflush(writer->output_file) != 0) {
+    return false;
+  }
+  const int fd = fileno(writer->output_file);
+  if (fd < 0) {
+    return false;
+  }
+  const off_t start = lseek(fd, 0, SEEK_CUR);
+  if (start != 0) {
+    return false; // Only whole files are mapped
+  }
+  char *map = NULL;
+  if (_mapping_reserve(fd, 0, BATCHED_WRITER_MAPPING_MIN_SIZE)) {
+    map = _mapping_map(fd, BATCHED_WRITER_MAPPING_MIN_SIZE);
+  }
+  if (map == NULL) {
+    // Give back whatever was reserved, the file was empty to begin with
+    const int ignored = ftruncate(fd, 0);
+    UNUSED(ignored);
+    return false;
+  }
+  writer->mapped_fd = fd;
+  writer->buffer = map;
+  writer->buffer_size = BATCHED_WRITER_MAPPING_MIN_SIZE;
+  return true;
+}
+
+// Unmaps the file, and trims it to what was actually written
+static void _mapping_destroy(BatchedWriter *writer) {
+  // Leave the stream positioned at the end, like a regular write would
+  if (munmap(writer->buffer, writer->buffer_size) != 0 ||
+      ftruncate(writer->mapped_fd, (off_t)writer->buffer_pos) != 0 ||
+      fseek(writer->output_file, (long)writer->buffer_pos, SEEK_SET) != 0) {
+    writer->error = errno ? errno : EIO;
+  }
+  writer->buffer = NULL;
+  writer->mapped_fd = -1;
+}
+
+// Stops mapping once the file can't grow any further, keeping what was
+// written so far. The rest goes through the pipeline, which reports the
+// reason in writer->error if the space really ran out
+static void _mapping_fall_back(BatchedWriter *writer) {
+  _mapping_destroy(writer);
+  writer->bytes_flushed = writer->buffer_pos;
+  writer->buffer_pos = 0;
+  writer->buffer_size = BATCHED_WRITER_BUFFER_SIZE;
+  writer->pipeline = _pipeline_create(writer->output_file);
+  if (writer->pipeline) {
+    writer->buffer = writer->pipeline->buffers[0];
+    return;
+  }
+  writer->buffer = malloc(BATCHED_WRITER_BUFFER_SIZE);
+  if (writer->buffer == NULL) {
+    DZ_THROW("batched_writer: failed to allocate output buffer");
+  }
+}
+
+// Grows the mapping so at least needed_space more bytes fit
+static void _mapping_grow(BatchedWriter *writer, size_t needed_space) {
+  size_t size = writer->buffer_size * 2;
+  while (size <= writer->buffer_pos + needed_space) {
+    size *= 2;
+  }
+  // The old mapping stays until the new one is in place, so nothing is lost
+  // if the file can't grow
+  char *map = NULL;
+  if (_mapping_reserve(writer->mapped_fd, writer->buffer_size, size)) {
+    map = _mapping_map(writer->mapped_fd, size);
+  }
+  if (map == NULL) {
+    _mapping_fall_back(writer);
+    return;
+  }
+  munmap(writer->buffer, writer->buffer_size);
+  writer->buffer = map;
+  writer->buffer_size = size;
+  writer->stats.flushes++;
+}
+#else
+#define BATCHED_WRITER_HAS_MAPPING 0
+#endif
+
+// ----------------------
+// Writer
+// ----------------------
 
 BatchedWriter batched_writer_init(FILE *output_file) {
+  return batched_writer_init_mode(output_file, BATCHED_WRITER_SYNC);
+}
+
+BatchedWriter batched_writer_init_mode(FILE *output_file,
+                                       BatchedWriterMode mode) {
   if (output_file == NULL) {
     DZ_THROW("batched_writer_init() called with NULL output_file");
   }
-  return (BatchedWriter){.output_file = output_file, .buffer_pos = 0};
+  BatchedWriter writer = {.output_file = output_file,
+                          .buffer = NULL,
+                          .buffer_pos = 0,
+                          .buffer_size = BATCHED_WRITER_BUFFER_SIZE,
+                          .bytes_flushed = 0,
+                          .stats = {0},
+                          .pipeline = NULL,
+                          .mapped_fd = -1,
+                          .error = 0};
+#if BATCHED_WRITER_HAS_MAPPING
+  if (mode == BATCHED_WRITER_MAPPED) {
+    if (_mapping_create(&writer)) {
+      return writer;
+    }
+    // Fall back to the next best thing for outputs that can't be mapped
+    mode = BATCHED_WRITER_PIPELINED;
+  }
+#endif
+#if BATCHED_WRITER_HAS_PIPELINE
+  if (mode == BATCHED_WRITER_PIPELINED) {
+    writer.pipeline = _pipeline_create(output_file);
+    if (writer.pipeline) {
+      writer.buffer = writer.pipeline->buffers[0];
+      return writer;
+    }
+  }
+#else
+  UNUSED(mode);
+#endif
+  writer.buffer = malloc(BATCHED_WRITER_BUFFER_SIZE);
+  if (writer.buffer == NULL) {
+    DZ_THROW("batched_writer_init() failed to allocate output buffer");
+  }
+  return writer;
 }
 
 void batched_writer_flush(BatchedWriter *writer) {
   if (writer == NULL) {
     DZ_THROW("batched_writer_flush() called with NULL writer");
   }
-  if (writer->buffer_pos > 0) {
-    size_t bytes_written =
-        fwrite(writer->buffer, 1, writer->buffer_pos, writer->output_file);
-    if (bytes_written != writer->buffer_pos) {
-      DZ_THROW(
-          "batched_writer_flush() failed to write %zu bytes (only wrote %zu)",
-          writer->buffer_pos, bytes_written);
-    }
+  if (writer->buffer_pos == 0 || writer->mapped_fd != -1) {
+    return; // Mapped output is already in the file
+  }
+  if (writer->error) {
+    // Output after a failed write is dropped, so nothing lands out of order
+    writer->bytes_flushed += writer->buffer_pos;
     writer->buffer_pos = 0;
+    return;
+  }
+  writer->stats.flushes++;
+#if BATCHED_WRITER_HAS_PIPELINE
+  if (writer->pipeline) {
+    writer->bytes_flushed += writer->buffer_pos;
+    writer->buffer = _pipeline_submit(writer);
+    writer->buffer_pos = 0;
+    return;
   }
+#endif
+  // Synchronous flushes always hold up the caller
+  Timer stall;
+  timer_init(&stall);
+  timer_start(&stall);
+  size_t bytes_written =
+      fwrite(writer->buffer, 1, writer->buffer_pos, writer->output_file);
+  timer_stop(&stall);
+  writer->stats.stalls++;
+  writer->stats.stall_ms += timer_elapsed_ms(&stall);
+  if (bytes_written != writer->buffer_pos) {
+    writer->error = errno ? errno : EIO;
+  }
+  writer->bytes_flushed += writer->buffer_pos;
+  writer->buffer_pos = 0;
+}
+
+size_t batched_writer_bytes_written(const BatchedWriter *writer) {
+  return writer->bytes_flushed + writer->buffer_pos;
 }
 
-void batched_writer_close(BatchedWriter *writer) {
+bool batched_writer_close(BatchedWriter *writer) {
+  if (writer->buffer == NULL) {
+    return writer->error == 0; // Already closed
+  }
+#if BATCHED_WRITER_HAS_MAPPING
+  if (writer->mapped_fd != -1) {
+    _mapping_destroy(writer);
+    return writer->error == 0;
+  }
+#endif
+  batched_writer_flush(writer);
+#if BATCHED_WRITER_HAS_PIPELINE
+  if (writer->pipeline) {
+    _pipeline_destroy(writer);
+    return writer->error == 0;
+  }
+#endif
+  free(writer->buffer);
+  writer->buffer = NULL;
+  return writer->error == 0;
+}
+
+// Makes room for needed_space more bytes, by flushing the buffer, or growing
+// the mapping when the output is mapped. needed_space must be smaller than
+// BATCHED_WRITER_BUFFER_SIZE unless mapped
+static void batched_writer_make_room(BatchedWriter *writer,
+                                     size_t needed_space) {
+#if BATCHED_WRITER_HAS_MAPPING
+  if (writer->mapped_fd != -1) {
+    _mapping_grow(writer, needed_space);
+    return;
+  }
+#endif
+  UNUSED(needed_space);
   batched_writer_flush(writer);
 }
 
 static void batched_writer_ensure_space(BatchedWriter *writer,
                                         size_t needed_space) {
-  if (writer->buffer_pos + needed_space >= BATCHED_WRITER_BUFFER_SIZE) {
-    batched_writer_flush(writer);
+  if (writer->buffer_pos + needed_space >= writer->buffer_size) {
+    batched_writer_make_room(writer, needed_space);
   }
 }
 
@@ -44,26 +421,98 @@ void batched_writer_write(BatchedWriter *writer, const char *str) {
   if (str == NULL) {
     DZ_THROW("batched_writer_write() called with NULL string");
   }
+  batched_writer_write_len(writer, str, strlen(str));
+}
 
-  size_t len = strlen(str);
+void batched_writer_write_len(BatchedWriter *writer, const char *str,
+                              size_t len) {
+  // Strings larger than the buffer are copied over in buffer sized chunks, so
+  // they stay in order with everything around them when pipelined
+  while (len >= writer->buffer_size - writer->buffer_pos) {
+    const size_t chunk = writer->buffer_size - writer->buffer_pos;
+    memcpy(writer->buffer + writer->buffer_pos, str, chunk);
+    writer->buffer_pos += chunk;
+    batched_writer_make_room(writer, len - chunk);
+    str += chunk;
+    len -= chunk;
+  }
+  memcpy(writer->buffer + writer->buffer_pos, str, len);
+  writer->buffer_pos += len;
+}
 
-  // If the string is larger than our buffer, just write it directly
-  if (len >= BATCHED_WRITER_BUFFER_SIZE) {
-    batched_writer_flush(writer);
-    size_t bytes_written = fwrite(str, 1, len, writer->output_file);
-    if (bytes_written != len) {
-      DZ_THROW("batched_writer_write() failed to write large string of %zu "
-               "bytes (only wrote %zu)",
-               len, bytes_written);
-    }
-    return;
+void batched_writer_write_char(BatchedWriter *writer, char c) {
+  batched_writer_ensure_space(writer, 1);
+  writer->buffer[writer->buffer_pos++] = c;
+}
+
+void batched_writer_write_padded(BatchedWriter *writer,
+                                 const PaddedString *str) {
+  // Always copy the whole padded string, then only keep len bytes of it
+  batched_writer_ensure_space(writer, sizeof(str->text));
+  memcpy(writer->buffer + writer->buffer_pos, str->text, sizeof(str->text));
+  writer->buffer_pos += str->len;
+}
+
+// "00" "01" ... "99", so the integer writer can emit two digits at a time
+static const char DIGIT_PAIRS[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+#define UINT64_MAX_DIGITS 20
+
+static uint32_t _decimal_length(uint64_t value) {
+  uint32_t len = 1;
+  while (value >= 100) {
+    value /= 100;
+    len += 2;
   }
+  return len + (value >= 10);
+}
 
-  batched_writer_ensure_space(writer, len);
-  memcpy(writer->buffer + writer->buffer_pos, str, len);
+void batched_writer_write_uint(BatchedWriter *writer, uint64_t value) {
+  batched_writer_ensure_space(writer, UINT64_MAX_DIGITS);
+  const uint32_t len = _decimal_length(value);
+  // Digits are written back to front, so we know where the number ends
+  char *out = writer->buffer + writer->buffer_pos + len;
+  while (value >= 100) {
+    const uint32_t pair = (uint32_t)(value % 100) * 2;
+    value /= 100;
+    *--out = DIGIT_PAIRS[pair + 1];
+    *--out = DIGIT_PAIRS[pair];
+  }
+  if (value >= 10) {
+    const uint32_t pair = (uint32_t)value * 2;
+    *--out = DIGIT_PAIRS[pair + 1];
+    *--out = DIGIT_PAIRS[pair];
+  } else {
+    *--out = (char)('0' + value);
+  }
   writer->buffer_pos += len;
 }
 
+void batched_writer_write_int(BatchedWriter *writer, int64_t value) {
+  if (value < 0) {
+    batched_writer_write_char(writer, '-');
+    // Negate in unsigned space so INT64_MIN doesn't overflow
+    batched_writer_write_uint(writer, 0 - (uint64_t)value);
+    return;
+  }
+  batched_writer_write_uint(writer, (uint64_t)value);
+}
+
+void batched_writer_write_symbol(BatchedWriter *writer, const char *prefix,
+                                 size_t prefix_len, uint64_t suffix) {
+  batched_writer_write_len(writer, prefix, prefix_len);
+  batched_writer_write_uint(writer, suffix);
+}
+
 void batched_writer_vprintf(BatchedWriter *writer, const char *format,
                             va_list args) {
   if (writer == NULL) {
@@ -74,7 +523,7 @@ void batched_writer_vprintf(BatchedWriter *writer, const char *format,
   }
 
   // Try to format directly into the buffer
-  size_t remaining_space = BATCHED_WRITER_BUFFER_SIZE - writer->buffer_pos;
+  size_t remaining_space = writer->buffer_size - writer->buffer_pos;
   va_list args_copy;
   va_copy(args_copy, args);
   int result = vsnprintf(writer->buffer + writer->buffer_pos, remaining_space,
@@ -94,9 +543,9 @@ void batched_writer_vprintf(BatchedWriter *writer, const char *format,
     return;
   }
 
-  // Otherwise, flush and try again
-  batched_writer_flush(writer);
-  remaining_space = BATCHED_WRITER_BUFFER_SIZE - writer->buffer_pos;
+  // Otherwise, make room and try again
+  batched_writer_make_room(writer, formatted_len + 1);
+  remaining_space = writer->buffer_size - writer->buffer_pos;
 
   result = vsnprintf(writer->buffer + writer->buffer_pos, remaining_space,
                      format, args);
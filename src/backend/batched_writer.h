@@ -2,23 +2,89 @@
 
 #include "compiler_compatibility.h"
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #define BATCHED_WRITER_BUFFER_SIZE (128 * 1024) // 128KB buffer
+// Number of buffers in flight when pipelined. One is being filled while the
+// rest wait for, or are being written by, the background thread
+#define BATCHED_WRITER_PIPELINE_DEPTH 4
+
+typedef enum {
+  BATCHED_WRITER_SYNC,      // Full buffers are written on the calling thread
+  BATCHED_WRITER_PIPELINED, // Full buffers are handed to a background thread,
+                            // so the caller keeps filling the next one. Falls
+                            // back to SYNC where threads aren't available
+  BATCHED_WRITER_MAPPED,    // Writes straight into a memory mapped file that
+                            // doubles as it fills, and is trimmed on close.
+                            // The file must be opened for reading and writing,
+                            // and be empty. Falls back to PIPELINED otherwise,
+                            // or once the file's space can't be reserved
+} BatchedWriterMode;
+
+typedef struct {
+  size_t flushes;  // Buffers handed to the output, or mapping resizes
+  size_t stalls;   // Flushes where the caller had to wait on the output
+  double stall_ms; // Total time spent waiting on the output
+} BatchedWriterStats;
+
+typedef struct BatchedWriterPipeline BatchedWriterPipeline;
 
 typedef struct {
   FILE *output_file;
-  char buffer[BATCHED_WRITER_BUFFER_SIZE];
+  char *buffer; // Buffer currently being filled, or the file mapping
   size_t buffer_pos;
+  size_t buffer_size;
+  size_t bytes_flushed; // Total bytes handed to output_file so far
+  BatchedWriterStats stats;
+  BatchedWriterPipeline *pipeline; // NULL unless pipelined
+  int mapped_fd;                   // -1 unless mapped
+  int error; // errno of the first failed write, 0 if none. Everything written
+             // after a failure is dropped
 } BatchedWriter;
 
 BatchedWriter batched_writer_init(FILE *output_file);
-void batched_writer_close(BatchedWriter *writer);
+BatchedWriter batched_writer_init_mode(FILE *output_file,
+                                       BatchedWriterMode mode);
+// Writes out everything still buffered and releases the buffers. Nothing is
+// guaranteed to reach output_file until this is called. Returns false if any
+// of the output couldn't be written, with the reason in writer->error
+bool batched_writer_close(BatchedWriter *writer);
+
+// A string of at most 16 bytes (register names, mnemonics) padded out so it
+// can be copied with a single fixed size store
+typedef struct {
+  char text[16];
+  uint8_t len;
+} PaddedString;
+
+// Builds a PaddedString from a string literal, computing its length at
+// compile time
+#define PADDED_STRING(str) {.text = str, .len = sizeof(str) - 1}
 
 void batched_writer_write(BatchedWriter *writer, const char *str);
+
+// Fast path appenders that skip strlen/vsnprintf, used by the emitter
+void batched_writer_write_len(BatchedWriter *writer, const char *str,
+                              size_t len);
+void batched_writer_write_char(BatchedWriter *writer, char c);
+void batched_writer_write_padded(BatchedWriter *writer,
+                                 const PaddedString *str);
+void batched_writer_write_int(BatchedWriter *writer, int64_t value);
+void batched_writer_write_uint(BatchedWriter *writer, uint64_t value);
+// Writes a symbol made of a prefix and a numeric suffix, e.g. .LI42
+void batched_writer_write_symbol(BatchedWriter *writer, const char *prefix,
+                                 size_t prefix_len, uint64_t suffix);
+
 void batched_writer_printf(BatchedWriter *writer, const char *format, ...)
     FORMAT_PRINTF(2, 3);
 void batched_writer_vprintf(BatchedWriter *writer, const char *format,
                             va_list args);
 
-void batched_writer_flush(BatchedWriter *writer);
\ No newline at end of file
+// Hands the current buffer to the output. When pipelined, it may still be in
+// flight once this returns
+void batched_writer_flush(BatchedWriter *writer);
+
+// Total number of bytes written through the writer, flushed or not
+size_t batched_writer_bytes_written(const BatchedWriter *writer);
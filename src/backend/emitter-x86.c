@@ -1,23 +1,32 @@
 #include "emitter-x86.h"
-#include "ast.h"
 #include "batched_writer.h"
 #include "compiler_compatibility.h"
 #include "dz_debug.h"
+#include "encoder-x86.h"
+#include "ir.h"
+#include "ir_ssa.h"
 #include "name_table.h"
+#include "peephole.h"
 #include "platform.h"
-#include "token.h"
+#include "register_allocator.h"
+#include "strength_reduction.h"
+#include "string_util.h"
+#include "tree_tiler.h"
 #include <stb_ds.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
-const char *PREAMBLE = ".intel_syntax noprefix\n"
-                       ".data\n"
-                       "\tprint_integer_fmt: .string \"%d\\n\"\n"
-                       "\tprint_string_fmt: .string \"%s\\n\"\n"
-                       "\tinput_string_fmt: .string \"%100s\"\n";
+const char *PREAMBLE = ".intel_syntax noprefix\n";
+// Read-only strings. PE targets keep them in .data
+const char *LINUX_RODATA_SECTION = ".section .rodata\n";
+const char *WINDOWS_RODATA_SECTION = ".data\n";
 const char *MAIN_PREAMBLE = ".text\n"
                             "\t.global main\n"
                             "main:\n";
+const char *START_PREAMBLE = ".text\n"
+                             "\t.global _start\n"
+                             "_start:\n";
 const char *LINUX_POSTAMBLE = ".section .note.GNU-stack,\"\",@progbits\n";
 
 // Function names
@@ -26,556 +35,2130 @@ const char *LINUX_POSTAMBLE = ".section .note.GNU-stack,\"\",@progbits\n";
 #define PRINT_STRING "print_string"
 #define INPUT_INTEGER "input_integer"
 
-#define PRINT_INTEGER_FMT_STR "print_integer_fmt"
-#define PRINT_STRING_FMT_STR "print_string_fmt"
-#define INPUT_INTEGER_FMT_STR "input_string_fmt"
+#define FLUSH_OUTPUT "flush_output"
+
+#define FILL_INPUT "fill_input"
+
+// The output buffer PRINT appends to, in .bss
+#define OUTPUT_BUFFER "output_buffer"
+#define OUTPUT_LENGTH "output_length"
+#define OUTPUT_BUFFER_SIZE 65536
+// print_integer copies this many bytes at once, which covers its longest line
+#define PRINT_INTEGER_COPY 16
+// x / 10 == (x * DIV10_MAGIC) >> DIV10_SHIFT for any x below 2^32
+#define DIV10_MAGIC 0xcccccccdLL
+#define DIV10_SHIFT 35
+
+// The input buffer INPUT reads stdin into, in .bss. The position is the offset
+// of the next character INPUT looks at
+#define INPUT_BUFFER "input_buffer"
+#define INPUT_LENGTH "input_length"
+#define INPUT_POSITION "input_position"
+#define INPUT_BUFFER_SIZE 65536
+
+// Instructions the peephole optimizer buffers before it outputs some, in a
+// block too long to hold at once
+#define PEEPHOLE_BUFFER_SIZE 256
+
+#define MAIN "main"
+
+// Freestanding runtime names
+
+#define START "_start"
+
+// Linux system call numbers, and the values the freestanding runtime needs
+#define SYS_READ 0
+#define SYS_WRITE 1
+#define SYS_EXIT_GROUP 231
+#define LINUX_EINTR 4
+#define STDIN_FD 0
+#define STDOUT_FD 1
+
+// INPUT reads at most this many characters of a token, like scanf("%100s")
+// used to
+#define INPUT_TOKEN_MAX 100
 
 // Internal delimiters
 
 #define LITERAL_DELIMITER "_static_"
-#define SYMBOL_DELIMITER "_var_"
+#define VARIABLE_BLOCK "_vars"
+#define VARIABLE_SIZE 8 // Every variable is a QWORD
 #define LABEL_DELIMITER ".LAB"
 #define INTERNAL_LABEL_DELIMITER ".ILAB"
 
+// Compact delimiters. These are all assembler-local (.L), numeric, and as
+// short as possible so huge programs assemble faster
+#define COMPACT_LITERAL_DELIMITER ".LS"
+#define COMPACT_VARIABLE_BLOCK ".LV"
+#define COMPACT_LABEL_DELIMITER ".L"
+#define COMPACT_INTERNAL_LABEL_DELIMITER ".LI"
+
+// ----------------------
+// Instruction Set
+// ----------------------
+
+// Instruction text is precomputed with its indent and trailing space, so an
+// instruction starts with a single fixed size copy
+static const PaddedString MNEMONICS[OP_COUNT] = {
+#define X(name, str) PADDED_STRING("\t" str " "),
+    X86_OPCODES(X)
+#undef X
+};
+static const PaddedString COMPACT_MNEMONICS[OP_COUNT] = {
+#define X(name, str) PADDED_STRING(str " "),
+    X86_OPCODES(X)
+#undef X
+};
+
+static const PaddedString REGISTER_NAMES[REG_COUNT] = {
+#define X(name, str, byte_str) PADDED_STRING(str),
+    X86_REGISTERS(X)
+#undef X
+};
+static const PaddedString BYTE_REGISTER_NAMES[REG_COUNT] = {
+#define X(name, str, byte_str) PADDED_STRING(byte_str),
+    X86_REGISTERS(X)
+#undef X
+};
+
+// A string whose length is known at compile time
+typedef struct {
+  const char *text;
+  uint32_t len;
+} SizedString;
+
+#define SIZED_STRING(str) {.text = str, .len = sizeof(str) - 1}
+
+static const SizedString PTR_PREFIXES[] = {
+    [PTR_NONE] = SIZED_STRING(""),
+    [PTR_BYTE] = SIZED_STRING("BYTE PTR "),
+    [PTR_DWORD] = SIZED_STRING("DWORD PTR "),
+    [PTR_QWORD] = SIZED_STRING("QWORD PTR "),
+};
+
+static const SizedString SYMBOL_PREFIXES[SYMBOL_KIND_COUNT] = {
+    [SYMBOL_NAMED] = SIZED_STRING(""),
+    [SYMBOL_VARIABLES] = SIZED_STRING(VARIABLE_BLOCK),
+    [SYMBOL_LITERAL] = SIZED_STRING(LITERAL_DELIMITER),
+    [SYMBOL_USER_LABEL] = SIZED_STRING(LABEL_DELIMITER),
+    [SYMBOL_INTERNAL_LABEL] = SIZED_STRING(INTERNAL_LABEL_DELIMITER),
+};
+static const SizedString COMPACT_SYMBOL_PREFIXES[SYMBOL_KIND_COUNT] = {
+    [SYMBOL_NAMED] = SIZED_STRING(""),
+    [SYMBOL_VARIABLES] = SIZED_STRING(COMPACT_VARIABLE_BLOCK),
+    [SYMBOL_LITERAL] = SIZED_STRING(COMPACT_LITERAL_DELIMITER),
+    [SYMBOL_USER_LABEL] = SIZED_STRING(COMPACT_LABEL_DELIMITER),
+    [SYMBOL_INTERNAL_LABEL] = SIZED_STRING(COMPACT_INTERNAL_LABEL_DELIMITER),
+};
+
 // ----------------------
 // Emitter Internals
 // ----------------------
 
+// A run of string PRINTs fused into one string, keyed by its text
 typedef struct {
-  BatchedWriter writer;
+  char *key;
+  uint32_t value;
+} PrintRunHash;
+
+// What instruction selection knows about a temporary's value
+typedef struct {
+  bool known;        // Defined once, by a const
+  bool needed;       // Read by an instruction that can't take it as an
+                     // immediate
+  int64_t value;     // For known temporaries
+  uint32_t variable; // The variable whose memory it lives in, or NO_VARIABLE
+  bool fused;        // A compare's result that's only left in the flags, for
+                     // the select right after it
+  bool covered;      // Worked out by the lea of the tree it's in
+  uint32_t address;  // The lea working out the tree it's the root of, as an
+                     // index into addresses, or NO_ADDRESS
+} TempValue;
+
+typedef struct {
+  BatchedWriter *writer; // Non-owning reference. NULL when encoding
+  X86Encoder *encoder;   // Non-owning reference. NULL when writing assembly
   const PlatformInfo *platform_info;
   const CallingConvention *cc;
-  uint32_t control_flow_label; // Used to create unique labels for IF and WHILE
-                               // statement
+  const EmitOptions *options;
+  const PaddedString *mnemonics;     // Written at the start of instructions
+  const SizedString *symbol_prefix;  // Indexed by SymbolKind
+  PaddedString indent;               // Written before every directive
+  PaddedString operand_sep;          // Written between instruction operands
+  uint32_t control_flow_label; // Used to create unique labels for blocks and
+                               // the runtime
   NameTable *table;            // Non-owning reference
-  AST *ast;                    // Non-owning reference
+  const IR *ir;                // Non-owning reference
+  bool *literal_used;          // stb_ds array, indexed by literal label
+  PrintRunHash *print_runs;    // Text of fused PRINT runs, with their labels
+  uint32_t print_run_label;    // Label of the next fused PRINT run
+  uint32_t block_label;        // Internal label of the first block
+  TempLocation *locations;     // stb_ds array, indexed by temporary
+  TempValue *values;           // stb_ds array, indexed by temporary
+  TreeAddress *addresses;      // stb_ds array, of the trees tiled as an lea
+  IrCondition fused_condition; // What the flags hold after a fused compare
+  uint32_t frame_size;         // Bytes of stack slots main needs
+  uint32_t saved_registers;    // Callee-saved registers main uses, as bits
+                               // indexed like the calling convention's
+  bool buffering;              // Instructions go to pending, not the output
+  X86Instr *pending;           // stb_ds array, instructions of the current
+                               // block the peephole optimizer hasn't seen
+  PeepholeStats peephole_stats;
 } Emitter;
 
-Emitter emitter_init(const PlatformInfo *platform_info, FILE *file, AST *ast,
-                     NameTable *table) {
-  return (Emitter){
-      .ast = ast,
-      .writer = batched_writer_init(file),
+static const PaddedString INDENT = PADDED_STRING("\t");
+static const PaddedString COMPACT_INDENT = PADDED_STRING("");
+static const PaddedString OPERAND_SEP = PADDED_STRING(", ");
+static const PaddedString COMPACT_OPERAND_SEP = PADDED_STRING(",");
+
+Emitter emitter_init(const PlatformInfo *platform_info, BatchedWriter *writer,
+                     X86Encoder *encoder, const IR *ir, NameTable *table,
+                     const EmitOptions *options) {
+  const bool compact = options->compact;
+  Emitter emit = {
+      .ir = ir,
+      .writer = writer,
+      .encoder = encoder,
       .table = table,
       .control_flow_label = 0,
       .platform_info = platform_info,
       .cc = get_calling_convention(platform_info),
+      .options = options,
+      .mnemonics = compact ? COMPACT_MNEMONICS : MNEMONICS,
+      .symbol_prefix = compact ? COMPACT_SYMBOL_PREFIXES : SYMBOL_PREFIXES,
+      .indent = compact ? COMPACT_INDENT : INDENT,
+      .operand_sep = compact ? COMPACT_OPERAND_SEP : OPERAND_SEP,
+      .literal_used = NULL,
+      .print_runs = NULL,
+      .print_run_label = 0,
+      .block_label = 0,
+      .locations = NULL,
+      .values = NULL,
+      .addresses = NULL,
+      .frame_size = 0,
+      .saved_registers = 0,
+      .buffering = false,
+      .pending = NULL,
   };
+  // Run text is built in a temporary array, so keys are copied
+  sh_new_strdup(emit.print_runs);
+  // Runs are numbered after the last string literal
+  const uint32_t literal_len = (uint32_t)shlenu(table->literal_table);
+  for (uint32_t i = 0; i < literal_len; i++) {
+    const uint32_t label = table->literal_table[i].value.label;
+    if (label >= emit.print_run_label) {
+      emit.print_run_label = label + 1;
+    }
+  }
+  arrsetlen(emit.literal_used, emit.print_run_label);
+  for (uint32_t i = 0; i < emit.print_run_label; i++) {
+    emit.literal_used[i] = false;
+  }
+  return emit;
+}
+
+void emitter_destroy(Emitter *emit) {
+  arrfree(emit->literal_used);
+  shfree(emit->print_runs);
+  arrfree(emit->locations);
+  arrfree(emit->values);
+  arrfree(emit->addresses);
+  arrfree(emit->pending);
 }
 
 uint32_t emitter_get_label(Emitter *emit) { return emit->control_flow_label++; }
 
-void _emit_literals(Emitter *emit) {
-  const LiteralTable literals = emit->table->literal_table;
-  const uint32_t literal_len = shlenu(literals);
-  for (uint32_t i = 0; i < literal_len; i++) {
-    const LiteralHash lit = literals[i];
-    batched_writer_printf(&emit->writer, "\t%s%" PRIu32 ": .string \"%s\"\n",
-                          LITERAL_DELIMITER, lit.value.label, lit.key);
+// ----------------------
+// Operands
+// ----------------------
+
+Operand _operand_reg(X86Reg reg) {
+  return (Operand){.kind = OPERAND_REG, .reg = reg};
+}
+
+Operand _operand_byte_reg(X86Reg reg) {
+  return (Operand){.kind = OPERAND_BYTE_REG, .reg = reg};
+}
+
+Operand _operand_imm(int64_t value) {
+  return (Operand){.kind = OPERAND_IMM, .value = value};
+}
+
+// A named symbol, used as a jump or call target
+Operand _operand_named(const char *name) {
+  return (Operand){.kind = OPERAND_SYMBOL,
+                   .symbol = {.kind = SYMBOL_NAMED, .name = name}};
+}
+
+// An internal (IF/WHILE/runtime) label
+Operand _operand_internal_label(uint32_t label) {
+  return (Operand){.kind = OPERAND_SYMBOL,
+                   .symbol = {.kind = SYMBOL_INTERNAL_LABEL, .id = label}};
+}
+
+// A user LABEL, by its index in the label table. Compact names, and the
+// encoder, use the index instead of its name
+Operand _operand_user_label(Emitter *emit, uint32_t label) {
+  const Symbol symbol = {.kind = SYMBOL_USER_LABEL,
+                         .name = emit->table->label_table[label].key,
+                         .id = label};
+  return (Operand){.kind = OPERAND_SYMBOL, .symbol = symbol};
+}
+
+// A rip relative reference to a named static symbol, e.g.
+// print_integer_fmt[rip]
+Operand _operand_rip_named(Emitter *emit, const char *name) {
+  return (Operand){.kind = OPERAND_MEM,
+                   .reg = emit->cc->rip,
+                   .ptr = PTR_NONE,
+                   .symbol = {.kind = SYMBOL_NAMED, .name = name}};
+}
+
+// A rip relative reference to a string literal, e.g. _static_3[rip]
+Operand _operand_literal(Emitter *emit, uint32_t label) {
+  return (Operand){.kind = OPERAND_MEM,
+                   .reg = emit->cc->rip,
+                   .ptr = PTR_NONE,
+                   .symbol = {.kind = SYMBOL_LITERAL, .id = label}};
+}
+
+// A stack slot relative to the base pointer, e.g. QWORD PTR [rbp-8]
+Operand _operand_stack_slot(Emitter *emit, PtrSize ptr, int32_t offset) {
+  return (Operand){
+      .kind = OPERAND_MEM, .reg = emit->cc->rbp, .ptr = ptr, .value = offset};
+}
+
+// The memory operand of a variable, by its index in the variable table, e.g.
+// QWORD PTR _vars[rip+16]. The operand size is left out in compact mode, since
+// the register operand it's always paired with already implies it
+Operand _operand_variable(Emitter *emit, uint32_t variable) {
+  const uint64_t offset =
+      (uint64_t)emit->table->variable_table[variable].value.slot *
+      VARIABLE_SIZE;
+  return (Operand){.kind = OPERAND_MEM,
+                   .reg = emit->cc->rip,
+                   .ptr = emit->options->compact ? PTR_NONE : PTR_QWORD,
+                   .symbol = {.kind = SYMBOL_VARIABLES},
+                   .value = (int64_t)offset};
+}
+
+// ----------------------
+// Text Output
+// ----------------------
+
+void _write_symbol(Emitter *emit, const Symbol *symbol) {
+  BatchedWriter *writer = emit->writer;
+  const SizedString *prefix = &emit->symbol_prefix[symbol->kind];
+  switch (symbol->kind) {
+  case SYMBOL_NAMED:
+    batched_writer_write(writer, symbol->name);
+    return;
+  case SYMBOL_VARIABLES:
+    batched_writer_write_len(writer, prefix->text, prefix->len);
+    return;
+  case SYMBOL_USER_LABEL:
+    if (!emit->options->compact) {
+      batched_writer_write_len(writer, prefix->text, prefix->len);
+      batched_writer_write(writer, symbol->name);
+      return;
+    }
+    batched_writer_write_symbol(writer, prefix->text, prefix->len, symbol->id);
+    return;
+  case SYMBOL_LITERAL:
+  case SYMBOL_INTERNAL_LABEL:
+    batched_writer_write_symbol(writer, prefix->text, prefix->len, symbol->id);
+    return;
+  case SYMBOL_KIND_COUNT:
+    break;
   }
+  DZ_THROW("Bad symbol kind %d", symbol->kind);
 }
 
-// Generic emitter for complex cases
-void _emit_instr(Emitter *emit, const char *msg, ...) FORMAT_PRINTF(2, 3);
-void _emit_instr(Emitter *emit, const char *msg, ...) {
-  va_list args;
-  va_start(args, msg);
-  batched_writer_write(&emit->writer, "\t");
-  batched_writer_vprintf(&emit->writer, msg, args);
-  batched_writer_write(&emit->writer, "\n");
-  va_end(args);
+void _write_operand(Emitter *emit, const Operand *operand) {
+  BatchedWriter *writer = emit->writer;
+  switch (operand->kind) {
+  case OPERAND_REG:
+    batched_writer_write_padded(writer, &REGISTER_NAMES[operand->reg]);
+    return;
+  case OPERAND_BYTE_REG:
+    batched_writer_write_padded(writer, &BYTE_REGISTER_NAMES[operand->reg]);
+    return;
+  case OPERAND_IMM:
+    batched_writer_write_int(writer, operand->value);
+    return;
+  case OPERAND_SYMBOL:
+    _write_symbol(emit, &operand->symbol);
+    return;
+  case OPERAND_MEM: {
+    const SizedString *ptr = &PTR_PREFIXES[operand->ptr];
+    batched_writer_write_len(writer, ptr->text, ptr->len);
+    const bool rip_relative = operand->reg == REG_RIP;
+    if (rip_relative) {
+      _write_symbol(emit, &operand->symbol);
+    }
+    batched_writer_write_char(writer, '[');
+    batched_writer_write_padded(writer, &REGISTER_NAMES[operand->reg]);
+    if (operand->scale) {
+      batched_writer_write_char(writer, '+');
+      batched_writer_write_padded(writer, &REGISTER_NAMES[operand->index]);
+      batched_writer_write_char(writer, '*');
+      batched_writer_write_int(writer, operand->scale);
+    }
+    // Symbols and indexes leave out a zero displacement, a lone base
+    // register always signs it
+    if ((!rip_relative && !operand->scale) || operand->value != 0) {
+      if (operand->value >= 0) {
+        batched_writer_write_char(writer, '+');
+      }
+      batched_writer_write_int(writer, operand->value);
+    }
+    batched_writer_write_char(writer, ']');
+    return;
+  }
+  }
+  DZ_THROW("Bad operand kind %d", operand->kind);
 }
 
-void _emit_label(Emitter *emit, const char *msg) {
-  batched_writer_printf(&emit->writer, "%s:\n", msg);
+// Characters that can't appear as is inside a .string
+static const char STRING_ESCAPES[] = "\"\\\x01\x02\x03\x04\x05\x06\x07\x08\t\n"
+                                     "\x0b\x0c\r\x0e\x0f\x10\x11\x12\x13\x14\x15"
+                                     "\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\x7f";
+
+// Writes text with everything the assembler would interpret escaped, so
+// .string reproduces it byte for byte
+void _write_escaped_string(Emitter *emit, const char *text) {
+  BatchedWriter *writer = emit->writer;
+  while (*text) {
+    const size_t run = strcspn(text, STRING_ESCAPES);
+    batched_writer_write_len(writer, text, run);
+    text += run;
+    if (!*text)
+      return;
+    const unsigned char c = (unsigned char)*text++;
+    if (c == '"' || c == '\\') {
+      const char escaped[2] = {'\\', (char)c};
+      batched_writer_write_len(writer, escaped, 2);
+    } else if (c == '\n') {
+      batched_writer_write_len(writer, "\\n", 2);
+    } else if (c == '\t') {
+      batched_writer_write_len(writer, "\\t", 2);
+    } else {
+      const char octal[4] = {'\\', (char)('0' + (c >> 6)),
+                             (char)('0' + ((c >> 3) & 7)),
+                             (char)('0' + (c & 7))};
+      batched_writer_write_len(writer, octal, 4);
+    }
+  }
 }
 
-void _emit_mov(Emitter *emit, const char *dest, const char *src) {
-  _emit_instr(emit, "mov %s, %s", dest, src);
+// Emits a NUL terminated string into the current section, under symbol
+void _emit_string(Emitter *emit, const Symbol *symbol, const char *text) {
+  if (emit->encoder) {
+    encoder_x86_label(emit->encoder, symbol);
+    encoder_x86_bytes(emit->encoder, text, strlen(text) + 1);
+    return;
+  }
+  BatchedWriter *writer = emit->writer;
+  batched_writer_write_padded(writer, &emit->indent);
+  _write_symbol(emit, symbol);
+  batched_writer_write_len(writer, ": .string \"", 11);
+  _write_escaped_string(emit, text);
+  batched_writer_write_len(writer, "\"\n", 2);
 }
 
-void _emit_lea(Emitter *emit, const char *dest, const char *src) {
-  _emit_instr(emit, "lea %s, %s", dest, src);
+void _emit_rodata_section(Emitter *emit) {
+  if (emit->encoder) {
+    encoder_x86_section(emit->encoder, OBJ_SECTION_RODATA);
+  } else {
+    batched_writer_write(emit->writer, emit->platform_info->os == OS_LINUX
+                                           ? LINUX_RODATA_SECTION
+                                           : WINDOWS_RODATA_SECTION);
+  }
+}
+
+
+// ----------------------
+// Instructions
+// ----------------------
+
+// Writes or encodes an instruction
+void _output_instr(Emitter *emit, const X86Instr *instr) {
+  if (emit->encoder) {
+    encoder_x86_op(emit->encoder, instr->op, instr->operands,
+                   instr->operand_count);
+    return;
+  }
+  const PaddedString *mnemonic = &emit->mnemonics[instr->op];
+  if (instr->operand_count == 0) {
+    // Leave out the space meant to separate the operands
+    batched_writer_write_len(emit->writer, mnemonic->text, mnemonic->len - 1);
+    batched_writer_write_char(emit->writer, '\n');
+    return;
+  }
+  batched_writer_write_padded(emit->writer, mnemonic);
+  for (uint32_t i = 0; i < instr->operand_count; i++) {
+    if (i) {
+      batched_writer_write_padded(emit->writer, &emit->operand_sep);
+    }
+    _write_operand(emit, &instr->operands[i]);
+  }
+  batched_writer_write_char(emit->writer, '\n');
 }
 
-void _emit_lea_fmt(Emitter *emit, const char *dest, const char *src_fmt, ...)
-    FORMAT_PRINTF(3, 4);
-void _emit_lea_fmt(Emitter *emit, const char *dest, const char *src_fmt, ...) {
-  va_list args;
-  va_start(args, src_fmt);
-  char src_buffer[256];
-  vsnprintf(src_buffer, sizeof(src_buffer), src_fmt, args);
-  va_end(args);
-  _emit_instr(emit, "lea %s, %s", dest, src_buffer);
+// Runs the peephole optimizer over the buffered instructions and outputs
+// them. next_label is the label they fall into, if any. Unless everything is
+// flushed, the last instruction is kept back, so rules can still pair it with
+// the next one
+void _flush_instrs(Emitter *emit, const Symbol *next_label, bool everything) {
+  uint32_t count = (uint32_t)arrlenu(emit->pending);
+  if (count == 0)
+    return;
+  count = peephole_optimize(emit->pending, count, next_label,
+                            &emit->peephole_stats);
+  const uint32_t output = everything || count == 0 ? count : count - 1;
+  for (uint32_t i = 0; i < output; i++) {
+    _output_instr(emit, &emit->pending[i]);
+  }
+  if (output < count) {
+    emit->pending[0] = emit->pending[output];
+  }
+  arrsetlen(emit->pending, count - output);
 }
 
-void _emit_push(Emitter *emit, const char *reg) {
-  _emit_instr(emit, "push %s", reg);
+// Outputs an instruction, or buffers it for the peephole optimizer
+void _emit_instr_operands(Emitter *emit, X86Op op, const Operand *operands,
+                          uint32_t operand_count) {
+  X86Instr instr = {.op = op, .operand_count = operand_count};
+  for (uint32_t i = 0; i < operand_count; i++) {
+    instr.operands[i] = operands[i];
+  }
+  if (!emit->buffering) {
+    _output_instr(emit, &instr);
+    return;
+  }
+  arrput(emit->pending, instr);
+  // Blocks of straight line code can be huge
+  if (arrlenu(emit->pending) >= PEEPHOLE_BUFFER_SIZE) {
+    _flush_instrs(emit, NULL, false);
+  }
 }
 
-void _emit_pop(Emitter *emit, const char *reg) {
-  _emit_instr(emit, "pop %s", reg);
+void _emit_op0(Emitter *emit, X86Op op) {
+  _emit_instr_operands(emit, op, NULL, 0);
 }
 
-void _emit_sub(Emitter *emit, const char *a1, const char *a2) {
-  _emit_instr(emit, "sub %s, %s", a1, a2);
+void _emit_op1(Emitter *emit, X86Op op, Operand a1) {
+  _emit_instr_operands(emit, op, &a1, 1);
 }
 
-void _emit_add(Emitter *emit, const char *a1, const char *a2) {
-  _emit_instr(emit, "add %s, %s", a1, a2);
+void _emit_op2(Emitter *emit, X86Op op, Operand a1, Operand a2) {
+  const Operand operands[] = {a1, a2};
+  _emit_instr_operands(emit, op, operands, 2);
+}
+
+void _emit_op3(Emitter *emit, X86Op op, Operand a1, Operand a2, Operand a3) {
+  const Operand operands[] = {a1, a2, a3};
+  _emit_instr_operands(emit, op, operands, 3);
+}
+
+void _emit_label(Emitter *emit, Operand label) {
+  DZ_ASSERT(label.kind == OPERAND_SYMBOL);
+  _flush_instrs(emit, &label.symbol, true);
+  if (emit->encoder) {
+    encoder_x86_label(emit->encoder, &label.symbol);
+    return;
+  }
+  _write_symbol(emit, &label.symbol);
+  batched_writer_write_len(emit->writer, ":\n", 2);
+}
+
+void _emit_internal_label(Emitter *emit, uint32_t label) {
+  _emit_label(emit, _operand_internal_label(label));
+}
+
+void _emit_jump(Emitter *emit, X86Op jmp_inst, uint32_t label) {
+  _emit_op1(emit, jmp_inst, _operand_internal_label(label));
+}
+
+void _emit_mov(Emitter *emit, Operand dest, Operand src) {
+  _emit_op2(emit, OP_MOV, dest, src);
+}
+
+void _emit_lea(Emitter *emit, Operand dest, Operand src) {
+  _emit_op2(emit, OP_LEA, dest, src);
+}
+
+void _emit_push(Emitter *emit, X86Reg reg) {
+  _emit_op1(emit, OP_PUSH, _operand_reg(reg));
+}
+
+void _emit_pop(Emitter *emit, X86Reg reg) {
+  _emit_op1(emit, OP_POP, _operand_reg(reg));
+}
+
+void _emit_sub(Emitter *emit, Operand a1, Operand a2) {
+  _emit_op2(emit, OP_SUB, a1, a2);
+}
+
+void _emit_add(Emitter *emit, Operand a1, Operand a2) {
+  _emit_op2(emit, OP_ADD, a1, a2);
+}
+
+// Shorthand for a register to register instruction
+void _emit_reg2(Emitter *emit, X86Op op, X86Reg a1, X86Reg a2) {
+  _emit_op2(emit, op, _operand_reg(a1), _operand_reg(a2));
 }
 
 void _emit_func_preamble(Emitter *emit) {
   const CallingConvention *cc = emit->cc;
   _emit_push(emit, cc->rbp);
-  _emit_mov(emit, cc->rbp, cc->rsp);
+  _emit_reg2(emit, OP_MOV, cc->rbp, cc->rsp);
   if (cc->shadow_space) {
-    _emit_instr(emit, "sub %s, %" PRIu8, cc->rsp, cc->shadow_space);
+    _emit_sub(emit, _operand_reg(cc->rsp), _operand_imm(cc->shadow_space));
   }
 }
 
 void _emit_func_ret(Emitter *emit) {
   const CallingConvention *cc = emit->cc;
   if (cc->shadow_space) {
-    _emit_instr(emit, "add %s, %" PRIu8, cc->rsp, cc->shadow_space);
+    _emit_add(emit, _operand_reg(cc->rsp), _operand_imm(cc->shadow_space));
   }
-  _emit_instr(emit, "leave");
-  _emit_instr(emit, "ret");
+  _emit_op0(emit, OP_LEAVE);
+  _emit_op0(emit, OP_RET);
 }
 
 void _emit_syscall(Emitter *emit, const char *sys_call) {
-  _emit_instr(emit, "xor %s, %s", emit->cc->ret_r, emit->cc->ret_r);
-  _emit_instr(emit, "call %s", sys_call);
+  _emit_reg2(emit, OP_XOR, emit->cc->ret_r, emit->cc->ret_r);
+  _emit_op1(emit, OP_CALL, _operand_named(sys_call));
 }
 
-// Emit Helpers
+// Makes a Linux system call, whose arguments are already in place. Only
+// used by the freestanding runtime
+void _emit_linux_syscall(Emitter *emit, int64_t number) {
+  _emit_mov(emit, _operand_reg(REG_RAX), _operand_imm(number));
+  _emit_op0(emit, OP_SYSCALL);
+}
+
+// Ends a freestanding program with exit status 0
+void _emit_exit(Emitter *emit) {
+  _emit_mov(emit, _operand_reg(REG_RDI), _operand_imm(0));
+  _emit_linux_syscall(emit, SYS_EXIT_GROUP);
+}
 
-// Helper that prints an integer
+// ----------------------
+// Output Buffer
+//
+// PRINT appends its line to a buffer in .bss instead
+// of going through printf. The buffer is written out
+// when it's full, before INPUT so prompts show up, and
+// when the program ends.
+// These helpers only touch registers that are volatile
+// in both the System V and Microsoft conventions
+// ----------------------
+
+// The output buffer's length, as a QWORD memory operand
+Operand _operand_output_length(Emitter *emit) {
+  Operand length = _operand_rip_named(emit, OUTPUT_LENGTH);
+  length.ptr = PTR_QWORD;
+  return length;
+}
+
+// The input buffer's length or position, as a QWORD memory operand
+Operand _operand_input_state(Emitter *emit, const char *name) {
+  Operand state = _operand_rip_named(emit, name);
+  state.ptr = PTR_QWORD;
+  return state;
+}
+
+// Writes out the output buffer and empties it. rcx, rdx and r8-r11 are kept
+// intact, so callers can flush in the middle of copying. Write errors drop the
+// output, like printf does
+void _emit_flush_output(Emitter *emit) {
+  static const X86Reg KEPT[] = {REG_RCX, REG_RDX, REG_R8,
+                                REG_R9,  REG_R10, REG_R11};
+  const CallingConvention *cc = emit->cc;
+  const Operand ret = _operand_reg(cc->ret_r);
+  const Operand length = _operand_output_length(emit);
+  const Operand cursor = _operand_stack_slot(emit, PTR_QWORD, -8);
+  const Operand remaining = _operand_stack_slot(emit, PTR_QWORD, -16);
+  const Operand written = _operand_stack_slot(emit, PTR_QWORD, -24);
+  const int32_t kept_offset = -32;
+  const uint32_t write_loop = emitter_get_label(emit);
+  const uint32_t failed = emitter_get_label(emit);
+  const uint32_t done = emitter_get_label(emit);
+  _emit_label(emit, _operand_named(FLUSH_OUTPUT));
+  _emit_func_preamble(emit);
+  _emit_sub(emit, _operand_reg(cc->rsp), _operand_imm(80));
+  for (uint32_t i = 0; i < array_size(KEPT); i++) {
+    _emit_mov(emit,
+              _operand_stack_slot(emit, PTR_QWORD,
+                                  kept_offset - (int32_t)(i * 8)),
+              _operand_reg(KEPT[i]));
+  }
+  _emit_mov(emit, ret, length);
+  _emit_op2(emit, OP_CMP, ret, _operand_imm(0));
+  _emit_jump(emit, OP_JE, done);
+  _emit_mov(emit, remaining, ret);
+  _emit_mov(emit, length, _operand_imm(0));
+  _emit_lea(emit, ret, _operand_rip_named(emit, OUTPUT_BUFFER));
+  _emit_mov(emit, cursor, ret);
+
+  _emit_internal_label(emit, write_loop);
+  _emit_mov(emit, _operand_reg(cc->arg_r[0]), _operand_imm(STDOUT_FD));
+  _emit_mov(emit, _operand_reg(cc->arg_r[1]), cursor);
+  _emit_mov(emit, _operand_reg(cc->arg_r[2]), remaining);
+  if (emit->options->freestanding) {
+    _emit_linux_syscall(emit, SYS_WRITE);
+  } else {
+    _emit_syscall(emit,
+                  emit->platform_info->os == OS_WINDOWS ? "_write" : "write");
+  }
+  // Windows' _write returns an int. Writes are never big enough for the
+  // upper half to matter, so only the low 32 bits are looked at
+  _emit_mov(emit, written, ret);
+  _emit_op2(emit, OP_MOVSXD, ret, _operand_stack_slot(emit, PTR_DWORD, -24));
+  _emit_op2(emit, OP_CMP, ret, _operand_imm(0));
+  _emit_jump(emit, OP_JLE, failed);
+  _emit_add(emit, cursor, ret);
+  _emit_sub(emit, remaining, ret);
+  _emit_op2(emit, OP_CMP, remaining, _operand_imm(0));
+  _emit_jump(emit, OP_JG, write_loop);
+  _emit_jump(emit, OP_JMP, done);
+
+  _emit_internal_label(emit, failed);
+  if (emit->options->freestanding) {
+    // Interrupted before anything was written
+    _emit_op2(emit, OP_CMP, ret, _operand_imm(-LINUX_EINTR));
+    _emit_jump(emit, OP_JE, write_loop);
+  }
+
+  _emit_internal_label(emit, done);
+  for (uint32_t i = 0; i < array_size(KEPT); i++) {
+    _emit_mov(emit, _operand_reg(KEPT[i]),
+              _operand_stack_slot(emit, PTR_QWORD,
+                                  kept_offset - (int32_t)(i * 8)));
+  }
+  _emit_func_ret(emit);
+}
+
+// Prints the integer in the first argument register, followed by a newline.
+// Like printf("%d\n"), only its low 32 bits are printed. The digits are
+// written backwards into a stack buffer that ends in the newline, then copied
+// into the output buffer with two fixed size moves.
+// Dividing by 10 is a multiply by DIV10_MAGIC and a shift by DIV10_SHIFT,
+// which is exact for every magnitude a 32 bit integer can have
 void _emit_print_int(Emitter *emit) {
   const CallingConvention *cc = emit->cc;
-  _emit_label(emit, PRINT_INTEGER);
+  const Operand ret = _operand_reg(cc->ret_r);
+  const Operand cursor = _operand_reg(REG_R10);
+  const Operand cursor_byte = {
+      .kind = OPERAND_MEM, .reg = REG_R10, .ptr = PTR_BYTE, .value = 0};
+  const Operand digit = _operand_reg(REG_RDX);
+  const Operand length = _operand_output_length(emit);
+  const uint32_t digit_loop = emitter_get_label(emit);
+  const uint32_t copy = emitter_get_label(emit);
+  const uint32_t has_room = emitter_get_label(emit);
+  _emit_label(emit, _operand_named(PRINT_INTEGER));
   _emit_func_preamble(emit);
-  _emit_mov(emit, cc->arg_r[1], cc->arg_r[0]);
-  _emit_instr(emit, "lea %s, " PRINT_INTEGER_FMT_STR "[%s]", cc->arg_r[0],
-              cc->rip);
-  _emit_syscall(emit, "printf");
+  _emit_sub(emit, _operand_reg(cc->rsp), _operand_imm(32));
+  _emit_mov(emit, _operand_stack_slot(emit, PTR_QWORD, -8),
+            _operand_reg(cc->arg_r[0]));
+  _emit_op2(emit, OP_MOVSXD, ret, _operand_stack_slot(emit, PTR_DWORD, -8));
+  _emit_reg2(emit, OP_MOV, REG_R9, cc->ret_r); // Remember the sign
+  _emit_lea(emit, cursor, _operand_stack_slot(emit, PTR_NONE, -9));
+  _emit_mov(emit, digit, _operand_imm('\n'));
+  _emit_mov(emit, cursor_byte, _operand_byte_reg(REG_RDX));
+  _emit_mov(emit, _operand_reg(REG_R8), _operand_imm(DIV10_MAGIC));
+  _emit_mov(emit, _operand_reg(REG_R11), _operand_imm(10));
+  _emit_op2(emit, OP_CMP, ret, _operand_imm(0));
+  _emit_jump(emit, OP_JGE, digit_loop);
+  _emit_op1(emit, OP_NEG, ret);
+
+  _emit_internal_label(emit, digit_loop);
+  _emit_reg2(emit, OP_MOV, REG_RDX, cc->ret_r);
+  _emit_reg2(emit, OP_IMUL, cc->ret_r, REG_R8);
+  _emit_op2(emit, OP_SHR, ret, _operand_imm(DIV10_SHIFT));
+  _emit_reg2(emit, OP_MOV, REG_RCX, cc->ret_r);
+  _emit_reg2(emit, OP_IMUL, REG_RCX, REG_R11);
+  _emit_reg2(emit, OP_SUB, REG_RDX, REG_RCX);
+  _emit_add(emit, digit, _operand_imm('0'));
+  _emit_sub(emit, cursor, _operand_imm(1));
+  _emit_mov(emit, cursor_byte, _operand_byte_reg(REG_RDX));
+  _emit_op2(emit, OP_CMP, ret, _operand_imm(0));
+  _emit_jump(emit, OP_JNE, digit_loop);
+
+  _emit_op2(emit, OP_CMP, _operand_reg(REG_R9), _operand_imm(0));
+  _emit_jump(emit, OP_JGE, copy);
+  _emit_sub(emit, cursor, _operand_imm(1));
+  _emit_mov(emit, digit, _operand_imm('-'));
+  _emit_mov(emit, cursor_byte, _operand_byte_reg(REG_RDX));
+
+  _emit_internal_label(emit, copy);
+  _emit_mov(emit, ret, length);
+  _emit_op2(emit, OP_CMP, ret,
+            _operand_imm(OUTPUT_BUFFER_SIZE - PRINT_INTEGER_COPY));
+  _emit_jump(emit, OP_JLE, has_room);
+  _emit_op1(emit, OP_CALL, _operand_named(FLUSH_OUTPUT));
+  _emit_mov(emit, ret, _operand_imm(0));
+  _emit_internal_label(emit, has_room);
+  _emit_lea(emit, _operand_reg(REG_RCX),
+            _operand_rip_named(emit, OUTPUT_BUFFER));
+  _emit_reg2(emit, OP_ADD, REG_RCX, cc->ret_r);
+  for (int32_t offset = 0; offset < PRINT_INTEGER_COPY; offset += 8) {
+    _emit_mov(emit, digit,
+              (Operand){.kind = OPERAND_MEM,
+                        .reg = REG_R10,
+                        .ptr = PTR_QWORD,
+                        .value = offset});
+    _emit_mov(emit,
+              (Operand){.kind = OPERAND_MEM,
+                        .reg = REG_RCX,
+                        .ptr = PTR_QWORD,
+                        .value = offset},
+              digit);
+  }
+  // The line runs from the cursor to just past the newline
+  _emit_lea(emit, digit, _operand_stack_slot(emit, PTR_NONE, -8));
+  _emit_reg2(emit, OP_SUB, REG_RDX, REG_R10);
+  _emit_reg2(emit, OP_ADD, cc->ret_r, REG_RDX);
+  _emit_mov(emit, length, ret);
   _emit_func_ret(emit);
 }
 
-// Helper that prints a string literal
+// Prints a string followed by a newline. The first argument register points
+// at the string, and the second holds its length, which is known when the
+// program is compiled. It's copied into the output buffer with rep movsb, a
+// buffer's worth at a time. rsi and rdi are saved, since rep movsb needs them
+// and the Microsoft convention has callers keep them
 void _emit_print_string(Emitter *emit) {
   const CallingConvention *cc = emit->cc;
-  _emit_label(emit, PRINT_STRING);
+  const Operand ret = _operand_reg(cc->ret_r);
+  const Operand remaining = _operand_reg(REG_R9);
+  const Operand count = _operand_reg(REG_RCX);
+  const Operand length = _operand_output_length(emit);
+  const Operand saved_rsi = _operand_stack_slot(emit, PTR_QWORD, -8);
+  const Operand saved_rdi = _operand_stack_slot(emit, PTR_QWORD, -16);
+  const uint32_t copy_loop = emitter_get_label(emit);
+  const uint32_t copy_rest = emitter_get_label(emit);
+  const uint32_t newline = emitter_get_label(emit);
+  const uint32_t has_room = emitter_get_label(emit);
+  _emit_label(emit, _operand_named(PRINT_STRING));
   _emit_func_preamble(emit);
-  _emit_mov(emit, cc->arg_r[1], cc->arg_r[0]);
-  _emit_instr(emit, "lea %s, " PRINT_STRING_FMT_STR "[%s]", cc->arg_r[0],
-              cc->rip);
-  _emit_syscall(emit, "printf");
+  _emit_sub(emit, _operand_reg(cc->rsp), _operand_imm(16));
+  _emit_reg2(emit, OP_MOV, REG_R8, cc->arg_r[0]);
+  _emit_reg2(emit, OP_MOV, REG_R9, cc->arg_r[1]);
+  _emit_mov(emit, saved_rsi, _operand_reg(REG_RSI));
+  _emit_mov(emit, saved_rdi, _operand_reg(REG_RDI));
+
+  _emit_internal_label(emit, copy_loop);
+  // Copy as much as fits
+  _emit_mov(emit, ret, length);
+  _emit_mov(emit, count, _operand_imm(OUTPUT_BUFFER_SIZE));
+  _emit_reg2(emit, OP_SUB, REG_RCX, cc->ret_r);
+  _emit_reg2(emit, OP_CMP, REG_RCX, REG_R9);
+  _emit_jump(emit, OP_JLE, copy_rest);
+  _emit_reg2(emit, OP_MOV, REG_RCX, REG_R9);
+  _emit_internal_label(emit, copy_rest);
+  _emit_lea(emit, _operand_reg(REG_RDI),
+            _operand_rip_named(emit, OUTPUT_BUFFER));
+  _emit_reg2(emit, OP_ADD, REG_RDI, cc->ret_r);
+  _emit_reg2(emit, OP_MOV, REG_RSI, REG_R8);
+  _emit_reg2(emit, OP_ADD, cc->ret_r, REG_RCX);
+  _emit_reg2(emit, OP_ADD, REG_R8, REG_RCX);
+  _emit_reg2(emit, OP_SUB, REG_R9, REG_RCX);
+  _emit_mov(emit, length, ret);
+  _emit_op0(emit, OP_REP_MOVSB);
+  _emit_op2(emit, OP_CMP, remaining, _operand_imm(0));
+  _emit_jump(emit, OP_JE, newline);
+  _emit_op1(emit, OP_CALL, _operand_named(FLUSH_OUTPUT));
+  _emit_jump(emit, OP_JMP, copy_loop);
+
+  _emit_internal_label(emit, newline);
+  _emit_op2(emit, OP_CMP, ret, _operand_imm(OUTPUT_BUFFER_SIZE));
+  _emit_jump(emit, OP_JL, has_room);
+  _emit_op1(emit, OP_CALL, _operand_named(FLUSH_OUTPUT));
+  _emit_mov(emit, ret, _operand_imm(0));
+  _emit_internal_label(emit, has_room);
+  _emit_lea(emit, count, _operand_rip_named(emit, OUTPUT_BUFFER));
+  _emit_reg2(emit, OP_ADD, REG_RCX, cc->ret_r);
+  _emit_mov(emit, _operand_reg(REG_RDX), _operand_imm('\n'));
+  _emit_mov(emit,
+            (Operand){.kind = OPERAND_MEM, .reg = REG_RCX, .ptr = PTR_BYTE},
+            _operand_byte_reg(REG_RDX));
+  _emit_add(emit, ret, _operand_imm(1));
+  _emit_mov(emit, length, ret);
+  _emit_mov(emit, _operand_reg(REG_RSI), saved_rsi);
+  _emit_mov(emit, _operand_reg(REG_RDI), saved_rdi);
   _emit_func_ret(emit);
 }
 
-// Safely prompts the user for an integer input. If a string is entered, it
-// Inteprets the first character as an ASCII integer
+// ----------------------
+// Input Buffer
+//
+// INPUT reads stdin in large blocks into a buffer in
+// .bss, and parses numbers straight out of it instead
+// of calling scanf and strtol. Whatever a read brings
+// in past the current number stays buffered for the
+// next INPUT.
+// Like the output buffer, these helpers only touch
+// registers that are volatile in both conventions
+// ----------------------
+
+// Reads the next block of stdin into the input buffer, and returns its length
+// in rax. 0 at the end of input, and on errors. r8-r11 are kept intact
+void _emit_fill_input(Emitter *emit) {
+  static const X86Reg KEPT[] = {REG_R8, REG_R9, REG_R10, REG_R11};
+  const CallingConvention *cc = emit->cc;
+  const Operand ret = _operand_reg(cc->ret_r);
+  const Operand length = _operand_input_state(emit, INPUT_LENGTH);
+  const Operand read_size = _operand_stack_slot(emit, PTR_QWORD, -8);
+  const int32_t kept_offset = -16;
+  const uint32_t retry = emitter_get_label(emit);
+  const uint32_t filled = emitter_get_label(emit);
+  _emit_label(emit, _operand_named(FILL_INPUT));
+  _emit_func_preamble(emit);
+  _emit_sub(emit, _operand_reg(cc->rsp), _operand_imm(48));
+  for (uint32_t i = 0; i < array_size(KEPT); i++) {
+    _emit_mov(emit,
+              _operand_stack_slot(emit, PTR_QWORD,
+                                  kept_offset - (int32_t)(i * 8)),
+              _operand_reg(KEPT[i]));
+  }
+
+  _emit_internal_label(emit, retry);
+  _emit_mov(emit, _operand_reg(cc->arg_r[0]), _operand_imm(STDIN_FD));
+  _emit_lea(emit, _operand_reg(cc->arg_r[1]),
+            _operand_rip_named(emit, INPUT_BUFFER));
+  _emit_mov(emit, _operand_reg(cc->arg_r[2]), _operand_imm(INPUT_BUFFER_SIZE));
+  if (emit->options->freestanding) {
+    _emit_linux_syscall(emit, SYS_READ);
+    _emit_op2(emit, OP_CMP, ret, _operand_imm(-LINUX_EINTR));
+    _emit_jump(emit, OP_JE, retry);
+  } else {
+    _emit_syscall(emit,
+                  emit->platform_info->os == OS_WINDOWS ? "_read" : "read");
+  }
+  // Windows' _read returns an int, so only the low 32 bits are looked at
+  _emit_mov(emit, read_size, ret);
+  _emit_op2(emit, OP_MOVSXD, ret, _operand_stack_slot(emit, PTR_DWORD, -8));
+  _emit_op2(emit, OP_CMP, ret, _operand_imm(0));
+  _emit_jump(emit, OP_JG, filled);
+  _emit_mov(emit, ret, _operand_imm(0));
+  _emit_internal_label(emit, filled);
+  _emit_mov(emit, length, ret);
+  _emit_mov(emit, _operand_input_state(emit, INPUT_POSITION), _operand_imm(0));
+
+  for (uint32_t i = 0; i < array_size(KEPT); i++) {
+    _emit_mov(emit, _operand_reg(KEPT[i]),
+              _operand_stack_slot(emit, PTR_QWORD,
+                                  kept_offset - (int32_t)(i * 8)));
+  }
+  _emit_func_ret(emit);
+}
+
+// Loads the next input character into rax, or jumps to end_of_input once
+// stdin runs out. rcx points at the next buffered character and rdx at the
+// end of the buffered input. They're refilled when they meet
+void _emit_next_input_char(Emitter *emit, uint32_t end_of_input) {
+  const CallingConvention *cc = emit->cc;
+  const Operand ret = _operand_reg(cc->ret_r);
+  const uint32_t buffered = emitter_get_label(emit);
+  _emit_reg2(emit, OP_CMP, REG_RCX, REG_RDX);
+  _emit_jump(emit, OP_JL, buffered);
+  _emit_op1(emit, OP_CALL, _operand_named(FILL_INPUT));
+  _emit_lea(emit, _operand_reg(REG_RCX),
+            _operand_rip_named(emit, INPUT_BUFFER));
+  _emit_reg2(emit, OP_MOV, REG_RDX, REG_RCX);
+  _emit_reg2(emit, OP_ADD, REG_RDX, cc->ret_r);
+  _emit_op2(emit, OP_CMP, ret, _operand_imm(0));
+  _emit_jump(emit, OP_JE, end_of_input);
+  _emit_internal_label(emit, buffered);
+  _emit_op2(emit, OP_MOVZX, ret,
+            (Operand){.kind = OPERAND_MEM, .reg = REG_RCX, .ptr = PTR_BYTE});
+  _emit_add(emit, _operand_reg(REG_RCX), _operand_imm(1));
+}
+
+// Jumps to label if the character in reg is whitespace, as isspace() sees it
+void _emit_jump_if_space(Emitter *emit, X86Reg reg, uint32_t label) {
+  const uint32_t not_space = emitter_get_label(emit);
+  _emit_op2(emit, OP_CMP, _operand_reg(reg), _operand_imm(' '));
+  _emit_jump(emit, OP_JE, label);
+  _emit_op2(emit, OP_CMP, _operand_reg(reg), _operand_imm('\t'));
+  _emit_jump(emit, OP_JL, not_space);
+  _emit_op2(emit, OP_CMP, _operand_reg(reg), _operand_imm('\r'));
+  _emit_jump(emit, OP_JLE, label);
+  _emit_internal_label(emit, not_space);
+}
+
+// Reads an integer from stdin into rax, with the semantics scanf("%100s")
+// followed by strtol used to have. Leading whitespace is skipped, and the next
+// token of at most 100 characters is read. If it starts with a number, that's
+// the result, or 0 if it's outside of int32. Otherwise it's the ASCII value of
+// its first character. 0 at the end of input.
+// rcx and rdx walk the input buffer, r8 holds the number, r9 the constant 10,
+// r10 the token's length, and r11 the point where the number stops growing
 void _emit_input_int(Emitter *emit) {
   const CallingConvention *cc = emit->cc;
-  _emit_label(emit, INPUT_INTEGER);
+  const Operand ret = _operand_reg(cc->ret_r);
+  const Operand number = _operand_reg(REG_R8);
+  const Operand length = _operand_reg(REG_R10);
+  const Operand first_char = _operand_stack_slot(emit, PTR_QWORD, -8);
+  const Operand has_digits = _operand_stack_slot(emit, PTR_QWORD, -16);
+  const Operand negative = _operand_stack_slot(emit, PTR_QWORD, -24);
+  const Operand position = _operand_input_state(emit, INPUT_POSITION);
+  // Numbers past this are out of range for either sign, and stop growing
+  const int64_t number_limit = (int64_t)INT32_MAX + 1;
+  const uint32_t skip_space = emitter_get_label(emit);
+  const uint32_t not_minus = emitter_get_label(emit);
+  const uint32_t parse_char = emitter_get_label(emit);
+  const uint32_t next_char = emitter_get_label(emit);
+  const uint32_t skip_rest = emitter_get_label(emit);
+  const uint32_t finish = emitter_get_label(emit);
+  const uint32_t have_number = emitter_get_label(emit);
+  const uint32_t positive = emitter_get_label(emit);
+  const uint32_t zero = emitter_get_label(emit);
+  const uint32_t done = emitter_get_label(emit);
+  _emit_label(emit, _operand_named(INPUT_INTEGER));
   _emit_func_preamble(emit);
+  // Anything printed so far, like a prompt, has to show up first
+  _emit_op1(emit, OP_CALL, _operand_named(FLUSH_OUTPUT));
+  _emit_sub(emit, _operand_reg(cc->rsp), _operand_imm(32));
+  _emit_lea(emit, _operand_reg(REG_R11),
+            _operand_rip_named(emit, INPUT_BUFFER));
+  _emit_mov(emit, _operand_reg(REG_RCX), position);
+  _emit_reg2(emit, OP_ADD, REG_RCX, REG_R11);
+  _emit_mov(emit, _operand_reg(REG_RDX),
+            _operand_input_state(emit, INPUT_LENGTH));
+  _emit_reg2(emit, OP_ADD, REG_RDX, REG_R11);
+  _emit_mov(emit, _operand_reg(REG_R9), _operand_imm(10));
+  _emit_mov(emit, _operand_reg(REG_R11), _operand_imm(number_limit));
+
+  _emit_internal_label(emit, skip_space);
+  _emit_next_input_char(emit, zero);
+  _emit_jump_if_space(emit, cc->ret_r, skip_space);
+
+  _emit_mov(emit, first_char, ret);
+  _emit_mov(emit, has_digits, _operand_imm(0));
+  _emit_mov(emit, negative, _operand_imm(0));
+  _emit_mov(emit, number, _operand_imm(0));
+  _emit_mov(emit, length, _operand_imm(1));
+  _emit_op2(emit, OP_CMP, ret, _operand_imm('-'));
+  _emit_jump(emit, OP_JNE, not_minus);
+  _emit_mov(emit, negative, _operand_imm(1));
+  _emit_jump(emit, OP_JMP, next_char);
+  _emit_internal_label(emit, not_minus);
+  _emit_op2(emit, OP_CMP, ret, _operand_imm('+'));
+  _emit_jump(emit, OP_JE, next_char);
+
+  _emit_internal_label(emit, parse_char);
+  _emit_op2(emit, OP_CMP, ret, _operand_imm('0'));
+  _emit_jump(emit, OP_JL, skip_rest);
+  _emit_op2(emit, OP_CMP, ret, _operand_imm('9'));
+  _emit_jump(emit, OP_JG, skip_rest);
+  _emit_sub(emit, ret, _operand_imm('0'));
+  _emit_mov(emit, has_digits, _operand_imm(1));
+  _emit_reg2(emit, OP_CMP, REG_R8, REG_R11);
+  _emit_jump(emit, OP_JG, next_char);
+  _emit_reg2(emit, OP_IMUL, REG_R8, REG_R9);
+  _emit_reg2(emit, OP_ADD, REG_R8, cc->ret_r);
+
+  _emit_internal_label(emit, next_char);
+  _emit_op2(emit, OP_CMP, length, _operand_imm(INPUT_TOKEN_MAX));
+  _emit_jump(emit, OP_JGE, finish);
+  _emit_next_input_char(emit, finish);
+  _emit_add(emit, length, _operand_imm(1));
+  _emit_jump_if_space(emit, cc->ret_r, finish);
+  _emit_jump(emit, OP_JMP, parse_char);
+
+  // The rest of the token is read, but doesn't count towards the number
+  _emit_internal_label(emit, skip_rest);
+  _emit_op2(emit, OP_CMP, length, _operand_imm(INPUT_TOKEN_MAX));
+  _emit_jump(emit, OP_JGE, finish);
+  _emit_next_input_char(emit, finish);
+  _emit_add(emit, length, _operand_imm(1));
+  _emit_jump_if_space(emit, cc->ret_r, finish);
+  _emit_jump(emit, OP_JMP, skip_rest);
+
+  _emit_internal_label(emit, finish);
+  _emit_op2(emit, OP_CMP, has_digits, _operand_imm(0));
+  _emit_jump(emit, OP_JNE, have_number);
+  // No number - use the first character as a (signed) ASCII value
+  _emit_op2(emit, OP_MOVSX, ret, _operand_stack_slot(emit, PTR_BYTE, -8));
+  _emit_jump(emit, OP_JMP, done);
+
+  _emit_internal_label(emit, have_number);
+  _emit_op2(emit, OP_CMP, negative, _operand_imm(0));
+  _emit_jump(emit, OP_JE, positive);
+  _emit_reg2(emit, OP_CMP, REG_R8, REG_R11);
+  _emit_jump(emit, OP_JG, zero);
+  _emit_op1(emit, OP_NEG, number);
+  _emit_reg2(emit, OP_MOV, cc->ret_r, REG_R8);
+  _emit_jump(emit, OP_JMP, done);
+  _emit_internal_label(emit, positive);
+  _emit_op2(emit, OP_CMP, number, _operand_imm(INT32_MAX));
+  _emit_jump(emit, OP_JG, zero);
+  _emit_reg2(emit, OP_MOV, cc->ret_r, REG_R8);
+  _emit_jump(emit, OP_JMP, done);
 
-  // Allocate 128 bytes on stack for input buffer
-  _emit_sub(emit, cc->rsp, "128");
-
-  // lea rax, [rbp-112] - buffer for input string
-  _emit_lea_fmt(emit, cc->ret_r, "[%s-112]", cc->rbp);
-  _emit_mov(emit, cc->arg_r[1], cc->ret_r); // rsi = buffer address
-  _emit_lea_fmt(emit, cc->arg_r[0], INPUT_INTEGER_FMT_STR "[%s]",
-                cc->rip); // rdi = format string
-  _emit_syscall(emit, "scanf");
-
-  // Check if scanf failed (returned -1)
-  _emit_instr(emit, "cmp %s, -1", cc->ret_r);
-  _emit_instr(emit, "jne .L2");
-  _emit_mov(emit, cc->ret_r, "0"); // Return 0 on scanf failure
-  _emit_instr(emit, "jmp .L7");
-
-  _emit_label(emit, ".L2");
-  // Try to convert string to long using strtol
-  _emit_lea_fmt(emit, cc->scratch_r[0], "[%s-120]", cc->rbp); // endptr location
-  _emit_lea_fmt(emit, cc->ret_r, "[%s-112]", cc->rbp);        // string buffer
-  _emit_mov(emit, cc->arg_r[2], "10");
-  _emit_mov(emit, cc->arg_r[1], cc->scratch_r[0]); // rsi = endptr
-  _emit_mov(emit, cc->arg_r[0], cc->ret_r);        // rdi = string
-  _emit_syscall(emit, "strtol");
-
-  // Store result in [rbp-8]
-  _emit_instr(emit, "mov QWORD PTR [%s-8], %s", cc->rbp, cc->ret_r);
-
-  // Check if endptr equals original string (no conversion occurred)
-  _emit_instr(emit, "mov %s, QWORD PTR [%s-120]", cc->scratch_r[1],
-              cc->rbp);                                // endptr value
-  _emit_lea_fmt(emit, cc->ret_r, "[%s-112]", cc->rbp); // original string
-  _emit_instr(emit, "cmp %s, %s", cc->scratch_r[1], cc->ret_r);
-  _emit_instr(emit, "jne .L4");
-
-  // No conversion - use first character as ASCII value
-  _emit_instr(emit, "movzx %s, BYTE PTR [%s-112]", cc->ret_r, cc->rbp);
-  // TODO: There's currently no mechanism in place for different register
-  // variants
-  _emit_instr(emit, "movsx %s, al", cc->ret_r);
-  _emit_instr(emit, "jmp .L7");
-
-  _emit_label(emit, ".L4");
-  // Check if converted value is within int32 range
-  _emit_instr(emit, "cmp QWORD PTR [%s-8], 2147483647", cc->rbp);
-  _emit_instr(emit, "jg .L5");
-  _emit_instr(emit, "cmp QWORD PTR [%s-8], -2147483648", cc->rbp);
-  _emit_instr(emit, "jge .L6");
-
-  _emit_label(emit, ".L5");
-  // Out of range - return 0
-  _emit_instr(emit, "mov %s, 0", cc->ret_r);
-  _emit_instr(emit, "jmp .L7");
-
-  _emit_label(emit, ".L6");
-  // In range - return the converted value
-  _emit_instr(emit, "mov %s, QWORD PTR [%s-8]", cc->ret_r, cc->rbp);
-
-  _emit_label(emit, ".L7");
+  _emit_internal_label(emit, zero);
+  _emit_mov(emit, ret, _operand_imm(0));
+  _emit_internal_label(emit, done);
+  // Whatever is left stays buffered for the next INPUT
+  _emit_lea(emit, _operand_reg(REG_R11),
+            _operand_rip_named(emit, INPUT_BUFFER));
+  _emit_reg2(emit, OP_SUB, REG_RCX, REG_R11);
+  _emit_mov(emit, position, _operand_reg(REG_RCX));
   _emit_func_ret(emit);
 }
 
-// We are storing uninitialized integers in the data sector using
-// var_name: .skip 8
-// This initialized 8 bytes of memory (QWORD) which can be referenced later
-// using mov QWORD PTR var_name[rip], 10
+// ----------------------
+// Emit Helpers
+// ----------------------
+
+// Emits the helpers PRINT and INPUT call
+void _emit_runtime(Emitter *emit) {
+  _emit_print_int(emit);
+  _emit_print_string(emit);
+  _emit_flush_output(emit);
+  _emit_input_int(emit);
+  _emit_fill_input(emit);
+}
+
+// Reserves size zeroed bytes in .bss for symbol, aligned to align
+void _emit_reserve(Emitter *emit, const Symbol *symbol, uint64_t size,
+                   uint64_t align) {
+  if (emit->encoder) {
+    encoder_x86_reserve(emit->encoder, symbol, size, align);
+    return;
+  }
+  batched_writer_printf(emit->writer, "%.*s.balign %" PRIu64 "\n",
+                        (int)emit->indent.len, emit->indent.text, align);
+  _write_symbol(emit, symbol);
+  batched_writer_printf(emit->writer, ": .skip %" PRIu64 "\n", size);
+}
+
+// All variables live in one zeroed, cache line aligned block in .bss
+// _vars: .skip 8 * variable_count
+// Each variable owns the QWORD at its slot, and is referenced with
+// mov QWORD PTR _vars[rip+8*slot], 10
+// Slots are ordered by access frequency, so hot variables share cache lines,
+// and the assembler only ever sees a single symbol.
+// The runtime's output and input buffers follow them
 void _emit_symbols(Emitter *emit) {
-  const VariableTable symbol_table = emit->table->variable_table;
-  const size_t symbol_len = shlenu(symbol_table);
-  for (size_t i = 0; i < symbol_len; i++) {
-    const IdentifierHash sym = symbol_table[i];
-    _emit_instr(emit, "%s%s: .skip 8", SYMBOL_DELIMITER, sym.key);
-  }
-}
-
-// Emits a primary identifier and places the result in rax
-// primary ::= number | indetifier
-void _emit_primary(Emitter *emit, NodeID primary_node) {
-  AST *ast = emit->ast;
-  const NodeID num_or_ident = ast_get_first_child(ast, primary_node);
-  // can only be number or identifier
-  if (num_or_ident == NO_NODE || ast_node_is_grammar(ast, num_or_ident))
-    return;
-  const Token *token = ast_node_get_token(ast, num_or_ident);
-  if (token->type == TOKEN_NUMBER) {
-    _emit_mov(emit, emit->cc->ret_r, token->text);
-  } else if (token->type == TOKEN_IDENT) {
-    _emit_instr(emit, "mov %s, QWORD PTR %s%s[%s]", emit->cc->ret_r,
-                SYMBOL_DELIMITER, token->text, emit->cc->rip);
-  }
-  // ERROR bad primary formed
-}
-
-// Emits a unary identifier and places the result in rax
-// unary ::= ["+" | "-"] primary
-void _emit_unary(Emitter *emit, NodeID unary_node) {
-  AST *ast = emit->ast;
-  // Should only be unary node, obv
-  if (ast_node_is_token(ast, unary_node) ||
-      ast_node_get_grammar(ast, unary_node) != GRAMMAR_TYPE_UNARY)
-    return;
-  const NodeID first_child = ast_get_first_child(ast, unary_node);
-  if (first_child == NO_NODE)
-    return;
-  // If its a token (+ or -)
-  if (ast_node_is_token(ast, first_child)) {
-    const Token *token = ast_node_get_token(ast, first_child);
-    const NodeID primary_child = ast_get_next_sibling(ast, first_child);
-    if (primary_child == NO_NODE)
-      return;
-    if (token->type == TOKEN_MINUS) {
-      _emit_primary(emit, primary_child);
-      _emit_instr(emit, "neg %s", emit->cc->ret_r);
-      return;
-    } else if (token->type == TOKEN_PLUS) {
-      // Unary + is a noop
-      _emit_primary(emit, primary_child);
-      return;
+  if (emit->writer) {
+    batched_writer_write(emit->writer, ".bss\n");
+  }
+  const size_t symbol_len = shlenu(emit->table->variable_table);
+  if (symbol_len != 0) {
+    const Symbol block = {.kind = SYMBOL_VARIABLES};
+    _emit_reserve(emit, &block, symbol_len * VARIABLE_SIZE, 64);
+  }
+  const Symbol length = {.kind = SYMBOL_NAMED, .name = OUTPUT_LENGTH};
+  _emit_reserve(emit, &length, VARIABLE_SIZE, VARIABLE_SIZE);
+  const Symbol buffer = {.kind = SYMBOL_NAMED, .name = OUTPUT_BUFFER};
+  _emit_reserve(emit, &buffer, OUTPUT_BUFFER_SIZE, 64);
+  const Symbol input_length = {.kind = SYMBOL_NAMED, .name = INPUT_LENGTH};
+  _emit_reserve(emit, &input_length, VARIABLE_SIZE, VARIABLE_SIZE);
+  const Symbol input_position = {.kind = SYMBOL_NAMED, .name = INPUT_POSITION};
+  _emit_reserve(emit, &input_position, VARIABLE_SIZE, VARIABLE_SIZE);
+  const Symbol input_buffer = {.kind = SYMBOL_NAMED, .name = INPUT_BUFFER};
+  _emit_reserve(emit, &input_buffer, INPUT_BUFFER_SIZE, 64);
+}
+
+// ----------------------
+// Folded Operands
+//
+// Some temporaries never need a location of their
+// own. Constants are folded into the instructions
+// that read them as immediates, wherever x86 takes
+// one. A load is folded into its readers as a memory
+// operand, when nothing stores to its variable before
+// the last of them reads it. A result that's only
+// stored to a variable is written straight to the
+// variable, when nothing reads or writes the variable
+// in between. Together they turn LET I = I + 1 into a
+// single inc of I's memory
+// ----------------------
+
+#define NO_VARIABLE TREE_NO_VARIABLE
+#define NO_ADDRESS TREE_NO_ADDRESS
+
+static bool _fits_int32(int64_t value) {
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool _is_imm32(const Emitter *emit, IrTemp temp) {
+  const TempValue *value = &emit->values[temp];
+  return value->known && _fits_int32(value->value);
+}
+
+// Bits of the arguments a branch or compare compares as an immediate. cmp only
+// takes one second, so the condition is swapped when it's the first
+static uint32_t _immediate_compare_args(const Emitter *emit,
+                                        const IrTemp args[2]) {
+  if (_is_imm32(emit, args[1]))
+    return 2;
+  return _is_imm32(emit, args[0]) ? 1 : 0;
+}
+
+// Bits of the arguments an instruction takes as immediates. Division by 0 and
+// -1 stays an idiv with its divisor in a register, since it can trap
+static uint32_t _immediate_args(const Emitter *emit, const IrInstr *instr) {
+  const TempValue *values = emit->values;
+  switch (instr->op) {
+  case IR_COPY:
+  case IR_STORE:
+  case IR_PRINT_INT:
+    // Moves take any immediate, going through rax when they have to
+    return values[instr->args[0]].known ? 1 : 0;
+  case IR_ADD:
+    if (_is_imm32(emit, instr->args[1]))
+      return 2;
+    return _is_imm32(emit, instr->args[0]) ? 1 : 0;
+  case IR_SUB:
+    return _is_imm32(emit, instr->args[1]) ? 2 : 0;
+  case IR_MUL:
+    // imul only takes a 32 bit immediate, the other plans take any
+    for (uint32_t a = 2; a-- > 0;) {
+      const TempValue *factor = &values[instr->args[a]];
+      if (factor->known &&
+          (_fits_int32(factor->value) ||
+           !strength_reduce_multiply(factor->value).multiply))
+        return 1u << a;
     }
+    return 0;
+  case IR_DIV: {
+    const TempValue *divisor = &values[instr->args[1]];
+    return divisor->known &&
+                   strength_reduce_divide(divisor->value).kind != DIVIDE_IDIV
+               ? 2
+               : 0;
+  }
+  case IR_COMPARE:
+    return _immediate_compare_args(emit, instr->args);
+  case IR_SELECT:
+    // cmov only moves from a register or memory, so one constant at most is
+    // moved in first, and the condition flipped if it's the first
+    if (values[instr->args[2]].known)
+      return 4;
+    return values[instr->args[1]].known ? 2 : 0;
+  case IR_CONST:
+  case IR_LOAD:
+  case IR_NEG:
+  case IR_PRINT_STR:
+  case IR_INPUT:
+  case IR_PHI:
+  case IR_OPCODE_COUNT:
+    break;
+  }
+  return 0;
+}
+
+// Whether temp needs a register or stack slot
+static bool _has_location(const Emitter *emit, IrTemp temp) {
+  const TempValue *value = &emit->values[temp];
+  return value->variable == NO_VARIABLE && !value->fused && !value->covered &&
+         (!value->known || value->needed);
+}
+
+// How a temporary is defined and read, while operands are folded. Positions
+// count instructions within a block, with the terminator last
+typedef struct {
+  uint32_t defs;
+  uint32_t reads;
+  IrBlockID block;     // Block of its first definition
+  uint32_t def;        // Position of its first definition
+  uint32_t last_read;  // Position it's last read at in block
+  bool read_elsewhere; // Read outside block, or before it's defined
+} TempUses;
+
+static void _note_read(Emitter *emit, TempUses *uses, IrTemp temp,
+                       IrBlockID block, uint32_t position, bool immediate) {
+  TempUses *use = &uses[temp];
+  use->reads++;
+  if (use->block != block || position <= use->def) {
+    use->read_elsewhere = true;
+  }
+  use->last_read = MAX(use->last_read, position);
+  if (!immediate) {
+    emit->values[temp].needed = true;
+  }
+}
+
+// Whether an instruction reads or writes variable, including through the
+// temporaries living in its memory
+static bool _touches_variable(const Emitter *emit, const IrInstr *instr,
+                              uint32_t variable) {
+  if ((instr->op == IR_LOAD || instr->op == IR_STORE) &&
+      instr->variable == variable)
+    return true;
+  for (uint32_t a = 0; a < ir_opcode_arg_count(instr->op); a++) {
+    if (emit->values[instr->args[a]].variable == variable)
+      return true;
+  }
+  return false;
+}
+
+// Whether the instructions strictly between first and last store to variable,
+// or, when reads count too, touch it at all
+static bool _variable_used_between(const Emitter *emit, const IrBlock *block,
+                                   uint32_t first, uint32_t last,
+                                   uint32_t variable, bool reads) {
+  for (uint32_t i = first + 1; i < last; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    if (reads ? _touches_variable(emit, instr, variable)
+              : instr->op == IR_STORE && instr->variable == variable)
+      return true;
+  }
+  return false;
+}
+
+// Folds the loads of a block into their readers, then the results it stores
+// into the variables they're stored to
+static void _fold_variables(Emitter *emit, const TempUses *uses,
+                            const IrBlock *block) {
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    if (instr->op != IR_LOAD)
+      continue;
+    const TempUses *use = &uses[instr->dest];
+    if (use->defs == 1 && !use->read_elsewhere &&
+        !_variable_used_between(emit, block, i, use->last_read,
+                                instr->variable, false)) {
+      emit->values[instr->dest].variable = instr->variable;
+    }
+  }
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    if (instr->op != IR_STORE)
+      continue;
+    const IrTemp temp = instr->args[0];
+    const TempUses *use = &uses[temp];
+    TempValue *value = &emit->values[temp];
+    if (use->defs == 1 && use->reads == 1 && !use->read_elsewhere &&
+        !value->known && value->variable == NO_VARIABLE &&
+        !_variable_used_between(emit, block, use->def, i, instr->variable,
+                                true)) {
+      value->variable = instr->variable;
+    }
+  }
+}
+
+// Leaves the result of a compare in the flags when the select right after it
+// is all that reads it
+static void _fuse_compares(Emitter *emit, const TempUses *uses,
+                           const IrBlock *block) {
+  for (uint32_t i = 0; i + 1 < block->instr_count; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    const IrInstr *next = &block->instrs[i + 1];
+    if (instr->op != IR_COMPARE || next->op != IR_SELECT ||
+        next->args[0] != instr->dest)
+      continue;
+    const TempUses *use = &uses[instr->dest];
+    if (use->defs == 1 && use->reads == 1 && !use->read_elsewhere) {
+      emit->values[instr->dest].fused = true;
+    }
+  }
+}
+
+// Tiles the trees of every block, once operands are folded. The nodes an lea
+// covers aren't emitted, and the roots keep its address
+static void _tile_blocks(Emitter *emit, const TempUses *uses) {
+  const IR *ir = emit->ir;
+  TreeTemp *temps = NULL; // stb_ds array
+  arrsetlen(temps, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    const TempValue *value = &emit->values[t];
+    temps[t] = (TreeTemp){.known = value->known,
+                          .value = value->value,
+                          .variable = value->variable,
+                          .has_location = _has_location(emit, t),
+                          .defs = uses[t].defs,
+                          .reads = uses[t].reads,
+                          .block = uses[t].block,
+                          .def = uses[t].def,
+                          .read_elsewhere = uses[t].read_elsewhere};
+  }
+  emit->addresses =
+      tree_tile(ir, temps, (uint32_t)shlenu(emit->table->variable_table));
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    emit->values[t].covered = temps[t].covered;
+    emit->values[t].address = temps[t].address;
+  }
+  arrfree(temps);
+}
+
+// Works out which temporaries are constants, which of them have to be loaded
+// anyway, which temporaries live in a variable's memory, which only live in
+// the flags, and which trees are covered by an lea
+void _fold_operands(Emitter *emit) {
+  const IR *ir = emit->ir;
+  TempUses *uses = NULL; // stb_ds array
+  arrsetlen(uses, ir->temp_count);
+  arrsetlen(emit->values, ir->temp_count);
+  for (uint32_t t = 0; t < ir->temp_count; t++) {
+    uses[t] = (TempUses){.block = IR_NO_BLOCK};
+    emit->values[t] =
+        (TempValue){.variable = NO_VARIABLE, .address = NO_ADDRESS};
+  }
+  for (uint32_t b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      if (instr->dest == IR_NO_TEMP)
+        continue;
+      TempUses *use = &uses[instr->dest];
+      if (use->defs++ == 0) {
+        use->block = b;
+        use->def = i;
+      }
+      TempValue *value = &emit->values[instr->dest];
+      value->known = use->defs == 1 && instr->op == IR_CONST;
+      value->value = instr->value;
+    }
+  }
+  for (uint32_t b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      const uint32_t immediate = _immediate_args(emit, instr);
+      for (uint32_t a = 0; a < ir_opcode_arg_count(instr->op); a++) {
+        _note_read(emit, uses, instr->args[a], b, i, immediate >> a & 1);
+      }
+    }
+    if (block->term.kind == IR_TERM_BRANCH) {
+      const uint32_t immediate =
+          _immediate_compare_args(emit, block->term.args);
+      for (uint32_t a = 0; a < 2; a++) {
+        _note_read(emit, uses, block->term.args[a], b, block->instr_count,
+                   immediate >> a & 1);
+      }
+    }
+  }
+  for (uint32_t b = 0; b < ir->block_count; b++) {
+    _fold_variables(emit, uses, &ir->blocks[b]);
+    _fuse_compares(emit, uses, &ir->blocks[b]);
+  }
+  if (emit->options->tile_trees) {
+    _tile_blocks(emit, uses);
+  }
+  arrfree(uses);
+}
+
+// The temporaries the code selected for an instruction reads: none for the
+// nodes an lea covers, and the registers of its address for the lea itself.
+// Returns how many there are
+static uint32_t _instr_reads(const Emitter *emit, const IrInstr *instr,
+                             IrTemp reads[IR_MAX_ARGS]) {
+  if (instr->dest != IR_NO_TEMP) {
+    const TempValue *value = &emit->values[instr->dest];
+    if (value->covered)
+      return 0;
+    if (value->address != NO_ADDRESS) {
+      const TreeAddress *address = &emit->addresses[value->address];
+      uint32_t count = 0;
+      reads[count++] = address->base;
+      if (address->scale && address->index != address->base) {
+        reads[count++] = address->index;
+      }
+      return count;
+    }
+  }
+  const uint32_t count = ir_opcode_arg_count(instr->op);
+  for (uint32_t a = 0; a < count; a++) {
+    reads[a] = instr->args[a];
+  }
+  return count;
+}
+
+// ----------------------
+// Temporary Locations
+// ----------------------
+
+static uint32_t _selected_reads(const void *context, const IrInstr *instr,
+                                IrTemp reads[IR_MAX_ARGS]) {
+  return _instr_reads(context, instr, reads);
+}
+
+// Gives every temporary that needs one a location with the register
+// allocator, and sizes main's frame
+void _assign_locations(Emitter *emit) {
+  const IR *ir = emit->ir;
+  bool *has_location = NULL; // stb_ds array
+  arrsetlen(has_location, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    has_location[t] = _has_location(emit, t);
+  }
+  const Allocation allocation = register_allocate(
+      ir, emit->cc, has_location, _selected_reads, emit);
+  emit->locations = allocation.locations;
+  emit->saved_registers = allocation.saved_registers;
+  emit->frame_size = allocation.frame_size;
+  arrfree(has_location);
+}
+
+// Saves the callee-saved registers main uses in its first stack slots, or
+// restores them from there. _start has no caller to keep them for
+void _emit_saved_registers(Emitter *emit, bool restore) {
+  if (emit->options->freestanding)
+    return;
+  uint32_t slot = 0;
+  for (uint32_t r = 0; r < emit->cc->saved_count; r++) {
+    if (!(emit->saved_registers >> r & 1))
+      continue;
+    slot++;
+    const Operand saved = _operand_stack_slot(
+        emit, PTR_QWORD, -(int32_t)(slot * STACK_SLOT_SIZE));
+    const Operand reg = _operand_reg(emit->cc->saved_r[r]);
+    if (restore) {
+      _emit_mov(emit, reg, saved);
+    } else {
+      _emit_mov(emit, saved, reg);
+    }
+  }
+}
+
+// ----------------------
+// Instruction Selection
+//
+// Each IR instruction becomes a few x86 instructions on
+// the locations of its temporaries. x86 overwrites the
+// first operand and can only take one memory operand,
+// so results are worked out in the destination's
+// register when that's safe, and in rax otherwise.
+// Folded constants and variables are used as
+// immediates and memory operands in place, and
+// multiplying or dividing by a constant becomes
+// cheaper instructions, using the plans from strength
+// reduction. Selects become cmov, straight off the
+// flags of the compare before them
+// ----------------------
+
+static const X86Op CONDITION_JUMPS[IR_COND_COUNT] = {
+    [IR_COND_EQ] = OP_JE, [IR_COND_NE] = OP_JNE, [IR_COND_LT] = OP_JL,
+    [IR_COND_LE] = OP_JLE, [IR_COND_GT] = OP_JG, [IR_COND_GE] = OP_JGE,
+};
+
+static const X86Op CONDITION_SETS[IR_COND_COUNT] = {
+    [IR_COND_EQ] = OP_SETE,  [IR_COND_NE] = OP_SETNE, [IR_COND_LT] = OP_SETL,
+    [IR_COND_LE] = OP_SETLE, [IR_COND_GT] = OP_SETG,  [IR_COND_GE] = OP_SETGE,
+};
+
+static const X86Op CONDITION_MOVES[IR_COND_COUNT] = {
+    [IR_COND_EQ] = OP_CMOVE,   [IR_COND_NE] = OP_CMOVNE,
+    [IR_COND_LT] = OP_CMOVL,   [IR_COND_LE] = OP_CMOVLE,
+    [IR_COND_GT] = OP_CMOVG,   [IR_COND_GE] = OP_CMOVGE,
+};
+
+static const X86Op ARITHMETIC_OPS[IR_OPCODE_COUNT] = {
+    [IR_ADD] = OP_ADD,
+    [IR_SUB] = OP_SUB,
+    [IR_MUL] = OP_IMUL,
+};
+
+// Where a temporary's value is. Temporaries living in a variable's memory
+// always spell out its size, since they can be paired with an immediate
+Operand _operand_temp(Emitter *emit, IrTemp temp) {
+  const TempValue *value = &emit->values[temp];
+  if (value->variable != NO_VARIABLE) {
+    Operand variable = _operand_variable(emit, value->variable);
+    variable.ptr = PTR_QWORD;
+    return variable;
+  }
+  DZ_ASSERT(_has_location(emit, temp), "A folded constant was read");
+  const TempLocation *location = &emit->locations[temp];
+  if (location->on_stack)
+    return _operand_stack_slot(emit, PTR_QWORD, location->offset);
+  return _operand_reg(location->reg);
+}
+
+// An argument, as an immediate when the bit for it in immediate is set
+Operand _operand_arg(Emitter *emit, const IrTemp *args, uint32_t immediate,
+                     uint32_t arg) {
+  if (immediate >> arg & 1)
+    return _operand_imm(emit->values[args[arg]].value);
+  return _operand_temp(emit, args[arg]);
+}
+
+// The label a block starts with. Blocks starting with a user LABEL keep it
+Operand _operand_block(Emitter *emit, IrBlockID block) {
+  const uint32_t label = emit->ir->blocks[block].label;
+  if (label != IR_NO_LABEL)
+    return _operand_user_label(emit, label);
+  return _operand_internal_label(emit->block_label + block);
+}
+
+static bool _same_location(Operand a, Operand b) {
+  if (a.kind != b.kind)
+    return false;
+  if (a.kind == OPERAND_REG)
+    return a.reg == b.reg;
+  return a.kind == OPERAND_MEM && a.reg == b.reg && a.value == b.value &&
+         a.symbol.kind == b.symbol.kind;
+}
+
+// Moves src into dest, going through rax when x86 has no instruction for it
+void _emit_move(Emitter *emit, Operand dest, Operand src) {
+  if (_same_location(dest, src))
+    return;
+  const bool needs_register =
+      src.kind == OPERAND_MEM ||
+      (src.kind == OPERAND_IMM && !_fits_int32(src.value));
+  if (dest.kind == OPERAND_MEM && needs_register) {
+    _emit_mov(emit, _operand_reg(REG_RAX), src);
+    src = _operand_reg(REG_RAX);
+  }
+  _emit_mov(emit, dest, src);
+}
+
+// The register a result can be worked out in, before it's moved to dest.
+// That's dest itself, unless it's on the stack or holds an operand that's
+// still needed
+static X86Reg _work_register(Operand dest, Operand still_needed) {
+  if (dest.kind == OPERAND_REG && !_same_location(dest, still_needed))
+    return dest.reg;
+  return REG_RAX;
+}
+
+// value * factor. lea can add a register to itself scaled by 2, 4 or 8
+void _emit_multiply_constant(Emitter *emit, Operand dest, Operand value,
+                             int64_t factor) {
+  const MultiplyPlan plan = strength_reduce_multiply(factor);
+  if (plan.zero) {
+    _emit_move(emit, dest, _operand_imm(0));
+    return;
+  }
+  // Every step reads value before it writes, so dest's register is safe
+  const Operand work =
+      _operand_reg(dest.kind == OPERAND_REG ? dest.reg : REG_RAX);
+  if (plan.multiply) {
+    _emit_op3(emit, OP_IMUL, work, value, _operand_imm(factor));
+    _emit_move(emit, dest, work);
+    return;
+  }
+  if (plan.scale) {
+    X86Reg base = value.reg;
+    if (value.kind != OPERAND_REG) {
+      _emit_move(emit, work, value);
+      base = work.reg;
+    }
+    _emit_lea(emit, work,
+              (Operand){.kind = OPERAND_MEM,
+                        .reg = base,
+                        .index = base,
+                        .scale = plan.scale,
+                        .ptr = PTR_NONE});
   } else {
-    // else, it must be a primary
-    _emit_primary(emit, first_child);
+    _emit_move(emit, work, value);
   }
+  if (plan.shift) {
+    _emit_op2(emit, OP_SHL, work, _operand_imm(plan.shift));
+  }
+  if (plan.negate) {
+    _emit_op1(emit, OP_NEG, work);
+  }
+  _emit_move(emit, dest, work);
 }
 
-// Emits a term, and stores the result into rax
-// term ::= unary {( "/" | "*" ) unary}
-void _emit_term(Emitter *emit, NodeID term_node) {
-  const CallingConvention *cc = emit->cc;
-  AST *ast = emit->ast;
-  NodeID child = ast_get_first_child(ast, term_node);
-  if (child == NO_NODE)
-    return;
-  _emit_unary(emit, child);
-  child = ast_get_next_sibling(ast, child);
-  // Handle the {( "/" | "*" ) unary} case
-  while (child != NO_NODE) {
-    const NodeID unary_node = ast_get_next_sibling(ast, child);
-    if (!ast_node_is_token(ast, child) || unary_node == NO_NODE)
-      return;
-    _emit_push(emit, cc->ret_r);
-    _emit_unary(emit, unary_node);
-    _emit_mov(emit, cc->scratch_r[0], cc->ret_r);
-    _emit_pop(emit, cc->ret_r);
-    const Token *child_token = ast_node_get_token(ast, child);
-    if (child_token->type == TOKEN_MULT) {
-      _emit_instr(emit, "imul %s, %s", cc->ret_r, cc->scratch_r[0]);
-    } else if (child_token->type == TOKEN_DIV) {
-      _emit_instr(emit, "cqo");
-      _emit_instr(emit, "idiv %s", cc->scratch_r[0]); // stores result in rax
+// value / divisor, rounded toward zero like idiv, in rax and rdx
+void _emit_divide_constant(Emitter *emit, Operand dest, Operand value,
+                           int64_t divisor) {
+  const DividePlan plan = strength_reduce_divide(divisor);
+  const Operand rax = _operand_reg(REG_RAX);
+  const Operand rdx = _operand_reg(REG_RDX);
+  switch (plan.kind) {
+  case DIVIDE_COPY:
+    _emit_move(emit, dest, value);
+    return;
+  case DIVIDE_SHIFT:
+    // cqo fills rdx with the sign, which becomes the bias that makes the
+    // shift round negative dividends up
+    _emit_move(emit, rax, value);
+    _emit_op0(emit, OP_CQO);
+    _emit_op2(emit, OP_SHR, rdx, _operand_imm(64 - plan.shift));
+    _emit_add(emit, rax, rdx);
+    _emit_op2(emit, OP_SAR, rax, _operand_imm(plan.shift));
+    if (plan.negate) {
+      _emit_op1(emit, OP_NEG, rax);
+    }
+    _emit_move(emit, dest, rax);
+    return;
+  case DIVIDE_MAGIC:
+    // One operand imul leaves the high half of the product in rdx
+    _emit_mov(emit, rax, _operand_imm(plan.multiplier));
+    _emit_op1(emit, OP_IMUL, value);
+    if (plan.adjust > 0) {
+      _emit_add(emit, rdx, value);
+    } else if (plan.adjust < 0) {
+      _emit_sub(emit, rdx, value);
+    }
+    if (plan.shift) {
+      _emit_op2(emit, OP_SAR, rdx, _operand_imm(plan.shift));
+    }
+    // The shift rounded negative quotients down, so they get 1 back
+    _emit_mov(emit, rax, rdx);
+    _emit_op2(emit, OP_SHR, rax, _operand_imm(63));
+    _emit_add(emit, rdx, rax);
+    _emit_move(emit, dest, rdx);
+    return;
+  case DIVIDE_IDIV:
+    break;
+  }
+  DZ_THROW("Bad division plan %d", plan.kind);
+}
+
+// op dest, src, where adding or subtracting 1 is an inc or dec
+void _emit_alu(Emitter *emit, X86Op op, Operand dest, Operand src) {
+  if ((op == OP_ADD || op == OP_SUB) && src.kind == OPERAND_IMM &&
+      (src.value == 1 || src.value == -1)) {
+    const bool up = (op == OP_ADD) == (src.value == 1);
+    _emit_op1(emit, up ? OP_INC : OP_DEC, dest);
+    return;
+  }
+  _emit_op2(emit, op, dest, src);
+}
+
+// The register temp is in, after loading it into scratch if it's in memory
+static X86Reg _address_register(Emitter *emit, IrTemp temp, X86Reg scratch) {
+  const Operand operand = _operand_temp(emit, temp);
+  if (operand.kind == OPERAND_REG)
+    return operand.reg;
+  _emit_mov(emit, _operand_reg(scratch), operand);
+  return scratch;
+}
+
+// Works out a tree with the lea its tiling chose. One that only adds to the
+// register it writes is an add instead
+void _emit_address(Emitter *emit, Operand dest, const TreeAddress *address) {
+  const X86Reg base = _address_register(emit, address->base, REG_RAX);
+  X86Reg index = base;
+  if (address->scale && address->index != address->base) {
+    index = _address_register(emit, address->index, REG_RDX);
+  }
+  // lea reads its address before it writes, so dest's register is safe
+  const Operand work =
+      _operand_reg(dest.kind == OPERAND_REG ? dest.reg : REG_RAX);
+  if (!address->scale && work.reg == base) {
+    if (address->disp) {
+      _emit_alu(emit, OP_ADD, work, _operand_imm(address->disp));
+    }
+  } else if (address->scale == 1 && !address->disp &&
+             (work.reg == base || work.reg == index)) {
+    _emit_add(emit, work, _operand_reg(work.reg == base ? index : base));
+  } else {
+    _emit_lea(emit, work,
+              (Operand){.kind = OPERAND_MEM,
+                        .reg = base,
+                        .index = index,
+                        .scale = address->scale,
+                        .ptr = PTR_NONE,
+                        .value = address->disp});
+  }
+  _emit_move(emit, dest, work);
+}
+
+void _emit_arithmetic(Emitter *emit, const IrInstr *instr) {
+  const TempValue *result = &emit->values[instr->dest];
+  if (result->covered)
+    return;
+  const Operand dest = _operand_temp(emit, instr->dest);
+  if (result->address != NO_ADDRESS) {
+    _emit_address(emit, dest, &emit->addresses[result->address]);
+    return;
+  }
+  const uint32_t immediate = _immediate_args(emit, instr);
+  if ((instr->op == IR_MUL || instr->op == IR_DIV) && immediate) {
+    const uint32_t folded = (uint32_t)__builtin_ctz(immediate);
+    const Operand value = _operand_temp(emit, instr->args[1 - folded]);
+    const int64_t constant = emit->values[instr->args[folded]].value;
+    if (instr->op == IR_MUL) {
+      _emit_multiply_constant(emit, dest, value, constant);
     } else {
-      return;
+      _emit_divide_constant(emit, dest, value, constant);
     }
-    child = ast_get_next_sibling(ast, unary_node);
+    return;
   }
+  Operand left = _operand_arg(emit, instr->args, immediate, 0);
+  Operand right = _operand_arg(emit, instr->args, immediate, 1);
+  if (instr->op == IR_DIV) {
+    // idiv divides rdx:rax, and leaves the quotient in rax
+    _emit_move(emit, _operand_reg(REG_RAX), left);
+    _emit_op0(emit, OP_CQO);
+    _emit_op1(emit, OP_IDIV, right);
+    _emit_move(emit, dest, _operand_reg(REG_RAX));
+    return;
+  }
+  const X86Op op = ARITHMETIC_OPS[instr->op];
+  if (left.kind == OPERAND_IMM) {
+    // Only addition folds its first argument, and x86 wants it second
+    const Operand swap = left;
+    left = right;
+    right = swap;
+  }
+  // Commutative operators can work in the right operand's register
+  if (op != OP_SUB && dest.kind == OPERAND_REG &&
+      _same_location(dest, right)) {
+    _emit_op2(emit, op, dest, left);
+    return;
+  }
+  // Adding to or subtracting from a value in place works in memory too
+  if (_same_location(dest, left) &&
+      (op != OP_IMUL || dest.kind == OPERAND_REG)) {
+    if (dest.kind == OPERAND_MEM && right.kind == OPERAND_MEM) {
+      _emit_mov(emit, _operand_reg(REG_RAX), right);
+      right = _operand_reg(REG_RAX);
+    }
+    _emit_alu(emit, op, dest, right);
+    return;
+  }
+  const Operand work = _operand_reg(_work_register(dest, right));
+  _emit_move(emit, work, left);
+  _emit_alu(emit, op, work, right);
+  _emit_move(emit, dest, work);
 }
 
-// expression := term {( "-" | "+" ) term}
-// Emits an expression, and places the result in rax
-void _emit_expression(Emitter *emit, NodeID expr_node) {
-  const CallingConvention *cc = emit->cc;
-  AST *ast = emit->ast;
-  NodeID child = ast_get_first_child(ast, expr_node);
-  if (child == NO_NODE)
-    return;
-  _emit_term(emit, child);
-  child = ast_get_next_sibling(ast, child);
-  // Handle the {( "/" | "*" ) unary} case
-  while (child != NO_NODE) {
-    const NodeID term_node = ast_get_next_sibling(ast, child);
-    if (!ast_node_is_token(ast, child) || term_node == NO_NODE)
-      return;
-    _emit_push(emit, cc->ret_r);
-    _emit_term(emit, term_node);
-    _emit_mov(emit, cc->scratch_r[0],
-              cc->ret_r); // Move the unary node into rbx
-    _emit_pop(emit, cc->ret_r);
-    const Token *child_token = ast_node_get_token(ast, child);
-    if (child_token->type == TOKEN_PLUS) {
-      _emit_add(emit, cc->ret_r, cc->scratch_r[0]);
-    } else if (child_token->type == TOKEN_MINUS) {
-      _emit_sub(emit, cc->ret_r, cc->scratch_r[0]);
+// Compares args[0] with args[1], and returns the condition the flags then hold
+// cond for, which is swapped when the constant had to go second
+IrCondition _emit_compare(Emitter *emit, const IrTemp args[2],
+                          IrCondition cond) {
+  const uint32_t immediate = _immediate_compare_args(emit, args);
+  Operand left = _operand_arg(emit, args, immediate, 0);
+  Operand right = _operand_arg(emit, args, immediate, 1);
+  if (left.kind == OPERAND_IMM) {
+    const Operand swap = left;
+    left = right;
+    right = swap;
+    cond = ir_condition_swap(cond);
+  }
+  if (left.kind == OPERAND_MEM && right.kind == OPERAND_MEM) {
+    _emit_mov(emit, _operand_reg(REG_RAX), left);
+    left = _operand_reg(REG_RAX);
+  }
+  // test sets the same flags as comparing with 0, and is shorter
+  if (left.kind == OPERAND_REG && right.kind == OPERAND_IMM &&
+      right.value == 0) {
+    _emit_op2(emit, OP_TEST, left, left);
+  } else {
+    _emit_op2(emit, OP_CMP, left, right);
+  }
+  return cond;
+}
+
+// 1 if the comparison holds, 0 if not. A fused compare only sets the flags,
+// for the select after it
+void _emit_compare_result(Emitter *emit, const IrInstr *instr) {
+  const IrCondition cond = _emit_compare(emit, instr->args, instr->cond);
+  if (emit->values[instr->dest].fused) {
+    emit->fused_condition = cond;
+    return;
+  }
+  const Operand rax = _operand_reg(REG_RAX);
+  _emit_op1(emit, CONDITION_SETS[cond], _operand_byte_reg(REG_RAX));
+  _emit_op2(emit, OP_MOVZX, rax, _operand_byte_reg(REG_RAX));
+  _emit_move(emit, _operand_temp(emit, instr->dest), rax);
+}
+
+// Picks one of two values without a branch: the value used when the condition
+// doesn't hold is moved in, and cmov overwrites it when it does. mov leaves
+// the flags alone, so they can be set first
+void _emit_select(Emitter *emit, const IrInstr *instr) {
+  IrCondition cond = IR_COND_NE;
+  if (emit->values[instr->args[0]].fused) {
+    cond = emit->fused_condition;
+  } else {
+    const Operand flag = _operand_temp(emit, instr->args[0]);
+    if (flag.kind == OPERAND_REG) {
+      _emit_op2(emit, OP_TEST, flag, flag);
     } else {
-      return;
+      _emit_op2(emit, OP_CMP, flag, _operand_imm(0));
     }
-    child = ast_get_next_sibling(ast, term_node);
   }
+  const uint32_t immediate = _immediate_args(emit, instr);
+  Operand if_true = _operand_arg(emit, instr->args, immediate, 1);
+  Operand if_false = _operand_arg(emit, instr->args, immediate, 2);
+  if (if_true.kind == OPERAND_IMM) {
+    const Operand swap = if_true;
+    if_true = if_false;
+    if_false = swap;
+    cond = ir_condition_negate(cond);
+  }
+  const Operand dest = _operand_temp(emit, instr->dest);
+  const Operand work = _operand_reg(_work_register(dest, if_true));
+  _emit_move(emit, work, if_false);
+  _emit_op2(emit, CONDITION_MOVES[cond], work, if_true);
+  _emit_move(emit, dest, work);
 }
 
-// Stores the comparison result in the jump flag (after cmp). Returns the ID of
-// the operation node comparison ::= expression ("==" | "!=" | ">" | ">=" | "<"
-// | "<=") expression
-NodeID _emit_comparison(Emitter *emit, NodeID comparison_node) {
+// Prints text, from the literal table or a fused PRINT run, plus a newline
+void _emit_print_text(Emitter *emit, char *text) {
+  const ptrdiff_t literal = shgeti(emit->table->literal_table, text);
+  uint32_t label = 0;
+  if (literal != -1) {
+    label = emit->table->literal_table[literal].value.label;
+    emit->literal_used[label] = true;
+  } else {
+    // Identical runs share their string
+    ptrdiff_t index = shgeti(emit->print_runs, text);
+    if (index == -1) {
+      shput(emit->print_runs, text, emit->print_run_label++);
+      index = shgeti(emit->print_runs, text);
+    }
+    label = emit->print_runs[index].value;
+  }
   const CallingConvention *cc = emit->cc;
-  AST *ast = emit->ast;
-  NodeID left_expr = ast_get_first_child(ast, comparison_node);
-  NodeID op_node = ast_get_next_sibling(ast, left_expr);
-  NodeID right_expr = ast_get_next_sibling(ast, op_node);
-  if (left_expr == NO_NODE || op_node == NO_NODE || right_expr == NO_NODE)
-    return NO_NODE;
-  _emit_expression(emit, left_expr);
-  _emit_push(emit, cc->ret_r);
-  _emit_expression(emit, right_expr);
-  _emit_mov(emit, cc->scratch_r[0], cc->ret_r);
-  _emit_pop(emit, cc->ret_r);
-  _emit_instr(emit, "cmp %s, %s", cc->ret_r, cc->scratch_r[0]);
-  return op_node;
-}
-
-const char *_get_jump_instruction_from_operation(const enum TOKEN token) {
-  // Switch statement isn't used bc gcc hates me
-  if (token == TOKEN_EQEQ)
-    return "jne";
-  if (token == TOKEN_NOTEQ)
-    return "je";
-  if (token == TOKEN_GT)
-    return "jle";
-  if (token == TOKEN_GTE)
-    return "jl";
-  if (token == TOKEN_LT)
-    return "jge";
-  if (token == TOKEN_LTE)
-    return "jg";
-  return NULL;
-}
-
-NodeID _emit_statement_block(Emitter *emit, NodeID possible_statement_node);
-
-void _emit_statement(Emitter *emit, NodeID statement_node) {
+  _emit_lea(emit, _operand_reg(cc->arg_r[0]), _operand_literal(emit, label));
+  _emit_mov(emit, _operand_reg(cc->arg_r[1]),
+            _operand_imm((int64_t)strlen(text)));
+  _emit_op1(emit, OP_CALL, _operand_named(PRINT_STRING));
+}
+
+// Emits the string literals the code printed, then the strings of every fused
+// PRINT run, as read-only data. Literals that only went into runs are left out
+void _emit_rodata(Emitter *emit) {
+  const LiteralTable literals = emit->table->literal_table;
+  const uint32_t literal_len = shlenu(literals);
+  const uint32_t run_count = (uint32_t)shlenu(emit->print_runs);
+  bool any_used = run_count != 0;
+  for (uint32_t i = 0; i < literal_len && !any_used; i++) {
+    any_used = emit->literal_used[literals[i].value.label];
+  }
+  if (!any_used)
+    return;
+  _emit_rodata_section(emit);
+  for (uint32_t i = 0; i < literal_len; i++) {
+    const LiteralHash lit = literals[i];
+    if (!emit->literal_used[lit.value.label])
+      continue;
+    const Symbol symbol = {.kind = SYMBOL_LITERAL, .id = lit.value.label};
+    _emit_string(emit, &symbol, lit.key);
+  }
+  for (uint32_t i = 0; i < run_count; i++) {
+    const Symbol symbol = {.kind = SYMBOL_LITERAL,
+                           .id = emit->print_runs[i].value};
+    _emit_string(emit, &symbol, emit->print_runs[i].key);
+  }
+}
+
+void _emit_instr(Emitter *emit, const IrInstr *instr) {
   const CallingConvention *cc = emit->cc;
-  AST *ast = emit->ast;
-  NodeID first_child = ast_get_first_child(ast, statement_node);
-  if (first_child == NO_NODE || !ast_node_is_token(ast, first_child))
-    return;
-  const Token *token = ast_node_get_token(ast, first_child);
-  // PRINT (expr | string)
-  if (token->type == TOKEN_PRINT) {
-    NodeID expr_or_str = ast_get_next_sibling(ast, first_child);
-    // must be string
-    if (ast_node_is_token(ast, expr_or_str) &&
-        ast_node_get_token(ast, expr_or_str)->type == TOKEN_STRING) {
-      const Token *string = ast_node_get_token(ast, expr_or_str);
-      LiteralInfo literal = shget(emit->table->literal_table, string->text);
-      _emit_instr(emit, "lea %s, %s%" PRIu32 "[%s]", cc->arg_r[0],
-                  LITERAL_DELIMITER, literal.label, cc->rip);
-      _emit_instr(emit, "call %s", PRINT_STRING);
+  switch (instr->op) {
+  case IR_CONST:
+    if (!_has_location(emit, instr->dest))
       return;
+    _emit_move(emit, _operand_temp(emit, instr->dest),
+               _operand_imm(instr->value));
+    return;
+  case IR_LOAD:
+    _emit_move(emit, _operand_temp(emit, instr->dest),
+               _operand_variable(emit, instr->variable));
+    return;
+  case IR_STORE: {
+    const Operand value =
+        _operand_arg(emit, instr->args, _immediate_args(emit, instr), 0);
+    Operand variable = _operand_variable(emit, instr->variable);
+    // Nothing else gives the size of an immediate
+    if (value.kind == OPERAND_IMM) {
+      variable.ptr = PTR_QWORD;
     }
-    // Otherwise, check if it's an expression node
-    if (ast_node_is_grammar(ast, expr_or_str) &&
-        ast_node_get_grammar(ast, expr_or_str) == GRAMMAR_TYPE_EXPRESSION) {
-      // Gets expr int in rax
-      _emit_expression(emit, expr_or_str);
-      _emit_instr(emit, "mov %s, %s", cc->arg_r[0], cc->ret_r);
-      _emit_instr(emit, "call %s", PRINT_INTEGER);
+    _emit_move(emit, variable, value);
+    return;
+  }
+  case IR_COPY:
+    _emit_move(emit, _operand_temp(emit, instr->dest),
+               _operand_arg(emit, instr->args, _immediate_args(emit, instr),
+                            0));
+    return;
+  case IR_NEG: {
+    const Operand dest = _operand_temp(emit, instr->dest);
+    const Operand value = _operand_temp(emit, instr->args[0]);
+    if (_same_location(dest, value)) {
+      _emit_op1(emit, OP_NEG, dest);
       return;
     }
-    // ERROR! Bad print statement
+    const Operand work = _operand_reg(_work_register(dest, value));
+    _emit_move(emit, work, value);
+    _emit_op1(emit, OP_NEG, work);
+    _emit_move(emit, dest, work);
     return;
-  } else if (token->type == TOKEN_LET) {
-    // "LET" ident "=" expression nl
-    const NodeID ident_node = ast_get_next_sibling(ast, first_child);
-    const NodeID eq_node = ast_get_next_sibling(ast, ident_node);
-    const NodeID expr_node = ast_get_next_sibling(ast, eq_node);
-    if (ident_node == NO_NODE || eq_node == NO_NODE || expr_node == NO_NODE)
-      return;
-    const Token *ident_token = ast_node_get_token(ast, ident_node);
-    // Get identifier name and write value
-    _emit_expression(emit, expr_node);
-    _emit_instr(emit, "mov QWORD PTR %s%s[%s], %s", SYMBOL_DELIMITER,
-                ident_token->text, cc->rip, cc->ret_r);
-    return;
-  } else if (token->type == TOKEN_INPUT) {
-    // "INPUT" ident nl
-    const NodeID ident_node = ast_get_next_sibling(ast, first_child);
-    if (ident_node == NO_NODE)
-      return;
-    const Token *ident_token = ast_node_get_token(ast, ident_node);
-    DZ_ASSERT(ident_token->type == TOKEN_IDENT);
-    _emit_instr(emit, "call %s", INPUT_INTEGER);
-    _emit_instr(emit, "mov QWORD PTR %s%s[%s], %s", SYMBOL_DELIMITER,
-                ident_token->text, cc->rip, cc->ret_r);
-    return;
-  } else if (token->type == TOKEN_LABEL) {
-    // LABEL ident
-    const NodeID label_ident_node = ast_get_next_sibling(ast, first_child);
-    if (label_ident_node == NO_NODE)
-      return;
-    const Token *ident_token = ast_node_get_token(ast, label_ident_node);
-    DZ_ASSERT(ident_token->type == TOKEN_IDENT);
-    _emit_instr(emit, "%s%s:", LABEL_DELIMITER, ident_token->text);
+  }
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+    _emit_arithmetic(emit, instr);
     return;
-  } else if (token->type == TOKEN_GOTO) {
-    const NodeID label_ident_node = ast_get_next_sibling(ast, first_child);
-    if (label_ident_node == NO_NODE)
-      return;
-    const Token *ident_token = ast_node_get_token(ast, label_ident_node);
-    DZ_ASSERT(ident_token->type == TOKEN_IDENT);
-    _emit_instr(emit, "jmp %s%s", LABEL_DELIMITER, ident_token->text);
-    return;
-  } else if (token->type == TOKEN_IF) {
-    // "IF" comparison "THEN" nl {statement}* "ENDIF" nl
-    const NodeID comp_node = ast_get_next_sibling(ast, first_child);
-    if (comp_node == NO_NODE)
-      return;
-    NodeID op_node = _emit_comparison(emit, comp_node);
-    const char *jmp_inst = _get_jump_instruction_from_operation(
-        ast_node_get_token(ast, op_node)->type);
-    const uint32_t label_number = emitter_get_label(emit);
-    _emit_instr(emit, "%s %s%" PRIu32, jmp_inst, INTERNAL_LABEL_DELIMITER,
-                label_number);
-    // Emit THEN body
-    const NodeID then_node = ast_get_next_sibling(ast, comp_node);
-    DZ_ASSERT(ast_node_get_token(ast, then_node)->type == TOKEN_THEN);
-    const NodeID possible_statement = ast_get_next_sibling(ast, then_node);
-    const NodeID end_if_node = _emit_statement_block(emit, possible_statement);
-    DZ_ASSERT(ast_node_get_token(ast, end_if_node)->type == TOKEN_ENDIF);
-    UNUSED(end_if_node);
-    _emit_instr(emit, "%s%" PRIu32 ":", INTERNAL_LABEL_DELIMITER, label_number);
-    return;
-  } else if (token->type == TOKEN_WHILE) {
-    // "WHILE" comparison "REPEAT" nl {statement}* "ENDWHILE" nl
-    const NodeID comp_node = ast_get_next_sibling(ast, first_child);
-    if (comp_node == NO_NODE)
+  case IR_COMPARE:
+    _emit_compare_result(emit, instr);
+    return;
+  case IR_SELECT:
+    _emit_select(emit, instr);
+    return;
+  case IR_PRINT_INT:
+    _emit_move(emit, _operand_reg(cc->arg_r[0]),
+               _operand_arg(emit, instr->args, _immediate_args(emit, instr),
+                            0));
+    _emit_op1(emit, OP_CALL, _operand_named(PRINT_INTEGER));
+    return;
+  case IR_PRINT_STR:
+    _emit_print_text(emit, instr->text);
+    return;
+  case IR_INPUT:
+    _emit_op1(emit, OP_CALL, _operand_named(INPUT_INTEGER));
+    _emit_move(emit, _operand_temp(emit, instr->dest),
+               _operand_reg(cc->ret_r));
+    return;
+  case IR_PHI: // Replaced by copies when the IR leaves SSA form
+  case IR_OPCODE_COUNT:
+    break;
+  }
+  DZ_THROW("Bad IR instruction %d", instr->op);
+}
+
+// Flushes PRINT's buffer, and leaves the program
+void _emit_program_exit(Emitter *emit) {
+  _emit_op1(emit, OP_CALL, _operand_named(FLUSH_OUTPUT));
+  if (emit->options->freestanding) {
+    // _start has nowhere to return to
+    _emit_exit(emit);
+  } else {
+    _emit_saved_registers(emit, true);
+    _emit_mov(emit, _operand_reg(emit->cc->ret_r), _operand_imm(0));
+    _emit_func_ret(emit);
+  }
+}
+
+// Emits the end of block, which falls through into the block laid out after
+// it wherever it can
+void _emit_terminator(Emitter *emit, IrBlockID block) {
+  const IrTerminator *term = &emit->ir->blocks[block].term;
+  const IrBlockID next = block + 1;
+  switch (term->kind) {
+  case IR_TERM_JUMP:
+    if (term->targets[0] != next) {
+      _emit_op1(emit, OP_JMP, _operand_block(emit, term->targets[0]));
+    }
+    return;
+  case IR_TERM_BRANCH: {
+    const IrCondition cond = _emit_compare(emit, term->args, term->cond);
+    if (term->targets[0] == next) {
+      _emit_op1(emit, CONDITION_JUMPS[ir_condition_negate(cond)],
+                _operand_block(emit, term->targets[1]));
       return;
-    const uint32_t loop_start_label = emitter_get_label(emit);
-    const uint32_t loop_end_label = emitter_get_label(emit);
-    _emit_instr(emit, "%s%" PRIu32 ":", INTERNAL_LABEL_DELIMITER,
-                loop_start_label);
-    NodeID op_node = _emit_comparison(emit, comp_node);
-    const char *jmp_inst = _get_jump_instruction_from_operation(
-        ast_node_get_token(ast, op_node)->type);
-    _emit_instr(emit, "%s %s%" PRIu32, jmp_inst, INTERNAL_LABEL_DELIMITER,
-                loop_end_label);
-
-    const NodeID repeat_node = ast_get_next_sibling(ast, comp_node);
-    DZ_ASSERT(ast_node_get_token(ast, repeat_node)->type == TOKEN_REPEAT);
-    const NodeID endwhile_node =
-        _emit_statement_block(emit, ast_get_next_sibling(ast, repeat_node));
-    _emit_instr(emit, "jmp %s%" PRIu32, INTERNAL_LABEL_DELIMITER,
-                loop_start_label);
-    UNUSED(endwhile_node);
-    DZ_ASSERT(ast_node_get_token(ast, endwhile_node)->type == TOKEN_ENDWHILE);
-    _emit_instr(emit, "%s%" PRIu32 ":", INTERNAL_LABEL_DELIMITER,
-                loop_end_label);
-  }
-}
-
-// Evaluate the results from several statements. Starts with
-// possible_statement_node, and continues traversing its siblings until a
-// non-statement is found, or the end of the sibling list is reached.
-// Returns the next possible sibling
-NodeID _emit_statement_block(Emitter *emit, NodeID possible_statement_node) {
-  AST *ast = emit->ast;
-  while (possible_statement_node != NO_NODE &&
-         ast_node_is_grammar(ast, possible_statement_node) &&
-         ast_node_get_grammar(ast, possible_statement_node) ==
-             GRAMMAR_TYPE_STATEMENT) {
-    _emit_statement(emit, possible_statement_node);
-    possible_statement_node =
-        ast_get_next_sibling(ast, possible_statement_node);
-  }
-  return possible_statement_node;
-}
-
-void _emit_program(Emitter *emit, NodeID program_node) {
-  AST *ast = emit->ast;
-  NodeID child = ast_get_first_child(ast, program_node);
-  while (child != NO_NODE) {
-    _emit_statement(emit, child);
-    child = ast_get_next_sibling(ast, child);
-  }
-}
-
-void emit_x86(const PlatformInfo *plat_info, FILE *file, AST *ast,
-              NameTable *table) {
-  Emitter emit = emitter_init(plat_info, file, ast, table);
-  batched_writer_write(&emit.writer, PREAMBLE);
-  // Here's where the static vars should go
-  _emit_literals(&emit);
-  _emit_symbols(&emit);
-  batched_writer_write(&emit.writer, MAIN_PREAMBLE);
-  _emit_func_preamble(&emit);
-  NodeID head = ast_head(ast);
-  if (head != NO_NODE) {
-    _emit_program(&emit, head);
+    }
+    _emit_op1(emit, CONDITION_JUMPS[cond],
+              _operand_block(emit, term->targets[0]));
+    if (term->targets[1] != next) {
+      _emit_op1(emit, OP_JMP, _operand_block(emit, term->targets[1]));
+    }
+    return;
+  }
+  case IR_TERM_EXIT:
+    _emit_program_exit(emit);
+    return;
+  case IR_TERM_NONE:
+    break;
+  }
+  DZ_THROW("Block %" PRIu32 " isn't terminated", block);
+}
+
+// Whether anything jumps to the block, rather than falling into it from the
+// block laid out before it
+static bool _is_jumped_to(const IR *ir, IrBlockID block) {
+  const IrBlock *b = &ir->blocks[block];
+  for (uint32_t p = 0; p < b->pred_count; p++) {
+    const IrTerminator *term = &ir->blocks[b->preds[p]].term;
+    // A branch falls through on one side only
+    if (b->preds[p] + 1 != block ||
+        (term->kind == IR_TERM_BRANCH && term->targets[0] == block &&
+         term->targets[1] == block))
+      return true;
+  }
+  return false;
+}
+
+// Emits every block in layout order. Only blocks something jumps to get a
+// label, so LABELs nothing GOTOs are dropped. When the peephole optimizer is
+// on, instructions are buffered until the next label, since code can only be
+// entered there
+void _emit_blocks(Emitter *emit) {
+  const IR *ir = emit->ir;
+  emit->buffering = emit->options->peephole;
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    const IrBlock *block = &ir->blocks[i];
+    if (_is_jumped_to(ir, i)) {
+      _emit_label(emit, _operand_block(emit, i));
+    }
+    for (uint32_t j = 0; j < block->instr_count; j++) {
+      _emit_instr(emit, &block->instrs[j]);
+    }
+    _emit_terminator(emit, i);
+  }
+  _flush_instrs(emit, NULL, true);
+  emit->buffering = false;
+  if (emit->options->peephole_stats) {
+    *emit->options->peephole_stats = emit->peephole_stats;
+  }
+}
+
+// Emits the prologue of main, or of _start when freestanding, where the
+// program starts
+void _emit_main_preamble(Emitter *emit) {
+  const bool freestanding = emit->options->freestanding;
+  if (emit->encoder) {
+    const Symbol main_symbol = {.kind = SYMBOL_NAMED,
+                                .name = freestanding ? START : MAIN};
+    encoder_x86_section(emit->encoder, OBJ_SECTION_TEXT);
+    encoder_x86_global(emit->encoder, &main_symbol);
+    encoder_x86_label(emit->encoder, &main_symbol);
+  } else {
+    batched_writer_write(emit->writer,
+                         freestanding ? START_PREAMBLE : MAIN_PREAMBLE);
+  }
+  _emit_func_preamble(emit);
+}
+
+// Emits everything, whether it's being written or encoded
+void _emit_x86(Emitter *emit) {
+  if (emit->writer) {
+    batched_writer_write(emit->writer, PREAMBLE);
   }
+  _emit_symbols(emit);
+  _fold_operands(emit);
+  _assign_locations(emit);
+  emit->block_label = emit->control_flow_label;
+  emit->control_flow_label += emit->ir->block_count;
+  _emit_main_preamble(emit);
+  if (emit->frame_size) {
+    _emit_sub(emit, _operand_reg(emit->cc->rsp),
+              _operand_imm(emit->frame_size));
+  }
+  _emit_saved_registers(emit, false);
   // Here's where the generated code should go
-  _emit_func_ret(&emit);
-  _emit_print_int(&emit);
-  _emit_print_string(&emit);
-  _emit_input_int(&emit);
-  if (plat_info->os == OS_LINUX) {
-    batched_writer_write(&emit.writer, LINUX_POSTAMBLE);
-  }
-  batched_writer_close(&emit.writer);
-  return;
+  _emit_blocks(emit);
+  _emit_runtime(emit);
+  // Strings go last, once the code has shown which ones it prints
+  _emit_rodata(emit);
+  if (emit->writer && emit->platform_info->os == OS_LINUX) {
+    batched_writer_write(emit->writer, LINUX_POSTAMBLE);
+  }
+}
+
+void emit_x86(const PlatformInfo *plat_info, BatchedWriter *writer,
+              const IR *ir, NameTable *table, const EmitOptions *options) {
+  Emitter emit = emitter_init(plat_info, writer, NULL, ir, table, options);
+  _emit_x86(&emit);
+  emitter_destroy(&emit);
+}
+
+void emit_x86_object(const PlatformInfo *plat_info, ObjectFile *object,
+                     const IR *ir, NameTable *table,
+                     const EmitOptions *options) {
+  DZ_ASSERT(plat_info->os == OS_LINUX && plat_info->arch == ARCH_X86_64,
+            "Objects can only be encoded for x86_64-linux");
+  X86Encoder encoder = encoder_x86_init(object);
+  Emitter emit = emitter_init(plat_info, NULL, &encoder, ir, table, options);
+  _emit_x86(&emit);
+  emitter_destroy(&emit);
+  encoder_x86_finish(&encoder);
+  encoder_x86_destroy(&encoder);
 }
@@ -3,14 +3,45 @@
 // -----------------------------
 // x86 EMITTER
 //
-// Takes an AST with symbol tables, etc. and emits
-// x86 assembly
+// Selects x86 instructions for the IR of a program,
+// and emits them as assembly, or encodes them into an
+// object file
 // -----------------------------
 
-#include "../ast/ast.h"
 #include "../common/name_table.h"
+#include "batched_writer.h"
+#include "ir.h"
+#include "object_file.h"
+#include "peephole.h"
 #include "platform.h"
 
-// Emits x86 assembly to the given file given an AST and several tables
-void emit_x86(const PlatformInfo *platform_info, FILE *file, AST *ast,
-              NameTable *table);
+typedef struct {
+  // Spells labels, literals and the variable block as short numeric
+  // assembler-local symbols, and drops redundant whitespace and operand sizes.
+  // Makes the .s file smaller and faster to assemble, but harder to read
+  bool compact;
+  // Starts the program at _start and replaces libc with a small runtime that
+  // makes raw system calls, for static -nostdlib executables. Only supported
+  // for x86_64-linux
+  bool freestanding;
+  // Tiles expression trees by cost, so an lea can work out a whole tree of
+  // additions and multiplications by small constants
+  bool tile_trees;
+  // Cleans up each block's instructions with the peephole optimizer before
+  // they're written or encoded
+  bool peephole;
+  // Set to what the peephole optimizer did, when it isn't NULL
+  PeepholeStats *peephole_stats;
+} EmitOptions;
+
+// Emits x86 assembly for the IR into the given writer. The IR's predecessors
+// have to be up to date. The writer is left open, so the caller decides when
+// the output is complete
+void emit_x86(const PlatformInfo *platform_info, BatchedWriter *writer,
+              const IR *ir, NameTable *table, const EmitOptions *options);
+
+// Encodes the same program straight into machine code inside object, instead
+// of writing assembly for it. Only x86_64-linux targets are supported
+void emit_x86_object(const PlatformInfo *platform_info, ObjectFile *object,
+                     const IR *ir, NameTable *table,
+                     const EmitOptions *options);
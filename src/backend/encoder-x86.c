@@ -0,0 +1,793 @@
+#include "encoder-x86.h"
+#include "compiler_compatibility.h"
+#include "dz_debug.h"
+#include <stb_ds.h>
+#include <string.h>
+
+// ----------------------
+// Encoding Constants
+// ----------------------
+
+#define REX 0x40
+#define REX_W 0x08 // 64 bit operand size
+#define REX_R 0x04 // Extends ModRM.reg
+#define REX_X 0x02 // Extends SIB.index
+#define REX_B 0x01 // Extends ModRM.rm, or the register in the opcode
+
+#define MODRM_MEM 0x0
+#define MODRM_MEM_DISP8 0x1
+#define MODRM_MEM_DISP32 0x2
+#define MODRM_REG 0x3
+#define MODRM_RM_SIB 0x4 // rm value that means a SIB byte follows
+#define MODRM_RM_RIP 0x5 // rm value that means [rip+disp32] when mod is 0
+#define SIB_NO_INDEX 0x24 // [base] with no index, for rsp/r12 bases
+
+#define JUMP_ALWAYS 0xff
+#define JUMP_SHORT_SIZE 2
+#define JMP_LONG_SIZE 5 // E9 rel32
+#define JCC_LONG_SIZE 6 // 0F 8x rel32
+
+#define MAX_INSTRUCTION_SIZE 15
+
+// The ALU instructions share their encodings, and only differ by opcode and
+// the /digit of their immediate forms
+typedef struct {
+  uint8_t digit;      // ModRM.reg of the 81/83 immediate forms
+  uint8_t store;      // op r/m64, r64
+  uint8_t load;       // op r64, r/m64
+  uint8_t rax_imm32;  // op rax, imm32
+} AluEncoding;
+
+static const AluEncoding ALU_ADD = {0, 0x01, 0x03, 0x05};
+static const AluEncoding ALU_SUB = {5, 0x29, 0x2b, 0x2d};
+static const AluEncoding ALU_XOR = {6, 0x31, 0x33, 0x35};
+static const AluEncoding ALU_CMP = {7, 0x39, 0x3b, 0x3d};
+
+static bool _fits_int8(int64_t value) { return value >= -128 && value <= 127; }
+
+static bool _fits_int32(int64_t value) {
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// Hardware register number, the same as its enum value
+static uint8_t _reg_number(X86Reg reg) {
+  DZ_ASSERT(reg != REG_RIP);
+  return (uint8_t)reg;
+}
+
+// SIB.scale of an index scale of 1, 2, 4 or 8
+static uint8_t _scale_bits(uint8_t scale) {
+  DZ_ASSERT(scale == 1 || scale == 2 || scale == 4 || scale == 8);
+  return (uint8_t)__builtin_ctz(scale);
+}
+
+// ----------------------
+// Encoder
+// ----------------------
+
+X86Encoder encoder_x86_init(ObjectFile *object) {
+  return (X86Encoder){.object = object, .section = OBJ_SECTION_TEXT};
+}
+
+void encoder_x86_destroy(X86Encoder *encoder) {
+  arrfree(encoder->symbols);
+  for (uint32_t i = 0; i < SYMBOL_KIND_COUNT; i++) {
+    arrfree(encoder->by_id[i]);
+  }
+  arrfree(encoder->named);
+  arrfree(encoder->fixups);
+  arrfree(encoder->jumps);
+  *encoder = (X86Encoder){0};
+}
+
+static uint32_t _new_symbol(X86Encoder *encoder, const char *name) {
+  arrput(encoder->symbols, ((EncoderSymbol){.name = name}));
+  return (uint32_t)arrlenu(encoder->symbols) - 1;
+}
+
+// Looks up the encoder's symbol for an emitter symbol, creating it on first
+// use
+static uint32_t _symbol_index(X86Encoder *encoder, const Symbol *symbol) {
+  switch (symbol->kind) {
+  case SYMBOL_NAMED:
+    for (size_t i = 0; i < arrlenu(encoder->named); i++) {
+      const uint32_t index = encoder->named[i];
+      if (strcmp(encoder->symbols[index].name, symbol->name) == 0)
+        return index;
+    }
+    arrput(encoder->named, _new_symbol(encoder, symbol->name));
+    return arrlast(encoder->named);
+  case SYMBOL_VARIABLES:
+    if (!encoder->variables) {
+      encoder->variables = _new_symbol(encoder, NULL) + 1;
+    }
+    return encoder->variables - 1;
+  case SYMBOL_LITERAL:
+  case SYMBOL_USER_LABEL:
+  case SYMBOL_INTERNAL_LABEL: {
+    uint32_t **by_id = &encoder->by_id[symbol->kind];
+    if (symbol->id >= arrlenu(*by_id)) {
+      const size_t old_len = arrlenu(*by_id);
+      arrsetlen(*by_id, (size_t)symbol->id + 1);
+      memset(*by_id + old_len, 0,
+             (arrlenu(*by_id) - old_len) * sizeof(**by_id));
+    }
+    if (!(*by_id)[symbol->id]) {
+      (*by_id)[symbol->id] = _new_symbol(encoder, NULL) + 1;
+    }
+    return (*by_id)[symbol->id] - 1;
+  }
+  case SYMBOL_KIND_COUNT:
+    break;
+  }
+  DZ_THROW("Bad symbol kind %d", symbol->kind);
+  return 0;
+}
+
+static uint8_t **_section_bytes(X86Encoder *encoder) {
+  DZ_ASSERT(encoder->section != OBJ_SECTION_BSS &&
+            encoder->section != OBJ_SECTION_UNDEF);
+  return &encoder->object->bytes[encoder->section];
+}
+
+static uint64_t _text_size(const X86Encoder *encoder) {
+  return arrlenu(encoder->object->bytes[OBJ_SECTION_TEXT]);
+}
+
+void encoder_x86_section(X86Encoder *encoder, ObjSection section) {
+  encoder->section = section;
+}
+
+static void _define(X86Encoder *encoder, uint32_t index, ObjSection section,
+                    uint64_t offset) {
+  EncoderSymbol *symbol = &encoder->symbols[index];
+  DZ_ASSERT(!symbol->defined, "Symbol defined twice");
+  symbol->defined = true;
+  symbol->section = section;
+  symbol->offset = offset;
+}
+
+void encoder_x86_label(X86Encoder *encoder, const Symbol *symbol) {
+  const uint32_t index = _symbol_index(encoder, symbol);
+  _define(encoder, index, encoder->section,
+          arrlenu(*_section_bytes(encoder)));
+}
+
+void encoder_x86_global(X86Encoder *encoder, const Symbol *symbol) {
+  const uint32_t index = _symbol_index(encoder, symbol);
+  encoder->symbols[index].global = true;
+}
+
+void encoder_x86_bytes(X86Encoder *encoder, const void *bytes, size_t size) {
+  if (size == 0)
+    return;
+  memcpy(arraddnptr(*_section_bytes(encoder), size), bytes, size);
+}
+
+void encoder_x86_reserve(X86Encoder *encoder, const Symbol *symbol,
+                         uint64_t size, uint64_t align) {
+  ObjectFile *object = encoder->object;
+  object->bss_size = (object->bss_size + align - 1) / align * align;
+  object->bss_align = MAX(object->bss_align, align);
+  _define(encoder, _symbol_index(encoder, symbol), OBJ_SECTION_BSS,
+          object->bss_size);
+  object->bss_size += size;
+}
+
+// ----------------------
+// Instructions
+// ----------------------
+
+// An instruction being put together, before it's appended to .text
+typedef struct {
+  uint8_t bytes[MAX_INSTRUCTION_SIZE];
+  uint8_t len;
+} Instruction;
+
+static void _put(Instruction *inst, uint8_t byte) {
+  DZ_ASSERT(inst->len < MAX_INSTRUCTION_SIZE);
+  inst->bytes[inst->len++] = byte;
+}
+
+static void _put_le(Instruction *inst, uint64_t value, uint32_t size) {
+  for (uint32_t i = 0; i < size; i++) {
+    _put(inst, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+static void _append(X86Encoder *encoder, const Instruction *inst) {
+  DZ_ASSERT(encoder->section == OBJ_SECTION_TEXT,
+            "Instructions can only go in .text");
+  encoder_x86_bytes(encoder, inst->bytes, inst->len);
+}
+
+// Encodes [rex] opcode modrm [sib] [disp] [imm], where rm is a register or
+// memory operand, and reg is a register number or an opcode /digit.
+// rex holds the REX bits the instruction always needs. A bare REX forces an
+// empty prefix, for byte registers in the reg field.
+// rip relative operands get a fixup, whose addend accounts for the immediate
+// that follows the displacement
+static void _encode_rm(X86Encoder *encoder, uint8_t rex, const uint8_t *opcode,
+                       uint32_t opcode_len, uint8_t reg, const Operand *rm,
+                       int64_t imm, uint32_t imm_size) {
+  Instruction inst = {0};
+  // spl, bpl, sil and dil only exist with a REX prefix
+  bool force_rex = (rex & REX) != 0;
+  rex &= (uint8_t)~REX;
+  if (reg >= 8)
+    rex |= REX_R;
+  if (rm->kind == OPERAND_REG || rm->kind == OPERAND_BYTE_REG) {
+    if (_reg_number(rm->reg) >= 8)
+      rex |= REX_B;
+    force_rex |= rm->kind == OPERAND_BYTE_REG && rm->reg >= REG_RSP &&
+                 rm->reg <= REG_RDI;
+  } else {
+    DZ_ASSERT(rm->kind == OPERAND_MEM);
+    if (rm->reg != REG_RIP && _reg_number(rm->reg) >= 8)
+      rex |= REX_B;
+    if (rm->scale && _reg_number(rm->index) >= 8)
+      rex |= REX_X;
+  }
+  if (rex || force_rex)
+    _put(&inst, REX | rex);
+  for (uint32_t i = 0; i < opcode_len; i++) {
+    _put(&inst, opcode[i]);
+  }
+  const uint8_t reg_bits = (uint8_t)((reg & 7) << 3);
+
+  if (rm->kind != OPERAND_MEM) {
+    _put(&inst, (uint8_t)(MODRM_REG << 6 | reg_bits | (rm->reg & 7)));
+  } else if (rm->reg == REG_RIP) {
+    _put(&inst, (uint8_t)(MODRM_MEM << 6 | reg_bits | MODRM_RM_RIP));
+    arrput(encoder->fixups,
+           ((EncoderFixup){
+               .offset = _text_size(encoder) + inst.len,
+               .symbol = _symbol_index(encoder, &rm->symbol),
+               .kind = FIXUP_PC32,
+               .addend = rm->value - 4 - (int64_t)imm_size,
+           }));
+    _put_le(&inst, 0, 4);
+  } else {
+    const uint8_t base = _reg_number(rm->reg) & 7;
+    const int64_t disp = rm->value;
+    uint8_t mod = MODRM_MEM_DISP32;
+    // [rbp] and [r13] have no displacement-free form
+    if (disp == 0 && base != MODRM_RM_RIP) {
+      mod = MODRM_MEM;
+    } else if (_fits_int8(disp)) {
+      mod = MODRM_MEM_DISP8;
+    }
+    DZ_ASSERT(_fits_int32(disp));
+    if (rm->scale) {
+      // rsp can't be an index
+      DZ_ASSERT(rm->index != REG_RSP);
+      _put(&inst, (uint8_t)(mod << 6 | reg_bits | MODRM_RM_SIB));
+      _put(&inst, (uint8_t)(_scale_bits(rm->scale) << 6 |
+                            (_reg_number(rm->index) & 7) << 3 | base));
+    } else {
+      _put(&inst, (uint8_t)(mod << 6 | reg_bits | base));
+      if (base == MODRM_RM_SIB)
+        _put(&inst, SIB_NO_INDEX);
+    }
+    if (mod == MODRM_MEM_DISP8) {
+      _put_le(&inst, (uint64_t)disp, 1);
+    } else if (mod == MODRM_MEM_DISP32) {
+      _put_le(&inst, (uint64_t)disp, 4);
+    }
+  }
+  _put_le(&inst, (uint64_t)imm, imm_size);
+  _append(encoder, &inst);
+}
+
+// Shorthand for instructions with a one byte opcode
+static void _encode_rm1(X86Encoder *encoder, uint8_t opcode, uint8_t reg,
+                        const Operand *rm, int64_t imm, uint32_t imm_size) {
+  _encode_rm(encoder, REX_W, &opcode, 1, reg, rm, imm, imm_size);
+}
+
+static inline bool _is_reg_or_mem(const Operand *operand) {
+  return operand->kind == OPERAND_REG || operand->kind == OPERAND_MEM;
+}
+
+static void _encode_alu(X86Encoder *encoder, const AluEncoding *alu,
+                        const Operand *dest, const Operand *src) {
+  DZ_ASSERT(_is_reg_or_mem(dest));
+  if (src->kind == OPERAND_REG) {
+    _encode_rm1(encoder, alu->store, _reg_number(src->reg), dest, 0, 0);
+    return;
+  }
+  if (src->kind == OPERAND_MEM) {
+    DZ_ASSERT(dest->kind == OPERAND_REG);
+    _encode_rm1(encoder, alu->load, _reg_number(dest->reg), src, 0, 0);
+    return;
+  }
+  DZ_ASSERT(src->kind == OPERAND_IMM && _fits_int32(src->value));
+  if (_fits_int8(src->value)) {
+    _encode_rm1(encoder, 0x83, alu->digit, dest, src->value, 1);
+  } else if (dest->kind == OPERAND_REG && dest->reg == REG_RAX) {
+    Instruction inst = {0};
+    _put(&inst, REX | REX_W);
+    _put(&inst, alu->rax_imm32);
+    _put_le(&inst, (uint64_t)src->value, 4);
+    _append(encoder, &inst);
+  } else {
+    _encode_rm1(encoder, 0x81, alu->digit, dest, src->value, 4);
+  }
+}
+
+// REX bits needed to name a byte register in the ModRM.reg field
+static uint8_t _byte_reg_rex(X86Reg reg) {
+  return reg >= REG_RSP && reg <= REG_RDI ? REX : 0;
+}
+
+static void _encode_mov(X86Encoder *encoder, const Operand *dest,
+                        const Operand *src) {
+  if (src->kind == OPERAND_BYTE_REG) {
+    DZ_ASSERT(dest->kind == OPERAND_MEM && dest->ptr == PTR_BYTE);
+    static const uint8_t opcode = 0x88; // mov r/m8, r8
+    _encode_rm(encoder, _byte_reg_rex(src->reg), &opcode, 1,
+               _reg_number(src->reg), dest, 0, 0);
+    return;
+  }
+  DZ_ASSERT(_is_reg_or_mem(dest));
+  if (src->kind == OPERAND_REG) {
+    _encode_rm1(encoder, 0x89, _reg_number(src->reg), dest, 0, 0);
+  } else if (src->kind == OPERAND_MEM) {
+    DZ_ASSERT(dest->kind == OPERAND_REG);
+    _encode_rm1(encoder, 0x8b, _reg_number(dest->reg), src, 0, 0);
+  } else if (_fits_int32(src->value)) {
+    DZ_ASSERT(src->kind == OPERAND_IMM);
+    _encode_rm1(encoder, 0xc7, 0, dest, src->value, 4);
+  } else {
+    // movabs, the only form with a 64 bit immediate
+    DZ_ASSERT(src->kind == OPERAND_IMM && dest->kind == OPERAND_REG);
+    const uint8_t reg = _reg_number(dest->reg);
+    Instruction inst = {0};
+    _put(&inst, (uint8_t)(REX | REX_W | (reg >= 8 ? REX_B : 0)));
+    _put(&inst, (uint8_t)(0xb8 + (reg & 7)));
+    _put_le(&inst, (uint64_t)src->value, 8);
+    _append(encoder, &inst);
+  }
+}
+
+// push/pop, which encode their register in the opcode
+static void _encode_push_pop(X86Encoder *encoder, uint8_t opcode,
+                             const Operand *operand) {
+  DZ_ASSERT(operand->kind == OPERAND_REG);
+  const uint8_t reg = _reg_number(operand->reg);
+  Instruction inst = {0};
+  if (reg >= 8)
+    _put(&inst, REX | REX_B);
+  _put(&inst, (uint8_t)(opcode + (reg & 7)));
+  _append(encoder, &inst);
+}
+
+static void _encode_jump(X86Encoder *encoder, uint8_t condition,
+                         const Operand *target) {
+  DZ_ASSERT(target->kind == OPERAND_SYMBOL);
+  arrput(encoder->jumps,
+         ((EncoderJump){.offset = _text_size(encoder),
+                        .symbol = _symbol_index(encoder, &target->symbol),
+                        .condition = condition}));
+  // Filled in once the jump's size is known
+  const Instruction inst = {.len = JUMP_SHORT_SIZE};
+  _append(encoder, &inst);
+}
+
+static void _encode_call(X86Encoder *encoder, const Operand *target) {
+  DZ_ASSERT(target->kind == OPERAND_SYMBOL);
+  Instruction inst = {0};
+  _put(&inst, 0xe8);
+  arrput(encoder->fixups,
+         ((EncoderFixup){.offset = _text_size(encoder) + inst.len,
+                         .symbol = _symbol_index(encoder, &target->symbol),
+                         .kind = FIXUP_CALL,
+                         .addend = -4}));
+  _put_le(&inst, 0, 4);
+  _append(encoder, &inst);
+}
+
+// imul's three forms: rdx:rax = rax * r/m, r *= r/m, and r = r/m * imm
+static void _encode_imul(X86Encoder *encoder, const Operand *a1,
+                         const Operand *a2, const Operand *imm) {
+  if (!a2) {
+    DZ_ASSERT(_is_reg_or_mem(a1));
+    _encode_rm1(encoder, 0xf7, 5, a1, 0, 0);
+    return;
+  }
+  DZ_ASSERT(a1->kind == OPERAND_REG && _is_reg_or_mem(a2));
+  if (!imm) {
+    static const uint8_t opcode[] = {0x0f, 0xaf};
+    _encode_rm(encoder, REX_W, opcode, 2, _reg_number(a1->reg), a2, 0, 0);
+    return;
+  }
+  DZ_ASSERT(imm->kind == OPERAND_IMM && _fits_int32(imm->value));
+  if (_fits_int8(imm->value)) {
+    _encode_rm1(encoder, 0x6b, _reg_number(a1->reg), a2, imm->value, 1);
+  } else {
+    _encode_rm1(encoder, 0x69, _reg_number(a1->reg), a2, imm->value, 4);
+  }
+}
+
+// Shifts by an immediate, where digit picks the kind of shift
+static void _encode_shift(X86Encoder *encoder, uint8_t digit,
+                          const Operand *dest, const Operand *count) {
+  DZ_ASSERT(_is_reg_or_mem(dest) && count->kind == OPERAND_IMM);
+  // gas has a shorter form for shifting by 1
+  if (count->value == 1) {
+    _encode_rm1(encoder, 0xd1, digit, dest, 0, 0);
+  } else {
+    _encode_rm1(encoder, 0xc1, digit, dest, count->value, 1);
+  }
+}
+
+// setcc r/m8, where condition is the same condition code jumps use
+static void _encode_setcc(X86Encoder *encoder, uint8_t condition,
+                          const Operand *dest) {
+  DZ_ASSERT(dest->kind == OPERAND_BYTE_REG);
+  const uint8_t opcode[] = {0x0f, (uint8_t)(0x90 | condition)};
+  _encode_rm(encoder, 0, opcode, 2, 0, dest, 0, 0);
+}
+
+// cmovcc r64, r/m64, where condition is the same condition code jumps use
+static void _encode_cmov(X86Encoder *encoder, uint8_t condition,
+                         const Operand *dest, const Operand *src) {
+  DZ_ASSERT(dest->kind == OPERAND_REG && _is_reg_or_mem(src));
+  const uint8_t opcode[] = {0x0f, (uint8_t)(0x40 | condition)};
+  _encode_rm(encoder, REX_W, opcode, 2, _reg_number(dest->reg), src, 0, 0);
+}
+
+static void _encode_bytes(X86Encoder *encoder, const uint8_t *bytes,
+                          uint8_t len) {
+  Instruction inst = {.len = len};
+  memcpy(inst.bytes, bytes, len);
+  _append(encoder, &inst);
+}
+
+void encoder_x86_op(X86Encoder *encoder, X86Op op, const Operand *operands,
+                    uint32_t operand_count) {
+  const Operand *a1 = operand_count > 0 ? &operands[0] : NULL;
+  const Operand *a2 = operand_count > 1 ? &operands[1] : NULL;
+  switch (op) {
+  case OP_MOV:
+    _encode_mov(encoder, a1, a2);
+    return;
+  case OP_MOVZX:
+  case OP_MOVSX: {
+    DZ_ASSERT(a1->kind == OPERAND_REG &&
+              (a2->kind == OPERAND_BYTE_REG ||
+               (a2->kind == OPERAND_MEM && a2->ptr == PTR_BYTE)));
+    const uint8_t opcode[] = {0x0f, op == OP_MOVZX ? 0xb6 : 0xbe};
+    _encode_rm(encoder, REX_W, opcode, 2, _reg_number(a1->reg), a2, 0, 0);
+    return;
+  }
+  case OP_MOVSXD: {
+    DZ_ASSERT(a1->kind == OPERAND_REG && a2->kind == OPERAND_MEM &&
+              a2->ptr == PTR_DWORD);
+    _encode_rm1(encoder, 0x63, _reg_number(a1->reg), a2, 0, 0);
+    return;
+  }
+  case OP_LEA:
+    DZ_ASSERT(a1->kind == OPERAND_REG && a2->kind == OPERAND_MEM);
+    _encode_rm1(encoder, 0x8d, _reg_number(a1->reg), a2, 0, 0);
+    return;
+  case OP_PUSH:
+    _encode_push_pop(encoder, 0x50, a1);
+    return;
+  case OP_POP:
+    _encode_push_pop(encoder, 0x58, a1);
+    return;
+  case OP_ADD:
+    _encode_alu(encoder, &ALU_ADD, a1, a2);
+    return;
+  case OP_SUB:
+    _encode_alu(encoder, &ALU_SUB, a1, a2);
+    return;
+  case OP_XOR:
+    _encode_alu(encoder, &ALU_XOR, a1, a2);
+    return;
+  case OP_CMP:
+    _encode_alu(encoder, &ALU_CMP, a1, a2);
+    return;
+  case OP_IMUL:
+    _encode_imul(encoder, a1, a2, operand_count > 2 ? &operands[2] : NULL);
+    return;
+  case OP_IDIV:
+    DZ_ASSERT(_is_reg_or_mem(a1));
+    _encode_rm1(encoder, 0xf7, 7, a1, 0, 0);
+    return;
+  case OP_NEG:
+    DZ_ASSERT(_is_reg_or_mem(a1));
+    _encode_rm1(encoder, 0xf7, 3, a1, 0, 0);
+    return;
+  case OP_INC:
+    DZ_ASSERT(_is_reg_or_mem(a1));
+    _encode_rm1(encoder, 0xff, 0, a1, 0, 0);
+    return;
+  case OP_DEC:
+    DZ_ASSERT(_is_reg_or_mem(a1));
+    _encode_rm1(encoder, 0xff, 1, a1, 0, 0);
+    return;
+  case OP_TEST:
+    DZ_ASSERT(_is_reg_or_mem(a1) && a2->kind == OPERAND_REG);
+    _encode_rm1(encoder, 0x85, _reg_number(a2->reg), a1, 0, 0);
+    return;
+  case OP_SHL:
+    _encode_shift(encoder, 4, a1, a2);
+    return;
+  case OP_SHR:
+    _encode_shift(encoder, 5, a1, a2);
+    return;
+  case OP_SAR:
+    _encode_shift(encoder, 7, a1, a2);
+    return;
+  case OP_REP_MOVSB:
+    _encode_bytes(encoder, (const uint8_t[]){0xf3, 0xa4}, 2);
+    return;
+  case OP_CQO:
+    _encode_bytes(encoder, (const uint8_t[]){REX | REX_W, 0x99}, 2);
+    return;
+  case OP_LEAVE:
+    _encode_bytes(encoder, (const uint8_t[]){0xc9}, 1);
+    return;
+  case OP_RET:
+    _encode_bytes(encoder, (const uint8_t[]){0xc3}, 1);
+    return;
+  case OP_CALL:
+    _encode_call(encoder, a1);
+    return;
+  case OP_SYSCALL:
+    _encode_bytes(encoder, (const uint8_t[]){0x0f, 0x05}, 2);
+    return;
+  case OP_JMP:
+    _encode_jump(encoder, JUMP_ALWAYS, a1);
+    return;
+  case OP_JE:
+    _encode_jump(encoder, 0x4, a1);
+    return;
+  case OP_JNE:
+    _encode_jump(encoder, 0x5, a1);
+    return;
+  case OP_JL:
+    _encode_jump(encoder, 0xc, a1);
+    return;
+  case OP_JGE:
+    _encode_jump(encoder, 0xd, a1);
+    return;
+  case OP_JLE:
+    _encode_jump(encoder, 0xe, a1);
+    return;
+  case OP_JG:
+    _encode_jump(encoder, 0xf, a1);
+    return;
+  case OP_SETE:
+    _encode_setcc(encoder, 0x4, a1);
+    return;
+  case OP_SETNE:
+    _encode_setcc(encoder, 0x5, a1);
+    return;
+  case OP_SETL:
+    _encode_setcc(encoder, 0xc, a1);
+    return;
+  case OP_SETGE:
+    _encode_setcc(encoder, 0xd, a1);
+    return;
+  case OP_SETLE:
+    _encode_setcc(encoder, 0xe, a1);
+    return;
+  case OP_SETG:
+    _encode_setcc(encoder, 0xf, a1);
+    return;
+  case OP_CMOVE:
+    _encode_cmov(encoder, 0x4, a1, a2);
+    return;
+  case OP_CMOVNE:
+    _encode_cmov(encoder, 0x5, a1, a2);
+    return;
+  case OP_CMOVL:
+    _encode_cmov(encoder, 0xc, a1, a2);
+    return;
+  case OP_CMOVGE:
+    _encode_cmov(encoder, 0xd, a1, a2);
+    return;
+  case OP_CMOVLE:
+    _encode_cmov(encoder, 0xe, a1, a2);
+    return;
+  case OP_CMOVG:
+    _encode_cmov(encoder, 0xf, a1, a2);
+    return;
+  case OP_COUNT:
+    break;
+  }
+  DZ_THROW("Bad instruction %d", op);
+}
+
+// ----------------------
+// Jump Relaxation
+//
+// Every jump starts out short. Any jump whose target is out of range is made
+// long, which pushes everything after it further away, so it's repeated until
+// nothing changes. Jumps only ever grow, so this always settles, and it
+// settles on the same sizes gas picks
+// ----------------------
+
+static uint64_t _jump_size(const EncoderJump *jump) {
+  if (!jump->is_long)
+    return JUMP_SHORT_SIZE;
+  return jump->condition == JUMP_ALWAYS ? JMP_LONG_SIZE : JCC_LONG_SIZE;
+}
+
+// Number of jumps that start before offset
+static size_t _jumps_before(const EncoderJump *jumps, size_t jump_count,
+                            uint64_t offset) {
+  size_t low = 0;
+  size_t high = jump_count;
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (jumps[mid].offset < offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// growth[i] is how many bytes the first i jumps grew by
+static void _jump_growth(const EncoderJump *jumps, size_t jump_count,
+                         uint64_t *growth) {
+  growth[0] = 0;
+  for (size_t i = 0; i < jump_count; i++) {
+    growth[i + 1] = growth[i] + _jump_size(&jumps[i]) - JUMP_SHORT_SIZE;
+  }
+}
+
+// Where an offset before relaxation ends up after it
+static uint64_t _relaxed_offset(const EncoderJump *jumps, size_t jump_count,
+                                const uint64_t *growth, uint64_t offset) {
+  return offset + growth[_jumps_before(jumps, jump_count, offset)];
+}
+
+static int64_t _jump_displacement(const X86Encoder *encoder, size_t index,
+                                  const uint64_t *growth) {
+  const EncoderJump *jump = &encoder->jumps[index];
+  const EncoderSymbol *target = &encoder->symbols[jump->symbol];
+  DZ_ASSERT(target->defined && target->section == OBJ_SECTION_TEXT,
+            "Jump to a label outside of .text");
+  const uint64_t start = jump->offset + growth[index];
+  const uint64_t end = start + _jump_size(jump);
+  return (int64_t)_relaxed_offset(encoder->jumps, arrlenu(encoder->jumps),
+                                  growth, target->offset) -
+         (int64_t)end;
+}
+
+static void _relax_jumps(X86Encoder *encoder) {
+  EncoderJump *jumps = encoder->jumps;
+  const size_t jump_count = arrlenu(jumps);
+  if (jump_count == 0)
+    return;
+  uint64_t *growth = NULL;
+  arrsetlen(growth, jump_count + 1);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    _jump_growth(jumps, jump_count, growth);
+    for (size_t i = 0; i < jump_count; i++) {
+      if (!jumps[i].is_long &&
+          !_fits_int8(_jump_displacement(encoder, i, growth))) {
+        jumps[i].is_long = true;
+        changed = true;
+      }
+    }
+  }
+
+  // Rebuild .text with every jump at its final size
+  uint8_t *old_text = encoder->object->bytes[OBJ_SECTION_TEXT];
+  const uint64_t old_size = arrlenu(old_text);
+  uint8_t *text = NULL;
+  arrsetlen(text, old_size + growth[jump_count]);
+  uint64_t read = 0;
+  uint64_t write = 0;
+  for (size_t i = 0; i < jump_count; i++) {
+    const EncoderJump *jump = &jumps[i];
+    memcpy(text + write, old_text + read, jump->offset - read);
+    write += jump->offset - read;
+    read = jump->offset + JUMP_SHORT_SIZE;
+    const int64_t disp = _jump_displacement(encoder, i, growth);
+    uint8_t *out = text + write;
+    if (!jump->is_long) {
+      out[0] = jump->condition == JUMP_ALWAYS ? 0xeb : 0x70 | jump->condition;
+      out[1] = (uint8_t)disp;
+    } else if (jump->condition == JUMP_ALWAYS) {
+      out[0] = 0xe9;
+      memcpy(out + 1, &(int32_t){(int32_t)disp}, 4);
+    } else {
+      out[0] = 0x0f;
+      out[1] = 0x80 | jump->condition;
+      memcpy(out + 2, &(int32_t){(int32_t)disp}, 4);
+    }
+    write += _jump_size(jump);
+  }
+  memcpy(text + write, old_text + read, old_size - read);
+  arrfree(old_text);
+  encoder->object->bytes[OBJ_SECTION_TEXT] = text;
+
+  // Move everything that was placed after a jump that grew
+  for (size_t i = 0; i < arrlenu(encoder->symbols); i++) {
+    EncoderSymbol *symbol = &encoder->symbols[i];
+    if (symbol->defined && symbol->section == OBJ_SECTION_TEXT) {
+      symbol->offset =
+          _relaxed_offset(jumps, jump_count, growth, symbol->offset);
+    }
+  }
+  for (size_t i = 0; i < arrlenu(encoder->fixups); i++) {
+    EncoderFixup *fixup = &encoder->fixups[i];
+    fixup->offset = _relaxed_offset(jumps, jump_count, growth, fixup->offset);
+  }
+  arrfree(growth);
+}
+
+// ----------------------
+// Symbols and Relocations
+// ----------------------
+
+void encoder_x86_finish(X86Encoder *encoder) {
+  ObjectFile *object = encoder->object;
+  _relax_jumps(encoder);
+
+  // Section symbols, for references to local data. Named symbols get their
+  // own entries, so they show up in disassembly
+  uint32_t section_symbol[OBJ_SECTION_COUNT] = {0};
+  for (uint32_t section = OBJ_SECTION_TEXT; section < OBJ_SECTION_COUNT;
+       section++) {
+    section_symbol[section] = (uint32_t)arrlenu(object->symbols);
+    arrput(object->symbols,
+           ((ObjSymbol){.name = NULL, .section = (ObjSection)section}));
+  }
+  uint32_t *object_symbol = NULL; // Encoder symbol -> object symbol
+  arrsetlen(object_symbol, arrlenu(encoder->symbols));
+  for (size_t i = 0; i < arrlenu(encoder->symbols); i++) {
+    const EncoderSymbol *symbol = &encoder->symbols[i];
+    object_symbol[i] = UINT32_MAX;
+    if (!symbol->name)
+      continue;
+    object_symbol[i] = (uint32_t)arrlenu(object->symbols);
+    arrput(object->symbols,
+           ((ObjSymbol){
+               .name = symbol->name,
+               .section = symbol->defined ? symbol->section : OBJ_SECTION_UNDEF,
+               .value = symbol->offset,
+               .global = symbol->global || !symbol->defined,
+           }));
+  }
+
+  uint8_t *text = object->bytes[OBJ_SECTION_TEXT];
+  for (size_t i = 0; i < arrlenu(encoder->fixups); i++) {
+    const EncoderFixup *fixup = &encoder->fixups[i];
+    const EncoderSymbol *symbol = &encoder->symbols[fixup->symbol];
+    DZ_ASSERT(symbol->defined || symbol->name,
+              "Reference to a label that was never defined");
+    if (symbol->defined && symbol->section == OBJ_SECTION_TEXT) {
+      // Resolved here, the linker never sees it
+      const int64_t value =
+          (int64_t)symbol->offset + fixup->addend - (int64_t)fixup->offset;
+      DZ_ASSERT(_fits_int32(value));
+      memcpy(text + fixup->offset, &(int32_t){(int32_t)value}, 4);
+      continue;
+    }
+    ObjRelocation reloc = {
+        .offset = fixup->offset,
+        .type = fixup->kind == FIXUP_CALL ? OBJ_RELOC_PLT32 : OBJ_RELOC_PC32,
+        .addend = fixup->addend,
+    };
+    if (symbol->defined) {
+      // Local data is referenced through its section, like gas does
+      reloc.symbol = section_symbol[symbol->section];
+      reloc.addend += (int64_t)symbol->offset;
+    } else {
+      reloc.symbol = object_symbol[fixup->symbol];
+    }
+    arrput(object->relocations, reloc);
+  }
+  arrfree(object_symbol);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+// -----------------------------
+// x86 ENCODER
+//
+// Encodes the emitter's instructions straight into
+// machine code inside an ObjectFile, so no assembler
+// has to run. Encodings, jump sizes and relocations
+// are picked the same way gas picks them, so the
+// object matches what gcc -c makes of the assembly
+// -----------------------------
+
+#include "instructions-x86.h"
+#include "object_file.h"
+
+typedef struct {
+  ObjSection section;
+  bool defined;
+  bool global;
+  uint64_t offset;  // Offset in section, once defined
+  const char *name; // Only named symbols end up in the symbol table
+} EncoderSymbol;
+
+typedef enum {
+  FIXUP_PC32, // rip relative memory operand
+  FIXUP_CALL, // call rel32
+} EncoderFixupKind;
+
+// A rel32 field in .text waiting on a symbol
+typedef struct {
+  uint64_t offset;
+  uint32_t symbol;
+  EncoderFixupKind kind;
+  int64_t addend; // Relative to the start of the field
+} EncoderFixup;
+
+// A jump to a label. Starts out short, and is only made long if its target
+// ends up out of range
+typedef struct {
+  uint64_t offset; // Offset of the jump before any jumps were made long
+  uint32_t symbol;
+  uint8_t condition; // Condition code, or JUMP_ALWAYS for jmp
+  bool is_long;
+} EncoderJump;
+
+typedef struct {
+  ObjectFile *object;                 // Non-owning reference
+  ObjSection section;                 // Section being appended to
+  EncoderSymbol *symbols;             // stb_ds array
+  uint32_t *by_id[SYMBOL_KIND_COUNT]; // Symbol index + 1 of numbered symbols
+  uint32_t *named;       // Indices of named symbols. There are only a handful
+                         // of them, so they're searched linearly
+  uint32_t variables;    // Symbol index + 1 of the variable block
+  EncoderFixup *fixups;  // stb_ds array, in .text order
+  EncoderJump *jumps;    // stb_ds array, in .text order
+} X86Encoder;
+
+X86Encoder encoder_x86_init(ObjectFile *object);
+void encoder_x86_destroy(X86Encoder *encoder);
+
+// Switches the section bytes, labels and instructions are appended to
+void encoder_x86_section(X86Encoder *encoder, ObjSection section);
+
+// Defines symbol at the current position of the current section
+void encoder_x86_label(X86Encoder *encoder, const Symbol *symbol);
+
+// Makes a symbol visible to the linker
+void encoder_x86_global(X86Encoder *encoder, const Symbol *symbol);
+
+// Appends raw bytes to the current section
+void encoder_x86_bytes(X86Encoder *encoder, const void *bytes, size_t size);
+
+// Reserves zeroed space in .bss, aligned to align, and defines symbol there
+void encoder_x86_reserve(X86Encoder *encoder, const Symbol *symbol,
+                         uint64_t size, uint64_t align);
+
+// Encodes an instruction into .text
+void encoder_x86_op(X86Encoder *encoder, X86Op op, const Operand *operands,
+                    uint32_t operand_count);
+
+// Sizes the jumps, resolves everything local to .text, and fills in the
+// object's symbols and relocations. Symbols that were never defined are
+// left for the linker
+void encoder_x86_finish(X86Encoder *encoder);
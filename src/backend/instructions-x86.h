@@ -0,0 +1,119 @@
+#pragma once
+
+// -----------------------------
+// x86 INSTRUCTIONS
+//
+// Structured form of the instructions the emitter
+// produces. Shared by the assembly text output and the
+// machine code encoder, so both see exactly the same
+// instruction stream
+// -----------------------------
+
+#include "platform.h"
+#include <stdint.h>
+
+// X macro definitions for every instruction the emitter uses
+#define X86_OPCODES(X)                                                         \
+  X(OP_MOV, "mov")                                                             \
+  X(OP_MOVZX, "movzx")                                                         \
+  X(OP_MOVSX, "movsx")                                                         \
+  X(OP_MOVSXD, "movsxd")                                                       \
+  X(OP_LEA, "lea")                                                             \
+  X(OP_PUSH, "push")                                                           \
+  X(OP_POP, "pop")                                                             \
+  X(OP_ADD, "add")                                                             \
+  X(OP_SUB, "sub")                                                             \
+  X(OP_IMUL, "imul")                                                           \
+  X(OP_IDIV, "idiv")                                                           \
+  X(OP_CQO, "cqo")                                                             \
+  X(OP_NEG, "neg")                                                             \
+  X(OP_INC, "inc")                                                             \
+  X(OP_DEC, "dec")                                                             \
+  X(OP_SHL, "shl")                                                             \
+  X(OP_SHR, "shr")                                                             \
+  X(OP_SAR, "sar")                                                             \
+  X(OP_XOR, "xor")                                                             \
+  X(OP_CMP, "cmp")                                                             \
+  X(OP_TEST, "test")                                                           \
+  X(OP_JMP, "jmp")                                                             \
+  X(OP_JE, "je")                                                               \
+  X(OP_JNE, "jne")                                                             \
+  X(OP_JL, "jl")                                                               \
+  X(OP_JLE, "jle")                                                             \
+  X(OP_JG, "jg")                                                               \
+  X(OP_JGE, "jge")                                                             \
+  X(OP_SETE, "sete")                                                           \
+  X(OP_SETNE, "setne")                                                         \
+  X(OP_SETL, "setl")                                                           \
+  X(OP_SETLE, "setle")                                                         \
+  X(OP_SETG, "setg")                                                           \
+  X(OP_SETGE, "setge")                                                         \
+  X(OP_CMOVE, "cmove")                                                         \
+  X(OP_CMOVNE, "cmovne")                                                       \
+  X(OP_CMOVL, "cmovl")                                                         \
+  X(OP_CMOVLE, "cmovle")                                                       \
+  X(OP_CMOVG, "cmovg")                                                         \
+  X(OP_CMOVGE, "cmovge")                                                       \
+  X(OP_CALL, "call")                                                           \
+  X(OP_SYSCALL, "syscall")                                                     \
+  X(OP_REP_MOVSB, "rep movsb")                                                 \
+  X(OP_LEAVE, "leave")                                                         \
+  X(OP_RET, "ret")
+
+typedef enum {
+#define X(name, str) name,
+  X86_OPCODES(X)
+#undef X
+      OP_COUNT,
+} X86Op;
+
+typedef enum {
+  PTR_NONE,  // Size is implied by the other operand
+  PTR_BYTE,  // BYTE PTR
+  PTR_DWORD, // DWORD PTR
+  PTR_QWORD, // QWORD PTR
+} PtrSize;
+
+typedef enum {
+  SYMBOL_NAMED,          // Runtime functions, format strings, libc
+  SYMBOL_VARIABLES,      // The variable block
+  SYMBOL_LITERAL,        // A string literal, by label
+  SYMBOL_USER_LABEL,     // A user LABEL, by name or label table index
+  SYMBOL_INTERNAL_LABEL, // An IF/WHILE/runtime label, by number
+  SYMBOL_KIND_COUNT,
+} SymbolKind;
+
+typedef struct {
+  SymbolKind kind;
+  uint32_t id;      // Numeric suffix of literals and labels
+  const char *name; // Named symbols, and user labels outside compact mode
+} Symbol;
+
+typedef enum {
+  OPERAND_REG,      // 64 bit register
+  OPERAND_BYTE_REG, // Low 8 bits of a register
+  OPERAND_IMM,      // Immediate
+  OPERAND_MEM,      // [base+index*scale+disp], or symbol[rip+disp] when
+                    // base is rip
+  OPERAND_SYMBOL,   // Jump and call targets
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  X86Reg reg;    // Register, or the base register of a memory operand
+  X86Reg index;  // Index register of a memory operand, when scale isn't 0
+  uint8_t scale; // 0 for no index, or 1, 2, 4 or 8
+  PtrSize ptr;   // Size prefix of a memory operand
+  Symbol symbol; // Memory operands relative to rip, and symbols
+  int64_t value; // Immediate value, or memory displacement
+} Operand;
+
+// The largest number of operands an instruction takes
+#define X86_MAX_OPERANDS 3
+
+// One instruction, as the emitter buffers it before it's written or encoded
+typedef struct {
+  X86Op op;
+  uint32_t operand_count;
+  Operand operands[X86_MAX_OPERANDS];
+} X86Instr;
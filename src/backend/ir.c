@@ -0,0 +1,613 @@
+#include "ir.h"
+#include "compiler_compatibility.h"
+#include "dz_debug.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stb_ds.h>
+#include <string.h>
+
+#define IR_INITIAL_CAPACITY 8
+
+static const char *OPCODE_NAMES[IR_OPCODE_COUNT] = {
+#define X(name, str, args, defines) str,
+    IR_OPCODES(X)
+#undef X
+};
+
+static const uint32_t OPCODE_ARG_COUNTS[IR_OPCODE_COUNT] = {
+#define X(name, str, args, defines) args,
+    IR_OPCODES(X)
+#undef X
+};
+
+static const bool OPCODE_DEFINES[IR_OPCODE_COUNT] = {
+#define X(name, str, args, defines) defines,
+    IR_OPCODES(X)
+#undef X
+};
+
+static const char *CONDITION_NAMES[IR_COND_COUNT] = {
+#define X(name, str) str,
+    IR_CONDITIONS(X)
+#undef X
+};
+
+static const IrCondition NEGATED_CONDITIONS[IR_COND_COUNT] = {
+    [IR_COND_EQ] = IR_COND_NE, [IR_COND_NE] = IR_COND_EQ,
+    [IR_COND_LT] = IR_COND_GE, [IR_COND_LE] = IR_COND_GT,
+    [IR_COND_GT] = IR_COND_LE, [IR_COND_GE] = IR_COND_LT,
+};
+
+static const IrCondition SWAPPED_CONDITIONS[IR_COND_COUNT] = {
+    [IR_COND_EQ] = IR_COND_EQ, [IR_COND_NE] = IR_COND_NE,
+    [IR_COND_LT] = IR_COND_GT, [IR_COND_LE] = IR_COND_GE,
+    [IR_COND_GT] = IR_COND_LT, [IR_COND_GE] = IR_COND_LE,
+};
+
+const char *ir_opcode_name(IrOpcode op) { return OPCODE_NAMES[op]; }
+
+uint32_t ir_opcode_arg_count(IrOpcode op) { return OPCODE_ARG_COUNTS[op]; }
+
+bool ir_opcode_defines(IrOpcode op) { return OPCODE_DEFINES[op]; }
+
+const char *ir_condition_name(IrCondition cond) {
+  return CONDITION_NAMES[cond];
+}
+
+IrCondition ir_condition_negate(IrCondition cond) {
+  return NEGATED_CONDITIONS[cond];
+}
+
+IrCondition ir_condition_swap(IrCondition cond) {
+  return SWAPPED_CONDITIONS[cond];
+}
+
+// ----------------------
+// Construction
+// ----------------------
+
+IR ir_init(const NameTable *table) {
+  return (IR){
+      .arena = arena_init(),
+      .blocks = NULL,
+      .block_count = 0,
+      .block_capacity = 0,
+      .temp_count = 0,
+      .table = table,
+  };
+}
+
+void ir_destroy(IR *ir) {
+  arena_destroy(&ir->arena);
+  ir->blocks = NULL;
+  ir->block_count = 0;
+  ir->block_capacity = 0;
+}
+
+// Makes room for one more item in an arena allocated array, moving it to a
+// new allocation twice the size when it's full. The old one is left to the
+// arena
+static void *_ir_grow(IR *ir, void *items, uint32_t count, uint32_t *capacity,
+                      uint32_t item_size) {
+  if (count < *capacity)
+    return items;
+  const uint32_t new_capacity =
+      *capacity ? *capacity * 2 : IR_INITIAL_CAPACITY;
+  void *new_items = arena_alloc(&ir->arena, new_capacity * item_size);
+  if (count) {
+    memcpy(new_items, items, (size_t)count * item_size);
+  }
+  *capacity = new_capacity;
+  return new_items;
+}
+
+IrBlockID ir_add_block(IR *ir) {
+  ir->blocks = _ir_grow(ir, ir->blocks, ir->block_count, &ir->block_capacity,
+                        sizeof(*ir->blocks));
+  ir->blocks[ir->block_count] = (IrBlock){
+      .instrs = NULL,
+      .instr_count = 0,
+      .instr_capacity = 0,
+      .term = {.kind = IR_TERM_NONE,
+               .args = {IR_NO_TEMP, IR_NO_TEMP},
+               .targets = {IR_NO_BLOCK, IR_NO_BLOCK}},
+      .preds = NULL,
+      .pred_count = 0,
+      .label = IR_NO_LABEL,
+  };
+  return ir->block_count++;
+}
+
+IrTemp ir_new_temp(IR *ir) { return ir->temp_count++; }
+
+IrInstr *ir_append(IR *ir, IrBlockID block_id, IrOpcode op) {
+  DZ_ASSERT(block_id < ir->block_count);
+  IrBlock *block = &ir->blocks[block_id];
+  block->instrs = _ir_grow(ir, block->instrs, block->instr_count,
+                           &block->instr_capacity, sizeof(*block->instrs));
+  IrInstr *instr = &block->instrs[block->instr_count++];
+  *instr = (IrInstr){.op = op,
+                     .dest = IR_NO_TEMP,
+                     .args = {IR_NO_TEMP, IR_NO_TEMP, IR_NO_TEMP}};
+  return instr;
+}
+
+IrInstr *ir_insert(IR *ir, IrBlockID block_id, uint32_t index, IrOpcode op) {
+  DZ_ASSERT(block_id < ir->block_count);
+  DZ_ASSERT(index <= ir->blocks[block_id].instr_count);
+  ir_append(ir, block_id, op);
+  IrBlock *block = &ir->blocks[block_id];
+  IrInstr *instr = &block->instrs[index];
+  const IrInstr inserted = block->instrs[block->instr_count - 1];
+  memmove(instr + 1, instr,
+          (block->instr_count - 1 - index) * sizeof(*block->instrs));
+  *instr = inserted;
+  return instr;
+}
+
+void ir_reorder_blocks(IR *ir, const IrBlockID *order, uint32_t order_count) {
+  IrBlockID *renumbered = NULL; // stb_ds array, old ID -> new ID
+  arrsetlen(renumbered, ir->block_count);
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    renumbered[i] = IR_NO_BLOCK;
+  }
+  IrBlock *blocks = arena_alloc(&ir->arena, order_count * sizeof(*blocks));
+  for (uint32_t i = 0; i < order_count; i++) {
+    DZ_ASSERT(renumbered[order[i]] == IR_NO_BLOCK, "Block ordered twice");
+    renumbered[order[i]] = i;
+    blocks[i] = ir->blocks[order[i]];
+  }
+  for (uint32_t i = 0; i < order_count; i++) {
+    IrTerminator *term = &blocks[i].term;
+    for (uint32_t t = 0; t < 2; t++) {
+      if (term->targets[t] != IR_NO_BLOCK) {
+        term->targets[t] = renumbered[term->targets[t]];
+        DZ_ASSERT(term->targets[t] != IR_NO_BLOCK,
+                  "Deleted a block that's still jumped to");
+      }
+    }
+    blocks[i].preds = NULL;
+    blocks[i].pred_count = 0;
+  }
+  arrfree(renumbered);
+  ir->blocks = blocks;
+  ir->block_count = order_count;
+  ir->block_capacity = order_count;
+}
+
+void ir_remove_unreachable_blocks(IR *ir) {
+  if (ir->block_count == 0)
+    return;
+  bool *reached = NULL;     // stb_ds array
+  IrBlockID *worklist = NULL; // stb_ds array
+  arrsetlen(reached, ir->block_count);
+  memset(reached, 0, ir->block_count * sizeof(*reached));
+  reached[0] = true;
+  arrput(worklist, 0);
+  uint32_t reached_count = 1;
+  while (arrlenu(worklist)) {
+    IrBlockID succs[2];
+    const uint32_t succ_count = ir_successors(&ir->blocks[arrpop(worklist)],
+                                              succs);
+    for (uint32_t s = 0; s < succ_count; s++) {
+      if (!reached[succs[s]]) {
+        reached[succs[s]] = true;
+        reached_count++;
+        arrput(worklist, succs[s]);
+      }
+    }
+  }
+  if (reached_count != ir->block_count) {
+    for (IrBlockID i = 0; i < ir->block_count; i++) {
+      if (reached[i]) {
+        arrput(worklist, i);
+      }
+    }
+    ir_reorder_blocks(ir, worklist, reached_count);
+    ir_compute_predecessors(ir);
+  }
+  arrfree(reached);
+  arrfree(worklist);
+}
+
+// ----------------------
+// Control-Flow Graph
+// ----------------------
+
+uint32_t ir_successors(const IrBlock *block, IrBlockID out[2]) {
+  switch (block->term.kind) {
+  case IR_TERM_JUMP:
+    out[0] = block->term.targets[0];
+    return 1;
+  case IR_TERM_BRANCH:
+    out[0] = block->term.targets[0];
+    // Both ways may lead to the same block, which is still one edge
+    if (block->term.targets[1] == out[0])
+      return 1;
+    out[1] = block->term.targets[1];
+    return 2;
+  case IR_TERM_NONE:
+  case IR_TERM_EXIT:
+    break;
+  }
+  return 0;
+}
+
+void ir_compute_predecessors(IR *ir) {
+  // Counted first, so each list is allocated once at its final size
+  uint32_t *counts = NULL; // stb_ds array
+  arrsetlen(counts, ir->block_count);
+  memset(counts, 0, ir->block_count * sizeof(*counts));
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    IrBlockID succs[2];
+    const uint32_t succ_count = ir_successors(&ir->blocks[i], succs);
+    for (uint32_t s = 0; s < succ_count; s++) {
+      counts[succs[s]]++;
+    }
+  }
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    IrBlock *block = &ir->blocks[i];
+    block->pred_count = 0;
+    block->preds = counts[i] ? arena_alloc(&ir->arena,
+                                           counts[i] * sizeof(*block->preds))
+                             : NULL;
+  }
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    IrBlockID succs[2];
+    const uint32_t succ_count = ir_successors(&ir->blocks[i], succs);
+    for (uint32_t s = 0; s < succ_count; s++) {
+      IrBlock *succ = &ir->blocks[succs[s]];
+      succ->preds[succ->pred_count++] = i;
+    }
+  }
+  arrfree(counts);
+}
+
+// ----------------------
+// Dump
+// ----------------------
+
+static void _dump_text(const char *text, FILE *out) {
+  fputc('"', out);
+  for (const char *c = text; *c; c++) {
+    if (*c == '\n') {
+      fputs("\\n", out);
+    } else if (*c == '"' || *c == '\\') {
+      fputc('\\', out);
+      fputc(*c, out);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static const char *_variable_name(const IR *ir, uint32_t variable) {
+  if (!ir->table || variable >= shlenu(ir->table->variable_table))
+    return "?";
+  return ir->table->variable_table[variable].key;
+}
+
+static void _dump_instr(const IR *ir, const IrBlock *block,
+                        const IrInstr *instr, FILE *out) {
+  fputs("    ", out);
+  if (instr->dest != IR_NO_TEMP) {
+    fprintf(out, "t%" PRIu32 " = ", instr->dest);
+  }
+  fputs(ir_opcode_name(instr->op), out);
+  switch (instr->op) {
+  case IR_CONST:
+    fprintf(out, " %" PRId64, instr->value);
+    break;
+  case IR_LOAD:
+    fprintf(out, " %s", _variable_name(ir, instr->variable));
+    break;
+  case IR_STORE:
+    fprintf(out, " %s, t%" PRIu32, _variable_name(ir, instr->variable),
+            instr->args[0]);
+    break;
+  case IR_PRINT_STR:
+    fputc(' ', out);
+    _dump_text(instr->text, out);
+    break;
+  case IR_PHI:
+    for (uint32_t p = 0; p < block->pred_count; p++) {
+      fprintf(out, "%s [t%" PRIu32 ", b%" PRIu32 "]", p ? "," : "",
+              instr->incoming[p], block->preds[p]);
+    }
+    break;
+  case IR_COMPARE:
+    fprintf(out, " %s t%" PRIu32 ", t%" PRIu32, ir_condition_name(instr->cond),
+            instr->args[0], instr->args[1]);
+    break;
+  case IR_COPY:
+  case IR_NEG:
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV:
+  case IR_SELECT:
+  case IR_PRINT_INT:
+  case IR_INPUT:
+  case IR_OPCODE_COUNT:
+    for (uint32_t i = 0; i < ir_opcode_arg_count(instr->op); i++) {
+      fprintf(out, "%s t%" PRIu32, i ? "," : "", instr->args[i]);
+    }
+    break;
+  }
+  fputc('\n', out);
+}
+
+static void _dump_terminator(const IrTerminator *term, FILE *out) {
+  switch (term->kind) {
+  case IR_TERM_JUMP:
+    fprintf(out, "    jump b%" PRIu32 "\n", term->targets[0]);
+    return;
+  case IR_TERM_BRANCH:
+    fprintf(out,
+            "    branch %s t%" PRIu32 ", t%" PRIu32 ", b%" PRIu32 ", b%" PRIu32
+            "\n",
+            ir_condition_name(term->cond), term->args[0], term->args[1],
+            term->targets[0], term->targets[1]);
+    return;
+  case IR_TERM_EXIT:
+    fputs("    exit\n", out);
+    return;
+  case IR_TERM_NONE:
+    fputs("    <unterminated>\n", out);
+    return;
+  }
+}
+
+void ir_dump(const IR *ir, FILE *out) {
+  fprintf(out, "; %" PRIu32 " blocks, %" PRIu32 " temporaries\n",
+          ir->block_count, ir->temp_count);
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    const IrBlock *block = &ir->blocks[i];
+    fprintf(out, "b%" PRIu32 ":", i);
+    if (block->label != IR_NO_LABEL && ir->table) {
+      fprintf(out, " ; LABEL %s", ir->table->label_table[block->label].key);
+    }
+    if (block->pred_count) {
+      fputs(block->label != IR_NO_LABEL ? ", preds" : " ; preds", out);
+      for (uint32_t p = 0; p < block->pred_count; p++) {
+        fprintf(out, " b%" PRIu32, block->preds[p]);
+      }
+    }
+    fputc('\n', out);
+    for (uint32_t j = 0; j < block->instr_count; j++) {
+      _dump_instr(ir, block, &block->instrs[j], out);
+    }
+    _dump_terminator(&block->term, out);
+  }
+}
+
+// ----------------------
+// Verification
+// ----------------------
+
+typedef struct {
+  const IR *ir;
+  FILE *report;
+  bool ok;
+  uint32_t *def_counts; // stb_ds array, definitions of each temporary
+  IrBlockID *def_block; // stb_ds array, block of a temporary's first
+                        // definition
+  uint32_t *defined_in; // stb_ds array, last block a temporary was seen
+                        // defined in while walking it, plus one
+} Verifier;
+
+static void _verify_fail(Verifier *v, IrBlockID block, const char *msg, ...)
+    FORMAT_PRINTF(3, 4);
+
+static void _verify_fail(Verifier *v, IrBlockID block, const char *msg, ...) {
+  v->ok = false;
+  if (!v->report)
+    return;
+  fprintf(v->report, "b%" PRIu32 ": ", block);
+  va_list args;
+  va_start(args, msg);
+  vfprintf(v->report, msg, args);
+  va_end(args);
+  fputc('\n', v->report);
+}
+
+// Checks a temporary read in block. It has to be defined somewhere, and if
+// the block hasn't defined it yet, by a different block
+static void _verify_use(Verifier *v, IrBlockID block, IrTemp temp,
+                        const char *what) {
+  if (temp == IR_NO_TEMP || temp >= v->ir->temp_count) {
+    _verify_fail(v, block, "%s reads a temporary that doesn't exist", what);
+    return;
+  }
+  if (v->def_counts[temp] == 0) {
+    _verify_fail(v, block, "%s reads t%" PRIu32 ", which is never defined",
+                 what, temp);
+  } else if (v->defined_in[temp] != block + 1 &&
+             v->def_block[temp] == block && v->def_counts[temp] == 1) {
+    _verify_fail(v, block, "%s reads t%" PRIu32 " before it's defined", what,
+                 temp);
+  }
+}
+
+// A phi reads each value at the end of a predecessor, so where it's defined in
+// this block doesn't matter
+static void _verify_phi(Verifier *v, IrBlockID block, const IrInstr *instr) {
+  const IrBlock *phi_block = &v->ir->blocks[block];
+  if (phi_block->pred_count == 0) {
+    _verify_fail(v, block, "phi in a block with no predecessors");
+    return;
+  }
+  for (uint32_t p = 0; p < phi_block->pred_count; p++) {
+    const IrTemp temp = instr->incoming[p];
+    if (temp >= v->ir->temp_count || v->def_counts[temp] == 0) {
+      _verify_fail(v, block, "phi reads an undefined temporary from b%" PRIu32,
+                   phi_block->preds[p]);
+    }
+  }
+}
+
+static void _verify_instr(Verifier *v, IrBlockID block, const IrInstr *instr) {
+  const char *name = ir_opcode_name(instr->op);
+  if (instr->op == IR_PHI) {
+    _verify_phi(v, block, instr);
+  }
+  const uint32_t arg_count = ir_opcode_arg_count(instr->op);
+  for (uint32_t i = 0; i < IR_MAX_ARGS; i++) {
+    if (i < arg_count) {
+      _verify_use(v, block, instr->args[i], name);
+    } else if (instr->args[i] != IR_NO_TEMP) {
+      _verify_fail(v, block, "%s has too many arguments", name);
+    }
+  }
+  if (ir_opcode_defines(instr->op) != (instr->dest != IR_NO_TEMP)) {
+    _verify_fail(v, block, "%s %s a temporary", name,
+                 instr->dest == IR_NO_TEMP ? "doesn't define" : "defines");
+  }
+  const IrTemp dest = instr->dest;
+  if (dest != IR_NO_TEMP && dest < v->ir->temp_count) {
+    v->defined_in[dest] = block + 1;
+  }
+  const uint32_t variable_count =
+      v->ir->table ? (uint32_t)shlenu(v->ir->table->variable_table)
+                   : UINT32_MAX;
+  if ((instr->op == IR_LOAD || instr->op == IR_STORE) &&
+      instr->variable >= variable_count) {
+    _verify_fail(v, block, "%s names a variable that doesn't exist", name);
+  }
+  if (instr->op == IR_PRINT_STR && !instr->text) {
+    _verify_fail(v, block, "print has no text");
+  }
+  if (instr->op == IR_COMPARE && instr->cond >= IR_COND_COUNT) {
+    _verify_fail(v, block, "compare has a bad condition");
+  }
+}
+
+static void _verify_terminator(Verifier *v, IrBlockID block,
+                               const IrTerminator *term) {
+  uint32_t target_count = 0;
+  switch (term->kind) {
+  case IR_TERM_NONE:
+    _verify_fail(v, block, "block isn't terminated");
+    return;
+  case IR_TERM_EXIT:
+    break;
+  case IR_TERM_JUMP:
+    target_count = 1;
+    break;
+  case IR_TERM_BRANCH:
+    target_count = 2;
+    if (term->cond >= IR_COND_COUNT) {
+      _verify_fail(v, block, "branch has a bad condition");
+    }
+    _verify_use(v, block, term->args[0], "branch");
+    _verify_use(v, block, term->args[1], "branch");
+    break;
+  }
+  for (uint32_t t = 0; t < target_count; t++) {
+    if (term->targets[t] >= v->ir->block_count) {
+      _verify_fail(v, block, "terminator targets a block that doesn't exist");
+    }
+  }
+}
+
+// Every edge has to show up in its target's predecessors exactly as often as
+// it's taken, unless predecessors were never computed
+static void _verify_predecessors(Verifier *v) {
+  const IR *ir = v->ir;
+  bool computed = false;
+  for (uint32_t i = 0; i < ir->block_count && !computed; i++) {
+    computed = ir->blocks[i].pred_count != 0;
+  }
+  if (!computed)
+    return;
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    IrBlockID succs[2];
+    const uint32_t succ_count = ir_successors(&ir->blocks[i], succs);
+    for (uint32_t s = 0; s < succ_count; s++) {
+      if (succs[s] >= ir->block_count)
+        continue;
+      const IrBlock *succ = &ir->blocks[succs[s]];
+      uint32_t found = 0;
+      for (uint32_t p = 0; p < succ->pred_count; p++) {
+        found += succ->preds[p] == i;
+      }
+      if (found != 1) {
+        _verify_fail(v, succs[s], "predecessors don't list b%" PRIu32, i);
+      }
+    }
+    const IrBlock *block = &ir->blocks[i];
+    for (uint32_t p = 0; p < block->pred_count; p++) {
+      const IrBlockID pred = block->preds[p];
+      IrBlockID pred_succs[2];
+      const uint32_t pred_succ_count =
+          pred < ir->block_count ? ir_successors(&ir->blocks[pred], pred_succs)
+                                 : 0;
+      bool is_edge = false;
+      for (uint32_t s = 0; s < pred_succ_count; s++) {
+        is_edge |= pred_succs[s] == i;
+      }
+      if (!is_edge) {
+        _verify_fail(v, i, "predecessor b%" PRIu32 " doesn't lead here", pred);
+      }
+    }
+  }
+}
+
+bool ir_verify(const IR *ir, FILE *report) {
+  Verifier v = {.ir = ir,
+                .report = report,
+                .ok = true,
+                .def_counts = NULL,
+                .def_block = NULL,
+                .defined_in = NULL};
+  if (ir->block_count == 0) {
+    if (report) {
+      fputs("IR has no entry block\n", report);
+    }
+    return false;
+  }
+  arrsetlen(v.def_counts, ir->temp_count);
+  arrsetlen(v.def_block, ir->temp_count);
+  arrsetlen(v.defined_in, ir->temp_count);
+  for (uint32_t t = 0; t < ir->temp_count; t++) {
+    v.def_counts[t] = 0;
+    v.def_block[t] = IR_NO_BLOCK;
+    v.defined_in[t] = 0;
+  }
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    const IrBlock *block = &ir->blocks[i];
+    for (uint32_t j = 0; j < block->instr_count; j++) {
+      const IrTemp dest = block->instrs[j].dest;
+      if (dest == IR_NO_TEMP)
+        continue;
+      if (dest >= ir->temp_count) {
+        _verify_fail(&v, i, "defines a temporary that doesn't exist");
+        continue;
+      }
+      if (v.def_counts[dest]++ == 0) {
+        v.def_block[dest] = i;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    const IrBlock *block = &ir->blocks[i];
+    for (uint32_t j = 0; j < block->instr_count; j++) {
+      if (block->instrs[j].op >= IR_OPCODE_COUNT) {
+        _verify_fail(&v, i, "bad opcode %d", block->instrs[j].op);
+        continue;
+      }
+      if (block->instrs[j].op == IR_PHI && j &&
+          block->instrs[j - 1].op != IR_PHI) {
+        _verify_fail(&v, i, "phi after the start of the block");
+      }
+      _verify_instr(&v, i, &block->instrs[j]);
+    }
+    _verify_terminator(&v, i, &block->term);
+  }
+  _verify_predecessors(&v);
+  arrfree(v.def_counts);
+  arrfree(v.def_block);
+  arrfree(v.defined_in);
+  return v.ok;
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+// -----------------------------
+// IR
+//
+// A linear three-address intermediate representation
+// between the AST and the instruction selector.
+// Statements are lowered into instructions on numbered
+// temporaries, which are grouped into basic blocks that
+// each end in a single terminator. IF, WHILE and
+// GOTO/LABEL become edges between blocks, and together
+// they form the control-flow graph
+//
+// Variables live in memory, and are only touched by
+// load and store. Every other instruction works on
+// temporaries
+// -----------------------------
+
+#include "../common/arena.h"
+#include "../common/name_table.h"
+#include <stdio.h>
+
+// A numbered temporary. Stands for a value, like a virtual register
+typedef uint32_t IrTemp;
+// Index of a block in IR.blocks
+typedef uint32_t IrBlockID;
+
+#define IR_NO_TEMP UINT32_MAX
+#define IR_NO_BLOCK UINT32_MAX
+#define IR_NO_LABEL UINT32_MAX
+
+// X macro definitions for every instruction, with its dump name, the number of
+// temporaries it reads, and whether it defines a temporary
+//   const:   dest = value
+//   load:    dest = variable
+//   store:   variable = args[0]
+//   copy:    dest = args[0]
+//   phi:     dest = incoming[i] when the block is entered from preds[i]. Only
+//            in SSA form, and only at the start of a block
+//   neg:     dest = -args[0]
+//   add..div dest = args[0] op args[1]
+//   compare: dest = 1 if args[0] cond args[1] holds, else 0
+//   select:  dest = args[1] if args[0] isn't 0, else args[2]
+//   print:   prints args[0], or text when there are no args, and a newline
+//   input:   dest = the next integer on stdin
+#define IR_OPCODES(X)                                                          \
+  X(IR_CONST, "const", 0, true)                                                \
+  X(IR_LOAD, "load", 0, true)                                                  \
+  X(IR_STORE, "store", 1, false)                                               \
+  X(IR_COPY, "copy", 1, true)                                                  \
+  X(IR_PHI, "phi", 0, true)                                                    \
+  X(IR_NEG, "neg", 1, true)                                                    \
+  X(IR_ADD, "add", 2, true)                                                    \
+  X(IR_SUB, "sub", 2, true)                                                    \
+  X(IR_MUL, "mul", 2, true)                                                    \
+  X(IR_DIV, "div", 2, true)                                                    \
+  X(IR_COMPARE, "compare", 2, true)                                            \
+  X(IR_SELECT, "select", 3, true)                                              \
+  X(IR_PRINT_INT, "print", 1, false)                                           \
+  X(IR_PRINT_STR, "print", 0, false)                                           \
+  X(IR_INPUT, "input", 0, true)
+
+typedef enum {
+#define X(name, str, args, defines) name,
+  IR_OPCODES(X)
+#undef X
+      IR_OPCODE_COUNT,
+} IrOpcode;
+
+// X macro definitions for branch conditions, with their dump names
+#define IR_CONDITIONS(X)                                                       \
+  X(IR_COND_EQ, "eq")                                                          \
+  X(IR_COND_NE, "ne")                                                          \
+  X(IR_COND_LT, "lt")                                                          \
+  X(IR_COND_LE, "le")                                                          \
+  X(IR_COND_GT, "gt")                                                          \
+  X(IR_COND_GE, "ge")
+
+typedef enum {
+#define X(name, str) name,
+  IR_CONDITIONS(X)
+#undef X
+      IR_COND_COUNT,
+} IrCondition;
+
+// The most temporaries an instruction reads, other than a phi
+#define IR_MAX_ARGS 3
+
+typedef struct {
+  IrOpcode op;
+  IrTemp dest;              // IR_NO_TEMP for instructions that don't define one
+  IrTemp args[IR_MAX_ARGS]; // IR_NO_TEMP past the instruction's argument count
+  union {
+    int64_t value;     // const
+    IrCondition cond;  // compare
+    uint32_t variable; // load, store. Index into the variable table
+    char *text;        // print of a string, without its newline
+    IrTemp *incoming;  // phi. Arena allocated, one per predecessor
+  };
+} IrInstr;
+
+typedef enum {
+  IR_TERM_NONE,   // Still being built. Never valid once the IR is complete
+  IR_TERM_JUMP,   // Goes to targets[0]
+  IR_TERM_BRANCH, // Goes to targets[0] if args[0] cond args[1], else targets[1]
+  IR_TERM_EXIT,   // Ends the program
+} IrTerminatorKind;
+
+typedef struct {
+  IrTerminatorKind kind;
+  IrCondition cond;
+  IrTemp args[2];
+  IrBlockID targets[2];
+} IrTerminator;
+
+typedef struct {
+  IrInstr *instrs; // Arena allocated
+  uint32_t instr_count;
+  uint32_t instr_capacity;
+  IrTerminator term;
+  IrBlockID *preds; // Arena allocated by ir_compute_predecessors
+  uint32_t pred_count;
+  uint32_t label; // Label table index of the user LABEL the block starts with,
+                  // or IR_NO_LABEL
+} IrBlock;
+
+// The whole program. Block 0 is the entry, and blocks are laid out in order
+typedef struct {
+  Arena arena; // Owns the blocks, their instructions and any new strings
+  IrBlock *blocks;
+  uint32_t block_count;
+  uint32_t block_capacity;
+  uint32_t temp_count;
+  const NameTable *table; // Non-owning reference, for names in dumps
+} IR;
+
+// ----------------------
+// Construction
+// ----------------------
+
+IR ir_init(const NameTable *table);
+void ir_destroy(IR *ir);
+
+// Lowers a checked (and folded) AST into IR, with predecessors computed
+IR ir_build(AST *ast, NameTable *table);
+
+IrBlockID ir_add_block(IR *ir);
+IrTemp ir_new_temp(IR *ir);
+
+// Appends an instruction to the end of block. Its dest and args start out as
+// IR_NO_TEMP. The returned pointer is only valid until the block grows again
+IrInstr *ir_append(IR *ir, IrBlockID block, IrOpcode op);
+
+// Inserts an instruction before the one at index in block, which may be the
+// block's instruction count to append it. Like ir_append otherwise
+IrInstr *ir_insert(IR *ir, IrBlockID block, uint32_t index, IrOpcode op);
+
+// Lays the blocks out in the given order, renumbering them. Blocks left out of
+// order are deleted, so nothing may still jump to them. Predecessors have to
+// be computed again after, so there can't be any phis
+void ir_reorder_blocks(IR *ir, const IrBlockID *order, uint32_t order_count);
+
+// Deletes the blocks that can't be reached from the entry, keeping the rest
+// in order, and computes predecessors again if any went. There can't be any
+// phis
+void ir_remove_unreachable_blocks(IR *ir);
+
+// ----------------------
+// Control-Flow Graph
+// ----------------------
+
+// Fills out with the block's successors, and returns how many there are
+uint32_t ir_successors(const IrBlock *block, IrBlockID out[2]);
+
+// Fills in every block's predecessors from the terminators
+void ir_compute_predecessors(IR *ir);
+
+// ----------------------
+// Opcode Info
+// ----------------------
+
+const char *ir_opcode_name(IrOpcode op);
+uint32_t ir_opcode_arg_count(IrOpcode op);
+bool ir_opcode_defines(IrOpcode op);
+const char *ir_condition_name(IrCondition cond);
+// The condition that holds exactly when cond doesn't
+IrCondition ir_condition_negate(IrCondition cond);
+// The condition that holds for b and a exactly when cond holds for a and b
+IrCondition ir_condition_swap(IrCondition cond);
+
+// ----------------------
+// Dump & Verification
+// ----------------------
+
+// Writes a readable listing of the IR
+void ir_dump(const IR *ir, FILE *out);
+
+// Checks the IR is well formed: every block is terminated and only names
+// blocks and temporaries that exist, instructions have the right operands,
+// every temporary that's read is defined, no earlier than its use within the
+// same block, phis only start blocks, and predecessors match the terminators. Problems are reported to
+// report, if it isn't NULL. Returns whether there were none
+bool ir_verify(const IR *ir, FILE *report);
@@ -0,0 +1,362 @@
+#include "ast.h"
+#include "dz_debug.h"
+#include "ir.h"
+#include "string_util.h"
+#include "token.h"
+#include <stb_ds.h>
+#include <string.h>
+
+// ----------------------
+// IR BUILDER
+//
+// Lowers the AST into IR. Statements are appended to the
+// current block, and control flow ends it. A GOTO leaves
+// no current block, so one is only made for code after
+// it if there is any. Blocks are laid out in the order
+// they're started, which is the order of the source
+// ----------------------
+
+typedef struct {
+  IR *ir;
+  AST *ast;
+  NameTable *table;
+  IrBlockID current;    // IR_NO_BLOCK right after a GOTO
+  IrBlockID *labels;    // stb_ds array. Block of each user label, by label
+                        // table index, or IR_NO_BLOCK until it's referenced
+  IrBlockID *layout;    // stb_ds array. Blocks in the order they're started
+} IrBuilder;
+
+// Makes block the one statements are appended to
+static void _start_block(IrBuilder *b, IrBlockID block) {
+  b->current = block;
+  arrput(b->layout, block);
+}
+
+// The block statements are appended to. Code after a GOTO gets a new block,
+// that nothing jumps to unless it starts with a LABEL
+static IrBlockID _current_block(IrBuilder *b) {
+  if (b->current == IR_NO_BLOCK) {
+    _start_block(b, ir_add_block(b->ir));
+  }
+  return b->current;
+}
+
+// Ends the current block with term, leaving no current block
+static void _terminate(IrBuilder *b, IrTerminator term) {
+  // Making the block can move ir->blocks, so it has to come first
+  const IrBlockID block = _current_block(b);
+  b->ir->blocks[block].term = term;
+  b->current = IR_NO_BLOCK;
+}
+
+static void _jump(IrBuilder *b, IrBlockID target) {
+  _terminate(b, (IrTerminator){.kind = IR_TERM_JUMP,
+                               .args = {IR_NO_TEMP, IR_NO_TEMP},
+                               .targets = {target, IR_NO_BLOCK}});
+}
+
+// The block a user label starts, made the first time the label is referenced
+static IrBlockID _label_block(IrBuilder *b, NodeID ident_node) {
+  const Token *ident = ast_node_get_token(b->ast, ident_node);
+  DZ_ASSERT(ident->type == TOKEN_IDENT);
+  const ptrdiff_t label = shgeti(b->table->label_table, ident->text);
+  DZ_ASSERT(label != -1, "GOTO to a label that was never declared");
+  if (b->labels[label] == IR_NO_BLOCK) {
+    b->labels[label] = ir_add_block(b->ir);
+    b->ir->blocks[b->labels[label]].label = (uint32_t)label;
+  }
+  return b->labels[label];
+}
+
+// Appends an instruction defining a new temporary, and returns it
+static IrInstr *_append_def(IrBuilder *b, IrOpcode op) {
+  IrInstr *instr = ir_append(b->ir, _current_block(b), op);
+  instr->dest = ir_new_temp(b->ir);
+  return instr;
+}
+
+// ----------------------
+// Expressions
+// ----------------------
+
+static IrTemp _lower_const(IrBuilder *b, int64_t value) {
+  IrInstr *instr = _append_def(b, IR_CONST);
+  instr->value = value;
+  return instr->dest;
+}
+
+// primary ::= number | ident
+static IrTemp _lower_primary(IrBuilder *b, NodeID primary_node, bool negate) {
+  const Token *token =
+      ast_node_get_token(b->ast, ast_get_first_child(b->ast, primary_node));
+  if (token->type == TOKEN_NUMBER) {
+    const int64_t value = string_parse_decimal_wrapping(token->text);
+    // Negative literals are constants of their own, rather than a negation
+    return _lower_const(
+        b, negate ? (int64_t)(0 - (uint64_t)value) : value);
+  }
+  DZ_ASSERT(token->type == TOKEN_IDENT);
+  IrInstr *load = _append_def(b, IR_LOAD);
+  load->variable = token->symbol_index;
+  const IrTemp loaded = load->dest;
+  if (!negate)
+    return loaded;
+  IrInstr *neg = _append_def(b, IR_NEG);
+  neg->args[0] = loaded;
+  return neg->dest;
+}
+
+// unary ::= ["+" | "-"] primary
+static IrTemp _lower_unary(IrBuilder *b, NodeID unary_node) {
+  AST *ast = b->ast;
+  NodeID child = ast_get_first_child(ast, unary_node);
+  bool negate = false;
+  if (ast_node_is_token(ast, child)) {
+    negate = ast_node_get_token(ast, child)->type == TOKEN_MINUS;
+    child = ast_get_next_sibling(ast, child);
+  }
+  return _lower_primary(b, child, negate);
+}
+
+static IrOpcode _arithmetic_opcode(enum TOKEN op) {
+  if (op == TOKEN_PLUS)
+    return IR_ADD;
+  if (op == TOKEN_MINUS)
+    return IR_SUB;
+  if (op == TOKEN_MULT)
+    return IR_MUL;
+  if (op == TOKEN_DIV)
+    return IR_DIV;
+  DZ_THROW("Bad arithmetic operation %s", token_type_to_string(op));
+  return IR_ADD;
+}
+
+// Lowers an expression, term or unary, and returns the temporary holding it
+// expression ::= term {( "-" | "+" ) term}
+// term ::= unary {( "/" | "*" ) unary}
+static IrTemp _lower_value(IrBuilder *b, NodeID node) {
+  AST *ast = b->ast;
+  const GRAMMAR_TYPE grammar = ast_node_get_grammar(ast, node);
+  if (grammar != GRAMMAR_TYPE_EXPRESSION && grammar != GRAMMAR_TYPE_TERM)
+    return _lower_unary(b, node);
+  NodeID child = ast_get_first_child(ast, node);
+  IrTemp result = _lower_value(b, child);
+  NodeID op_node = ast_get_next_sibling(ast, child);
+  while (op_node != NO_NODE) {
+    const NodeID operand = ast_get_next_sibling(ast, op_node);
+    const IrTemp right = _lower_value(b, operand);
+    IrInstr *instr = _append_def(
+        b, _arithmetic_opcode(ast_node_get_token(ast, op_node)->type));
+    instr->args[0] = result;
+    instr->args[1] = right;
+    result = instr->dest;
+    op_node = ast_get_next_sibling(ast, operand);
+  }
+  return result;
+}
+
+static IrCondition _comparison_condition(enum TOKEN op) {
+  if (op == TOKEN_EQEQ)
+    return IR_COND_EQ;
+  if (op == TOKEN_NOTEQ)
+    return IR_COND_NE;
+  if (op == TOKEN_LT)
+    return IR_COND_LT;
+  if (op == TOKEN_LTE)
+    return IR_COND_LE;
+  if (op == TOKEN_GT)
+    return IR_COND_GT;
+  if (op == TOKEN_GTE)
+    return IR_COND_GE;
+  DZ_THROW("Bad comparison operation %s", token_type_to_string(op));
+  return IR_COND_EQ;
+}
+
+// Ends the current block with a branch on the comparison, to if_true when it
+// holds and to if_false otherwise
+// comparison ::= expression ("==" | "!=" | ">" | ">=" | "<" | "<=") expression
+static void _lower_branch(IrBuilder *b, NodeID comparison_node,
+                          IrBlockID if_true, IrBlockID if_false) {
+  AST *ast = b->ast;
+  const NodeID left = ast_get_first_child(ast, comparison_node);
+  const NodeID op_node = ast_get_next_sibling(ast, left);
+  const NodeID right = ast_get_next_sibling(ast, op_node);
+  const IrTemp left_temp = _lower_value(b, left);
+  const IrTemp right_temp = _lower_value(b, right);
+  _terminate(
+      b, (IrTerminator){.kind = IR_TERM_BRANCH,
+                        .cond = _comparison_condition(
+                            ast_node_get_token(ast, op_node)->type),
+                        .args = {left_temp, right_temp},
+                        .targets = {if_true, if_false}});
+}
+
+// ----------------------
+// Statements
+// ----------------------
+
+static NodeID _lower_statements(IrBuilder *b, NodeID statement_node);
+
+// Returns the text of a PRINT statement's string, or NULL if it prints
+// anything else, or isn't a PRINT
+static char *_print_string_text(AST *ast, NodeID statement_node) {
+  if (statement_node == NO_NODE || !ast_node_is_grammar(ast, statement_node) ||
+      ast_node_get_grammar(ast, statement_node) != GRAMMAR_TYPE_STATEMENT)
+    return NULL;
+  const NodeID first_child = ast_get_first_child(ast, statement_node);
+  if (first_child == NO_NODE || !ast_node_is_token(ast, first_child) ||
+      ast_node_get_token(ast, first_child)->type != TOKEN_PRINT)
+    return NULL;
+  const NodeID string_node = ast_get_next_sibling(ast, first_child);
+  if (string_node == NO_NODE || !ast_node_is_token(ast, string_node))
+    return NULL;
+  const Token *string = ast_node_get_token(ast, string_node);
+  return string->type == TOKEN_STRING ? string->text : NULL;
+}
+
+// Lowers the run of consecutive string PRINTs starting at statement_node into
+// a single print, with the newlines between them baked into its text. Nothing
+// can jump into the middle of a run, since LABELs are statements of their own.
+// Returns the run's last statement
+static NodeID _lower_print_run(IrBuilder *b, NodeID statement_node) {
+  AST *ast = b->ast;
+  char *text = _print_string_text(ast, statement_node);
+  NodeID next = ast_get_next_sibling(ast, statement_node);
+  IrInstr *print = ir_append(b->ir, _current_block(b), IR_PRINT_STR);
+  if (!_print_string_text(ast, next)) {
+    print->text = text;
+    return statement_node;
+  }
+  char *run_text = NULL; // stb_ds array
+  NodeID last = statement_node;
+  while (true) {
+    const size_t len = strlen(text);
+    if (len != 0) {
+      memcpy(arraddnptr(run_text, len), text, len);
+    }
+    text = _print_string_text(ast, next);
+    if (!text)
+      break;
+    arrput(run_text, '\n');
+    last = next;
+    next = ast_get_next_sibling(ast, next);
+  }
+  print->text = arena_allocate_string(&b->ir->arena, run_text,
+                                      run_text + arrlenu(run_text));
+  arrfree(run_text);
+  return last;
+}
+
+// Lowers statement_node, or the whole PRINT run that starts there. Returns the
+// last statement that was lowered
+static NodeID _lower_statement(IrBuilder *b, NodeID statement_node) {
+  AST *ast = b->ast;
+  const NodeID first_child = ast_get_first_child(ast, statement_node);
+  const Token *token = ast_node_get_token(ast, first_child);
+  const NodeID second = ast_get_next_sibling(ast, first_child);
+  if (token->type == TOKEN_PRINT) {
+    // PRINT (expr | string)
+    if (ast_node_is_token(ast, second))
+      return _lower_print_run(b, statement_node);
+    const IrTemp value = _lower_value(b, second);
+    ir_append(b->ir, _current_block(b), IR_PRINT_INT)->args[0] = value;
+  } else if (token->type == TOKEN_LET) {
+    // "LET" ident "=" expression
+    const NodeID expr_node =
+        ast_get_next_sibling(ast, ast_get_next_sibling(ast, second));
+    const IrTemp value = _lower_value(b, expr_node);
+    IrInstr *store = ir_append(b->ir, _current_block(b), IR_STORE);
+    store->variable = ast_node_get_token(ast, second)->symbol_index;
+    store->args[0] = value;
+  } else if (token->type == TOKEN_INPUT) {
+    // "INPUT" ident
+    const IrTemp value = _append_def(b, IR_INPUT)->dest;
+    IrInstr *store = ir_append(b->ir, _current_block(b), IR_STORE);
+    store->variable = ast_node_get_token(ast, second)->symbol_index;
+    store->args[0] = value;
+  } else if (token->type == TOKEN_LABEL) {
+    // LABEL ident. Control falls into the label's block
+    const IrBlockID target = _label_block(b, second);
+    if (b->current != IR_NO_BLOCK) {
+      _jump(b, target);
+    }
+    _start_block(b, target);
+  } else if (token->type == TOKEN_GOTO) {
+    // GOTO ident
+    _jump(b, _label_block(b, second));
+  } else if (token->type == TOKEN_IF) {
+    // "IF" comparison "THEN" nl {statement}* "ENDIF" nl
+    const IrBlockID then_block = ir_add_block(b->ir);
+    const IrBlockID end_block = ir_add_block(b->ir);
+    _lower_branch(b, second, then_block, end_block);
+    _start_block(b, then_block);
+    const NodeID then_node = ast_get_next_sibling(ast, second);
+    _lower_statements(b, ast_get_next_sibling(ast, then_node));
+    if (b->current != IR_NO_BLOCK) {
+      _jump(b, end_block);
+    }
+    _start_block(b, end_block);
+  } else if (token->type == TOKEN_WHILE) {
+    // "WHILE" comparison "REPEAT" nl {statement}* "ENDWHILE" nl
+    const IrBlockID header = ir_add_block(b->ir);
+    const IrBlockID body = ir_add_block(b->ir);
+    const IrBlockID end_block = ir_add_block(b->ir);
+    _jump(b, header);
+    _start_block(b, header);
+    _lower_branch(b, second, body, end_block);
+    _start_block(b, body);
+    const NodeID repeat_node = ast_get_next_sibling(ast, second);
+    _lower_statements(b, ast_get_next_sibling(ast, repeat_node));
+    if (b->current != IR_NO_BLOCK) {
+      _jump(b, header);
+    }
+    _start_block(b, end_block);
+  } else {
+    DZ_THROW("Bad statement %s", token_type_to_string(token->type));
+  }
+  return statement_node;
+}
+
+// Lowers statement_node and the statements after it, until something that
+// isn't a statement, like ENDIF, or the end of the list. Returns what stopped
+// it
+static NodeID _lower_statements(IrBuilder *b, NodeID statement_node) {
+  AST *ast = b->ast;
+  while (statement_node != NO_NODE &&
+         ast_node_is_grammar(ast, statement_node) &&
+         ast_node_get_grammar(ast, statement_node) ==
+             GRAMMAR_TYPE_STATEMENT) {
+    statement_node =
+        ast_get_next_sibling(ast, _lower_statement(b, statement_node));
+  }
+  return statement_node;
+}
+
+IR ir_build(AST *ast, NameTable *table) {
+  IR ir = ir_init(table);
+  IrBuilder b = {.ir = &ir,
+                 .ast = ast,
+                 .table = table,
+                 .current = IR_NO_BLOCK,
+                 .labels = NULL,
+                 .layout = NULL};
+  const size_t label_count = shlenu(table->label_table);
+  arrsetlen(b.labels, label_count);
+  for (size_t i = 0; i < label_count; i++) {
+    b.labels[i] = IR_NO_BLOCK;
+  }
+  // The entry block always exists, even if the program starts with a LABEL
+  _current_block(&b);
+  const NodeID head = ast_head(ast);
+  if (head != NO_NODE) {
+    _lower_statements(&b, ast_get_first_child(ast, head));
+  }
+  _terminate(&b, (IrTerminator){.kind = IR_TERM_EXIT,
+                                .args = {IR_NO_TEMP, IR_NO_TEMP},
+                                .targets = {IR_NO_BLOCK, IR_NO_BLOCK}});
+  ir_reorder_blocks(&ir, b.layout, (uint32_t)arrlenu(b.layout));
+  ir_compute_predecessors(&ir);
+  arrfree(b.labels);
+  arrfree(b.layout);
+  return ir;
+}
@@ -0,0 +1,2235 @@
+#include "ir_optimizer.h"
+#include "dz_debug.h"
+#include "ir_ssa.h"
+#include <stb_ds.h>
+#include <string.h>
+
+// A place a temporary is mentioned: an instruction, or the block's terminator
+// when index is the block's instruction count
+typedef struct {
+  IrBlockID block;
+  uint32_t index;
+} Site;
+
+// Works out op on constants, with the generated code's 64 bit wraparound.
+// Fails for a division the program has to trap on when it runs
+static bool _fold(IrOpcode op, int64_t left, int64_t right, int64_t *out) {
+  const uint64_t l = (uint64_t)left;
+  const uint64_t r = (uint64_t)right;
+  switch (op) {
+  case IR_NEG:
+    *out = (int64_t)(0 - l);
+    return true;
+  case IR_ADD:
+    *out = (int64_t)(l + r);
+    return true;
+  case IR_SUB:
+    *out = (int64_t)(l - r);
+    return true;
+  case IR_MUL:
+    *out = (int64_t)(l * r);
+    return true;
+  case IR_DIV:
+    if (right == 0 || (left == INT64_MIN && right == -1))
+      return false;
+    *out = left / right;
+    return true;
+  case IR_CONST:
+  case IR_LOAD:
+  case IR_STORE:
+  case IR_COPY:
+  case IR_PHI:
+  case IR_COMPARE:
+  case IR_SELECT:
+  case IR_PRINT_INT:
+  case IR_PRINT_STR:
+  case IR_INPUT:
+  case IR_OPCODE_COUNT:
+    break;
+  }
+  return false;
+}
+
+static bool _condition_holds(IrCondition cond, int64_t left, int64_t right) {
+  switch (cond) {
+  case IR_COND_EQ:
+    return left == right;
+  case IR_COND_NE:
+    return left != right;
+  case IR_COND_LT:
+    return left < right;
+  case IR_COND_LE:
+    return left <= right;
+  case IR_COND_GT:
+    return left > right;
+  case IR_COND_GE:
+    return left >= right;
+  case IR_COND_COUNT:
+    break;
+  }
+  DZ_THROW("Bad branch condition %d", cond);
+  return false;
+}
+
+static bool _is_arithmetic(IrOpcode op) {
+  return op == IR_NEG || op == IR_ADD || op == IR_SUB || op == IR_MUL ||
+         op == IR_DIV;
+}
+
+// Whether op's result only depends on its arguments
+static bool _is_computation(IrOpcode op) {
+  return _is_arithmetic(op) || op == IR_COMPARE || op == IR_SELECT;
+}
+
+static IrTemp _resolve(const IrTemp *replace, IrTemp temp) {
+  return replace[temp] != IR_NO_TEMP ? replace[temp] : temp;
+}
+
+// ----------------------
+// Sparse Conditional Constant Propagation
+//
+// Wegman and Zadeck. Every temporary starts out unknown,
+// and only ever moves down to a constant and then to
+// varying. Blocks are only evaluated once an edge into
+// them is found to run, so values coming from paths that
+// never run don't spoil phis, and a branch on constants
+// only lets one of its edges run
+// ----------------------
+
+typedef enum {
+  VALUE_UNKNOWN,  // Nothing that runs has defined it yet
+  VALUE_CONSTANT, // Always value
+  VALUE_VARYING,  // Could be different each time
+} ValueKind;
+
+typedef struct {
+  ValueKind kind;
+  int64_t value;
+} Value;
+
+typedef struct {
+  IR *ir;
+  Value *values;         // stb_ds array, per temporary
+  bool *reached;         // stb_ds array, per block. Whether it can run
+  uint32_t *edge_start;  // stb_ds array, per block. First of its
+                         // predecessors' slots in edge_reached
+  bool *edge_reached;    // stb_ds array, per predecessor of each block
+  uint32_t *use_start;   // stb_ds array, per temporary. First of its uses
+  Site *uses;            // stb_ds array, grouped by temporary
+  IrBlockID *flow;       // stb_ds array of edges to visit, as from, to pairs
+  IrTemp *changed;       // stb_ds array of temporaries whose value moved
+} Propagator;
+
+static Value _varying(void) {
+  return (Value){.kind = VALUE_VARYING, .value = 0};
+}
+
+static Value _constant(int64_t value) {
+  return (Value){.kind = VALUE_CONSTANT, .value = value};
+}
+
+static Value _meet(Value a, Value b) {
+  if (a.kind == VALUE_UNKNOWN)
+    return b;
+  if (b.kind == VALUE_UNKNOWN)
+    return a;
+  if (a.kind == VALUE_CONSTANT && b.kind == VALUE_CONSTANT &&
+      a.value == b.value)
+    return a;
+  return _varying();
+}
+
+// Groups every mention of each temporary, so the instructions reading it can
+// be evaluated again when its value moves
+static void _collect_uses(Propagator *p) {
+  const IR *ir = p->ir;
+  arrsetlen(p->use_start, ir->temp_count + 1);
+  memset(p->use_start, 0, (ir->temp_count + 1) * sizeof(*p->use_start));
+  // Counted into the next temporary's start, then summed
+  for (int pass = 0; pass < 2; pass++) {
+    for (IrBlockID b = 0; b < ir->block_count; b++) {
+      const IrBlock *block = &ir->blocks[b];
+      for (uint32_t i = 0; i <= block->instr_count; i++) {
+        const IrTemp *reads = NULL;
+        uint32_t read_count = 0;
+        if (i == block->instr_count) {
+          reads = block->term.args;
+          read_count = block->term.kind == IR_TERM_BRANCH ? 2 : 0;
+        } else if (block->instrs[i].op == IR_PHI) {
+          reads = block->instrs[i].incoming;
+          read_count = block->pred_count;
+        } else {
+          reads = block->instrs[i].args;
+          read_count = ir_opcode_arg_count(block->instrs[i].op);
+        }
+        for (uint32_t r = 0; r < read_count; r++) {
+          if (pass == 0) {
+            p->use_start[reads[r] + 1]++;
+          } else {
+            p->uses[p->use_start[reads[r]]++] = (Site){b, i};
+          }
+        }
+      }
+    }
+    if (pass == 0) {
+      for (IrTemp t = 0; t < ir->temp_count; t++) {
+        p->use_start[t + 1] += p->use_start[t];
+      }
+      arrsetlen(p->uses, p->use_start[ir->temp_count]);
+    } else {
+      // Filling moved each start up to the next one's
+      memmove(&p->use_start[1], p->use_start,
+              ir->temp_count * sizeof(*p->use_start));
+      p->use_start[0] = 0;
+    }
+  }
+}
+
+static Value _evaluate(const Propagator *p, IrBlockID b, const IrInstr *instr) {
+  const Value *values = p->values;
+  switch (instr->op) {
+  case IR_CONST:
+    return _constant(instr->value);
+  case IR_COPY:
+    return values[instr->args[0]];
+  case IR_PHI: {
+    const IrBlock *block = &p->ir->blocks[b];
+    Value value = {.kind = VALUE_UNKNOWN, .value = 0};
+    for (uint32_t i = 0; i < block->pred_count; i++) {
+      if (p->edge_reached[p->edge_start[b] + i]) {
+        value = _meet(value, values[instr->incoming[i]]);
+      }
+    }
+    return value;
+  }
+  case IR_NEG:
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_DIV: {
+    const Value left = values[instr->args[0]];
+    const Value right =
+        instr->op == IR_NEG ? _constant(0) : values[instr->args[1]];
+    if (left.kind == VALUE_VARYING || right.kind == VALUE_VARYING)
+      return _varying();
+    if (left.kind == VALUE_UNKNOWN || right.kind == VALUE_UNKNOWN)
+      return left.kind == VALUE_UNKNOWN ? left : right;
+    int64_t result = 0;
+    if (!_fold(instr->op, left.value, right.value, &result))
+      return _varying();
+    return _constant(result);
+  }
+  case IR_COMPARE: {
+    const Value left = values[instr->args[0]];
+    const Value right = values[instr->args[1]];
+    if (left.kind == VALUE_VARYING || right.kind == VALUE_VARYING)
+      return _varying();
+    if (left.kind == VALUE_UNKNOWN || right.kind == VALUE_UNKNOWN)
+      return left.kind == VALUE_UNKNOWN ? left : right;
+    return _constant(_condition_holds(instr->cond, left.value, right.value));
+  }
+  case IR_SELECT: {
+    const Value flag = values[instr->args[0]];
+    if (flag.kind == VALUE_CONSTANT)
+      return values[instr->args[flag.value ? 1 : 2]];
+    if (flag.kind == VALUE_UNKNOWN)
+      return flag;
+    // Either could be picked, which only matters if they differ
+    return _meet(values[instr->args[1]], values[instr->args[2]]);
+  }
+  case IR_LOAD:
+  case IR_STORE:
+  case IR_PRINT_INT:
+  case IR_PRINT_STR:
+  case IR_INPUT:
+  case IR_OPCODE_COUNT:
+    break;
+  }
+  return _varying();
+}
+
+static void _add_flow(Propagator *p, IrBlockID from, IrBlockID to) {
+  arrput(p->flow, from);
+  arrput(p->flow, to);
+}
+
+static void _visit_terminator(Propagator *p, IrBlockID b) {
+  const IrTerminator *term = &p->ir->blocks[b].term;
+  if (term->kind == IR_TERM_JUMP) {
+    _add_flow(p, b, term->targets[0]);
+  } else if (term->kind == IR_TERM_BRANCH) {
+    const Value left = p->values[term->args[0]];
+    const Value right = p->values[term->args[1]];
+    if (left.kind == VALUE_UNKNOWN || right.kind == VALUE_UNKNOWN)
+      return;
+    if (left.kind == VALUE_CONSTANT && right.kind == VALUE_CONSTANT) {
+      const bool taken = _condition_holds(term->cond, left.value, right.value);
+      _add_flow(p, b, term->targets[taken ? 0 : 1]);
+      return;
+    }
+    _add_flow(p, b, term->targets[0]);
+    _add_flow(p, b, term->targets[1]);
+  }
+}
+
+static void _visit(Propagator *p, Site site) {
+  const IrBlock *block = &p->ir->blocks[site.block];
+  if (site.index == block->instr_count) {
+    _visit_terminator(p, site.block);
+    return;
+  }
+  const IrInstr *instr = &block->instrs[site.index];
+  if (instr->dest == IR_NO_TEMP)
+    return;
+  const Value value = _evaluate(p, site.block, instr);
+  Value *old = &p->values[instr->dest];
+  if (value.kind != old->kind || value.value != old->value) {
+    *old = value;
+    arrput(p->changed, instr->dest);
+  }
+}
+
+// Marks an edge as running. The first edge into a block evaluates all of it,
+// and later ones only its phis, which are the only things they can change
+static void _visit_edge(Propagator *p, IrBlockID from, IrBlockID to) {
+  const IrBlock *block = &p->ir->blocks[to];
+  uint32_t slot = 0;
+  while (block->preds[slot] != from) {
+    slot++;
+  }
+  if (p->edge_reached[p->edge_start[to] + slot])
+    return;
+  p->edge_reached[p->edge_start[to] + slot] = true;
+  const bool first = !p->reached[to];
+  p->reached[to] = true;
+  for (uint32_t i = 0; i <= block->instr_count; i++) {
+    if (!first && (i == block->instr_count || block->instrs[i].op != IR_PHI))
+      break;
+    _visit(p, (Site){to, i});
+  }
+}
+
+// Moves phis still left back to the start of a block, after some were made
+// constants
+static void _hoist_phis(IrBlock *block) {
+  IrInstr *others = NULL; // stb_ds array
+  uint32_t phi_count = 0;
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    if (block->instrs[i].op == IR_PHI) {
+      block->instrs[phi_count++] = block->instrs[i];
+    } else {
+      arrput(others, block->instrs[i]);
+    }
+  }
+  if (arrlenu(others)) {
+    memcpy(&block->instrs[phi_count], others,
+           arrlenu(others) * sizeof(*others));
+  }
+  arrfree(others);
+}
+
+// Rewrites the IR with what propagation found. Constant temporaries are
+// defined as constants, branches on constants become jumps, and blocks that
+// can't run are cut off, to be deleted when the IR leaves SSA form
+static void _apply_constants(Propagator *p) {
+  IR *ir = p->ir;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    if (!p->reached[b])
+      continue;
+    IrBlock *block = &ir->blocks[b];
+    bool made_phi_constant = false;
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      IrInstr *instr = &block->instrs[i];
+      if (instr->dest == IR_NO_TEMP || instr->op == IR_CONST ||
+          p->values[instr->dest].kind != VALUE_CONSTANT)
+        continue;
+      made_phi_constant |= instr->op == IR_PHI;
+      *instr = (IrInstr){.op = IR_CONST,
+                         .dest = instr->dest,
+                         .args = {IR_NO_TEMP, IR_NO_TEMP, IR_NO_TEMP},
+                         .value = p->values[instr->dest].value};
+    }
+    if (made_phi_constant) {
+      _hoist_phis(block);
+    }
+    IrTerminator *term = &block->term;
+    if (term->kind != IR_TERM_BRANCH)
+      continue;
+    const Value left = p->values[term->args[0]];
+    const Value right = p->values[term->args[1]];
+    if (left.kind != VALUE_CONSTANT || right.kind != VALUE_CONSTANT) {
+      DZ_ASSERT(p->reached[term->targets[0]] && p->reached[term->targets[1]],
+                "A branch that isn't decided has to run both ways");
+      continue;
+    }
+    const bool taken = _condition_holds(term->cond, left.value, right.value);
+    const IrBlockID target = term->targets[taken ? 0 : 1];
+    const IrBlockID skipped = term->targets[taken ? 1 : 0];
+    if (skipped != target) {
+      ir_remove_edge(ir, b, skipped);
+    }
+    *term = (IrTerminator){.kind = IR_TERM_JUMP,
+                           .args = {IR_NO_TEMP, IR_NO_TEMP},
+                           .targets = {target, IR_NO_BLOCK}};
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    if (p->reached[b])
+      continue;
+    IrBlock *block = &ir->blocks[b];
+    IrBlockID succs[2];
+    const uint32_t succ_count = ir_successors(block, succs);
+    for (uint32_t s = 0; s < succ_count; s++) {
+      ir_remove_edge(ir, b, succs[s]);
+    }
+    block->instr_count = 0;
+    block->term = (IrTerminator){.kind = IR_TERM_EXIT,
+                                 .args = {IR_NO_TEMP, IR_NO_TEMP},
+                                 .targets = {IR_NO_BLOCK, IR_NO_BLOCK}};
+  }
+}
+
+static void _propagate_constants(IR *ir) {
+  Propagator p = {.ir = ir,
+                  .values = NULL,
+                  .reached = NULL,
+                  .edge_start = NULL,
+                  .edge_reached = NULL,
+                  .use_start = NULL,
+                  .uses = NULL,
+                  .flow = NULL,
+                  .changed = NULL};
+  arrsetlen(p.values, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    p.values[t] = (Value){.kind = VALUE_UNKNOWN, .value = 0};
+  }
+  arrsetlen(p.reached, ir->block_count);
+  memset(p.reached, 0, ir->block_count * sizeof(*p.reached));
+  arrsetlen(p.edge_start, ir->block_count);
+  uint32_t edge_count = 0;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    p.edge_start[b] = edge_count;
+    edge_count += ir->blocks[b].pred_count;
+  }
+  arrsetlen(p.edge_reached, edge_count);
+  if (edge_count) {
+    memset(p.edge_reached, 0, edge_count * sizeof(*p.edge_reached));
+  }
+  _collect_uses(&p);
+
+  p.reached[0] = true;
+  for (uint32_t i = 0; i <= ir->blocks[0].instr_count; i++) {
+    _visit(&p, (Site){0, i});
+  }
+  while (arrlenu(p.flow) || arrlenu(p.changed)) {
+    if (arrlenu(p.flow)) {
+      const IrBlockID to = arrpop(p.flow);
+      const IrBlockID from = arrpop(p.flow);
+      _visit_edge(&p, from, to);
+      continue;
+    }
+    const IrTemp temp = arrpop(p.changed);
+    for (uint32_t u = p.use_start[temp]; u < p.use_start[temp + 1]; u++) {
+      if (p.reached[p.uses[u].block]) {
+        _visit(&p, p.uses[u]);
+      }
+    }
+  }
+  _apply_constants(&p);
+
+  arrfree(p.values);
+  arrfree(p.reached);
+  arrfree(p.edge_start);
+  arrfree(p.edge_reached);
+  arrfree(p.use_start);
+  arrfree(p.uses);
+  arrfree(p.flow);
+  arrfree(p.changed);
+}
+
+// ----------------------
+// Global Value Numbering
+//
+// A walk down the dominator tree in preorder, with a
+// table of the computations made so far. Whatever a
+// dominating block already worked out is reused instead
+// of being computed again, and copies and phis that only
+// ever see one value are replaced by it. An entry made
+// by a block that doesn't dominate the one being
+// numbered is stale, since preorder never comes back
+// into that block's subtree, so it's simply overwritten
+// ----------------------
+
+typedef struct {
+  int64_t value; // const's value, compare's condition, 0 otherwise
+  IrOpcode op;
+  IrTemp args[IR_MAX_ARGS];
+} ValueKey;
+
+typedef struct {
+  ValueKey key;
+  IrTemp temp; // IR_NO_TEMP when the slot is empty
+} ValueSlot;
+
+typedef struct {
+  IR *ir;
+  const IrDominators *doms;
+  IrTemp *replace;      // stb_ds array, per temporary. What it's replaced by
+  IrBlockID *def_block; // stb_ds array, per temporary in the table
+  ValueSlot *slots;     // stb_ds array, open addressed
+  uint32_t mask;        // Slot count minus one, a power of two
+  bool changed;
+} Numberer;
+
+static ValueKey _value_key(const IrInstr *instr) {
+  ValueKey key = {.value = 0,
+                  .op = instr->op,
+                  .args = {instr->args[0], instr->args[1], instr->args[2]}};
+  if (instr->op == IR_CONST) {
+    key.value = instr->value;
+  } else if (instr->op == IR_COMPARE) {
+    key.value = instr->cond;
+  }
+  if ((instr->op == IR_ADD || instr->op == IR_MUL) &&
+      key.args[0] > key.args[1]) {
+    key.args[0] = instr->args[1];
+    key.args[1] = instr->args[0];
+  }
+  return key;
+}
+
+static uint32_t _hash_key(const ValueKey *key) {
+  uint64_t hash = (uint64_t)key->value;
+  hash = (hash ^ key->op) * 0x9E3779B97F4A7C15ull;
+  hash = (hash ^ key->args[0]) * 0x9E3779B97F4A7C15ull;
+  hash = (hash ^ key->args[1]) * 0x9E3779B97F4A7C15ull;
+  hash = (hash ^ key->args[2]) * 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(hash >> 32);
+}
+
+static bool _same_key(const ValueKey *a, const ValueKey *b) {
+  return a->value == b->value && a->op == b->op && a->args[0] == b->args[0] &&
+         a->args[1] == b->args[1] && a->args[2] == b->args[2];
+}
+
+// Returns the temporary already holding instr's value in a dominating block,
+// or records instr's own and returns IR_NO_TEMP
+static IrTemp _number_value(Numberer *n, IrBlockID b, const IrInstr *instr) {
+  const ValueKey key = _value_key(instr);
+  uint32_t slot = _hash_key(&key) & n->mask;
+  while (n->slots[slot].temp != IR_NO_TEMP &&
+         !_same_key(&n->slots[slot].key, &key)) {
+    slot = (slot + 1) & n->mask;
+  }
+  ValueSlot *found = &n->slots[slot];
+  if (found->temp != IR_NO_TEMP &&
+      ir_dominates(n->doms, n->def_block[found->temp], b))
+    return found->temp;
+  *found = (ValueSlot){.key = key, .temp = instr->dest};
+  n->def_block[instr->dest] = b;
+  return IR_NO_TEMP;
+}
+
+// Returns whether the phi was replaced. It is if every value it sees, other
+// than its own from around a loop, is the same
+static bool _number_phi(Numberer *n, const IrBlock *block, IrInstr *phi) {
+  IrTemp same = IR_NO_TEMP;
+  bool trivial = true;
+  for (uint32_t p = 0; p < block->pred_count; p++) {
+    const IrTemp value = _resolve(n->replace, phi->incoming[p]);
+    phi->incoming[p] = value;
+    if (value == phi->dest)
+      continue;
+    if (same == IR_NO_TEMP) {
+      same = value;
+    } else if (value != same) {
+      trivial = false;
+    }
+  }
+  if (!trivial || same == IR_NO_TEMP)
+    return false;
+  n->replace[phi->dest] = same;
+  return true;
+}
+
+static void _number_block(Numberer *n, IrBlockID b) {
+  IrBlock *block = &n->ir->blocks[b];
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    IrInstr instr = block->instrs[i];
+    for (uint32_t a = 0; a < ir_opcode_arg_count(instr.op); a++) {
+      instr.args[a] = _resolve(n->replace, instr.args[a]);
+    }
+    IrTemp same = IR_NO_TEMP;
+    if (instr.op == IR_PHI && _number_phi(n, block, &instr)) {
+      n->changed = true;
+      continue;
+    }
+    if (instr.op == IR_COPY) {
+      same = instr.args[0];
+    } else if (instr.op == IR_CONST || _is_computation(instr.op)) {
+      same = _number_value(n, b, &instr);
+    }
+    if (same != IR_NO_TEMP) {
+      n->replace[instr.dest] = same;
+      n->changed = true;
+      continue;
+    }
+    block->instrs[kept++] = instr;
+  }
+  block->instr_count = kept;
+  if (block->term.kind == IR_TERM_BRANCH) {
+    block->term.args[0] = _resolve(n->replace, block->term.args[0]);
+    block->term.args[1] = _resolve(n->replace, block->term.args[1]);
+  }
+}
+
+// Returns whether anything was replaced
+static bool _number_values(IR *ir) {
+  IrDominators doms = ir_dominators_compute(ir);
+  Numberer n = {.ir = ir,
+                .doms = &doms,
+                .replace = NULL,
+                .def_block = NULL,
+                .slots = NULL,
+                .mask = 0,
+                .changed = false};
+  arrsetlen(n.replace, ir->temp_count);
+  arrsetlen(n.def_block, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    n.replace[t] = IR_NO_TEMP;
+  }
+  // At least twice as many slots as there are values, so probes stay short
+  uint32_t instr_count = 0;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    instr_count += ir->blocks[b].instr_count;
+  }
+  uint32_t slot_count = 16;
+  while (slot_count < instr_count * 2) {
+    slot_count *= 2;
+  }
+  n.mask = slot_count - 1;
+  arrsetlen(n.slots, slot_count);
+  for (uint32_t i = 0; i < slot_count; i++) {
+    n.slots[i].temp = IR_NO_TEMP;
+  }
+
+  for (uint32_t i = 0; i < arrlenu(doms.preorder); i++) {
+    _number_block(&n, doms.preorder[i]);
+  }
+  // Phis read values from around loops before the blocks defining them were
+  // numbered
+  for (uint32_t i = 0; i < arrlenu(doms.preorder); i++) {
+    const IrBlock *block = &ir->blocks[doms.preorder[i]];
+    for (uint32_t j = 0; j < block->instr_count; j++) {
+      if (block->instrs[j].op != IR_PHI)
+        break;
+      for (uint32_t p = 0; p < block->pred_count; p++) {
+        block->instrs[j].incoming[p] =
+            _resolve(n.replace, block->instrs[j].incoming[p]);
+      }
+    }
+  }
+  arrfree(n.slots);
+  arrfree(n.def_block);
+  arrfree(n.replace);
+  ir_dominators_destroy(&doms);
+  return n.changed;
+}
+
+// ----------------------
+// Dead Code Elimination
+//
+// Starting from what the program does that can be seen,
+// its output, input, branches and divisions that may
+// trap, marks every definition those depend on. The rest
+// is deleted. With every variable promoted, this is also
+// where stores nothing reads again end up going
+// ----------------------
+
+// Whether an instruction has to stay even if nothing reads what it defines
+static bool _has_effect(const IrInstr *instr, const Site *defs,
+                        const IR *ir) {
+  if (instr->op == IR_PRINT_INT || instr->op == IR_PRINT_STR ||
+      instr->op == IR_INPUT || instr->op == IR_STORE)
+    return true;
+  if (instr->op != IR_DIV)
+    return false;
+  // Dividing by 0, or the lowest number by -1, traps
+  const Site def = defs[instr->args[1]];
+  const IrInstr *divisor = &ir->blocks[def.block].instrs[def.index];
+  return divisor->op != IR_CONST || divisor->value == 0 ||
+         divisor->value == -1;
+}
+
+static void _mark_live(bool *live, IrTemp **worklist, IrTemp temp) {
+  if (!live[temp]) {
+    live[temp] = true;
+    arrput(*worklist, temp);
+  }
+}
+
+// Marks everything an instruction reads as live
+static void _mark_reads(bool *live, IrTemp **worklist, const IrBlock *block,
+                        const IrInstr *instr) {
+  if (instr->op == IR_PHI) {
+    for (uint32_t p = 0; p < block->pred_count; p++) {
+      _mark_live(live, worklist, instr->incoming[p]);
+    }
+    return;
+  }
+  for (uint32_t a = 0; a < ir_opcode_arg_count(instr->op); a++) {
+    _mark_live(live, worklist, instr->args[a]);
+  }
+}
+
+static void _eliminate_dead_code(IR *ir) {
+  Site *defs = NULL;     // stb_ds array, per temporary
+  bool *live = NULL;     // stb_ds array, per temporary
+  IrTemp *worklist = NULL; // stb_ds array
+  arrsetlen(defs, ir->temp_count);
+  arrsetlen(live, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    live[t] = false;
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      if (block->instrs[i].dest != IR_NO_TEMP) {
+        defs[block->instrs[i].dest] = (Site){b, i};
+      }
+    }
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      if (_has_effect(&block->instrs[i], defs, ir)) {
+        _mark_reads(live, &worklist, block, &block->instrs[i]);
+      }
+    }
+    if (block->term.kind == IR_TERM_BRANCH) {
+      _mark_live(live, &worklist, block->term.args[0]);
+      _mark_live(live, &worklist, block->term.args[1]);
+    }
+  }
+  while (arrlenu(worklist)) {
+    const Site def = defs[arrpop(worklist)];
+    const IrBlock *block = &ir->blocks[def.block];
+    _mark_reads(live, &worklist, block, &block->instrs[def.index]);
+  }
+  // Everything is decided before anything moves, since deciding reads
+  // divisors through defs
+  bool *keep = NULL; // stb_ds array, per instruction in layout order
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      arrput(keep, (instr->dest != IR_NO_TEMP && live[instr->dest]) ||
+                       _has_effect(instr, defs, ir));
+    }
+  }
+  uint32_t position = 0;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    IrBlock *block = &ir->blocks[b];
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      if (keep[position++]) {
+        block->instrs[kept++] = block->instrs[i];
+      }
+    }
+    block->instr_count = kept;
+  }
+  arrfree(keep);
+  arrfree(defs);
+  arrfree(live);
+  arrfree(worklist);
+}
+
+// ----------------------
+// Rematerialization
+//
+// Out of SSA form, a constant that's read in other blocks
+// than the one defining it would have to be kept in a
+// register, or on the stack, all the way there. Each
+// block reading it gets its own copy of the constant
+// instead, just before the first read, which frees the
+// register for the values that need it
+// ----------------------
+
+static void _rematerialize_constants(IR *ir) {
+  // Where each temporary is defined, if it's defined once, by a constant
+  IrBlockID *const_block = NULL; // stb_ds array, per temporary
+  uint32_t *def_count = NULL;    // stb_ds array, per temporary
+  int64_t *values = NULL;        // stb_ds array, per temporary
+  const uint32_t temp_count = ir->temp_count;
+  arrsetlen(const_block, temp_count);
+  arrsetlen(def_count, temp_count);
+  arrsetlen(values, temp_count);
+  for (IrTemp t = 0; t < temp_count; t++) {
+    const_block[t] = IR_NO_BLOCK;
+    def_count[t] = 0;
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      if (instr->dest == IR_NO_TEMP)
+        continue;
+      def_count[instr->dest]++;
+      if (instr->op == IR_CONST) {
+        const_block[instr->dest] = b;
+        values[instr->dest] = instr->value;
+      }
+    }
+  }
+  for (IrTemp t = 0; t < temp_count; t++) {
+    if (def_count[t] != 1) {
+      const_block[t] = IR_NO_BLOCK;
+    }
+  }
+
+  // The block's copy of each constant, reset after every block. The counts
+  // are reused for the reads left in the defining block
+  IrTemp *local = NULL; // stb_ds array, per temporary
+  arrsetlen(local, temp_count);
+  for (IrTemp t = 0; t < temp_count; t++) {
+    local[t] = IR_NO_TEMP;
+    def_count[t] = 0;
+  }
+  uint32_t *reads = def_count;
+  IrTemp *copied = NULL; // stb_ds array. Constants copied into the block
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    IrBlock *block = &ir->blocks[b];
+    IrInstr *instrs = NULL; // stb_ds array. The block, rebuilt
+    for (uint32_t i = 0; i <= block->instr_count; i++) {
+      const bool is_term = i == block->instr_count;
+      IrInstr instr = is_term ? (IrInstr){.op = IR_OPCODE_COUNT}
+                              : block->instrs[i];
+      const uint32_t arg_count =
+          is_term ? (block->term.kind == IR_TERM_BRANCH ? 2 : 0)
+                  : ir_opcode_arg_count(instr.op);
+      IrTemp *args = is_term ? block->term.args : instr.args;
+      for (uint32_t a = 0; a < arg_count; a++) {
+        const IrTemp arg = args[a];
+        if (const_block[arg] == IR_NO_BLOCK)
+          continue;
+        if (const_block[arg] == b) {
+          reads[arg]++;
+          continue;
+        }
+        if (local[arg] == IR_NO_TEMP) {
+          local[arg] = ir_new_temp(ir);
+          arrput(copied, arg);
+          arrput(instrs, ((IrInstr){.op = IR_CONST,
+                                    .dest = local[arg],
+                                    .args = {IR_NO_TEMP, IR_NO_TEMP,
+                                             IR_NO_TEMP},
+                                    .value = values[arg]}));
+        }
+        args[a] = local[arg];
+      }
+      if (!is_term) {
+        arrput(instrs, instr);
+      }
+    }
+    const uint32_t count = (uint32_t)arrlenu(instrs);
+    if (count != block->instr_count) {
+      block->instrs = arena_alloc(&ir->arena, count * sizeof(*instrs));
+      block->instr_count = count;
+      block->instr_capacity = count;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      block->instrs[i] = instrs[i];
+    }
+    while (arrlenu(copied)) {
+      local[arrpop(copied)] = IR_NO_TEMP;
+    }
+    arrfree(instrs);
+  }
+  // Constants nothing reads where they're defined anymore go
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    IrBlock *block = &ir->blocks[b];
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrTemp dest = block->instrs[i].dest;
+      if (dest < temp_count && const_block[dest] != IR_NO_BLOCK &&
+          reads[dest] == 0)
+        continue;
+      block->instrs[kept++] = block->instrs[i];
+    }
+    block->instr_count = kept;
+  }
+  arrfree(copied);
+  arrfree(local);
+  arrfree(def_count);
+  arrfree(values);
+  arrfree(const_block);
+}
+
+// ----------------------
+// Loop-Invariant Code Motion
+//
+// Computations in a loop whose arguments are all defined
+// outside of it give the same value on every iteration,
+// so they're moved to the end of the loop's preheader.
+// Loops are visited innermost first, so a computation can
+// move out of several loops in turn. Only computations
+// that can't trap move, since the loop might not have
+// reached them
+// ----------------------
+
+// Whether an instruction can run early without changing what the program
+// does
+static bool _can_hoist(const IrInstr *instr, const bool *constant,
+                       const int64_t *values) {
+  if (instr->op == IR_CONST || instr->op == IR_COPY)
+    return true;
+  if (!_is_computation(instr->op))
+    return false;
+  if (instr->op != IR_DIV)
+    return true;
+  const IrTemp divisor = instr->args[1];
+  return constant[divisor] && values[divisor] != 0 && values[divisor] != -1;
+}
+
+// The only block outside the loop that jumps to its header, if it's a plain
+// jump. IR_NO_BLOCK otherwise
+static IrBlockID _preheader(const IR *ir, IrBlockID header,
+                            const IrBlockID *in_loop) {
+  const IrBlock *block = &ir->blocks[header];
+  IrBlockID preheader = IR_NO_BLOCK;
+  for (uint32_t p = 0; p < block->pred_count; p++) {
+    const IrBlockID pred = block->preds[p];
+    if (in_loop[pred] == header + 1)
+      continue;
+    if (preheader != IR_NO_BLOCK ||
+        ir->blocks[pred].term.kind != IR_TERM_JUMP)
+      return IR_NO_BLOCK;
+    preheader = pred;
+  }
+  return preheader;
+}
+
+static void _hoist_invariants(IR *ir) {
+  IrDominators doms = ir_dominators_compute(ir);
+  uint32_t *depths = ir_loop_depths(ir, &doms);
+  IrBlockID *def_block = NULL; // stb_ds array, per temporary
+  bool *constant = NULL;       // stb_ds array, per temporary
+  int64_t *values = NULL;      // stb_ds array, per temporary
+  arrsetlen(def_block, ir->temp_count);
+  arrsetlen(constant, ir->temp_count);
+  arrsetlen(values, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    def_block[t] = IR_NO_BLOCK;
+    constant[t] = false;
+    values[t] = 0;
+  }
+  IrBlockID *headers = NULL; // stb_ds array
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      if (instr->dest == IR_NO_TEMP)
+        continue;
+      def_block[instr->dest] = b;
+      constant[instr->dest] = instr->op == IR_CONST;
+      values[instr->dest] = instr->value;
+    }
+    for (uint32_t p = 0; p < block->pred_count; p++) {
+      if (ir_dominates(&doms, b, block->preds[p])) {
+        arrput(headers, b);
+        break;
+      }
+    }
+  }
+  // Innermost first. Headers are few, so a simple sort will do
+  const uint32_t header_count = (uint32_t)arrlenu(headers);
+  for (uint32_t i = 1; i < header_count; i++) {
+    for (uint32_t j = i; j > 0 && depths[headers[j]] > depths[headers[j - 1]];
+         j--) {
+      const IrBlockID swap = headers[j];
+      headers[j] = headers[j - 1];
+      headers[j - 1] = swap;
+    }
+  }
+
+  // Blocks are marked with the header of the loop they were last found in,
+  // plus one
+  IrBlockID *in_loop = NULL; // stb_ds array
+  IrBlockID *stack = NULL;   // stb_ds array
+  arrsetlen(in_loop, ir->block_count);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    in_loop[b] = 0;
+  }
+  for (uint32_t h = 0; h < header_count; h++) {
+    const IrBlockID header = headers[h];
+    const IrBlockID mark = header + 1;
+    const IrBlock *header_block = &ir->blocks[header];
+    in_loop[header] = mark;
+    for (uint32_t p = 0; p < header_block->pred_count; p++) {
+      if (ir_dominates(&doms, header, header_block->preds[p])) {
+        arrput(stack, header_block->preds[p]);
+      }
+    }
+    while (arrlenu(stack)) {
+      const IrBlockID member = arrpop(stack);
+      if (in_loop[member] == mark)
+        continue;
+      in_loop[member] = mark;
+      const IrBlock *member_block = &ir->blocks[member];
+      for (uint32_t p = 0; p < member_block->pred_count; p++) {
+        arrput(stack, member_block->preds[p]);
+      }
+    }
+    const IrBlockID preheader = _preheader(ir, header, in_loop);
+    if (preheader == IR_NO_BLOCK)
+      continue;
+    // Dominators come first, so whatever an instruction reads that can move
+    // has already moved
+    const uint32_t first = doms.tree_first[header];
+    for (uint32_t d = first; d < doms.tree_end[header]; d++) {
+      const IrBlockID b = doms.preorder[d];
+      if (in_loop[b] != mark)
+        continue;
+      IrBlock *block = &ir->blocks[b];
+      uint32_t kept = 0;
+      for (uint32_t i = 0; i < block->instr_count; i++) {
+        const IrInstr instr = block->instrs[i];
+        bool invariant = _can_hoist(&instr, constant, values);
+        for (uint32_t a = 0; invariant && a < ir_opcode_arg_count(instr.op);
+             a++) {
+          invariant = in_loop[def_block[instr.args[a]]] != mark;
+        }
+        if (!invariant) {
+          block->instrs[kept++] = instr;
+          continue;
+        }
+        *ir_append(ir, preheader, instr.op) = instr;
+        def_block[instr.dest] = preheader;
+      }
+      block->instr_count = kept;
+    }
+  }
+  arrfree(stack);
+  arrfree(in_loop);
+  arrfree(headers);
+  arrfree(values);
+  arrfree(constant);
+  arrfree(def_block);
+  arrfree(depths);
+  ir_dominators_destroy(&doms);
+}
+
+// ----------------------
+// Counted Loops
+//
+// A rotated loop that's a single block, and steps a
+// counter by a constant until it passes a bound, is a
+// counted loop. Products of the counter and a constant
+// become counters of their own, stepped by an add every
+// iteration instead. When the counter starts and stops at
+// constants, the number of iterations is known. A loop
+// that only adds up values which change by a constant
+// every iteration is then replaced by the closed forms of
+// its sums. Otherwise its body is copied so each
+// iteration runs it several times and only tests once,
+// with the iterations left over peeled off in front of
+// it, or all of them if there are only a few. Every
+// formula wraps around like the arithmetic it replaces
+// ----------------------
+
+// Bodies are only copied while the copies come to no more instructions than
+// this
+#define UNROLL_MAX_INSTRS 64
+
+// A value that's scale * temp + offset + stride * k on the kth iteration,
+// added to the value of the phi sum then if there is one. temp is defined
+// outside the loop, or IR_NO_TEMP with a scale of 0
+typedef struct {
+  bool known;
+  IrTemp temp;
+  int64_t scale;
+  int64_t offset;
+  int64_t stride;
+  IrTemp sum;
+} Affine;
+
+// A phi that adds the same affine value to itself every iteration
+typedef struct {
+  IrTemp phi;
+  IrTemp start; // The phi's value from the preheader
+  Affine addend;
+} Accumulator;
+
+typedef struct {
+  IR *ir;
+  uint32_t unroll_factor;
+  Site *defs;      // stb_ds array, per temporary
+  bool *constant;  // stb_ds array, per temporary
+  int64_t *values; // stb_ds array, per temporary
+  bool *escapes;   // stb_ds array, per temporary. Read outside of its block
+  IrTemp *replace; // stb_ds array, per temporary. Applied once every loop is
+                   // done
+  Affine *forms;   // stb_ds array, per temporary the loop defines
+  // The loop being optimized
+  IrBlockID loop;
+  IrBlockID preheader;
+  IrBlockID exit;
+  uint32_t entry; // The preheader's index in the loop's predecessors
+  uint32_t latch; // The loop's own
+  uint32_t phi_count;
+  uint32_t body_count; // Instructions after the phis
+} LoopOptimizer;
+
+static const Affine UNKNOWN_AFFINE = {.known = false,
+                                      .temp = IR_NO_TEMP,
+                                      .scale = 0,
+                                      .offset = 0,
+                                      .stride = 0,
+                                      .sum = IR_NO_TEMP};
+
+static int64_t _wrap_add(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+
+static int64_t _wrap_mul(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a * (uint64_t)b);
+}
+
+static Affine _constant_affine(int64_t value) {
+  return (Affine){.known = true,
+                  .temp = IR_NO_TEMP,
+                  .scale = 0,
+                  .offset = value,
+                  .stride = 0,
+                  .sum = IR_NO_TEMP};
+}
+
+static bool _is_constant_affine(const Affine *form) {
+  return form->known && form->temp == IR_NO_TEMP && form->stride == 0 &&
+         form->sum == IR_NO_TEMP;
+}
+
+// Drops the temporary from a form it's been scaled out of
+static Affine _normalized(Affine form) {
+  if (form.scale == 0) {
+    form.temp = IR_NO_TEMP;
+  }
+  return form;
+}
+
+// a + sign * b. A sum can only be added once
+static Affine _affine_add(Affine a, Affine b, int64_t sign) {
+  if (!a.known || !b.known ||
+      (a.temp != IR_NO_TEMP && b.temp != IR_NO_TEMP && a.temp != b.temp) ||
+      (b.sum != IR_NO_TEMP && (sign != 1 || a.sum != IR_NO_TEMP)))
+    return UNKNOWN_AFFINE;
+  return _normalized(
+      (Affine){.known = true,
+               .temp = a.temp != IR_NO_TEMP ? a.temp : b.temp,
+               .scale = _wrap_add(a.scale, _wrap_mul(sign, b.scale)),
+               .offset = _wrap_add(a.offset, _wrap_mul(sign, b.offset)),
+               .stride = _wrap_add(a.stride, _wrap_mul(sign, b.stride)),
+               .sum = a.sum != IR_NO_TEMP ? a.sum : b.sum});
+}
+
+static Affine _affine_scale(Affine form, int64_t factor) {
+  if (!form.known || (form.sum != IR_NO_TEMP && factor != 1))
+    return UNKNOWN_AFFINE;
+  form.scale = _wrap_mul(form.scale, factor);
+  form.offset = _wrap_mul(form.offset, factor);
+  form.stride = _wrap_mul(form.stride, factor);
+  return _normalized(form);
+}
+
+static Affine _affine_of(const LoopOptimizer *o, IrTemp temp) {
+  if (o->defs[temp].block == o->loop)
+    return o->forms[temp];
+  if (o->constant[temp])
+    return _constant_affine(o->values[temp]);
+  return (Affine){.known = true,
+                  .temp = temp,
+                  .scale = 1,
+                  .offset = 0,
+                  .stride = 0,
+                  .sum = IR_NO_TEMP};
+}
+
+static Affine _instr_affine(const LoopOptimizer *o, const IrInstr *instr) {
+  switch (instr->op) {
+  case IR_CONST:
+    return _constant_affine(instr->value);
+  case IR_COPY:
+    return _affine_of(o, instr->args[0]);
+  case IR_NEG:
+    return _affine_scale(_affine_of(o, instr->args[0]), -1);
+  case IR_ADD:
+    return _affine_add(_affine_of(o, instr->args[0]),
+                       _affine_of(o, instr->args[1]), 1);
+  case IR_SUB:
+    return _affine_add(_affine_of(o, instr->args[0]),
+                       _affine_of(o, instr->args[1]), -1);
+  case IR_MUL: {
+    const Affine left = _affine_of(o, instr->args[0]);
+    const Affine right = _affine_of(o, instr->args[1]);
+    if (_is_constant_affine(&right))
+      return _affine_scale(left, right.offset);
+    if (_is_constant_affine(&left))
+      return _affine_scale(right, left.offset);
+    return UNKNOWN_AFFINE;
+  }
+  case IR_LOAD:
+  case IR_STORE:
+  case IR_PHI:
+  case IR_DIV:
+  case IR_COMPARE:
+  case IR_SELECT:
+  case IR_PRINT_INT:
+  case IR_PRINT_STR:
+  case IR_INPUT:
+  case IR_OPCODE_COUNT:
+    break;
+  }
+  return UNKNOWN_AFFINE;
+}
+
+// Whether the block is a loop that only branches back to itself, entered
+// from a preheader that jumps to it. Fills in the loop's blocks if it is
+static bool _find_loop(LoopOptimizer *o, IrBlockID b) {
+  const IrBlock *block = &o->ir->blocks[b];
+  const IrTerminator *term = &block->term;
+  if (term->kind != IR_TERM_BRANCH || block->pred_count != 2 ||
+      term->targets[0] == term->targets[1] ||
+      (term->targets[0] != b && term->targets[1] != b))
+    return false;
+  o->loop = b;
+  o->latch = block->preds[0] == b ? 0 : 1;
+  o->entry = 1 - o->latch;
+  o->preheader = block->preds[o->entry];
+  o->exit = term->targets[term->targets[0] == b ? 1 : 0];
+  if (block->preds[o->latch] != b || o->preheader == b ||
+      o->exit == o->preheader ||
+      o->ir->blocks[o->preheader].term.kind != IR_TERM_JUMP)
+    return false;
+  o->phi_count = 0;
+  while (o->phi_count < block->instr_count &&
+         block->instrs[o->phi_count].op == IR_PHI) {
+    o->phi_count++;
+  }
+  o->body_count = block->instr_count - o->phi_count;
+  return true;
+}
+
+// Finds the phis that step by a constant every iteration, and works out the
+// form of every value the loop computes from them. Every other phi is taken
+// to be a sum, for _sum_closed_form to check
+static void _find_forms(LoopOptimizer *o) {
+  const IrBlock *block = &o->ir->blocks[o->loop];
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    if (block->instrs[i].dest != IR_NO_TEMP) {
+      o->forms[block->instrs[i].dest] = UNKNOWN_AFFINE;
+    }
+  }
+  for (uint32_t i = 0; i < o->phi_count; i++) {
+    const IrInstr *phi = &block->instrs[i];
+    Affine *form = &o->forms[phi->dest];
+    *form = _constant_affine(0);
+    form->sum = phi->dest;
+    const IrTemp next = phi->incoming[o->latch];
+    if (o->defs[next].block != o->loop)
+      continue;
+    const IrInstr *update = &block->instrs[o->defs[next].index];
+    IrTemp step = IR_NO_TEMP;
+    int64_t sign = 1;
+    if (update->op == IR_ADD && update->args[0] == phi->dest) {
+      step = update->args[1];
+    } else if (update->op == IR_ADD && update->args[1] == phi->dest) {
+      step = update->args[0];
+    } else if (update->op == IR_SUB && update->args[0] == phi->dest) {
+      step = update->args[1];
+      sign = -1;
+    }
+    if (step == IR_NO_TEMP || !o->constant[step] || o->values[step] == 0)
+      continue;
+    *form = _affine_of(o, phi->incoming[o->entry]);
+    form->stride = _wrap_mul(sign, o->values[step]);
+  }
+  for (uint32_t i = o->phi_count; i < block->instr_count; i++) {
+    if (block->instrs[i].dest != IR_NO_TEMP) {
+      o->forms[block->instrs[i].dest] = _instr_affine(o, &block->instrs[i]);
+    }
+  }
+}
+
+// How many steps of step a counter takes to get distance past where it
+// starts, overshooting by no more than room
+static bool _steps_to_pass(uint64_t distance, uint64_t step, uint64_t room,
+                           uint64_t *steps) {
+  *steps = distance / step + (distance % step != 0);
+  return (step - distance % step) % step <= room;
+}
+
+// How many times the body of a loop runs when it goes on while
+// start + step * k cond bound holds after the kth time. Fails when that can't
+// be worked out, including when the counter would wrap around first
+static bool _trip_count(IrCondition cond, int64_t start, int64_t step,
+                        int64_t bound, uint64_t *trips) {
+  const uint64_t below = (uint64_t)bound - (uint64_t)start;
+  const uint64_t above = (uint64_t)start - (uint64_t)bound;
+  const uint64_t up = (uint64_t)step;
+  const uint64_t down = 0 - (uint64_t)step;
+  uint64_t steps = 0;
+  bool known = false;
+  switch (cond) {
+  case IR_COND_EQ:
+    steps = start == bound;
+    known = true;
+    break;
+  case IR_COND_NE:
+    if (step > 0 && bound >= start && below % up == 0) {
+      steps = below / up;
+      known = true;
+    } else if (step < 0 && bound <= start && above % down == 0) {
+      steps = above / down;
+      known = true;
+    }
+    break;
+  case IR_COND_LE:
+    return bound != INT64_MAX &&
+           _trip_count(IR_COND_LT, start, step, bound + 1, trips);
+  case IR_COND_GE:
+    return bound != INT64_MIN &&
+           _trip_count(IR_COND_GT, start, step, bound - 1, trips);
+  case IR_COND_LT:
+    if (start >= bound) {
+      known = true;
+    } else if (step > 0) {
+      known = _steps_to_pass(below, up, (uint64_t)INT64_MAX - (uint64_t)bound,
+                             &steps);
+    }
+    break;
+  case IR_COND_GT:
+    if (start <= bound) {
+      known = true;
+    } else if (step < 0) {
+      known = _steps_to_pass(above, down, (uint64_t)bound - (uint64_t)INT64_MIN,
+                             &steps);
+    }
+    break;
+  case IR_COND_COUNT:
+    break;
+  }
+  if (!known || steps == UINT64_MAX)
+    return false;
+  *trips = steps + 1;
+  return true;
+}
+
+// How many times the loop's body runs, or 0 when that isn't known
+static uint64_t _loop_trips(const LoopOptimizer *o) {
+  const IrTerminator *term = &o->ir->blocks[o->loop].term;
+  IrCondition cond = term->targets[0] == o->loop
+                         ? term->cond
+                         : ir_condition_negate(term->cond);
+  Affine counter = _affine_of(o, term->args[0]);
+  Affine bound = _affine_of(o, term->args[1]);
+  if (_is_constant_affine(&counter)) {
+    const Affine swap = counter;
+    counter = bound;
+    bound = swap;
+    cond = ir_condition_swap(cond);
+  }
+  if (!counter.known || counter.temp != IR_NO_TEMP || counter.stride == 0 ||
+      counter.sum != IR_NO_TEMP || !_is_constant_affine(&bound))
+    return 0;
+  uint64_t trips = 0;
+  if (!_trip_count(cond, counter.offset, counter.stride, bound.offset, &trips))
+    return 0;
+  return trips;
+}
+
+static IrTemp _new_temp(LoopOptimizer *o) {
+  arrput(o->replace, IR_NO_TEMP);
+  arrput(o->escapes, false);
+  return ir_new_temp(o->ir);
+}
+
+static IrTemp _emit(LoopOptimizer *o, IrBlockID b, IrOpcode op, IrTemp left,
+                    IrTemp right) {
+  const IrTemp dest = _new_temp(o);
+  IrInstr *instr = ir_append(o->ir, b, op);
+  instr->dest = dest;
+  instr->args[0] = left;
+  instr->args[1] = right;
+  return dest;
+}
+
+static IrTemp _emit_constant(LoopOptimizer *o, IrBlockID b, int64_t value) {
+  const IrTemp dest = _new_temp(o);
+  IrInstr *instr = ir_append(o->ir, b, IR_CONST);
+  instr->dest = dest;
+  instr->value = value;
+  return dest;
+}
+
+// Emits scale * temp + offset at the end of a block
+static IrTemp _emit_linear(LoopOptimizer *o, IrBlockID b, IrTemp temp,
+                           int64_t scale, int64_t offset) {
+  if (temp == IR_NO_TEMP || scale == 0)
+    return _emit_constant(o, b, offset);
+  IrTemp result = temp;
+  if (scale != 1) {
+    const IrTemp factor = _emit_constant(o, b, scale);
+    result = _emit(o, b, IR_MUL, result, factor);
+  }
+  if (offset != 0) {
+    const IrTemp addend = _emit_constant(o, b, offset);
+    result = _emit(o, b, IR_ADD, result, addend);
+  }
+  return result;
+}
+
+// The sum of an addend's values on the first count iterations
+static Affine _sum_affine(const Affine *addend, uint64_t count) {
+  // The sum of every k below count, halving whichever factor is even so it's
+  // right modulo 2^64
+  const uint64_t pairs = count % 2 == 0 ? count / 2 * (count - 1)
+                                        : (count - 1) / 2 * count;
+  const int64_t n = (int64_t)count;
+  return _normalized(
+      (Affine){.known = true,
+               .temp = addend->temp,
+               .scale = _wrap_mul(addend->scale, n),
+               .offset = _wrap_add(_wrap_mul(addend->offset, n),
+                                   _wrap_mul(addend->stride, (int64_t)pairs)),
+               .stride = 0,
+               .sum = IR_NO_TEMP});
+}
+
+// Emits a value's form on the last of trips iterations into the preheader
+static IrTemp _emit_last(LoopOptimizer *o, const Affine *form,
+                         const Accumulator *sums, uint64_t trips) {
+  Affine total = *form;
+  total.offset =
+      _wrap_add(form->offset, _wrap_mul(form->stride, (int64_t)(trips - 1)));
+  total.stride = 0;
+  total.sum = IR_NO_TEMP;
+  IrTemp apart = IR_NO_TEMP; // What doesn't fold into total
+  if (form->sum != IR_NO_TEMP) {
+    uint32_t s = 0;
+    while (sums[s].phi != form->sum) {
+      s++;
+    }
+    // What the sum started at, plus everything added before the last
+    // iteration
+    const Affine pieces[2] = {_affine_of(o, sums[s].start),
+                              _sum_affine(&sums[s].addend, trips - 1)};
+    for (uint32_t p = 0; p < 2; p++) {
+      const Affine merged = _affine_add(total, pieces[p], 1);
+      if (merged.known) {
+        total = merged;
+        continue;
+      }
+      const IrTemp piece = _emit_linear(o, o->preheader, pieces[p].temp,
+                                        pieces[p].scale, pieces[p].offset);
+      apart = apart == IR_NO_TEMP
+                  ? piece
+                  : _emit(o, o->preheader, IR_ADD, apart, piece);
+    }
+  }
+  if (apart != IR_NO_TEMP && total.temp == IR_NO_TEMP && total.offset == 0)
+    return apart;
+  const IrTemp result =
+      _emit_linear(o, o->preheader, total.temp, total.scale, total.offset);
+  return apart == IR_NO_TEMP ? result
+                             : _emit(o, o->preheader, IR_ADD, apart, result);
+}
+
+// Chains of replacements come from loops that read what an earlier one left
+static IrTemp _replacement(const LoopOptimizer *o, IrTemp temp) {
+  while (o->replace[temp] != IR_NO_TEMP) {
+    temp = o->replace[temp];
+  }
+  return temp;
+}
+
+// An unrolled loop keeps reading the first copy of its own values, which are
+// only replaced after it
+static IrTemp _replacement_in(const LoopOptimizer *o, IrBlockID b,
+                              IrTemp temp) {
+  if (temp < arrlenu(o->defs) && o->defs[temp].block == b)
+    return temp;
+  return _replacement(o, temp);
+}
+
+// Makes the preheader jump straight to the exit, leaving the loop unreachable
+static void _bypass_loop(LoopOptimizer *o) {
+  IR *ir = o->ir;
+  IrBlock *exit = &ir->blocks[o->exit];
+  for (uint32_t p = 0; p < exit->pred_count; p++) {
+    if (exit->preds[p] == o->loop) {
+      exit->preds[p] = o->preheader;
+    }
+  }
+  ir->blocks[o->preheader].term.targets[0] = o->exit;
+  IrBlock *loop = &ir->blocks[o->loop];
+  loop->instr_count = 0;
+  loop->pred_count = 0;
+  loop->term = (IrTerminator){.kind = IR_TERM_EXIT,
+                              .args = {IR_NO_TEMP, IR_NO_TEMP},
+                              .targets = {IR_NO_BLOCK, IR_NO_BLOCK}};
+}
+
+// Replaces the loop with the closed forms of the values read after it, if all
+// it does is step counters and add up values that change by a constant every
+// iteration. Returns whether it did
+static bool _sum_closed_form(LoopOptimizer *o, uint64_t trips) {
+  const IrBlock *block = &o->ir->blocks[o->loop];
+  Accumulator *sums = NULL; // stb_ds array
+  bool closed = true;
+  for (uint32_t i = 0; closed && i < block->instr_count; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    if (instr->op == IR_DIV ||
+        (!_is_computation(instr->op) && instr->op != IR_CONST &&
+         instr->op != IR_COPY && instr->op != IR_PHI)) {
+      closed = false;
+      continue;
+    }
+    if (instr->op != IR_PHI || o->forms[instr->dest].sum != instr->dest)
+      continue;
+    Affine addend = _affine_of(o, instr->incoming[o->latch]);
+    closed = addend.known && addend.sum == instr->dest;
+    addend.sum = IR_NO_TEMP;
+    arrput(sums, ((Accumulator){.phi = instr->dest,
+                                .start = instr->incoming[o->entry],
+                                .addend = addend}));
+  }
+  // Every value read after the loop needs a closed form
+  for (uint32_t i = 0; closed && i < block->instr_count; i++) {
+    const IrTemp dest = block->instrs[i].dest;
+    closed = dest == IR_NO_TEMP || !o->escapes[dest] || o->forms[dest].known;
+  }
+  if (!closed) {
+    arrfree(sums);
+    return false;
+  }
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    const IrTemp dest = o->ir->blocks[o->loop].instrs[i].dest;
+    if (dest != IR_NO_TEMP && o->escapes[dest]) {
+      // Emitting grows replace
+      const IrTemp last = _emit_last(o, &o->forms[dest], sums, trips);
+      o->replace[dest] = last;
+    }
+  }
+  _bypass_loop(o);
+  arrfree(sums);
+  return true;
+}
+
+// Gives every product of a counter and a constant in the loop its own
+// counter, stepped by an add instead. Returns whether there were any
+static bool _reduce_strength(LoopOptimizer *o) {
+  IR *ir = o->ir;
+  IrTemp *products = NULL; // stb_ds array
+  const IrBlock *block = &ir->blocks[o->loop];
+  for (uint32_t i = o->phi_count; i < block->instr_count; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    const Affine *form = &o->forms[instr->dest];
+    if (instr->op == IR_MUL && form->known && form->stride != 0 &&
+        form->sum == IR_NO_TEMP) {
+      arrput(products, instr->dest);
+    }
+  }
+  const uint32_t product_count = (uint32_t)arrlenu(products);
+  for (uint32_t p = 0; p < product_count; p++) {
+    const Affine form = o->forms[products[p]];
+    const IrTemp start =
+        _emit_linear(o, o->preheader, form.temp, form.scale, form.offset);
+    const IrTemp step = _emit_constant(o, o->preheader, form.stride);
+    const IrTemp counter = _new_temp(o);
+    const IrTemp next = _emit(o, o->loop, IR_ADD, counter, step);
+    IrInstr *phi = ir_insert(ir, o->loop, 0, IR_PHI);
+    phi->dest = counter;
+    phi->incoming = arena_alloc(&ir->arena, 2 * sizeof(*phi->incoming));
+    phi->incoming[o->entry] = start;
+    phi->incoming[o->latch] = next;
+    o->replace[products[p]] = counter;
+  }
+  o->phi_count += product_count;
+  o->body_count += product_count;
+  // The products themselves are left for dead code elimination
+  IrBlock *loop = &ir->blocks[o->loop];
+  for (uint32_t i = 0; product_count && i < loop->instr_count; i++) {
+    IrInstr *instr = &loop->instrs[i];
+    if (instr->op == IR_PHI) {
+      instr->incoming[o->latch] =
+          _replacement(o, instr->incoming[o->latch]);
+      continue;
+    }
+    for (uint32_t a = 0; a < ir_opcode_arg_count(instr->op); a++) {
+      instr->args[a] = _replacement(o, instr->args[a]);
+    }
+  }
+  if (product_count && loop->term.kind == IR_TERM_BRANCH) {
+    loop->term.args[0] = _replacement(o, loop->term.args[0]);
+    loop->term.args[1] = _replacement(o, loop->term.args[1]);
+  }
+  arrfree(products);
+  return product_count != 0;
+}
+
+// Appends a copy of the loop's body to a block. current holds each phi's
+// value going into the copy, and is left holding its value coming out.
+// renamed is left mapping the loop's temporaries to the copy's
+static void _copy_body(LoopOptimizer *o, IrBlockID to, IrTemp *current,
+                       IrTemp *renamed) {
+  IR *ir = o->ir;
+  for (uint32_t p = 0; p < o->phi_count; p++) {
+    renamed[ir->blocks[o->loop].instrs[p].dest] = current[p];
+  }
+  for (uint32_t i = o->phi_count; i < o->phi_count + o->body_count; i++) {
+    IrInstr copy = ir->blocks[o->loop].instrs[i];
+    for (uint32_t a = 0; a < ir_opcode_arg_count(copy.op); a++) {
+      copy.args[a] = _resolve(renamed, copy.args[a]);
+    }
+    if (copy.dest != IR_NO_TEMP) {
+      const IrTemp fresh = _new_temp(o);
+      renamed[copy.dest] = fresh;
+      copy.dest = fresh;
+    }
+    *ir_append(ir, to, copy.op) = copy;
+  }
+  for (uint32_t p = 0; p < o->phi_count; p++) {
+    current[p] =
+        _resolve(renamed, ir->blocks[o->loop].instrs[p].incoming[o->latch]);
+  }
+}
+
+// Points the reads after the loop of every value it defines at the copy in
+// renamed
+static void _replace_escaping(LoopOptimizer *o, const IrTemp *renamed) {
+  const IrBlock *block = &o->ir->blocks[o->loop];
+  for (uint32_t i = 0; i < o->phi_count + o->body_count; i++) {
+    const IrTemp dest = block->instrs[i].dest;
+    if (dest != IR_NO_TEMP && o->escapes[dest]) {
+      o->replace[dest] = _resolve(renamed, dest);
+    }
+  }
+}
+
+// Copies the body trips times into the preheader, in place of the loop when
+// peel_all is set, or else the iterations left over by the unroll factor in
+// front of it, and the rest into the loop so each iteration runs it that
+// many times
+static void _unroll(LoopOptimizer *o, uint64_t trips, bool peel_all) {
+  IR *ir = o->ir;
+  const uint32_t factor = o->unroll_factor;
+  IrTemp *renamed = NULL; // stb_ds array, per temporary
+  IrTemp *current = NULL; // stb_ds array, per phi
+  arrsetlen(renamed, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    renamed[t] = IR_NO_TEMP;
+  }
+  arrsetlen(current, o->phi_count);
+  for (uint32_t p = 0; p < o->phi_count; p++) {
+    current[p] = ir->blocks[o->loop].instrs[p].incoming[o->entry];
+  }
+  const uint64_t peeled = peel_all ? trips : trips % factor;
+  for (uint64_t k = 0; k < peeled; k++) {
+    _copy_body(o, o->preheader, current, renamed);
+  }
+  if (peel_all) {
+    _replace_escaping(o, renamed);
+    _bypass_loop(o);
+    arrfree(current);
+    arrfree(renamed);
+    return;
+  }
+  // The loop's own instructions are the first copy
+  for (uint32_t p = 0; p < o->phi_count; p++) {
+    IrInstr *phi = &ir->blocks[o->loop].instrs[p];
+    phi->incoming[o->entry] = current[p];
+    current[p] = phi->incoming[o->latch];
+  }
+  for (uint32_t c = 1; c < factor; c++) {
+    _copy_body(o, o->loop, current, renamed);
+  }
+  IrBlock *loop = &ir->blocks[o->loop];
+  for (uint32_t p = 0; p < o->phi_count; p++) {
+    loop->instrs[p].incoming[o->latch] = current[p];
+  }
+  loop->term.args[0] = _resolve(renamed, loop->term.args[0]);
+  loop->term.args[1] = _resolve(renamed, loop->term.args[1]);
+  _replace_escaping(o, renamed);
+  arrfree(current);
+  arrfree(renamed);
+}
+
+// Returns whether any loop changed
+static bool _optimize_counted_loops(IR *ir, uint32_t unroll_factor) {
+  LoopOptimizer o = {.ir = ir,
+                     .unroll_factor = unroll_factor,
+                     .defs = NULL,
+                     .constant = NULL,
+                     .values = NULL,
+                     .escapes = NULL,
+                     .replace = NULL,
+                     .forms = NULL};
+  arrsetlen(o.defs, ir->temp_count);
+  arrsetlen(o.constant, ir->temp_count);
+  arrsetlen(o.values, ir->temp_count);
+  arrsetlen(o.escapes, ir->temp_count);
+  arrsetlen(o.replace, ir->temp_count);
+  arrsetlen(o.forms, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    o.defs[t] = (Site){IR_NO_BLOCK, 0};
+    o.constant[t] = false;
+    o.values[t] = 0;
+    o.escapes[t] = false;
+    o.replace[t] = IR_NO_TEMP;
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      if (instr->dest == IR_NO_TEMP)
+        continue;
+      o.defs[instr->dest] = (Site){b, i};
+      o.constant[instr->dest] = instr->op == IR_CONST;
+      o.values[instr->dest] = instr->op == IR_CONST ? instr->value : 0;
+    }
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      const uint32_t read_count = instr->op == IR_PHI
+                                      ? block->pred_count
+                                      : ir_opcode_arg_count(instr->op);
+      for (uint32_t a = 0; a < read_count; a++) {
+        const IrTemp read =
+            instr->op == IR_PHI ? instr->incoming[a] : instr->args[a];
+        o.escapes[read] |= o.defs[read].block != b;
+      }
+    }
+    if (block->term.kind == IR_TERM_BRANCH) {
+      for (uint32_t a = 0; a < 2; a++) {
+        o.escapes[block->term.args[a]] |=
+            o.defs[block->term.args[a]].block != b;
+      }
+    }
+  }
+
+  bool changed = false;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    if (!_find_loop(&o, b))
+      continue;
+    _find_forms(&o);
+    const uint64_t trips = _loop_trips(&o);
+    if (trips && _sum_closed_form(&o, trips)) {
+      changed = true;
+      continue;
+    }
+    const bool unrolls = trips && unroll_factor > 1 && o.body_count;
+    if (unrolls && trips <= UNROLL_MAX_INSTRS / o.body_count) {
+      _unroll(&o, trips, true);
+      changed = true;
+      continue;
+    }
+    changed |= _reduce_strength(&o);
+    if (unrolls && o.body_count * unroll_factor <= UNROLL_MAX_INSTRS) {
+      _unroll(&o, trips, false);
+      changed = true;
+    }
+  }
+
+  if (changed) {
+    for (IrBlockID b = 0; b < ir->block_count; b++) {
+      IrBlock *block = &ir->blocks[b];
+      for (uint32_t i = 0; i < block->instr_count; i++) {
+        IrInstr *instr = &block->instrs[i];
+        if (instr->op == IR_PHI) {
+          for (uint32_t p = 0; p < block->pred_count; p++) {
+            instr->incoming[p] = _replacement_in(&o, b, instr->incoming[p]);
+          }
+          continue;
+        }
+        for (uint32_t a = 0; a < ir_opcode_arg_count(instr->op); a++) {
+          instr->args[a] = _replacement_in(&o, b, instr->args[a]);
+        }
+      }
+      if (block->term.kind == IR_TERM_BRANCH) {
+        block->term.args[0] = _replacement_in(&o, b, block->term.args[0]);
+        block->term.args[1] = _replacement_in(&o, b, block->term.args[1]);
+      }
+    }
+  }
+  arrfree(o.defs);
+  arrfree(o.constant);
+  arrfree(o.values);
+  arrfree(o.escapes);
+  arrfree(o.replace);
+  arrfree(o.forms);
+  return changed;
+}
+
+// ----------------------
+// Loop Rotation
+//
+// A loop whose header tests its condition and whose
+// latches jump back to it takes two branches every
+// iteration. Each latch gets its own copy of the header
+// instead, so it tests the condition itself and branches
+// straight back into the body. The header is left in
+// front of the loop as a guard, entering it through a new
+// preheader that's empty until code is hoisted into it
+// ----------------------
+
+// Headers with more instructions than this aren't copied
+#define ROTATE_MAX_INSTRS 32
+
+typedef struct {
+  IrBlockID header;
+  IrBlockID body;       // The header's target inside the loop
+  IrBlockID *latches;   // stb_ds array
+} Rotation;
+
+// Whether every temporary the block defines is only mentioned in it, so a
+// copy of it can use new ones
+static bool _defines_only_local(const IrBlock *block, const IrBlockID *home) {
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    const IrTemp dest = block->instrs[i].dest;
+    if (dest != IR_NO_TEMP && home[dest] == IR_NO_BLOCK)
+      return false;
+  }
+  return true;
+}
+
+// Appends a copy of the header's instructions and branch to the latch, with
+// new temporaries for the ones the header defines
+static void _copy_header(IR *ir, IrBlockID header, IrBlockID latch,
+                         IrTemp *renamed) {
+  const uint32_t count = ir->blocks[header].instr_count;
+  for (uint32_t i = 0; i < count; i++) {
+    IrInstr copy = ir->blocks[header].instrs[i];
+    for (uint32_t a = 0; a < ir_opcode_arg_count(copy.op); a++) {
+      copy.args[a] = _resolve(renamed, copy.args[a]);
+    }
+    if (copy.dest != IR_NO_TEMP) {
+      const IrTemp fresh = ir_new_temp(ir);
+      renamed[copy.dest] = fresh;
+      copy.dest = fresh;
+    }
+    *ir_append(ir, latch, copy.op) = copy;
+  }
+  IrTerminator term = ir->blocks[header].term;
+  term.args[0] = _resolve(renamed, term.args[0]);
+  term.args[1] = _resolve(renamed, term.args[1]);
+  ir->blocks[latch].term = term;
+  for (uint32_t i = 0; i < count; i++) {
+    const IrTemp dest = ir->blocks[header].instrs[i].dest;
+    if (dest != IR_NO_TEMP) {
+      renamed[dest] = IR_NO_TEMP;
+    }
+  }
+}
+
+// Finds the loops that can be rotated, before any of them are
+static Rotation *_find_rotations(const IR *ir) {
+  IrDominators doms = ir_dominators_compute(ir);
+  // The only block mentioning each temporary, or IR_NO_BLOCK
+  IrBlockID *home = NULL; // stb_ds array
+  arrsetlen(home, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    home[t] = IR_NO_BLOCK;
+  }
+  bool *seen = NULL; // stb_ds array, per temporary
+  arrsetlen(seen, ir->temp_count);
+  if (ir->temp_count) {
+    memset(seen, 0, ir->temp_count * sizeof(*seen));
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i <= block->instr_count; i++) {
+      // Its arguments, then what it defines
+      IrTemp temps[IR_MAX_ARGS + 1] = {IR_NO_TEMP, IR_NO_TEMP, IR_NO_TEMP,
+                                       IR_NO_TEMP};
+      if (i == block->instr_count) {
+        if (block->term.kind == IR_TERM_BRANCH) {
+          temps[0] = block->term.args[0];
+          temps[1] = block->term.args[1];
+        }
+      } else {
+        for (uint32_t a = 0; a < ir_opcode_arg_count(block->instrs[i].op);
+             a++) {
+          temps[a] = block->instrs[i].args[a];
+        }
+        temps[IR_MAX_ARGS] = block->instrs[i].dest;
+      }
+      for (uint32_t k = 0; k <= IR_MAX_ARGS; k++) {
+        const IrTemp temp = temps[k];
+        if (temp == IR_NO_TEMP)
+          continue;
+        if (!seen[temp]) {
+          seen[temp] = true;
+          home[temp] = b;
+        } else if (home[temp] != b) {
+          home[temp] = IR_NO_BLOCK;
+        }
+      }
+    }
+  }
+  arrfree(seen);
+
+  Rotation *rotations = NULL; // stb_ds array
+  IrBlockID *in_loop = NULL;  // stb_ds array. Header plus one, like above
+  IrBlockID *stack = NULL;    // stb_ds array
+  arrsetlen(in_loop, ir->block_count);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    in_loop[b] = 0;
+  }
+  for (IrBlockID header = 0; header < ir->block_count; header++) {
+    const IrBlock *block = &ir->blocks[header];
+    if (block->term.kind != IR_TERM_BRANCH ||
+        block->instr_count > ROTATE_MAX_INSTRS ||
+        block->term.targets[0] == header || block->term.targets[1] == header ||
+        !_defines_only_local(block, home))
+      continue;
+    Rotation rotation = {.header = header, .body = IR_NO_BLOCK, .latches = NULL};
+    const IrBlockID mark = header + 1;
+    in_loop[header] = mark;
+    for (uint32_t p = 0; p < block->pred_count; p++) {
+      const IrBlockID pred = block->preds[p];
+      if (!ir_dominates(&doms, header, pred))
+        continue;
+      arrput(stack, pred);
+      if (ir->blocks[pred].term.kind == IR_TERM_JUMP) {
+        arrput(rotation.latches, pred);
+      }
+    }
+    while (arrlenu(stack)) {
+      const IrBlockID member = arrpop(stack);
+      if (in_loop[member] == mark)
+        continue;
+      in_loop[member] = mark;
+      const IrBlock *member_block = &ir->blocks[member];
+      for (uint32_t p = 0; p < member_block->pred_count; p++) {
+        arrput(stack, member_block->preds[p]);
+      }
+    }
+    const bool first_inside = in_loop[block->term.targets[0]] == mark;
+    const bool second_inside = in_loop[block->term.targets[1]] == mark;
+    if (arrlenu(rotation.latches) == 0 || first_inside == second_inside) {
+      arrfree(rotation.latches);
+      continue;
+    }
+    rotation.body = block->term.targets[first_inside ? 0 : 1];
+    arrput(rotations, rotation);
+  }
+  arrfree(stack);
+  arrfree(in_loop);
+  arrfree(home);
+  ir_dominators_destroy(&doms);
+  return rotations;
+}
+
+void ir_rotate_loops(IR *ir) {
+  Rotation *rotations = _find_rotations(ir);
+  const uint32_t rotation_count = (uint32_t)arrlenu(rotations);
+  if (rotation_count == 0) {
+    arrfree(rotations);
+    return;
+  }
+  IrTemp *renamed = NULL; // stb_ds array, per temporary
+  arrsetlen(renamed, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    renamed[t] = IR_NO_TEMP;
+  }
+  // Each preheader is laid out right after its guard, which falls into it
+  IrBlockID *preheader_of = NULL; // stb_ds array, per block before rotation
+  arrsetlen(preheader_of, ir->block_count);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    preheader_of[b] = IR_NO_BLOCK;
+  }
+  const uint32_t old_count = ir->block_count;
+  for (uint32_t r = 0; r < rotation_count; r++) {
+    const Rotation *rotation = &rotations[r];
+    for (uint32_t l = 0; l < arrlenu(rotation->latches); l++) {
+      _copy_header(ir, rotation->header, rotation->latches[l], renamed);
+    }
+    const IrBlockID preheader = ir_add_block(ir);
+    ir->blocks[preheader].term =
+        (IrTerminator){.kind = IR_TERM_JUMP,
+                       .args = {IR_NO_TEMP, IR_NO_TEMP},
+                       .targets = {rotation->body, IR_NO_BLOCK}};
+    IrTerminator *guard = &ir->blocks[rotation->header].term;
+    guard->targets[guard->targets[0] == rotation->body ? 0 : 1] = preheader;
+    preheader_of[rotation->header] = preheader;
+    arrfree(rotations[r].latches);
+  }
+  IrBlockID *order = NULL; // stb_ds array
+  for (IrBlockID b = 0; b < old_count; b++) {
+    arrput(order, b);
+    if (preheader_of[b] != IR_NO_BLOCK) {
+      arrput(order, preheader_of[b]);
+    }
+  }
+  ir_reorder_blocks(ir, order, (uint32_t)arrlenu(order));
+  ir_compute_predecessors(ir);
+  arrfree(order);
+  arrfree(preheader_of);
+  arrfree(renamed);
+  arrfree(rotations);
+}
+
+// ----------------------
+// If-Conversion
+//
+// An IF whose body only works out a value and stores it
+// takes a branch that's mispredicted whenever the
+// condition changes its mind. The body is moved in front
+// of the branch instead, where it always runs, and a
+// select stores the variable's old value back when the
+// condition doesn't hold, which x86 does without a
+// branch. Bodies that print, read input, go anywhere but
+// the end of the IF or might trap keep their branch
+// ----------------------
+
+// Bodies with more instructions than this cost more to always run than the
+// branch they'd save
+#define IF_CONVERT_MAX_INSTRS 8
+
+// Whether the division can't trap, because its divisor is a constant defined
+// earlier in the block that isn't 0 or -1
+static bool _is_safe_division(const IrBlock *block, uint32_t index) {
+  const IrTemp divisor = block->instrs[index].args[1];
+  for (uint32_t i = 0; i < index; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    if (instr->dest == divisor)
+      return instr->op == IR_CONST && instr->value != 0 && instr->value != -1;
+  }
+  return false;
+}
+
+// Whether body is the body of an IF that branch guards and that ends at join,
+// and it can run whether the condition holds or not. It can if all it does is
+// work out values and store one of them last
+static bool _is_convertible_body(const IR *ir, IrBlockID branch,
+                                 IrBlockID body, IrBlockID join) {
+  const IrBlock *block = &ir->blocks[body];
+  if (body == join || join == branch || block->label != IR_NO_LABEL ||
+      block->pred_count != 1 || block->preds[0] != branch ||
+      block->term.kind != IR_TERM_JUMP || block->term.targets[0] != join ||
+      block->instr_count == 0 || block->instr_count > IF_CONVERT_MAX_INSTRS)
+    return false;
+  const uint32_t last = block->instr_count - 1;
+  if (block->instrs[last].op != IR_STORE)
+    return false;
+  for (uint32_t i = 0; i < last; i++) {
+    switch (block->instrs[i].op) {
+    case IR_CONST:
+    case IR_LOAD:
+    case IR_COPY:
+    case IR_NEG:
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_COMPARE:
+    case IR_SELECT:
+      break;
+    case IR_DIV:
+      if (!_is_safe_division(block, i))
+        return false;
+      break;
+    case IR_STORE:
+    case IR_PHI:
+    case IR_PRINT_INT:
+    case IR_PRINT_STR:
+    case IR_INPUT:
+    case IR_OPCODE_COUNT:
+      return false;
+    }
+  }
+  return true;
+}
+
+// Moves the body on the given side of branch's terminator in front of it, and
+// makes the branch a jump to the end of the IF. The body is left unreachable
+static void _convert_if(IR *ir, IrBlockID branch, uint32_t side) {
+  const IrTerminator term = ir->blocks[branch].term;
+  const IrBlock *body = &ir->blocks[term.targets[side]];
+  const uint32_t last = body->instr_count - 1;
+  for (uint32_t i = 0; i < last; i++) {
+    *ir_append(ir, branch, body->instrs[i].op) = body->instrs[i];
+  }
+  const IrInstr store = body->instrs[last];
+  IrInstr *load = ir_append(ir, branch, IR_LOAD);
+  load->dest = ir_new_temp(ir);
+  load->variable = store.variable;
+  const IrTemp old = load->dest;
+  IrInstr *compare = ir_append(ir, branch, IR_COMPARE);
+  compare->dest = ir_new_temp(ir);
+  compare->args[0] = term.args[0];
+  compare->args[1] = term.args[1];
+  // The body ran when the condition held on the first side
+  compare->cond = side == 0 ? term.cond : ir_condition_negate(term.cond);
+  const IrTemp flag = compare->dest;
+  IrInstr *select = ir_append(ir, branch, IR_SELECT);
+  select->dest = ir_new_temp(ir);
+  select->args[0] = flag;
+  select->args[1] = store.args[0];
+  select->args[2] = old;
+  const IrTemp value = select->dest;
+  IrInstr *new_store = ir_append(ir, branch, IR_STORE);
+  new_store->args[0] = value;
+  new_store->variable = store.variable;
+  ir->blocks[branch].term =
+      (IrTerminator){.kind = IR_TERM_JUMP,
+                     .args = {IR_NO_TEMP, IR_NO_TEMP},
+                     .targets = {term.targets[1 - side], IR_NO_BLOCK}};
+}
+
+void ir_if_convert(IR *ir) {
+  bool *converted = NULL; // stb_ds array, per block. Whether it was a body
+  arrsetlen(converted, ir->block_count);
+  memset(converted, 0, ir->block_count * sizeof(*converted));
+  uint32_t converted_count = 0;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrTerminator *term = &ir->blocks[b].term;
+    if (term->kind != IR_TERM_BRANCH)
+      continue;
+    for (uint32_t side = 0; side < 2; side++) {
+      const IrBlockID body = term->targets[side];
+      if (_is_convertible_body(ir, b, body, term->targets[1 - side])) {
+        _convert_if(ir, b, side);
+        converted[body] = true;
+        converted_count++;
+        break;
+      }
+    }
+  }
+  if (converted_count) {
+    IrBlockID *order = NULL; // stb_ds array
+    for (IrBlockID b = 0; b < ir->block_count; b++) {
+      if (!converted[b]) {
+        arrput(order, b);
+      }
+    }
+    ir_reorder_blocks(ir, order, (uint32_t)arrlenu(order));
+    ir_compute_predecessors(ir);
+    arrfree(order);
+  }
+  arrfree(converted);
+}
+
+// ----------------------
+// Jump Threading
+//
+// GOTOs to a LABEL that only GOTOs on, and IFs and
+// loops that end in empty blocks, leave chains of jumps
+// that do nothing but jump again. Every jump is pointed
+// straight at the end of its chain, and a block that's
+// only ever entered by a jump from one other block is
+// merged into the end of it. Blocks left unreachable,
+// including code after a GOTO, are then deleted
+// ----------------------
+
+// Where a jump to target ends up after the empty blocks that only jump on.
+// They can form a loop, so at most as many are followed as there are blocks
+static IrBlockID _final_target(const IR *ir, IrBlockID target) {
+  for (uint32_t steps = 0; steps < ir->block_count; steps++) {
+    const IrBlock *block = &ir->blocks[target];
+    if (block->instr_count != 0 || block->term.kind != IR_TERM_JUMP)
+      break;
+    target = block->term.targets[0];
+  }
+  return target;
+}
+
+static void _thread_jumps(IR *ir) {
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    IrTerminator *term = &ir->blocks[b].term;
+    if (term->kind == IR_TERM_JUMP) {
+      term->targets[0] = _final_target(ir, term->targets[0]);
+    } else if (term->kind == IR_TERM_BRANCH) {
+      term->targets[0] = _final_target(ir, term->targets[0]);
+      term->targets[1] = _final_target(ir, term->targets[1]);
+      // Comparing has no effect, so a branch that goes the same way either
+      // way is a jump
+      if (term->targets[0] == term->targets[1]) {
+        *term = (IrTerminator){.kind = IR_TERM_JUMP,
+                               .args = {IR_NO_TEMP, IR_NO_TEMP},
+                               .targets = {term->targets[0], IR_NO_BLOCK}};
+      }
+    }
+  }
+  ir_compute_predecessors(ir);
+}
+
+// Merges each block that's only entered by a jump from another into it.
+// Returns whether any were, which leaves them empty and unreachable. Works in
+// SSA form too, where a block that still has phis stays
+static bool _merge_blocks(IR *ir) {
+  bool merged = false;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    while (ir->blocks[b].term.kind == IR_TERM_JUMP) {
+      const IrBlockID next = ir->blocks[b].term.targets[0];
+      const IrBlock *absorbed = &ir->blocks[next];
+      // The entry has to stay first
+      if (next == b || next == 0 || absorbed->pred_count != 1 ||
+          (absorbed->instr_count && absorbed->instrs[0].op == IR_PHI))
+        break;
+      for (uint32_t i = 0; i < absorbed->instr_count; i++) {
+        *ir_append(ir, b, absorbed->instrs[i].op) = absorbed->instrs[i];
+      }
+      ir->blocks[b].term = absorbed->term;
+      // Its successors are entered from b now
+      IrBlockID succs[2];
+      const uint32_t succ_count = ir_successors(absorbed, succs);
+      for (uint32_t s = 0; s < succ_count; s++) {
+        IrBlock *succ = &ir->blocks[succs[s]];
+        for (uint32_t p = 0; p < succ->pred_count; p++) {
+          if (succ->preds[p] == next) {
+            succ->preds[p] = b;
+          }
+        }
+      }
+      ir->blocks[next].instr_count = 0;
+      ir->blocks[next].pred_count = 0;
+      ir->blocks[next].term =
+          (IrTerminator){.kind = IR_TERM_EXIT,
+                         .args = {IR_NO_TEMP, IR_NO_TEMP},
+                         .targets = {IR_NO_BLOCK, IR_NO_BLOCK}};
+      merged = true;
+    }
+  }
+  return merged;
+}
+
+void ir_thread_jumps(IR *ir) {
+  _thread_jumps(ir);
+  // Code that can't run still counts as a predecessor until it's gone
+  ir_remove_unreachable_blocks(ir);
+  if (_merge_blocks(ir)) {
+    ir_remove_unreachable_blocks(ir);
+  }
+}
+
+void ir_optimize(IR *ir, uint32_t unroll_factor) {
+  ir_to_ssa(ir);
+  _propagate_constants(ir);
+  while (_number_values(ir)) {
+  }
+  _hoist_invariants(ir);
+  // If-conversion leaves loops it made branchless in several blocks
+  _merge_blocks(ir);
+  if (_optimize_counted_loops(ir, unroll_factor)) {
+    // Peeled iterations and closed forms of loops that start at constants
+    // mostly work out to constants too
+    _propagate_constants(ir);
+    while (_number_values(ir)) {
+    }
+  }
+  _eliminate_dead_code(ir);
+  ir_from_ssa(ir);
+  _rematerialize_constants(ir);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+// -----------------------------
+// IR OPTIMIZER
+//
+// The global optimizations run at -O2. The IR is put
+// into SSA form, which promotes every variable to
+// temporaries so none of their loads or stores are left,
+// and then:
+//  - Sparse conditional constant propagation finds the
+//    temporaries that are constant on every path that
+//    can run, and the branches that can only go one way
+//  - Global value numbering replaces computations that
+//    a dominating block already made
+//  - Loop-invariant code motion moves computations that
+//    are the same on every iteration into the preheader
+//    of their loop
+//  - Counted loops have products of their counter
+//    stepped by adds. Those that run a known number of
+//    times are replaced by the closed forms of their sums,
+//    or unrolled
+//  - Dead code elimination deletes whatever no output,
+//    input or branch depends on
+// before the IR leaves SSA form again.
+// If-conversion and loop rotation are cheap and nearly
+// always pay off, so they run from -O1 up, before the IR
+// is put into SSA form, and jump threading runs last
+// -----------------------------
+
+#include "ir.h"
+
+// Optimizes a verified IR in place. Counted loops run their body up to
+// unroll_factor times per iteration, and 1 doesn't unroll them. Predecessors
+// are current after
+void ir_optimize(IR *ir, uint32_t unroll_factor);
+
+// Turns each IF whose body only stores a value it works out, without printing,
+// reading input, jumping elsewhere or dividing by what might be 0, into a
+// compare and a select that store the variable's old value back when the
+// condition doesn't hold. The IR can't be in SSA form. Predecessors are current
+// after
+void ir_if_convert(IR *ir);
+
+// Rotates loops whose header tests their condition, so each iteration ends by
+// testing it again and branching back, and the header only guards the way in.
+// Every rotated loop is entered through a new empty preheader. The IR can't be
+// in SSA form. Predecessors are current after
+void ir_rotate_loops(IR *ir);
+
+// Points every jump at the end of the chain of empty blocks it would jump
+// through, merges each block only entered by a jump from one other block into
+// it, and deletes the blocks that can't be reached. The IR can't be in SSA
+// form. Predecessors are current after
+void ir_thread_jumps(IR *ir);
@@ -0,0 +1,561 @@
+#include "ir_ssa.h"
+#include "dz_debug.h"
+#include <stb_ds.h>
+#include <string.h>
+
+// ----------------------
+// Dominators
+//
+// Cooper, Harvey and Kennedy's iterative algorithm: each
+// block's dominator is refined from its predecessors',
+// in reverse postorder, until nothing changes
+// ----------------------
+
+// Reachable blocks in reverse postorder
+static IrBlockID *_reverse_postorder(const IR *ir) {
+  typedef struct {
+    IrBlockID block;
+    uint32_t next_succ;
+  } Frame;
+  IrBlockID *postorder = NULL; // stb_ds array
+  Frame *stack = NULL;         // stb_ds array
+  bool *visited = NULL;        // stb_ds array
+  arrsetlen(visited, ir->block_count);
+  memset(visited, 0, ir->block_count * sizeof(*visited));
+  visited[0] = true;
+  arrput(stack, ((Frame){.block = 0, .next_succ = 0}));
+  while (arrlenu(stack)) {
+    Frame *frame = &arrlast(stack);
+    IrBlockID succs[2];
+    const uint32_t succ_count =
+        ir_successors(&ir->blocks[frame->block], succs);
+    if (frame->next_succ == succ_count) {
+      arrput(postorder, frame->block);
+      (void)arrpop(stack);
+      continue;
+    }
+    const IrBlockID succ = succs[frame->next_succ++];
+    if (!visited[succ]) {
+      visited[succ] = true;
+      arrput(stack, ((Frame){.block = succ, .next_succ = 0}));
+    }
+  }
+  const size_t count = arrlenu(postorder);
+  for (size_t i = 0; i < count / 2; i++) {
+    const IrBlockID swap = postorder[i];
+    postorder[i] = postorder[count - 1 - i];
+    postorder[count - 1 - i] = swap;
+  }
+  arrfree(stack);
+  arrfree(visited);
+  return postorder;
+}
+
+// Walks up from two blocks to the closest block dominating both
+static IrBlockID _intersect(const IrBlockID *idom, const uint32_t *rpo_index,
+                            IrBlockID a, IrBlockID b) {
+  while (a != b) {
+    while (rpo_index[a] > rpo_index[b]) {
+      a = idom[a];
+    }
+    while (rpo_index[b] > rpo_index[a]) {
+      b = idom[b];
+    }
+  }
+  return a;
+}
+
+// Numbers the dominator tree in preorder, so a block's subtree is a range
+static void _number_tree(const IR *ir, IrDominators *doms) {
+  // Children are grouped by parent, counted first
+  uint32_t *child_start = NULL; // stb_ds array
+  IrBlockID *children = NULL;   // stb_ds array
+  arrsetlen(child_start, ir->block_count + 1);
+  memset(child_start, 0, (ir->block_count + 1) * sizeof(*child_start));
+  for (IrBlockID b = 1; b < ir->block_count; b++) {
+    if (doms->idom[b] != IR_NO_BLOCK) {
+      child_start[doms->idom[b] + 1]++;
+    }
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    child_start[b + 1] += child_start[b];
+  }
+  arrsetlen(children, child_start[ir->block_count]);
+  uint32_t *filled = NULL; // stb_ds array
+  arrsetlen(filled, ir->block_count);
+  memcpy(filled, child_start, ir->block_count * sizeof(*filled));
+  for (IrBlockID b = 1; b < ir->block_count; b++) {
+    if (doms->idom[b] != IR_NO_BLOCK) {
+      children[filled[doms->idom[b]]++] = b;
+    }
+  }
+  arrfree(filled);
+
+  arrsetlen(doms->tree_first, ir->block_count);
+  arrsetlen(doms->tree_end, ir->block_count);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    doms->tree_first[b] = UINT32_MAX;
+    doms->tree_end[b] = UINT32_MAX;
+  }
+  IrBlockID *stack = NULL; // stb_ds array
+  arrput(stack, 0);
+  while (arrlenu(stack)) {
+    const IrBlockID block = arrpop(stack);
+    doms->tree_first[block] = (uint32_t)arrlenu(doms->preorder);
+    arrput(doms->preorder, block);
+    for (uint32_t c = child_start[block]; c < child_start[block + 1]; c++) {
+      arrput(stack, children[c]);
+    }
+  }
+  // A subtree ends where the next block that isn't in it starts, so ends are
+  // filled in from the last block back
+  const uint32_t count = (uint32_t)arrlenu(doms->preorder);
+  for (uint32_t i = count; i-- > 0;) {
+    const IrBlockID block = doms->preorder[i];
+    uint32_t end = i + 1;
+    for (uint32_t c = child_start[block]; c < child_start[block + 1]; c++) {
+      if (doms->tree_end[children[c]] > end) {
+        end = doms->tree_end[children[c]];
+      }
+    }
+    doms->tree_end[block] = end;
+  }
+  arrfree(stack);
+  arrfree(children);
+  arrfree(child_start);
+}
+
+IrDominators ir_dominators_compute(const IR *ir) {
+  IrDominators doms = {
+      .idom = NULL, .preorder = NULL, .tree_first = NULL, .tree_end = NULL};
+  if (ir->block_count == 0)
+    return doms;
+  IrBlockID *rpo = _reverse_postorder(ir);
+  uint32_t *rpo_index = NULL; // stb_ds array
+  arrsetlen(rpo_index, ir->block_count);
+  arrsetlen(doms.idom, ir->block_count);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    rpo_index[b] = UINT32_MAX;
+    doms.idom[b] = IR_NO_BLOCK;
+  }
+  for (uint32_t i = 0; i < arrlenu(rpo); i++) {
+    rpo_index[rpo[i]] = i;
+  }
+  doms.idom[0] = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (uint32_t i = 1; i < arrlenu(rpo); i++) {
+      const IrBlock *block = &ir->blocks[rpo[i]];
+      IrBlockID new_idom = IR_NO_BLOCK;
+      for (uint32_t p = 0; p < block->pred_count; p++) {
+        const IrBlockID pred = block->preds[p];
+        if (doms.idom[pred] == IR_NO_BLOCK)
+          continue;
+        new_idom = new_idom == IR_NO_BLOCK
+                       ? pred
+                       : _intersect(doms.idom, rpo_index, pred, new_idom);
+      }
+      if (doms.idom[rpo[i]] != new_idom) {
+        doms.idom[rpo[i]] = new_idom;
+        changed = true;
+      }
+    }
+  }
+  arrfree(rpo);
+  arrfree(rpo_index);
+  _number_tree(ir, &doms);
+  return doms;
+}
+
+void ir_dominators_destroy(IrDominators *doms) {
+  arrfree(doms->idom);
+  arrfree(doms->preorder);
+  arrfree(doms->tree_first);
+  arrfree(doms->tree_end);
+}
+
+bool ir_dominates(const IrDominators *doms, IrBlockID a, IrBlockID b) {
+  if (doms->idom[a] == IR_NO_BLOCK || doms->idom[b] == IR_NO_BLOCK)
+    return false;
+  return doms->tree_first[a] <= doms->tree_first[b] &&
+         doms->tree_first[b] < doms->tree_end[a];
+}
+
+// ----------------------
+// Loops
+//
+// A loop is found from the edges back to a block that
+// dominates their source, by walking predecessors from
+// those sources up to the header
+// ----------------------
+
+uint32_t *ir_loop_depths(const IR *ir, const IrDominators *doms) {
+  uint32_t *depths = NULL;   // stb_ds array
+  IrBlockID *in_loop = NULL; // stb_ds array. Header of the last loop each
+                             // block was found in, plus one
+  IrBlockID *stack = NULL;   // stb_ds array
+  arrsetlen(depths, ir->block_count);
+  arrsetlen(in_loop, ir->block_count);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    depths[b] = 0;
+    in_loop[b] = 0;
+  }
+  for (IrBlockID header = 0; header < ir->block_count; header++) {
+    const IrBlock *block = &ir->blocks[header];
+    // Every back edge into the header is part of the same loop
+    for (uint32_t p = 0; p < block->pred_count; p++) {
+      if (ir_dominates(doms, header, block->preds[p])) {
+        arrput(stack, block->preds[p]);
+      }
+    }
+    if (arrlenu(stack) == 0)
+      continue;
+    in_loop[header] = header + 1;
+    depths[header]++;
+    while (arrlenu(stack)) {
+      const IrBlockID member = arrpop(stack);
+      if (in_loop[member] == header + 1)
+        continue;
+      in_loop[member] = header + 1;
+      depths[member]++;
+      const IrBlock *member_block = &ir->blocks[member];
+      for (uint32_t p = 0; p < member_block->pred_count; p++) {
+        const IrBlockID pred = member_block->preds[p];
+        if (in_loop[pred] != header + 1 && doms->idom[pred] != IR_NO_BLOCK) {
+          arrput(stack, pred);
+        }
+      }
+    }
+  }
+  arrfree(stack);
+  arrfree(in_loop);
+  return depths;
+}
+
+// ----------------------
+// Edges
+// ----------------------
+
+void ir_remove_edge(IR *ir, IrBlockID from, IrBlockID to) {
+  IrBlock *block = &ir->blocks[to];
+  uint32_t index = 0;
+  while (index < block->pred_count && block->preds[index] != from) {
+    index++;
+  }
+  DZ_ASSERT(index < block->pred_count, "Removed an edge that isn't there");
+  const uint32_t moved = block->pred_count - index - 1;
+  memmove(&block->preds[index], &block->preds[index + 1],
+          moved * sizeof(*block->preds));
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    IrInstr *phi = &block->instrs[i];
+    if (phi->op != IR_PHI)
+      break;
+    memmove(&phi->incoming[index], &phi->incoming[index + 1],
+            moved * sizeof(*phi->incoming));
+  }
+  block->pred_count--;
+}
+
+// ----------------------
+// Into SSA
+//
+// Cytron et al: a variable stored to in some block needs
+// a phi wherever that block's dominance stops, and where
+// those phis' dominance stops in turn. Then one walk
+// down the dominator tree, tracking each variable's
+// current temporary, renames loads to it
+// ----------------------
+
+// Where each block's dominance stops: the blocks it doesn't strictly
+// dominate, but does dominate a predecessor of. Returns an stb_ds array of
+// stb_ds arrays
+static IrBlockID **_dominance_frontiers(const IR *ir,
+                                        const IrDominators *doms) {
+  IrBlockID **frontiers = NULL;
+  arrsetlen(frontiers, ir->block_count);
+  memset(frontiers, 0, ir->block_count * sizeof(*frontiers));
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    if (block->pred_count < 2)
+      continue;
+    for (uint32_t p = 0; p < block->pred_count; p++) {
+      IrBlockID runner = block->preds[p];
+      while (runner != doms->idom[b]) {
+        // Blocks are visited one at a time, so b is only ever last
+        if (arrlenu(frontiers[runner]) == 0 || arrlast(frontiers[runner]) != b) {
+          arrput(frontiers[runner], b);
+        }
+        runner = doms->idom[runner];
+      }
+    }
+  }
+  return frontiers;
+}
+
+static uint32_t _variable_count(const IR *ir) {
+  uint32_t count = 0;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      if ((instr->op == IR_LOAD || instr->op == IR_STORE) &&
+          instr->variable >= count) {
+        count = instr->variable + 1;
+      }
+    }
+  }
+  return count;
+}
+
+// Works out which variables need a phi in each block. Returns an stb_ds array
+// of stb_ds arrays of variables
+static uint32_t **_place_phis(const IR *ir, const IrDominators *doms,
+                              uint32_t variable_count) {
+  IrBlockID **frontiers = _dominance_frontiers(ir, doms);
+  // Blocks storing to each variable
+  IrBlockID **stores = NULL;
+  arrsetlen(stores, variable_count);
+  for (uint32_t v = 0; v < variable_count; v++) {
+    stores[v] = NULL;
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      if (instr->op != IR_STORE)
+        continue;
+      IrBlockID *blocks = stores[instr->variable];
+      if (arrlenu(blocks) == 0 || arrlast(blocks) != b) {
+        arrput(stores[instr->variable], b);
+      }
+    }
+  }
+
+  uint32_t **phis = NULL;
+  arrsetlen(phis, ir->block_count);
+  memset(phis, 0, ir->block_count * sizeof(*phis));
+  // Both hold the last variable plus one a block was handled for, so they
+  // never have to be cleared
+  uint32_t *has_phi = NULL; // stb_ds array
+  uint32_t *queued = NULL;  // stb_ds array
+  arrsetlen(has_phi, ir->block_count);
+  arrsetlen(queued, ir->block_count);
+  memset(has_phi, 0, ir->block_count * sizeof(*has_phi));
+  memset(queued, 0, ir->block_count * sizeof(*queued));
+  IrBlockID *worklist = NULL; // stb_ds array
+  for (uint32_t v = 0; v < variable_count; v++) {
+    for (size_t i = 0; i < arrlenu(stores[v]); i++) {
+      queued[stores[v][i]] = v + 1;
+      arrput(worklist, stores[v][i]);
+    }
+    while (arrlenu(worklist)) {
+      const IrBlockID block = arrpop(worklist);
+      for (size_t i = 0; i < arrlenu(frontiers[block]); i++) {
+        const IrBlockID join = frontiers[block][i];
+        if (has_phi[join] == v + 1)
+          continue;
+        has_phi[join] = v + 1;
+        arrput(phis[join], v);
+        if (queued[join] != v + 1) {
+          queued[join] = v + 1;
+          arrput(worklist, join);
+        }
+      }
+    }
+  }
+  arrfree(worklist);
+  arrfree(has_phi);
+  arrfree(queued);
+  for (uint32_t v = 0; v < variable_count; v++) {
+    arrfree(stores[v]);
+  }
+  arrfree(stores);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    arrfree(frontiers[b]);
+  }
+  arrfree(frontiers);
+  return phis;
+}
+
+// Puts the phis at the start of each block, and gives every variable a zero
+// at the start of the entry, which can't have phis. Returns the zeros'
+// temporaries, an stb_ds array
+static IrTemp *_insert_phis(IR *ir, uint32_t **phis, uint32_t variable_count) {
+  IrTemp *zeros = NULL;
+  arrsetlen(zeros, variable_count);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const uint32_t phi_count = (uint32_t)arrlenu(phis[b]);
+    const uint32_t prefix_count = b == 0 ? variable_count : phi_count;
+    if (prefix_count == 0)
+      continue;
+    IrBlock *block = &ir->blocks[b];
+    const uint32_t count = prefix_count + block->instr_count;
+    IrInstr *instrs = arena_alloc(&ir->arena, count * sizeof(*instrs));
+    if (block->instr_count) {
+      memcpy(&instrs[prefix_count], block->instrs,
+             block->instr_count * sizeof(*instrs));
+    }
+    for (uint32_t i = 0; b == 0 && i < variable_count; i++) {
+      instrs[i] = (IrInstr){.op = IR_CONST,
+                            .dest = zeros[i] = ir_new_temp(ir),
+                            .args = {IR_NO_TEMP, IR_NO_TEMP, IR_NO_TEMP},
+                            .value = 0};
+    }
+    for (uint32_t i = 0; i < phi_count; i++) {
+      IrTemp *incoming =
+          arena_alloc(&ir->arena, block->pred_count * sizeof(*incoming));
+      for (uint32_t p = 0; p < block->pred_count; p++) {
+        incoming[p] = IR_NO_TEMP;
+      }
+      instrs[i] = (IrInstr){.op = IR_PHI,
+                            .dest = ir_new_temp(ir),
+                            .args = {IR_NO_TEMP, IR_NO_TEMP, IR_NO_TEMP},
+                            .incoming = incoming};
+    }
+    block->instrs = instrs;
+    block->instr_count = count;
+    block->instr_capacity = count;
+  }
+  return zeros;
+}
+
+typedef struct {
+  uint32_t variable;
+  IrTemp previous;
+} Shadowed;
+
+// Renames one block. current holds each variable's temporary coming in, and
+// what it replaces is pushed to shadowed so it can be undone
+static void _rename_block(IR *ir, IrBlockID b, uint32_t **phis,
+                          IrTemp *current, IrTemp *replace,
+                          Shadowed **shadowed) {
+  IrBlock *block = &ir->blocks[b];
+  const uint32_t phi_count = (uint32_t)arrlenu(phis[b]);
+  for (uint32_t i = 0; i < phi_count; i++) {
+    const uint32_t variable = phis[b][i];
+    arrput(*shadowed, ((Shadowed){variable, current[variable]}));
+    current[variable] = block->instrs[i].dest;
+  }
+  // Loads and stores are dropped as the block is compacted
+  uint32_t kept = phi_count;
+  for (uint32_t i = phi_count; i < block->instr_count; i++) {
+    IrInstr instr = block->instrs[i];
+    if (instr.op == IR_LOAD) {
+      replace[instr.dest] = current[instr.variable];
+      continue;
+    }
+    for (uint32_t a = 0; a < ir_opcode_arg_count(instr.op); a++) {
+      if (replace[instr.args[a]] != IR_NO_TEMP) {
+        instr.args[a] = replace[instr.args[a]];
+      }
+    }
+    if (instr.op == IR_STORE) {
+      arrput(*shadowed, ((Shadowed){instr.variable, current[instr.variable]}));
+      current[instr.variable] = instr.args[0];
+      continue;
+    }
+    block->instrs[kept++] = instr;
+  }
+  block->instr_count = kept;
+  if (block->term.kind == IR_TERM_BRANCH) {
+    for (uint32_t a = 0; a < 2; a++) {
+      if (replace[block->term.args[a]] != IR_NO_TEMP) {
+        block->term.args[a] = replace[block->term.args[a]];
+      }
+    }
+  }
+  // Successors' phis take whatever each variable holds leaving this block
+  IrBlockID succs[2];
+  const uint32_t succ_count = ir_successors(block, succs);
+  for (uint32_t s = 0; s < succ_count; s++) {
+    const IrBlock *succ = &ir->blocks[succs[s]];
+    uint32_t index = 0;
+    while (succ->preds[index] != b) {
+      index++;
+    }
+    for (uint32_t i = 0; i < arrlenu(phis[succs[s]]); i++) {
+      succ->instrs[i].incoming[index] = current[phis[succs[s]][i]];
+    }
+  }
+}
+
+void ir_to_ssa(IR *ir) {
+  ir_remove_unreachable_blocks(ir);
+  DZ_ASSERT(ir->block_count && ir->blocks[0].pred_count == 0,
+            "The entry can't be jumped to");
+  const uint32_t variable_count = _variable_count(ir);
+  IrDominators doms = ir_dominators_compute(ir);
+  uint32_t **phis = _place_phis(ir, &doms, variable_count);
+  // The entry can't have phis, so its zeros are renamed like any other
+  // instruction
+  IrTemp *current = _insert_phis(ir, phis, variable_count);
+
+  IrTemp *replace = NULL; // stb_ds array, a load's temporary -> its value
+  arrsetlen(replace, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    replace[t] = IR_NO_TEMP;
+  }
+  Shadowed *shadowed = NULL;  // stb_ds array
+  uint32_t *open = NULL;      // stb_ds array, positions in preorder
+  uint32_t *open_marks = NULL; // stb_ds array, shadowed's length as each
+                               // open block was entered
+  for (uint32_t i = 0; i < arrlenu(doms.preorder); i++) {
+    // Leaving the blocks that don't dominate this one undoes their renames
+    while (arrlenu(open) && doms.tree_end[doms.preorder[arrlast(open)]] <= i) {
+      const uint32_t mark = arrpop(open_marks);
+      while (arrlenu(shadowed) > mark) {
+        const Shadowed undo = arrpop(shadowed);
+        current[undo.variable] = undo.previous;
+      }
+      (void)arrpop(open);
+    }
+    arrput(open, i);
+    arrput(open_marks, (uint32_t)arrlenu(shadowed));
+    _rename_block(ir, doms.preorder[i], phis, current, replace, &shadowed);
+  }
+  arrfree(open);
+  arrfree(open_marks);
+  arrfree(shadowed);
+  arrfree(replace);
+  arrfree(current);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    arrfree(phis[b]);
+  }
+  arrfree(phis);
+  ir_dominators_destroy(&doms);
+}
+
+// ----------------------
+// Out of SSA
+//
+// Each phi gets a fresh temporary that every predecessor
+// copies its value into, and the phi becomes a copy out
+// of it. Going through a temporary of its own means one
+// phi's copy can never overwrite a value another phi of
+// the same block still reads
+// ----------------------
+
+void ir_from_ssa(IR *ir) {
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    for (uint32_t i = 0; i < ir->blocks[b].instr_count; i++) {
+      IrInstr *phi = &ir->blocks[b].instrs[i];
+      if (phi->op != IR_PHI)
+        break;
+      const IrTemp incoming = ir_new_temp(ir);
+      IrTemp *values = phi->incoming;
+      phi->op = IR_COPY;
+      phi->args[0] = incoming;
+      const IrBlock *block = &ir->blocks[b];
+      for (uint32_t p = 0; p < block->pred_count; p++) {
+        // Appending may move the predecessor's instructions, which could be
+        // this block's own
+        const IrBlockID pred = ir->blocks[b].preds[p];
+        IrInstr *copy = ir_append(ir, pred, IR_COPY);
+        copy->dest = incoming;
+        copy->args[0] = values[p];
+      }
+    }
+  }
+  ir_remove_unreachable_blocks(ir);
+}
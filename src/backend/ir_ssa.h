@@ -0,0 +1,53 @@
+#pragma once
+
+// -----------------------------
+// SSA
+//
+// Puts the IR into static single assignment form and
+// takes it back out. In SSA form variables are gone:
+// every load is replaced by the temporary holding the
+// variable's value at that point, with phis where
+// control flow merges different values, so each
+// temporary has exactly one definition. Leaving SSA
+// form turns every phi into copies at the ends of its
+// block's predecessors
+// -----------------------------
+
+#include "ir.h"
+
+// The dominator tree of the blocks reachable from the entry. Block a
+// dominates block b when every path from the entry to b goes through a
+typedef struct {
+  IrBlockID *idom;      // stb_ds array. Immediate dominator of each block. The
+                        // entry's is itself, and unreachable blocks have
+                        // IR_NO_BLOCK
+  IrBlockID *preorder;  // stb_ds array. Reachable blocks, each after its
+                        // dominator
+  uint32_t *tree_first; // stb_ds array. Each block's position in preorder
+  uint32_t *tree_end;   // stb_ds array. One past the position of the last
+                        // block the block dominates in preorder
+} IrDominators;
+
+// Works out the dominators. Predecessors have to be current
+IrDominators ir_dominators_compute(const IR *ir);
+void ir_dominators_destroy(IrDominators *doms);
+
+// Whether a dominates b. Every reachable block dominates itself
+bool ir_dominates(const IrDominators *doms, IrBlockID a, IrBlockID b);
+
+// How many natural loops each block is in, as an stb_ds array. A natural loop
+// is a header, and every block that reaches an edge back to the header
+// without going through it. Unreachable blocks are in none
+uint32_t *ir_loop_depths(const IR *ir, const IrDominators *doms);
+
+// Promotes every variable to temporaries, removing all loads and stores.
+// Variables start out as 0. Unreachable blocks are deleted first
+void ir_to_ssa(IR *ir);
+
+// Replaces every phi with copies, and deletes blocks left unreachable
+void ir_from_ssa(IR *ir);
+
+// Deletes the edge from one block to another from the target's predecessors,
+// along with its phis' values for it. The source's terminator is left to the
+// caller
+void ir_remove_edge(IR *ir, IrBlockID from, IrBlockID to);
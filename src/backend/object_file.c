@@ -0,0 +1,599 @@
+#include "object_file.h"
+#include "core.h"
+#include "compiler_compatibility.h"
+#include <stb_ds.h>
+
+// ----------------------
+// ELF64 Format
+//
+// Only what an x86-64 relocatable needs. Declared here instead of taken from
+// <elf.h>, so objects can be written from hosts that don't have it
+// ----------------------
+
+typedef struct {
+  uint8_t ident[16];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uint64_t entry;
+  uint64_t phoff;
+  uint64_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+} Elf64Header;
+
+typedef struct {
+  uint32_t name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t addr;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+  uint32_t info;
+  uint64_t addralign;
+  uint64_t entsize;
+} Elf64SectionHeader;
+
+typedef struct {
+  uint32_t name;
+  uint8_t info;
+  uint8_t other;
+  uint16_t shndx;
+  uint64_t value;
+  uint64_t size;
+} Elf64Symbol;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t info;
+  int64_t addend;
+} Elf64Rela;
+
+#define ELF_TYPE_REL 1
+#define ELF_MACHINE_X86_64 62
+#define ELF_SHT_PROGBITS 1
+#define ELF_SHT_SYMTAB 2
+#define ELF_SHT_STRTAB 3
+#define ELF_SHT_RELA 4
+#define ELF_SHT_NOBITS 8
+#define ELF_SHF_WRITE 0x1
+#define ELF_SHF_ALLOC 0x2
+#define ELF_SHF_EXECINSTR 0x4
+#define ELF_SHF_INFO_LINK 0x40
+#define ELF_STB_LOCAL 0
+#define ELF_STB_GLOBAL 1
+#define ELF_STT_NOTYPE 0
+#define ELF_STT_SECTION 3
+#define ELF_R_X86_64_PC32 2
+#define ELF_R_X86_64_PLT32 4
+
+#define ELF_SYMBOL_INFO(bind, type) ((uint8_t)(((bind) << 4) | (type)))
+#define ELF_SYMBOL_BIND(info) ((info) >> 4)
+#define ELF_SYMBOL_TYPE(info) ((info) & 0xf)
+#define ELF_RELA_INFO(sym, type) (((uint64_t)(sym) << 32) | (type))
+#define ELF_RELA_SYMBOL(info) ((uint32_t)((info) >> 32))
+#define ELF_RELA_TYPE(info) ((uint32_t)(info))
+
+static const char *OBJ_SECTION_NAMES[OBJ_SECTION_COUNT] = {
+#define X(name, str) str,
+    OBJ_SECTIONS(X)
+#undef X
+};
+
+// Section header indices, in the same order gas lays them out
+enum {
+  ELF_INDEX_NULL,
+  ELF_INDEX_TEXT,
+  ELF_INDEX_RELA_TEXT,
+  ELF_INDEX_DATA,
+  ELF_INDEX_BSS,
+  ELF_INDEX_RODATA,
+  ELF_INDEX_NOTE_GNU_STACK,
+  ELF_INDEX_SYMTAB,
+  ELF_INDEX_STRTAB,
+  ELF_INDEX_SHSTRTAB,
+  ELF_INDEX_COUNT,
+};
+
+static const uint16_t SECTION_INDICES[OBJ_SECTION_COUNT] = {
+    [OBJ_SECTION_UNDEF] = ELF_INDEX_NULL,
+    [OBJ_SECTION_TEXT] = ELF_INDEX_TEXT,
+    [OBJ_SECTION_DATA] = ELF_INDEX_DATA,
+    [OBJ_SECTION_BSS] = ELF_INDEX_BSS,
+    [OBJ_SECTION_RODATA] = ELF_INDEX_RODATA,
+};
+
+// ----------------------
+// Object File
+// ----------------------
+
+ObjectFile object_file_init(void) {
+  return (ObjectFile){.bss_align = 1};
+}
+
+void object_file_destroy(ObjectFile *object) {
+  for (uint32_t i = 0; i < OBJ_SECTION_COUNT; i++) {
+    arrfree(object->bytes[i]);
+  }
+  arrfree(object->symbols);
+  arrfree(object->relocations);
+  *object = (ObjectFile){0};
+}
+
+uint64_t object_file_section_size(const ObjectFile *object,
+                                  ObjSection section) {
+  if (section == OBJ_SECTION_BSS)
+    return object->bss_size;
+  return arrlenu(object->bytes[section]);
+}
+
+// ----------------------
+// ELF Output
+// ----------------------
+
+// Writes out a file sequentially, remembering the first failure
+typedef struct {
+  FILE *file;
+  uint64_t offset;
+  bool ok;
+} ElfOutput;
+
+static void _output_bytes(ElfOutput *out, const void *bytes, size_t size) {
+  if (size == 0 || !out->ok)
+    return;
+  if (fwrite(bytes, 1, size, out->file) != size) {
+    out->ok = false;
+  }
+  out->offset += size;
+}
+
+// Pads the output with zeroes up to the next multiple of align
+static void _output_align(ElfOutput *out, uint64_t align) {
+  static const uint8_t ZEROES[16] = {0};
+  DZ_ASSERT(align <= sizeof(ZEROES));
+  const uint64_t padding = (align - out->offset % align) % align;
+  _output_bytes(out, ZEROES, padding);
+}
+
+// Appends a name to a string table, returning its offset
+static uint32_t _strtab_add(char **strtab, const char *name) {
+  const uint32_t offset = (uint32_t)arrlenu(*strtab);
+  const size_t len = strlen(name) + 1;
+  memcpy(arraddnptr(*strtab, len), name, len);
+  return offset;
+}
+
+bool object_file_write_elf(const ObjectFile *object, FILE *file) {
+  // Symbol table. Locals have to come first: the null symbol, a symbol for
+  // each section, then named locals, followed by the globals
+  Elf64Symbol *symtab = NULL;
+  char *strtab = NULL;
+  uint32_t *symbol_index = NULL; // ObjectFile symbol -> ELF symbol
+  arrsetlen(symbol_index, arrlenu(object->symbols));
+  _strtab_add(&strtab, "");
+  arrput(symtab, (Elf64Symbol){0});
+  uint32_t section_symbol[OBJ_SECTION_COUNT] = {0};
+  for (uint32_t section = OBJ_SECTION_TEXT; section < OBJ_SECTION_COUNT;
+       section++) {
+    section_symbol[section] = (uint32_t)arrlenu(symtab);
+    arrput(symtab, ((Elf64Symbol){
+                       .info = ELF_SYMBOL_INFO(ELF_STB_LOCAL, ELF_STT_SECTION),
+                       .shndx = SECTION_INDICES[section],
+                   }));
+  }
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    const bool globals = pass == 1;
+    for (size_t i = 0; i < arrlenu(object->symbols); i++) {
+      const ObjSymbol *symbol = &object->symbols[i];
+      if (symbol->global != globals)
+        continue;
+      if (!symbol->name) {
+        symbol_index[i] = section_symbol[symbol->section];
+        continue;
+      }
+      symbol_index[i] = (uint32_t)arrlenu(symtab);
+      arrput(symtab,
+             ((Elf64Symbol){
+                 .name = _strtab_add(&strtab, symbol->name),
+                 .info = ELF_SYMBOL_INFO(globals ? ELF_STB_GLOBAL : ELF_STB_LOCAL,
+                                         ELF_STT_NOTYPE),
+                 .shndx = SECTION_INDICES[symbol->section],
+                 .value = symbol->value,
+             }));
+    }
+  }
+  uint32_t first_global = (uint32_t)arrlenu(symtab);
+  for (uint32_t i = 1; i < arrlenu(symtab); i++) {
+    if (ELF_SYMBOL_BIND(symtab[i].info) == ELF_STB_GLOBAL) {
+      first_global = i;
+      break;
+    }
+  }
+
+  Elf64Rela *relocations = NULL;
+  for (size_t i = 0; i < arrlenu(object->relocations); i++) {
+    const ObjRelocation *reloc = &object->relocations[i];
+    const uint32_t type = reloc->type == OBJ_RELOC_PLT32 ? ELF_R_X86_64_PLT32
+                                                         : ELF_R_X86_64_PC32;
+    arrput(relocations,
+           ((Elf64Rela){
+               .offset = reloc->offset,
+               .info = ELF_RELA_INFO(symbol_index[reloc->symbol], type),
+               .addend = reloc->addend,
+           }));
+  }
+
+  static const char *EXTRA_SECTION_NAMES[] = {
+      ".rela.text", ".note.GNU-stack", ".symtab", ".strtab", ".shstrtab"};
+  char *shstrtab = NULL;
+  _strtab_add(&shstrtab, "");
+  uint32_t name_offsets[ELF_INDEX_COUNT] = {0};
+  for (uint32_t section = OBJ_SECTION_TEXT; section < OBJ_SECTION_COUNT;
+       section++) {
+    name_offsets[SECTION_INDICES[section]] =
+        _strtab_add(&shstrtab, OBJ_SECTION_NAMES[section]);
+  }
+  name_offsets[ELF_INDEX_RELA_TEXT] =
+      _strtab_add(&shstrtab, EXTRA_SECTION_NAMES[0]);
+  name_offsets[ELF_INDEX_NOTE_GNU_STACK] =
+      _strtab_add(&shstrtab, EXTRA_SECTION_NAMES[1]);
+  name_offsets[ELF_INDEX_SYMTAB] =
+      _strtab_add(&shstrtab, EXTRA_SECTION_NAMES[2]);
+  name_offsets[ELF_INDEX_STRTAB] =
+      _strtab_add(&shstrtab, EXTRA_SECTION_NAMES[3]);
+  name_offsets[ELF_INDEX_SHSTRTAB] =
+      _strtab_add(&shstrtab, EXTRA_SECTION_NAMES[4]);
+
+  Elf64SectionHeader headers[ELF_INDEX_COUNT] = {0};
+  for (uint32_t i = 0; i < ELF_INDEX_COUNT; i++) {
+    headers[i].name = name_offsets[i];
+    headers[i].addralign = 1;
+  }
+  headers[ELF_INDEX_NULL].addralign = 0;
+
+  ElfOutput out = {.file = file, .ok = true};
+  const Elf64Header header = {
+      .ident = {0x7f, 'E', 'L', 'F', 2 /* 64 bit */, 1 /* little endian */,
+                1 /* version */},
+      .type = ELF_TYPE_REL,
+      .machine = ELF_MACHINE_X86_64,
+      .version = 1,
+      .ehsize = sizeof(Elf64Header),
+      .shentsize = sizeof(Elf64SectionHeader),
+      .shnum = ELF_INDEX_COUNT,
+      .shstrndx = ELF_INDEX_SHSTRTAB,
+  };
+  // The header is written last, once the section headers' offset is known
+  _output_bytes(&out, &header, sizeof(header));
+
+  static const struct {
+    ObjSection section;
+    uint32_t index;
+    uint64_t flags;
+  } PROGBITS[] = {
+      {OBJ_SECTION_TEXT, ELF_INDEX_TEXT, ELF_SHF_ALLOC | ELF_SHF_EXECINSTR},
+      {OBJ_SECTION_DATA, ELF_INDEX_DATA, ELF_SHF_ALLOC | ELF_SHF_WRITE},
+      {OBJ_SECTION_RODATA, ELF_INDEX_RODATA, ELF_SHF_ALLOC},
+  };
+  for (uint32_t i = 0; i < array_size(PROGBITS); i++) {
+    Elf64SectionHeader *section = &headers[PROGBITS[i].index];
+    section->type = ELF_SHT_PROGBITS;
+    section->flags = PROGBITS[i].flags;
+    section->offset = out.offset;
+    section->size = arrlenu(object->bytes[PROGBITS[i].section]);
+    _output_bytes(&out, object->bytes[PROGBITS[i].section], section->size);
+  }
+
+  Elf64SectionHeader *bss = &headers[ELF_INDEX_BSS];
+  bss->type = ELF_SHT_NOBITS;
+  bss->flags = ELF_SHF_ALLOC | ELF_SHF_WRITE;
+  bss->offset = out.offset;
+  bss->size = object->bss_size;
+  bss->addralign = object->bss_align;
+
+  Elf64SectionHeader *note = &headers[ELF_INDEX_NOTE_GNU_STACK];
+  note->type = ELF_SHT_PROGBITS;
+  note->offset = out.offset;
+
+  _output_align(&out, 8);
+  Elf64SectionHeader *symtab_header = &headers[ELF_INDEX_SYMTAB];
+  symtab_header->type = ELF_SHT_SYMTAB;
+  symtab_header->offset = out.offset;
+  symtab_header->size = arrlenu(symtab) * sizeof(Elf64Symbol);
+  symtab_header->link = ELF_INDEX_STRTAB;
+  symtab_header->info = first_global;
+  symtab_header->addralign = 8;
+  symtab_header->entsize = sizeof(Elf64Symbol);
+  _output_bytes(&out, symtab, symtab_header->size);
+
+  Elf64SectionHeader *strtab_header = &headers[ELF_INDEX_STRTAB];
+  strtab_header->type = ELF_SHT_STRTAB;
+  strtab_header->offset = out.offset;
+  strtab_header->size = arrlenu(strtab);
+  _output_bytes(&out, strtab, strtab_header->size);
+
+  _output_align(&out, 8);
+  Elf64SectionHeader *rela_header = &headers[ELF_INDEX_RELA_TEXT];
+  rela_header->type = ELF_SHT_RELA;
+  rela_header->flags = ELF_SHF_INFO_LINK;
+  rela_header->offset = out.offset;
+  rela_header->size = arrlenu(relocations) * sizeof(Elf64Rela);
+  rela_header->link = ELF_INDEX_SYMTAB;
+  rela_header->info = ELF_INDEX_TEXT;
+  rela_header->addralign = 8;
+  rela_header->entsize = sizeof(Elf64Rela);
+  _output_bytes(&out, relocations, rela_header->size);
+
+  Elf64SectionHeader *shstrtab_header = &headers[ELF_INDEX_SHSTRTAB];
+  shstrtab_header->type = ELF_SHT_STRTAB;
+  shstrtab_header->offset = out.offset;
+  shstrtab_header->size = arrlenu(shstrtab);
+  _output_bytes(&out, shstrtab, shstrtab_header->size);
+
+  _output_align(&out, 8);
+  Elf64Header final_header = header;
+  final_header.shoff = out.offset;
+  _output_bytes(&out, headers, sizeof(headers));
+  if (out.ok && (fseek(file, 0, SEEK_SET) != 0 ||
+                 fwrite(&final_header, sizeof(final_header), 1, file) != 1)) {
+    out.ok = false;
+  }
+
+  arrfree(symtab);
+  arrfree(strtab);
+  arrfree(symbol_index);
+  arrfree(relocations);
+  arrfree(shstrtab);
+  return out.ok;
+}
+
+// ----------------------
+// ELF Comparison
+// ----------------------
+
+// Stop reporting after this many differences, one is usually enough
+#define ELF_DIFF_MAX_REPORTS 8
+
+// The parts of a relocatable the comparison looks at
+typedef struct {
+  const char *path;
+  uint8_t *file;
+  size_t file_size;
+  const Elf64SectionHeader *sections;
+  uint32_t section_count;
+  const char *section_names;
+  const Elf64Symbol *symbols;
+  uint32_t symbol_count;
+  const char *symbol_names;
+} ElfImage;
+
+// A relocation with its target resolved to a symbol name, or a section and
+// offset for local targets
+typedef struct {
+  uint64_t offset;
+  uint32_t type;
+  const char *target;
+  int64_t addend;
+} ElfTarget;
+
+static bool _elf_in_bounds(const ElfImage *image, uint64_t offset,
+                           uint64_t size) {
+  return offset <= image->file_size && size <= image->file_size - offset;
+}
+
+static bool _elf_load(ElfImage *image, const char *path) {
+  *image = (ElfImage){.path = path};
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  bool ok = fseek(file, 0, SEEK_END) == 0;
+  const long size = ok ? ftell(file) : -1;
+  ok = ok && size >= (long)sizeof(Elf64Header) && fseek(file, 0, SEEK_SET) == 0;
+  if (ok) {
+    image->file_size = (size_t)size;
+    image->file = malloc(image->file_size);
+    ok = image->file &&
+         fread(image->file, 1, image->file_size, file) == image->file_size;
+  }
+  fclose(file);
+  const Elf64Header *header = (const Elf64Header *)(void *)image->file;
+  if (!ok || memcmp(header->ident, "\x7f"
+                                   "ELF",
+                    4) != 0 ||
+      header->shentsize != sizeof(Elf64SectionHeader) ||
+      !_elf_in_bounds(image, header->shoff,
+                      (uint64_t)header->shnum * sizeof(Elf64SectionHeader)) ||
+      header->shstrndx >= header->shnum) {
+    fprintf(stderr, "%s is not a valid ELF64 object\n", path);
+    return false;
+  }
+  image->sections =
+      (const Elf64SectionHeader *)(void *)(image->file + header->shoff);
+  image->section_count = header->shnum;
+  const Elf64SectionHeader *shstrtab = &image->sections[header->shstrndx];
+  if (!_elf_in_bounds(image, shstrtab->offset, shstrtab->size)) {
+    fprintf(stderr, "%s is not a valid ELF64 object\n", path);
+    return false;
+  }
+  image->section_names = (const char *)image->file + shstrtab->offset;
+  for (uint32_t i = 0; i < image->section_count; i++) {
+    const Elf64SectionHeader *section = &image->sections[i];
+    if (section->type != ELF_SHT_NOBITS &&
+        !_elf_in_bounds(image, section->offset, section->size)) {
+      fprintf(stderr, "%s is not a valid ELF64 object\n", path);
+      return false;
+    }
+    if (section->type == ELF_SHT_SYMTAB && section->link < image->section_count) {
+      image->symbols =
+          (const Elf64Symbol *)(void *)(image->file + section->offset);
+      image->symbol_count = (uint32_t)(section->size / sizeof(Elf64Symbol));
+      image->symbol_names =
+          (const char *)image->file + image->sections[section->link].offset;
+    }
+  }
+  return true;
+}
+
+static const Elf64SectionHeader *_elf_find_section(const ElfImage *image,
+                                                   const char *name) {
+  for (uint32_t i = 1; i < image->section_count; i++) {
+    if (strcmp(image->section_names + image->sections[i].name, name) == 0)
+      return &image->sections[i];
+  }
+  return NULL;
+}
+
+static const char *_elf_section_name(const ElfImage *image, uint32_t index) {
+  if (index == 0 || index >= image->section_count)
+    return "*UND*";
+  return image->section_names + image->sections[index].name;
+}
+
+// Resolves every relocation of .text. Local targets become their section, with
+// the symbol's offset folded into the addend
+static ElfTarget *_elf_text_relocations(const ElfImage *image) {
+  ElfTarget *targets = NULL;
+  const Elf64SectionHeader *rela = _elf_find_section(image, ".rela.text");
+  if (!rela || !image->symbols)
+    return NULL;
+  const Elf64Rela *entries = (const Elf64Rela *)(void *)(image->file +
+                                                         rela->offset);
+  const size_t count = rela->size / sizeof(Elf64Rela);
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t symbol_index = ELF_RELA_SYMBOL(entries[i].info);
+    ElfTarget target = {.offset = entries[i].offset,
+                        .type = ELF_RELA_TYPE(entries[i].info),
+                        .addend = entries[i].addend,
+                        .target = "*BAD*"};
+    if (symbol_index < image->symbol_count) {
+      const Elf64Symbol *symbol = &image->symbols[symbol_index];
+      const bool local = ELF_SYMBOL_BIND(symbol->info) == ELF_STB_LOCAL &&
+                         symbol->shndx != 0;
+      if (local) {
+        target.target = _elf_section_name(image, symbol->shndx);
+        target.addend += (int64_t)symbol->value;
+      } else {
+        target.target = image->symbol_names + symbol->name;
+      }
+    }
+    arrput(targets, target);
+  }
+  return targets;
+}
+
+static bool _elf_diff_section(const ElfImage *expected, const ElfImage *actual,
+                              const char *name, uint32_t *reports) {
+  const Elf64SectionHeader *a = _elf_find_section(expected, name);
+  const Elf64SectionHeader *b = _elf_find_section(actual, name);
+  const uint64_t a_size = a ? a->size : 0;
+  const uint64_t b_size = b ? b->size : 0;
+  if (a_size != b_size) {
+    if ((*reports)++ < ELF_DIFF_MAX_REPORTS)
+      fprintf(stderr, "%s: expected %" PRIu64 " bytes, got %" PRIu64 "\n",
+              name, a_size, b_size);
+    return false;
+  }
+  if (a_size == 0 || a->type == ELF_SHT_NOBITS)
+    return true;
+  const uint8_t *a_bytes = expected->file + a->offset;
+  const uint8_t *b_bytes = actual->file + b->offset;
+  for (uint64_t i = 0; i < a_size; i++) {
+    if (a_bytes[i] != b_bytes[i]) {
+      if ((*reports)++ < ELF_DIFF_MAX_REPORTS)
+        fprintf(stderr,
+                "%s+0x%" PRIx64 ": expected byte %02x, got %02x\n", name, i,
+                a_bytes[i], b_bytes[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool _elf_diff_relocations(const ElfImage *expected,
+                                  const ElfImage *actual, uint32_t *reports) {
+  ElfTarget *a = _elf_text_relocations(expected);
+  ElfTarget *b = _elf_text_relocations(actual);
+  bool same = arrlenu(a) == arrlenu(b);
+  if (!same && (*reports)++ < ELF_DIFF_MAX_REPORTS) {
+    fprintf(stderr, ".rela.text: expected %zu relocations, got %zu\n",
+            (size_t)arrlenu(a), (size_t)arrlenu(b));
+  }
+  const size_t count = MIN(arrlenu(a), arrlenu(b));
+  for (size_t i = 0; i < count; i++) {
+    if (a[i].offset == b[i].offset && a[i].type == b[i].type &&
+        a[i].addend == b[i].addend && strcmp(a[i].target, b[i].target) == 0)
+      continue;
+    same = false;
+    if ((*reports)++ < ELF_DIFF_MAX_REPORTS)
+      fprintf(stderr,
+              ".rela.text: expected type %" PRIu32 " at 0x%" PRIx64
+              " to %s%+" PRId64 ", got type %" PRIu32 " at 0x%" PRIx64
+              " to %s%+" PRId64 "\n",
+              a[i].type, a[i].offset, a[i].target, a[i].addend, b[i].type,
+              b[i].offset, b[i].target, b[i].addend);
+  }
+  arrfree(a);
+  arrfree(b);
+  return same;
+}
+
+// Every defined global has to match by name, section and value
+static bool _elf_diff_globals(const ElfImage *expected, const ElfImage *actual,
+                              uint32_t *reports) {
+  bool same = true;
+  for (uint32_t i = 0; i < expected->symbol_count; i++) {
+    const Elf64Symbol *a = &expected->symbols[i];
+    if (ELF_SYMBOL_BIND(a->info) != ELF_STB_GLOBAL || a->shndx == 0)
+      continue;
+    const char *name = expected->symbol_names + a->name;
+    bool found = false;
+    for (uint32_t j = 0; j < actual->symbol_count && !found; j++) {
+      const Elf64Symbol *b = &actual->symbols[j];
+      found = ELF_SYMBOL_BIND(b->info) == ELF_STB_GLOBAL &&
+              strcmp(actual->symbol_names + b->name, name) == 0 &&
+              strcmp(_elf_section_name(expected, a->shndx),
+                     _elf_section_name(actual, b->shndx)) == 0 &&
+              a->value == b->value;
+    }
+    if (!found) {
+      same = false;
+      if ((*reports)++ < ELF_DIFF_MAX_REPORTS)
+        fprintf(stderr, "Global %s (%s+0x%" PRIx64 ") is missing\n", name,
+                _elf_section_name(expected, a->shndx), a->value);
+    }
+  }
+  return same;
+}
+
+bool object_file_diff_elf(const char *expected_path, const char *actual_path) {
+  ElfImage expected;
+  ElfImage actual;
+  bool same = _elf_load(&expected, expected_path);
+  same = _elf_load(&actual, actual_path) && same;
+  if (same) {
+    uint32_t reports = 0;
+    for (uint32_t section = OBJ_SECTION_TEXT; section < OBJ_SECTION_COUNT;
+         section++) {
+      same = _elf_diff_section(&expected, &actual, OBJ_SECTION_NAMES[section],
+                               &reports) &&
+             same;
+    }
+    same = _elf_diff_relocations(&expected, &actual, &reports) && same;
+    same = _elf_diff_globals(&expected, &actual, &reports) && same;
+    if (reports > ELF_DIFF_MAX_REPORTS) {
+      fprintf(stderr, "... and %" PRIu32 " more differences\n",
+              reports - ELF_DIFF_MAX_REPORTS);
+    }
+  }
+  free(expected.file);
+  free(actual.file);
+  return same;
+}
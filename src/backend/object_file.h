@@ -0,0 +1,75 @@
+#pragma once
+
+// -----------------------------
+// OBJECT FILE
+//
+// A relocatable object in memory: section contents,
+// symbols and relocations. Filled in by the machine
+// code encoder, and written out as ELF64
+// -----------------------------
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// X macro definitions for object sections, with their ELF names
+#define OBJ_SECTIONS(X)                                                        \
+  X(OBJ_SECTION_UNDEF, "")                                                     \
+  X(OBJ_SECTION_TEXT, ".text")                                                 \
+  X(OBJ_SECTION_DATA, ".data")                                                 \
+  X(OBJ_SECTION_BSS, ".bss")                                                   \
+  X(OBJ_SECTION_RODATA, ".rodata")
+
+typedef enum {
+#define X(name, str) name,
+  OBJ_SECTIONS(X)
+#undef X
+      OBJ_SECTION_COUNT,
+} ObjSection;
+
+typedef enum {
+  OBJ_RELOC_PC32,  // 32 bit pc relative data reference (R_X86_64_PC32)
+  OBJ_RELOC_PLT32, // 32 bit pc relative call (R_X86_64_PLT32)
+} ObjRelocType;
+
+typedef struct {
+  const char *name;   // NULL for section symbols
+  ObjSection section; // OBJ_SECTION_UNDEF if defined elsewhere
+  uint64_t value;     // Offset in its section
+  bool global;
+} ObjSymbol;
+
+// A relocation in .text
+typedef struct {
+  uint64_t offset; // Offset of the field being relocated
+  uint32_t symbol; // Index into the object's symbols
+  ObjRelocType type;
+  int64_t addend;
+} ObjRelocation;
+
+typedef struct {
+  uint8_t *bytes[OBJ_SECTION_COUNT]; // stb_ds arrays. NULL for UNDEF and BSS
+  uint64_t bss_size;
+  uint64_t bss_align;
+  ObjSymbol *symbols;         // stb_ds array
+  ObjRelocation *relocations; // stb_ds array, sorted by offset
+} ObjectFile;
+
+ObjectFile object_file_init(void);
+void object_file_destroy(ObjectFile *object);
+
+// Size of a section's contents, including .bss
+uint64_t object_file_section_size(const ObjectFile *object,
+                                  ObjSection section);
+
+// Writes the object as an x86-64 ELF64 relocatable. Returns false if the file
+// couldn't be written
+bool object_file_write_elf(const ObjectFile *object, FILE *file);
+
+// Compares two ELF64 relocatables by what the linker sees: section contents,
+// relocations and global symbols. References to local symbols are compared by
+// the section and offset they resolve to, since assemblers are free to pick
+// either the symbol or its section. Differences are reported on stderr.
+// Returns true if the objects are equivalent
+bool object_file_diff_elf(const char *expected_path, const char *actual_path);
@@ -0,0 +1,251 @@
+#include "peephole.h"
+#include <stdbool.h>
+#include <string.h>
+
+const char *const PEEPHOLE_RULE_NAMES[PEEPHOLE_RULE_COUNT] = {
+#define X(name, str) str,
+    PEEPHOLE_RULES(X)
+#undef X
+};
+
+// ----------------------
+// Operands
+// ----------------------
+
+static bool _is_reg(const Operand *operand, X86Reg reg) {
+  return operand->kind == OPERAND_REG && operand->reg == reg;
+}
+
+// Whether the operand reads reg, or is reg
+static bool _mentions(const Operand *operand, X86Reg reg) {
+  switch (operand->kind) {
+  case OPERAND_REG:
+  case OPERAND_BYTE_REG:
+    return operand->reg == reg;
+  case OPERAND_MEM:
+    return operand->reg == reg || (operand->scale && operand->index == reg);
+  case OPERAND_IMM:
+  case OPERAND_SYMBOL:
+    return false;
+  }
+  return true;
+}
+
+static bool _same_symbol(const Symbol *a, const Symbol *b) {
+  if (a->kind != b->kind || a->id != b->id)
+    return false;
+  if (!a->name || !b->name)
+    return a->name == b->name;
+  return strcmp(a->name, b->name) == 0;
+}
+
+// Whether both operands are the same QWORD in memory. Memory operands leave
+// out their size when a register gives it
+static bool _same_qword(const Operand *a, const Operand *b) {
+  if (a->kind != OPERAND_MEM || b->kind != OPERAND_MEM)
+    return false;
+  if ((a->ptr != PTR_NONE && a->ptr != PTR_QWORD) ||
+      (b->ptr != PTR_NONE && b->ptr != PTR_QWORD))
+    return false;
+  return a->reg == b->reg && a->scale == b->scale &&
+         (!a->scale || a->index == b->index) && a->value == b->value &&
+         _same_symbol(&a->symbol, &b->symbol);
+}
+
+// Whether the instruction stores a whole register or an immediate to memory
+static bool _is_store(const X86Instr *instr) {
+  return instr->op == OP_MOV && instr->operands[0].kind == OPERAND_MEM &&
+         (instr->operands[1].kind == OPERAND_REG ||
+          instr->operands[1].kind == OPERAND_IMM);
+}
+
+// Bits of the operands each instruction only reads, so a register holding the
+// same value can stand in for them
+static const uint8_t SOURCE_OPERANDS[OP_COUNT] = {
+    [OP_CMP] = 3,    [OP_TEST] = 3,    [OP_ADD] = 2,     [OP_SUB] = 2,
+    [OP_XOR] = 2,    [OP_IMUL] = 2,    [OP_CMOVE] = 2,   [OP_CMOVNE] = 2,
+    [OP_CMOVL] = 2,  [OP_CMOVLE] = 2,  [OP_CMOVG] = 2,   [OP_CMOVGE] = 2,
+};
+
+// Instructions that set their first operand without reading it
+static const bool OVERWRITES_FIRST[OP_COUNT] = {
+    [OP_MOV] = true,    [OP_MOVZX] = true, [OP_MOVSX] = true,
+    [OP_MOVSXD] = true, [OP_LEA] = true,   [OP_POP] = true,
+};
+
+// Whether the instruction sets reg without reading its old value
+static bool _overwrites(const X86Instr *instr, X86Reg reg) {
+  if (!OVERWRITES_FIRST[instr->op] || !_is_reg(&instr->operands[0], reg))
+    return false;
+  for (uint32_t i = 1; i < instr->operand_count; i++) {
+    if (_mentions(&instr->operands[i], reg))
+      return false;
+  }
+  return true;
+}
+
+// ----------------------
+// Rules
+//
+// Each rule looks at the end of the instructions kept
+// so far, and returns whether it changed anything
+// ----------------------
+
+typedef bool (*PeepholeApply)(X86Instr *instrs, uint32_t *count,
+                              PeepholeStats *stats);
+
+// Drops the second to last instruction
+static void _drop_previous(X86Instr *instrs, uint32_t *count) {
+  instrs[*count - 2] = instrs[*count - 1];
+  (*count)--;
+}
+
+// mov r, r
+static bool _self_move(X86Instr *instrs, uint32_t *count,
+                       PeepholeStats *stats) {
+  const X86Instr *last = &instrs[*count - 1];
+  if (last->op != OP_MOV || last->operands[0].kind != OPERAND_REG ||
+      !_is_reg(&last->operands[1], last->operands[0].reg))
+    return false;
+  (*count)--;
+  stats->removed[PEEPHOLE_SELF_MOVE]++;
+  return true;
+}
+
+// mov M, r followed by mov r, M drops the load. Loading M into another
+// register copies r, or the stored immediate, instead
+static bool _reload(X86Instr *instrs, uint32_t *count, PeepholeStats *stats) {
+  if (*count < 2)
+    return false;
+  const X86Instr *store = &instrs[*count - 2];
+  X86Instr *load = &instrs[*count - 1];
+  if (!_is_store(store) || load->op != OP_MOV ||
+      load->operands[0].kind != OPERAND_REG ||
+      !_same_qword(&store->operands[0], &load->operands[1]))
+    return false;
+  const Operand stored = store->operands[1];
+  if (_is_reg(&stored, load->operands[0].reg)) {
+    (*count)--;
+    stats->removed[PEEPHOLE_RELOAD]++;
+    return true;
+  }
+  load->operands[1] = stored;
+  stats->rewritten[PEEPHOLE_RELOAD]++;
+  return true;
+}
+
+// mov M, r followed by an instruction that reads M reads r instead
+static bool _store_forward(X86Instr *instrs, uint32_t *count,
+                           PeepholeStats *stats) {
+  if (*count < 2)
+    return false;
+  const X86Instr *store = &instrs[*count - 2];
+  X86Instr *last = &instrs[*count - 1];
+  if (!_is_store(store) || store->operands[1].kind != OPERAND_REG)
+    return false;
+  for (uint32_t i = 0; i < last->operand_count; i++) {
+    if ((SOURCE_OPERANDS[last->op] >> i & 1) &&
+        _same_qword(&store->operands[0], &last->operands[i])) {
+      last->operands[i] = store->operands[1];
+      stats->rewritten[PEEPHOLE_STORE_FORWARD]++;
+      return true;
+    }
+  }
+  return false;
+}
+
+// mov r, X followed by an instruction that sets r without reading it
+static bool _dead_move(X86Instr *instrs, uint32_t *count,
+                       PeepholeStats *stats) {
+  if (*count < 2)
+    return false;
+  const X86Instr *move = &instrs[*count - 2];
+  if (move->op != OP_MOV || move->operands[0].kind != OPERAND_REG ||
+      !_overwrites(&instrs[*count - 1], move->operands[0].reg))
+    return false;
+  _drop_previous(instrs, count);
+  stats->removed[PEEPHOLE_DEAD_MOVE]++;
+  return true;
+}
+
+// push a followed by pop b is mov b, a, or nothing when they're the same
+static bool _push_pop(X86Instr *instrs, uint32_t *count,
+                      PeepholeStats *stats) {
+  if (*count < 2)
+    return false;
+  X86Instr *push = &instrs[*count - 2];
+  const X86Instr *pop = &instrs[*count - 1];
+  if (push->op != OP_PUSH || pop->op != OP_POP ||
+      push->operands[0].kind != OPERAND_REG ||
+      pop->operands[0].kind != OPERAND_REG)
+    return false;
+  if (push->operands[0].reg == pop->operands[0].reg) {
+    *count -= 2;
+    stats->removed[PEEPHOLE_PUSH_POP] += 2;
+    return true;
+  }
+  *push = (X86Instr){.op = OP_MOV,
+                     .operand_count = 2,
+                     .operands = {pop->operands[0], push->operands[0]}};
+  (*count)--;
+  stats->removed[PEEPHOLE_PUSH_POP]++;
+  return true;
+}
+
+// cmp r, 0 sets the same flags as the shorter test r, r
+static bool _compare_zero(X86Instr *instrs, uint32_t *count,
+                          PeepholeStats *stats) {
+  X86Instr *last = &instrs[*count - 1];
+  if (last->op != OP_CMP || last->operands[0].kind != OPERAND_REG ||
+      last->operands[1].kind != OPERAND_IMM || last->operands[1].value != 0)
+    return false;
+  last->op = OP_TEST;
+  last->operands[1] = last->operands[0];
+  stats->rewritten[PEEPHOLE_COMPARE_ZERO]++;
+  return true;
+}
+
+// Tried in order at the end of the kept instructions. jmp to the next label
+// needs to know the label, so it's tried separately
+static const PeepholeApply RULES[] = {
+    _self_move, _reload, _store_forward, _dead_move, _push_pop, _compare_zero,
+};
+
+// Applies rules until none of them match the end of the instructions
+static void _apply_rules(X86Instr *instrs, uint32_t *count,
+                         PeepholeStats *stats) {
+  bool changed = true;
+  while (changed && *count) {
+    changed = false;
+    for (uint32_t r = 0; r < sizeof(RULES) / sizeof(*RULES) && !changed;
+         r++) {
+      changed = RULES[r](instrs, count, stats);
+    }
+  }
+}
+
+uint32_t peephole_optimize(X86Instr *instrs, uint32_t count,
+                           const Symbol *next_label, PeepholeStats *stats) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    instrs[kept++] = instrs[i];
+    _apply_rules(instrs, &kept, stats);
+  }
+  // Every pair before the jump has already been looked at, so dropping it
+  // can't enable anything else
+  if (next_label && kept && instrs[kept - 1].op == OP_JMP &&
+      instrs[kept - 1].operands[0].kind == OPERAND_SYMBOL &&
+      _same_symbol(&instrs[kept - 1].operands[0].symbol, next_label)) {
+    kept--;
+    stats->removed[PEEPHOLE_JUMP_TO_NEXT]++;
+  }
+  return kept;
+}
+
+uint32_t peephole_removed(const PeepholeStats *stats) {
+  uint32_t removed = 0;
+  for (uint32_t r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+    removed += stats->removed[r];
+  }
+  return removed;
+}
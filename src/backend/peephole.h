@@ -0,0 +1,53 @@
+#pragma once
+
+// -----------------------------
+// PEEPHOLE OPTIMIZER
+//
+// Cleans up the x86 instructions of a basic block
+// before they're written or encoded. Instruction
+// selection works on one IR instruction at a time, so
+// it leaves redundancies between neighbours, like a
+// value stored to a variable and loaded straight back.
+// Each rule looks at the last one or two instructions
+// of the block, and rules are tried again on whatever a
+// change leaves at the end, so one change can enable
+// the next
+// -----------------------------
+
+#include "instructions-x86.h"
+#include <stdint.h>
+
+// X macro definitions for every rule, with its name in statistics
+#define PEEPHOLE_RULES(X)                                                      \
+  X(PEEPHOLE_SELF_MOVE, "self moves")                                          \
+  X(PEEPHOLE_RELOAD, "reloads of a store")                                     \
+  X(PEEPHOLE_STORE_FORWARD, "reads of a store")                                \
+  X(PEEPHOLE_DEAD_MOVE, "overwritten moves")                                   \
+  X(PEEPHOLE_PUSH_POP, "push and pop pairs")                                   \
+  X(PEEPHOLE_COMPARE_ZERO, "compares with 0")                                  \
+  X(PEEPHOLE_JUMP_TO_NEXT, "jumps to the next instruction")
+
+typedef enum {
+#define X(name, str) name,
+  PEEPHOLE_RULES(X)
+#undef X
+      PEEPHOLE_RULE_COUNT,
+} PeepholeRule;
+
+extern const char *const PEEPHOLE_RULE_NAMES[PEEPHOLE_RULE_COUNT];
+
+// How often each rule fired. Rules that keep an instruction but make it
+// cheaper count as rewrites
+typedef struct {
+  uint32_t removed[PEEPHOLE_RULE_COUNT];
+  uint32_t rewritten[PEEPHOLE_RULE_COUNT];
+} PeepholeStats;
+
+// Optimizes count instructions in place, and returns how many are left.
+// next_label is the label the instructions fall into, or NULL when they don't
+// end at a label. stats is added to
+uint32_t peephole_optimize(X86Instr *instrs, uint32_t count,
+                           const Symbol *next_label, PeepholeStats *stats);
+
+// The number of instructions every rule removed in total
+uint32_t peephole_removed(const PeepholeStats *stats);
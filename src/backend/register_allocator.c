@@ -0,0 +1,545 @@
+#include "register_allocator.h"
+#include "ir_ssa.h"
+#include <stb_ds.h>
+#include <stdlib.h>
+
+// An allocation in progress
+typedef struct {
+  const IR *ir;
+  const CallingConvention *cc;
+  const bool *has_location; // Non-owning reference, indexed by temporary
+  AllocatorReads reads;
+  const void *context;
+  TempLocation *locations; // stb_ds array, indexed by temporary
+} RegisterAllocator;
+
+static bool _is_call(IrOpcode op) {
+  return op == IR_PRINT_INT || op == IR_PRINT_STR || op == IR_INPUT;
+}
+
+// What's known about each temporary while locations are assigned. Positions
+// count instructions within the block, with the terminator last
+typedef struct {
+  IrBlockID block; // The only block mentioning it, IR_NO_BLOCK if none yet
+  uint32_t first;  // Position of its first definition
+  uint32_t last;   // Position it's last mentioned at
+  bool global;     // Mentioned outside block, read before it's defined, or
+                   // live across a call
+} TempRange;
+
+// Notes a mention of temp at position in block. Reads come before the
+// instruction's own definition. Temporaries without a location are left out
+static void _note_mention(const RegisterAllocator *alloc, TempRange *ranges,
+                          IrTemp temp, IrBlockID block, uint32_t position,
+                          bool is_def, uint32_t last_call) {
+  if (!alloc->has_location[temp])
+    return;
+  TempRange *range = &ranges[temp];
+  if (range->block == IR_NO_BLOCK && is_def) {
+    range->block = block;
+    range->first = position;
+  } else if (range->block != block) {
+    range->global = true;
+  } else if (last_call != UINT32_MAX && last_call > range->first &&
+             last_call < position) {
+    range->global = true;
+  }
+  range->last = position;
+}
+
+static void _collect_ranges(const RegisterAllocator *alloc, TempRange *ranges) {
+  const IR *ir = alloc->ir;
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    const IrBlock *block = &ir->blocks[i];
+    uint32_t last_call = UINT32_MAX;
+    for (uint32_t j = 0; j < block->instr_count; j++) {
+      const IrInstr *instr = &block->instrs[j];
+      IrTemp reads[IR_MAX_ARGS];
+      const uint32_t read_count = alloc->reads(alloc->context, instr, reads);
+      for (uint32_t a = 0; a < read_count; a++) {
+        _note_mention(alloc, ranges, reads[a], i, j, false, last_call);
+      }
+      if (instr->dest != IR_NO_TEMP) {
+        _note_mention(alloc, ranges, instr->dest, i, j, true, last_call);
+      }
+      if (_is_call(instr->op)) {
+        last_call = j;
+      }
+    }
+    if (block->term.kind == IR_TERM_BRANCH) {
+      _note_mention(alloc, ranges, block->term.args[0], i, block->instr_count,
+                    false, last_call);
+      _note_mention(alloc, ranges, block->term.args[1], i, block->instr_count,
+                    false, last_call);
+    }
+  }
+}
+
+// A mention of a global temporary. The terminator's index is the block's
+// instruction count
+typedef struct {
+  IrBlockID block;
+  uint32_t index;
+  bool is_def;
+} Mention;
+
+// A run of positions, which count every instruction and terminator in layout
+// order. Each has two positions, reading its arguments at the first and
+// writing its result at the second, so a temporary read for the last time can
+// share its register with the result. Both ends are included
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+} LiveRange;
+
+// Where a global temporary is live. Between its ranges are holes it isn't
+// live in, which other temporaries can use its register for
+typedef struct {
+  IrTemp temp;
+  IrTemp hint;          // A temporary it's copied to or from, or IR_NO_TEMP
+  uint32_t first_range; // Index of its first range
+  uint32_t range_count;
+  uint32_t start;  // Start of the first range
+  uint32_t end;    // End of the last range
+  uint64_t weight; // How much keeping it in a register is worth
+} LiveInterval;
+
+typedef struct {
+  LiveInterval *intervals; // stb_ds array
+  LiveRange *ranges;       // stb_ds array. Each interval's, in order
+} Liveness;
+
+// Mentions in loops weigh this many times more per level of nesting
+#define LOOP_WEIGHT_SHIFT 3
+#define MAX_WEIGHTED_DEPTH 8
+
+// Groups the global temporaries' mentions by temporary, in layout order.
+// mention_start has an entry per temporary, plus one
+static Mention *_collect_global_mentions(const RegisterAllocator *alloc,
+                                         const TempRange *ranges,
+                                         uint32_t **mention_start) {
+  const IR *ir = alloc->ir;
+  uint32_t *start = NULL; // stb_ds array
+  arrsetlen(start, ir->temp_count + 1);
+  for (uint32_t t = 0; t <= ir->temp_count; t++) {
+    start[t] = 0;
+  }
+  // Counted first, then filled in a second walk
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    Mention *mentions = NULL; // stb_ds array
+    uint32_t *filled = NULL;  // stb_ds array
+    if (pass == 1) {
+      for (uint32_t t = 0; t < ir->temp_count; t++) {
+        start[t + 1] += start[t];
+      }
+      arrsetlen(mentions, start[ir->temp_count]);
+      arrsetlen(filled, ir->temp_count);
+      for (uint32_t t = 0; t < ir->temp_count; t++) {
+        filled[t] = start[t];
+      }
+    }
+    for (IrBlockID b = 0; b < ir->block_count; b++) {
+      const IrBlock *block = &ir->blocks[b];
+      for (uint32_t i = 0; i <= block->instr_count; i++) {
+        // Its arguments, then what it defines
+        IrTemp temps[IR_MAX_ARGS + 1] = {IR_NO_TEMP, IR_NO_TEMP, IR_NO_TEMP,
+                                         IR_NO_TEMP};
+        if (i == block->instr_count) {
+          if (block->term.kind == IR_TERM_BRANCH) {
+            temps[0] = block->term.args[0];
+            temps[1] = block->term.args[1];
+          }
+        } else {
+          const IrInstr *instr = &block->instrs[i];
+          alloc->reads(alloc->context, instr, temps);
+          temps[IR_MAX_ARGS] = instr->dest;
+        }
+        for (uint32_t k = 0; k <= IR_MAX_ARGS; k++) {
+          const IrTemp temp = temps[k];
+          if (temp == IR_NO_TEMP || !ranges[temp].global)
+            continue;
+          if (pass == 0) {
+            start[temp + 1]++;
+          } else {
+            mentions[filled[temp]++] =
+                (Mention){.block = b, .index = i, .is_def = k == IR_MAX_ARGS};
+          }
+        }
+      }
+    }
+    arrfree(filled);
+    if (pass == 1) {
+      *mention_start = start;
+      return mentions;
+    }
+  }
+  return NULL;
+}
+
+// Pairs up global temporaries that are copied into each other, so they can
+// share a register and the copy disappears
+static IrTemp *_copy_hints(const IR *ir, const TempRange *ranges) {
+  IrTemp *hints = NULL; // stb_ds array
+  arrsetlen(hints, ir->temp_count);
+  for (uint32_t t = 0; t < ir->temp_count; t++) {
+    hints[t] = IR_NO_TEMP;
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    const IrBlock *block = &ir->blocks[b];
+    for (uint32_t i = 0; i < block->instr_count; i++) {
+      const IrInstr *instr = &block->instrs[i];
+      if (instr->op != IR_COPY || !ranges[instr->dest].global ||
+          !ranges[instr->args[0]].global)
+        continue;
+      if (hints[instr->dest] == IR_NO_TEMP) {
+        hints[instr->dest] = instr->args[0];
+      }
+      if (hints[instr->args[0]] == IR_NO_TEMP) {
+        hints[instr->args[0]] = instr->dest;
+      }
+    }
+  }
+  return hints;
+}
+
+// The last position in a block, just past its terminator
+static uint32_t _block_end(const IR *ir, const uint32_t *block_start,
+                           IrBlockID block) {
+  return block_start[block] + 2 * ir->blocks[block].instr_count + 1;
+}
+
+static int _compare_block(const void *a, const void *b) {
+  const IrBlockID left = *(const IrBlockID *)a;
+  const IrBlockID right = *(const IrBlockID *)b;
+  return left < right ? -1 : left > right;
+}
+
+// Works out where every global temporary is live. A temporary is live into
+// every block from which a read of it can be reached without passing a
+// definition, found by walking predecessors back from each read. Within a
+// block it's live from the start if it's live in, or else from its first
+// mention, up to the end if it's live out, or else its last mention
+static Liveness _compute_liveness(const RegisterAllocator *alloc,
+                                  const TempRange *ranges) {
+  const IR *ir = alloc->ir;
+  uint32_t *block_start = NULL; // stb_ds array. Position of each block
+  arrsetlen(block_start, ir->block_count);
+  uint32_t position = 0;
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    block_start[b] = position;
+    position += 2 * (ir->blocks[b].instr_count + 1);
+  }
+  IrDominators doms = ir_dominators_compute(ir);
+  uint32_t *depths = ir_loop_depths(ir, &doms);
+  ir_dominators_destroy(&doms);
+  uint32_t *mention_start = NULL;
+  Mention *mentions = _collect_global_mentions(alloc, ranges, &mention_start);
+  IrTemp *hints = _copy_hints(ir, ranges);
+
+  // Blocks are marked with the temporary being worked on, plus one
+  uint32_t *defines = NULL;  // stb_ds array
+  uint32_t *live_in = NULL;  // stb_ds array
+  uint32_t *live_out = NULL; // stb_ds array
+  uint32_t *touched = NULL;  // stb_ds array. Whether it's in touched_blocks
+  uint32_t *first = NULL;    // stb_ds array. Position of the first mention
+  uint32_t *last = NULL;     // stb_ds array. Position of the last mention
+  arrsetlen(defines, ir->block_count);
+  arrsetlen(live_in, ir->block_count);
+  arrsetlen(live_out, ir->block_count);
+  arrsetlen(touched, ir->block_count);
+  arrsetlen(first, ir->block_count);
+  arrsetlen(last, ir->block_count);
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    defines[b] = live_in[b] = live_out[b] = touched[b] = 0;
+  }
+  IrBlockID *stack = NULL; // stb_ds array
+  Liveness liveness = {.intervals = NULL, .ranges = NULL};
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    if (!ranges[t].global)
+      continue;
+    const uint32_t mark = t + 1;
+    LiveInterval interval = {.temp = t,
+                             .hint = hints[t],
+                             .first_range = (uint32_t)arrlenu(liveness.ranges),
+                             .range_count = 0,
+                             .weight = 0};
+    IrBlockID *touched_blocks = NULL; // stb_ds array
+    for (uint32_t m = mention_start[t]; m < mention_start[t + 1]; m++) {
+      if (mentions[m].is_def) {
+        defines[mentions[m].block] = mark;
+      }
+    }
+    bool defined = false; // Whether the block defined it before this mention
+    for (uint32_t m = mention_start[t]; m < mention_start[t + 1]; m++) {
+      const Mention *mention = &mentions[m];
+      const IrBlockID block = mention->block;
+      const uint32_t at =
+          block_start[block] + 2 * mention->index + mention->is_def;
+      if (touched[block] != mark) {
+        touched[block] = mark;
+        arrput(touched_blocks, block);
+        first[block] = at;
+        defined = false;
+      }
+      last[block] = at;
+      const uint32_t depth = depths[block] < MAX_WEIGHTED_DEPTH
+                                 ? depths[block]
+                                 : MAX_WEIGHTED_DEPTH;
+      interval.weight += 1ull << (depth * LOOP_WEIGHT_SHIFT);
+      if (!mention->is_def && !defined && live_in[block] != mark) {
+        live_in[block] = mark;
+        arrput(stack, block);
+      }
+      defined |= mention->is_def;
+    }
+    while (arrlenu(stack)) {
+      const IrBlock *live_block = &ir->blocks[arrpop(stack)];
+      for (uint32_t p = 0; p < live_block->pred_count; p++) {
+        const IrBlockID pred = live_block->preds[p];
+        live_out[pred] = mark;
+        if (touched[pred] != mark) {
+          // Live straight through, unless it's defined there
+          touched[pred] = mark;
+          arrput(touched_blocks, pred);
+          first[pred] = block_start[pred];
+          last[pred] = _block_end(ir, block_start, pred);
+        }
+        if (defines[pred] != mark && live_in[pred] != mark) {
+          live_in[pred] = mark;
+          arrput(stack, pred);
+        }
+      }
+    }
+    const uint32_t touched_count = (uint32_t)arrlenu(touched_blocks);
+    qsort(touched_blocks, touched_count, sizeof(*touched_blocks),
+          _compare_block);
+    for (uint32_t i = 0; i < touched_count; i++) {
+      const IrBlockID block = touched_blocks[i];
+      const LiveRange range = {
+          .start = live_in[block] == mark ? block_start[block] : first[block],
+          .end = live_out[block] == mark ? _block_end(ir, block_start, block)
+                                         : last[block]};
+      // Ranges that meet are merged
+      if (interval.range_count &&
+          arrlast(liveness.ranges).end + 1 >= range.start) {
+        arrlast(liveness.ranges).end = range.end;
+        continue;
+      }
+      arrput(liveness.ranges, range);
+      interval.range_count++;
+    }
+    interval.start = liveness.ranges[interval.first_range].start;
+    interval.end = arrlast(liveness.ranges).end;
+    arrput(liveness.intervals, interval);
+    arrfree(touched_blocks);
+  }
+  arrfree(stack);
+  arrfree(last);
+  arrfree(first);
+  arrfree(touched);
+  arrfree(live_out);
+  arrfree(live_in);
+  arrfree(defines);
+  arrfree(hints);
+  arrfree(mentions);
+  arrfree(mention_start);
+  arrfree(depths);
+  arrfree(block_start);
+  return liveness;
+}
+
+static int _compare_interval_start(const void *a, const void *b) {
+  const LiveInterval *left = a;
+  const LiveInterval *right = b;
+  if (left->start != right->start)
+    return left->start < right->start ? -1 : 1;
+  return left->temp < right->temp ? -1 : left->temp > right->temp;
+}
+
+// Whether two intervals are live at the same position
+static bool _intervals_overlap(const LiveRange *ranges, const LiveInterval *a,
+                               const LiveInterval *b) {
+  if (a->end < b->start || b->end < a->start)
+    return false;
+  uint32_t i = a->first_range;
+  uint32_t j = b->first_range;
+  const uint32_t a_end = a->first_range + a->range_count;
+  const uint32_t b_end = b->first_range + b->range_count;
+  while (i < a_end && j < b_end) {
+    if (ranges[i].end < ranges[j].start) {
+      i++;
+    } else if (ranges[j].end < ranges[i].start) {
+      j++;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Gives the global temporaries callee-saved registers by linear scan, marking
+// the ones left over as on the stack. An interval can take a register while
+// the intervals holding it are in a hole. When none is free, it takes the
+// register whose overlapping holders are worth the least in total, if they're
+// worth less than it. Returns the callee-saved registers used, by their index
+static uint32_t _allocate_global(RegisterAllocator *alloc,
+                                 const TempRange *temp_ranges) {
+  const CallingConvention *cc = alloc->cc;
+  Liveness liveness = _compute_liveness(alloc, temp_ranges);
+  LiveInterval *intervals = liveness.intervals;
+  const uint32_t count = (uint32_t)arrlenu(intervals);
+  if (count) {
+    qsort(intervals, count, sizeof(*intervals), _compare_interval_start);
+  }
+  // Register index of each temporary's interval, UINT32_MAX until it has one
+  uint32_t *temp_reg = NULL; // stb_ds array
+  arrsetlen(temp_reg, alloc->ir->temp_count);
+  for (uint32_t t = 0; t < alloc->ir->temp_count; t++) {
+    temp_reg[t] = UINT32_MAX;
+  }
+  // Intervals holding each register that haven't ended yet, by index
+  uint32_t *holders[MAX_REGISTER] = {NULL}; // stb_ds arrays
+  uint32_t used = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const LiveInterval *current = &intervals[i];
+    uint32_t chosen = UINT32_MAX;
+    uint64_t cheapest = UINT64_MAX;
+    for (uint32_t r = 0; r < cc->saved_count; r++) {
+      uint64_t cost = 0;
+      uint32_t kept = 0;
+      for (uint32_t h = 0; h < arrlenu(holders[r]); h++) {
+        const LiveInterval *holder = &intervals[holders[r][h]];
+        if (holder->end < current->start)
+          continue;
+        holders[r][kept++] = holders[r][h];
+        if (_intervals_overlap(liveness.ranges, holder, current)) {
+          cost += holder->weight;
+        }
+      }
+      arrsetlen(holders[r], kept);
+      const bool hinted =
+          current->hint != IR_NO_TEMP && temp_reg[current->hint] == r;
+      if (cost < cheapest || (cost == cheapest && cost == 0 && hinted)) {
+        cheapest = cost;
+        chosen = r;
+      }
+    }
+    if (cheapest >= current->weight && cheapest != 0) {
+      alloc->locations[current->temp].on_stack = true;
+      continue;
+    }
+    // Whatever overlaps it is evicted to the stack
+    uint32_t kept = 0;
+    for (uint32_t h = 0; h < arrlenu(holders[chosen]); h++) {
+      const LiveInterval *holder = &intervals[holders[chosen][h]];
+      if (_intervals_overlap(liveness.ranges, holder, current)) {
+        alloc->locations[holder->temp].on_stack = true;
+        temp_reg[holder->temp] = UINT32_MAX;
+      } else {
+        holders[chosen][kept++] = holders[chosen][h];
+      }
+    }
+    arrsetlen(holders[chosen], kept);
+    arrput(holders[chosen], i);
+    temp_reg[current->temp] = chosen;
+    alloc->locations[current->temp].reg = cc->saved_r[chosen];
+    used |= 1u << chosen;
+  }
+  for (uint32_t r = 0; r < MAX_REGISTER; r++) {
+    arrfree(holders[r]);
+  }
+  arrfree(temp_reg);
+  arrfree(liveness.ranges);
+  arrfree(liveness.intervals);
+  return used;
+}
+
+// Returns temp's register to free if it's last mentioned at position
+static void _release(const RegisterAllocator *alloc, const TempRange *ranges,
+                     IrTemp temp, uint32_t position, uint32_t *free) {
+  const CallingConvention *cc = alloc->cc;
+  if (ranges[temp].block == IR_NO_BLOCK || ranges[temp].global ||
+      ranges[temp].last != position)
+    return;
+  for (uint32_t r = 0; r < cc->scratch_count; r++) {
+    if (cc->scratch_r[r] == alloc->locations[temp].reg) {
+      *free |= 1u << r;
+    }
+  }
+}
+
+Allocation register_allocate(const IR *ir, const CallingConvention *cc,
+                              const bool *has_location,
+                              AllocatorReads instr_reads,
+                              const void *context) {
+  RegisterAllocator allocator = {.ir = ir,
+                                 .cc = cc,
+                                 .has_location = has_location,
+                                 .reads = instr_reads,
+                                 .context = context,
+                                 .locations = NULL};
+  RegisterAllocator *alloc = &allocator;
+  TempRange *ranges = NULL; // stb_ds array
+  arrsetlen(ranges, ir->temp_count);
+  arrsetlen(alloc->locations, ir->temp_count);
+  for (uint32_t t = 0; t < ir->temp_count; t++) {
+    ranges[t] = (TempRange){.block = IR_NO_BLOCK};
+    alloc->locations[t] = (TempLocation){.on_stack = false, .reg = REG_RAX};
+  }
+  _collect_ranges(alloc, ranges);
+  const uint32_t saved_registers = _allocate_global(alloc, ranges);
+  // The callee-saved registers are saved in the first slots
+  uint32_t stack_slots = (uint32_t)__builtin_popcount(saved_registers);
+  for (uint32_t t = 0; t < ir->temp_count; t++) {
+    if (alloc->locations[t].on_stack) {
+      stack_slots++;
+      alloc->locations[t].offset = -(int32_t)(stack_slots * STACK_SLOT_SIZE);
+    }
+  }
+  const uint32_t all_free = (1u << cc->scratch_count) - 1;
+  for (uint32_t i = 0; i < ir->block_count; i++) {
+    const IrBlock *block = &ir->blocks[i];
+    uint32_t free = all_free;
+    for (uint32_t j = 0; j < block->instr_count; j++) {
+      const IrInstr *instr = &block->instrs[j];
+      IrTemp reads[IR_MAX_ARGS];
+      const uint32_t read_count = alloc->reads(alloc->context, instr, reads);
+      for (uint32_t a = 0; a < read_count; a++) {
+        _release(alloc, ranges, reads[a], j, &free);
+      }
+      const IrTemp dest = instr->dest;
+      if (dest == IR_NO_TEMP || ranges[dest].block == IR_NO_BLOCK ||
+          ranges[dest].global || ranges[dest].first != j)
+        continue;
+      if (free == 0) {
+        stack_slots++;
+        ranges[dest].global = true;
+        alloc->locations[dest] = (TempLocation){
+            .on_stack = true,
+            .offset = -(int32_t)(stack_slots * STACK_SLOT_SIZE)};
+        continue;
+      }
+      // Taking the register of the first argument saves a move, since x86
+      // overwrites its first operand
+      uint32_t r = (uint32_t)__builtin_ctz(free);
+      const IrTemp first_arg = instr->args[0];
+      for (uint32_t k = 0; first_arg != IR_NO_TEMP &&
+                           !ranges[first_arg].global && k < cc->scratch_count;
+           k++) {
+        if ((free >> k & 1) &&
+            cc->scratch_r[k] == alloc->locations[first_arg].reg) {
+          r = k;
+        }
+      }
+      free &= ~(1u << r);
+      alloc->locations[dest].reg = cc->scratch_r[r];
+      _release(alloc, ranges, dest, j, &free);
+    }
+  }
+  arrfree(ranges);
+  // Calls need the stack to stay 16 byte aligned
+  return (Allocation){
+      .locations = alloc->locations,
+      .saved_registers = saved_registers,
+      .frame_size = (stack_slots * STACK_SLOT_SIZE + 15) & ~15u};
+}
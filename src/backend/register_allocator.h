@@ -0,0 +1,59 @@
+#pragma once
+
+// -----------------------------
+// REGISTER ALLOCATOR
+//
+// Temporaries that are live across a call or into
+// another block are allocated first, by linear scan over
+// the blocks in layout order. Each one holds one of the
+// callee-saved registers, which the runtime never
+// touches, over the whole range of positions it's live
+// at. When they run out, whichever competing temporary
+// is mentioned least goes to a stack slot in main's
+// frame instead, with mentions inside loops counting
+// for more, so the values loops work on stay in
+// registers.
+// The rest are given the volatile scratch registers one
+// block at a time. A register is handed out where its
+// temporary is first defined, and handed back after the
+// temporary is last mentioned. Any that don't fit get a
+// stack slot too.
+// rax and rdx are never handed out, so instruction
+// selection is free to use them
+// -----------------------------
+
+#include "ir.h"
+#include "platform.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STACK_SLOT_SIZE 8 // Every stack slot holds a QWORD
+
+// Where a temporary lives while it's live
+typedef struct {
+  bool on_stack;
+  X86Reg reg;     // For temporaries in registers
+  int32_t offset; // From rbp, for temporaries on the stack
+} TempLocation;
+
+// Writes the temporaries the code selected for instr reads to reads, and
+// returns how many there are
+typedef uint32_t (*AllocatorReads)(const void *context, const IrInstr *instr,
+                                   IrTemp reads[IR_MAX_ARGS]);
+
+typedef struct {
+  TempLocation *locations;  // stb_ds array, indexed by temporary
+  uint32_t saved_registers; // Callee-saved registers used, as bits indexed
+                            // like the calling convention's. They're saved in
+                            // the first stack slots
+  uint32_t frame_size;      // Bytes of stack slots main needs, a multiple of 16
+} Allocation;
+
+// Gives every temporary that needs one a location, and sizes main's frame to
+// hold the callee-saved registers it uses and the temporaries on the stack.
+// has_location is indexed by temporary, and instr_reads is called with
+// context. The IR's predecessors have to be computed
+Allocation register_allocate(const IR *ir, const CallingConvention *cc,
+                              const bool *has_location,
+                              AllocatorReads instr_reads,
+                              const void *context);
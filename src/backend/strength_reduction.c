@@ -0,0 +1,94 @@
+#include "strength_reduction.h"
+
+// Longest sequence of lea, shifts and neg that beats a multiply, which takes
+// three cycles
+#define MAX_MULTIPLY_STEPS 2
+
+static bool _is_power_of_two(uint64_t value) {
+  return value && !(value & (value - 1));
+}
+
+// |value|, which fits even for INT64_MIN
+static uint64_t _magnitude(int64_t value) {
+  return value < 0 ? -(uint64_t)value : (uint64_t)value;
+}
+
+MultiplyPlan strength_reduce_multiply(int64_t factor) {
+  if (factor == 0)
+    return (MultiplyPlan){.zero = true};
+  const uint64_t magnitude = _magnitude(factor);
+  const uint8_t shift = (uint8_t)__builtin_ctzll(magnitude);
+  const uint64_t odd = magnitude >> shift;
+  MultiplyPlan plan = {.shift = shift, .negate = factor < 0};
+  if (odd == 3 || odd == 5 || odd == 9) {
+    plan.scale = (uint8_t)(odd - 1);
+  } else if (odd != 1) {
+    return (MultiplyPlan){.multiply = true};
+  }
+  const uint32_t steps = (plan.scale != 0) + (plan.shift != 0) + plan.negate;
+  if (steps > MAX_MULTIPLY_STEPS)
+    return (MultiplyPlan){.multiply = true};
+  return plan;
+}
+
+// Granlund and Montgomery's magic numbers, worked out the way Hacker's
+// Delight does: the smallest shift whose multiplier is exact for every 64 bit
+// dividend
+static DividePlan _magic(int64_t divisor) {
+  const uint64_t two63 = 1ull << 63;
+  const uint64_t magnitude = _magnitude(divisor);
+  const uint64_t t = two63 + ((uint64_t)divisor >> 63);
+  // The largest dividend that leaves remainder magnitude - 1
+  const uint64_t anc = t - 1 - t % magnitude;
+  uint32_t p = 63;
+  uint64_t q1 = two63 / anc;
+  uint64_t r1 = two63 - q1 * anc;
+  uint64_t q2 = two63 / magnitude;
+  uint64_t r2 = two63 - q2 * magnitude;
+  uint64_t delta = 0;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= magnitude) {
+      q2++;
+      r2 -= magnitude;
+    }
+    delta = magnitude - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  uint64_t multiplier = q2 + 1;
+  if (divisor < 0)
+    multiplier = -multiplier;
+  DividePlan plan = {.kind = DIVIDE_MAGIC,
+                     .shift = (uint8_t)(p - 64),
+                     .multiplier = (int64_t)multiplier};
+  // The multiplier can come out with the wrong sign, which the dividend makes
+  // up for
+  if (divisor > 0 && plan.multiplier < 0) {
+    plan.adjust = 1;
+  } else if (divisor < 0 && plan.multiplier > 0) {
+    plan.adjust = -1;
+  }
+  return plan;
+}
+
+DividePlan strength_reduce_divide(int64_t divisor) {
+  if (divisor == 0 || divisor == -1)
+    return (DividePlan){.kind = DIVIDE_IDIV};
+  if (divisor == 1)
+    return (DividePlan){.kind = DIVIDE_COPY};
+  const uint64_t magnitude = _magnitude(divisor);
+  if (_is_power_of_two(magnitude)) {
+    return (DividePlan){.kind = DIVIDE_SHIFT,
+                        .shift = (uint8_t)__builtin_ctzll(magnitude),
+                        .negate = divisor < 0};
+  }
+  return _magic(divisor);
+}
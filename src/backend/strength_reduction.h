@@ -0,0 +1,56 @@
+#pragma once
+
+// -----------------------------
+// STRENGTH REDUCTION
+//
+// Plans for multiplying and dividing by a constant with
+// cheaper instructions than imul and idiv. Products
+// become shifts, scaled adds and negation, and signed
+// quotients become a multiply by a magic number that
+// keeps the high half of the product, then shifts and
+// a fix up that rounds toward zero like idiv does
+// -----------------------------
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// x * factor, worked out as
+//   y = scale ? x + x * scale : x
+//   y = y << shift
+//   y = negate ? -y : y
+// unless zero or multiply say otherwise
+typedef struct {
+  bool zero;      // The product is always 0
+  bool multiply;  // Nothing cheaper than a multiply
+  uint8_t scale;  // 0, or 2, 4 or 8, to work out x + x * scale with lea
+  uint8_t shift;  // Shifts left by this much
+  bool negate;    // Negates the result
+} MultiplyPlan;
+
+typedef enum {
+  DIVIDE_IDIV,  // Left to idiv. Dividing by 0 or -1 has to trap the same way
+  DIVIDE_COPY,  // Dividing by 1
+  DIVIDE_SHIFT, // Dividing by a power of two, positive or negative
+  DIVIDE_MAGIC, // Everything else
+} DivideKind;
+
+// x / divisor, rounded toward zero.
+// DIVIDE_SHIFT biases negative dividends by 2^shift - 1 first:
+//   q = (x + ((x >> 63) >>> (64 - shift))) >> shift
+//   q = negate ? -q : q
+// DIVIDE_MAGIC keeps the high half of multiplier * x, then:
+//   q = high + x * adjust
+//   q = q >> shift
+//   q = q + (q >>> 63)
+// where >> is an arithmetic shift, and >>> a logical one
+typedef struct {
+  DivideKind kind;
+  uint8_t shift;
+  bool negate;
+  int64_t multiplier;
+  int8_t adjust; // -1, 0 or 1
+} DividePlan;
+
+MultiplyPlan strength_reduce_multiply(int64_t factor);
+
+DividePlan strength_reduce_divide(int64_t divisor);
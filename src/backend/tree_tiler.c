@@ -0,0 +1,483 @@
+#include "tree_tiler.h"
+#include "dz_debug.h"
+#include "strength_reduction.h"
+#include <stb_ds.h>
+
+// X macro definitions for the nonterminals of the tree grammar
+#define TREE_NONTERMINALS(X)                                                   \
+  X(NT_REG)        /* A temporary with a location */                           \
+  X(NT_IMM)        /* A 32 bit constant */                                     \
+  X(NT_MEM)        /* A temporary living in a variable's memory */             \
+  X(NT_OPERAND)    /* Anything a generic rule takes */                         \
+  X(NT_INDEX)      /* index*scale */                                           \
+  X(NT_BASE_DISP)  /* base+disp */                                             \
+  X(NT_BASE_INDEX) /* base+index*scale */                                      \
+  X(NT_FULL)       /* base+index*scale+disp */                                 \
+  X(NT_ADDR)       /* Any of the three addresses */
+
+typedef enum {
+#define X(name) name,
+  TREE_NONTERMINALS(X)
+#undef X
+      NT_COUNT,
+} Nonterminal;
+
+// The opcode of chain rules, which reduce a node from one nonterminal to
+// another
+#define TREE_CHAIN IR_OPCODE_COUNT
+
+// X macro definitions for the rules of the tree grammar, as
+// X(name, nonterminal, opcode, left, right, cost), with chain rules taking
+// their node as left. Costs count instructions, and _rule_cost refines them
+// for the arguments at hand. Chain rules come first, each after every chain
+// rule reaching the nonterminal it reduces from, so one pass closes a label
+#define TREE_RULES(X)                                                          \
+  X(RULE_ADDR_BASE_DISP, NT_ADDR, TREE_CHAIN, NT_BASE_DISP, NT_COUNT, 0)       \
+  X(RULE_ADDR_BASE_INDEX, NT_ADDR, TREE_CHAIN, NT_BASE_INDEX, NT_COUNT, 0)     \
+  X(RULE_ADDR_FULL, NT_ADDR, TREE_CHAIN, NT_FULL, NT_COUNT, 0)                 \
+  X(RULE_LEA, NT_REG, TREE_CHAIN, NT_ADDR, NT_COUNT, 1)                        \
+  X(RULE_LOAD, NT_REG, TREE_CHAIN, NT_MEM, NT_COUNT, 1)                        \
+  X(RULE_OPERAND_REG, NT_OPERAND, TREE_CHAIN, NT_REG, NT_COUNT, 0)             \
+  X(RULE_OPERAND_MEM, NT_OPERAND, TREE_CHAIN, NT_MEM, NT_COUNT, 0)             \
+  X(RULE_OPERAND_IMM, NT_OPERAND, TREE_CHAIN, NT_IMM, NT_COUNT, 0)             \
+  X(RULE_INDEX_REG, NT_INDEX, TREE_CHAIN, NT_REG, NT_COUNT, 0)                 \
+  X(RULE_ADD, NT_REG, IR_ADD, NT_OPERAND, NT_OPERAND, 2)                       \
+  X(RULE_SUB, NT_REG, IR_SUB, NT_OPERAND, NT_OPERAND, 2)                       \
+  X(RULE_MUL, NT_REG, IR_MUL, NT_OPERAND, NT_OPERAND, 2)                       \
+  X(RULE_INDEX_MUL, NT_INDEX, IR_MUL, NT_REG, NT_IMM, 0)                       \
+  X(RULE_BASE_DISP_ADD, NT_BASE_DISP, IR_ADD, NT_REG, NT_IMM, 0)               \
+  X(RULE_BASE_DISP_SUB, NT_BASE_DISP, IR_SUB, NT_REG, NT_IMM, 0)               \
+  X(RULE_BASE_INDEX_ADD, NT_BASE_INDEX, IR_ADD, NT_REG, NT_INDEX, 0)           \
+  X(RULE_BASE_INDEX_MUL, NT_BASE_INDEX, IR_MUL, NT_REG, NT_IMM, 0)             \
+  X(RULE_FULL_ADD, NT_FULL, IR_ADD, NT_BASE_INDEX, NT_IMM, 0)                  \
+  X(RULE_FULL_SUB, NT_FULL, IR_SUB, NT_BASE_INDEX, NT_IMM, 0)                  \
+  X(RULE_FULL_ADD_INDEX, NT_FULL, IR_ADD, NT_BASE_DISP, NT_INDEX, 0)
+
+typedef enum {
+#define X(name, nt, op, left, right, cost) name,
+  TREE_RULES(X)
+#undef X
+      RULE_COUNT,
+} TreeRuleID;
+
+typedef struct {
+  Nonterminal nt;
+  uint32_t op; // An IrOpcode, or TREE_CHAIN
+  Nonterminal left;
+  Nonterminal right;
+  uint32_t cost;
+} TreeRule;
+
+static const TreeRule TREE_RULE_TABLE[RULE_COUNT] = {
+#define X(name, nt, op, left, right, cost) {nt, op, left, right, cost},
+    TREE_RULES(X)
+#undef X
+};
+
+#define NO_COST UINT32_MAX
+// The most temporaries a subtree can read and still be folded into its
+// parent. Only addresses are folded, and they read two at most
+#define TREE_MAX_LEAVES 4
+
+// The cheapest rule found to reduce a node to each nonterminal
+typedef struct {
+  uint32_t cost[NT_COUNT];
+  uint8_t rule[NT_COUNT]; // TreeRuleID
+  uint16_t swapped;       // Bits of the nonterminals whose rule takes the
+                          // arguments the other way round
+  IrTemp leaves[TREE_MAX_LEAVES]; // What its subtree reads, besides constants
+  uint32_t leaf_count;            // More than TREE_MAX_LEAVES when it reads
+                                  // too many to track
+  bool coverable; // Its parent can fold it in, since nothing in between
+                  // changes its leaves
+} TreeLabel;
+
+// A block being tiled. Serials number every instruction in layout order, so
+// changes can be ordered across blocks
+typedef struct {
+  TreeTemp *temps;        // Non-owning reference, indexed by temporary
+  TreeAddress *addresses; // stb_ds array, of the trees tiled as an lea
+  const IrBlock *block;
+  IrBlockID block_id;
+  TreeLabel *labels;    // stb_ds array, indexed by position in block
+  uint32_t serial;      // Of the block's first instruction
+  uint32_t *last_def;   // stb_ds array, serial of each temporary's last
+                        // definition, or UINT32_MAX
+  uint32_t *last_store; // stb_ds array, serial of each variable's last write,
+                        // or UINT32_MAX
+  TreeLabel empty;      // No rule reduces it to anything
+  TreeLabel leaf_kinds[NT_COUNT]; // Closed labels of leaves reduced to each
+                                  // nonterminal, before their leaves are added
+} TreeTiler;
+
+static bool _fits_int32(int64_t value) {
+  return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool _is_imm32(const TreeTiler *tiler, IrTemp temp) {
+  const TreeTemp *value = &tiler->temps[temp];
+  return value->known && _fits_int32(value->value);
+}
+
+static uint32_t _add_costs(uint32_t a, uint32_t b) {
+  return a == NO_COST || b == NO_COST ? NO_COST : a + b;
+}
+
+static bool _is_tree_op(IrOpcode op) {
+  return op == IR_ADD || op == IR_SUB || op == IR_MUL;
+}
+
+static void _add_leaves(TreeLabel *label, const TreeLabel *from) {
+  if (label->leaf_count + from->leaf_count > TREE_MAX_LEAVES) {
+    label->leaf_count = TREE_MAX_LEAVES + 1;
+    return;
+  }
+  for (uint32_t l = 0; l < from->leaf_count; l++) {
+    label->leaves[label->leaf_count++] = from->leaves[l];
+  }
+}
+
+// Applies every chain rule that makes a nonterminal cheaper, in one pass
+static void _close_chains(TreeLabel *label) {
+  for (uint32_t r = 0; TREE_RULE_TABLE[r].op == TREE_CHAIN; r++) {
+    const TreeRule *rule = &TREE_RULE_TABLE[r];
+    const uint32_t cost = _add_costs(label->cost[rule->left], rule->cost);
+    if (cost < label->cost[rule->nt]) {
+      label->cost[rule->nt] = cost;
+      label->rule[rule->nt] = (uint8_t)r;
+    }
+  }
+}
+
+// The label of a temporary that isn't a node of the tree. Constants that
+// don't fit an immediate are left to the generic rules
+static TreeLabel _leaf_label(const TreeTiler *tiler, IrTemp temp) {
+  const TreeTemp *value = &tiler->temps[temp];
+  Nonterminal nt = NT_OPERAND;
+  if (_is_imm32(tiler, temp)) {
+    nt = NT_IMM;
+  } else if (value->variable != TREE_NO_VARIABLE) {
+    nt = NT_MEM;
+  } else if (tiler->temps[temp].has_location) {
+    nt = NT_REG;
+  }
+  TreeLabel label = tiler->leaf_kinds[nt];
+  if (nt == NT_REG || nt == NT_MEM) {
+    label.leaves[label.leaf_count++] = temp;
+  }
+  return label;
+}
+
+// The position of the node defining temp, if it's only read by the node at
+// position and could be folded into it. UINT32_MAX if not
+static uint32_t _tree_candidate(const TreeTiler *tiler, IrTemp temp,
+                                uint32_t position) {
+  const TreeTemp *use = &tiler->temps[temp];
+  if (use->defs != 1 || use->reads != 1 || use->read_elsewhere ||
+      use->block != tiler->block_id || use->def >= position ||
+      !_is_tree_op(tiler->block->instrs[use->def].op) ||
+      !tiler->temps[temp].has_location)
+    return UINT32_MAX;
+  return use->def;
+}
+
+// The label of the node defining temp, if the node at position can fold it in
+static const TreeLabel *_tree_child(const TreeTiler *tiler, IrTemp temp,
+                                    uint32_t position) {
+  const uint32_t def = _tree_candidate(tiler, temp, position);
+  if (def == UINT32_MAX || !tiler->labels[def].coverable)
+    return NULL;
+  return &tiler->labels[def];
+}
+
+// Whether nothing after the node at position and before serial changes any
+// of its leaves, so reading them at serial reads the same values
+static bool _leaves_unchanged(const TreeTiler *tiler, uint32_t position,
+                              uint32_t serial) {
+  const TreeLabel *label = &tiler->labels[position];
+  if (label->leaf_count > TREE_MAX_LEAVES)
+    return false;
+  for (uint32_t l = 0; l < label->leaf_count; l++) {
+    const IrTemp leaf = label->leaves[l];
+    const uint32_t variable = tiler->temps[leaf].variable;
+    const uint32_t changed = variable != TREE_NO_VARIABLE
+                                 ? tiler->last_store[variable]
+                                 : tiler->last_def[leaf];
+    if (changed != UINT32_MAX && changed > tiler->serial + position &&
+        changed < serial)
+      return false;
+  }
+  return true;
+}
+
+static int64_t _constant(const TreeTiler *tiler, IrTemp temp) {
+  return tiler->temps[temp].value;
+}
+
+// The cost of a base rule on a node, from the table, refined by its
+// arguments. NO_COST if it doesn't apply to them
+static uint32_t _rule_cost(const TreeTiler *tiler, TreeRuleID rule,
+                           const IrInstr *instr, IrTemp left, IrTemp right) {
+  const uint32_t cost = TREE_RULE_TABLE[rule].cost;
+  switch (rule) {
+  case RULE_ADD:
+  case RULE_SUB: {
+    // Adding to a variable in place is a single instruction
+    const uint32_t variable = tiler->temps[instr->dest].variable;
+    return variable != TREE_NO_VARIABLE &&
+                   tiler->temps[left].variable == variable
+               ? 1
+               : cost;
+  }
+  case RULE_MUL: {
+    // Constant factors are left to the plan from strength reduction
+    if (!tiler->temps[right].known)
+      return cost;
+    const MultiplyPlan plan = strength_reduce_multiply(_constant(tiler, right));
+    if (plan.multiply)
+      return _is_imm32(tiler, right) ? 1 : cost;
+    return plan.zero ? 1 : 1 + (plan.shift != 0) + plan.negate;
+  }
+  case RULE_INDEX_MUL: {
+    const int64_t factor = _constant(tiler, right);
+    return factor == 1 || factor == 2 || factor == 4 || factor == 8 ? cost
+                                                                    : NO_COST;
+  }
+  case RULE_BASE_INDEX_MUL: {
+    const int64_t factor = _constant(tiler, right);
+    return factor == 3 || factor == 5 || factor == 9 ? cost : NO_COST;
+  }
+  case RULE_BASE_DISP_SUB:
+  case RULE_FULL_SUB:
+    // The displacement is the constant negated
+    return _constant(tiler, right) != INT32_MIN ? cost : NO_COST;
+  case RULE_BASE_DISP_ADD:
+  case RULE_BASE_INDEX_ADD:
+  case RULE_FULL_ADD:
+  case RULE_FULL_ADD_INDEX:
+    return cost;
+  case RULE_OPERAND_REG:
+  case RULE_OPERAND_MEM:
+  case RULE_OPERAND_IMM:
+  case RULE_LOAD:
+  case RULE_INDEX_REG:
+  case RULE_ADDR_BASE_DISP:
+  case RULE_ADDR_BASE_INDEX:
+  case RULE_ADDR_FULL:
+  case RULE_LEA:
+  case RULE_COUNT:
+    break;
+  }
+  DZ_THROW("Rule %d isn't a base rule", rule);
+  return NO_COST;
+}
+
+// Labels the node at position with the cheapest rules for each nonterminal.
+// The nodes it reads are labelled already, and are marked coverable here,
+// since it's their only reader
+static void _label_node(TreeTiler *tiler, uint32_t position) {
+  const IrInstr *instr = &tiler->block->instrs[position];
+  const uint32_t serial = tiler->serial + position;
+  TreeLabel leaves[2];
+  const TreeLabel *args[2];
+  for (uint32_t a = 0; a < 2; a++) {
+    const uint32_t def = _tree_candidate(tiler, instr->args[a], position);
+    if (def != UINT32_MAX) {
+      tiler->labels[def].coverable = _leaves_unchanged(tiler, def, serial);
+    }
+    args[a] = _tree_child(tiler, instr->args[a], position);
+    if (!args[a]) {
+      leaves[a] = _leaf_label(tiler, instr->args[a]);
+      args[a] = &leaves[a];
+    }
+  }
+  TreeLabel *label = &tiler->labels[position];
+  *label = tiler->empty;
+  const uint32_t orders = instr->op == IR_SUB ? 1 : 2;
+  for (uint32_t r = 0; r < RULE_COUNT; r++) {
+    const TreeRule *rule = &TREE_RULE_TABLE[r];
+    if (rule->op != instr->op)
+      continue;
+    for (uint32_t swapped = 0; swapped < orders; swapped++) {
+      const TreeLabel *left = args[swapped];
+      const TreeLabel *right = args[1 - swapped];
+      uint32_t cost =
+          _add_costs(left->cost[rule->left], right->cost[rule->right]);
+      if (cost == NO_COST)
+        continue;
+      cost = _add_costs(cost, _rule_cost(tiler, (TreeRuleID)r, instr,
+                                         instr->args[swapped],
+                                         instr->args[1 - swapped]));
+      if (cost < label->cost[rule->nt]) {
+        label->cost[rule->nt] = cost;
+        label->rule[rule->nt] = (uint8_t)r;
+        label->swapped = (uint16_t)((label->swapped & ~(1u << rule->nt)) |
+                                    swapped << rule->nt);
+      }
+    }
+  }
+  _close_chains(label);
+  _add_leaves(label, args[0]);
+  _add_leaves(label, args[1]);
+}
+
+// Fills in the part of address the node at position stands for, reduced to
+// nt by a base rule or the chain rules from one
+static void _reduce_node(TreeTiler *tiler, uint32_t position, Nonterminal nt,
+                         TreeAddress *address);
+
+// Fills in the part of address that temp, read by the node at parent, stands
+// for when it's reduced to nt. Nodes folded into the address are covered
+static void _reduce_arg(TreeTiler *tiler, IrTemp temp, uint32_t parent,
+                        Nonterminal nt, TreeAddress *address) {
+  if (nt == NT_REG) {
+    address->base = temp;
+    return;
+  }
+  const TreeLabel *label = _tree_child(tiler, temp, parent);
+  if (nt == NT_INDEX && (!label || label->rule[nt] == RULE_INDEX_REG)) {
+    address->index = temp;
+    address->scale = 1;
+    return;
+  }
+  DZ_ASSERT(label, "Only nodes reduce to parts of addresses");
+  tiler->temps[temp].covered = true;
+  _reduce_node(tiler, tiler->temps[temp].def, nt, address);
+}
+
+static void _reduce_node(TreeTiler *tiler, uint32_t position, Nonterminal nt,
+                         TreeAddress *address) {
+  const TreeLabel *label = &tiler->labels[position];
+  const TreeRuleID rule = (TreeRuleID)label->rule[nt];
+  const TreeRule *entry = &TREE_RULE_TABLE[rule];
+  if (entry->op == TREE_CHAIN) {
+    _reduce_node(tiler, position, entry->left, address);
+    return;
+  }
+  const IrInstr *instr = &tiler->block->instrs[position];
+  const bool swapped = label->swapped >> nt & 1;
+  const IrTemp left = instr->args[swapped];
+  const IrTemp right = instr->args[1 - swapped];
+  switch (rule) {
+  case RULE_INDEX_MUL:
+    address->index = left;
+    address->scale = (uint8_t)_constant(tiler, right);
+    return;
+  case RULE_BASE_INDEX_MUL:
+    address->base = left;
+    address->index = left;
+    address->scale = (uint8_t)(_constant(tiler, right) - 1);
+    return;
+  case RULE_BASE_DISP_ADD:
+  case RULE_FULL_ADD:
+    _reduce_arg(tiler, left, position, entry->left, address);
+    address->disp = (int32_t)_constant(tiler, right);
+    return;
+  case RULE_BASE_DISP_SUB:
+  case RULE_FULL_SUB:
+    _reduce_arg(tiler, left, position, entry->left, address);
+    address->disp = (int32_t)-_constant(tiler, right);
+    return;
+  case RULE_BASE_INDEX_ADD:
+  case RULE_FULL_ADD_INDEX:
+    _reduce_arg(tiler, left, position, entry->left, address);
+    _reduce_arg(tiler, right, position, entry->right, address);
+    return;
+  case RULE_OPERAND_REG:
+  case RULE_OPERAND_MEM:
+  case RULE_OPERAND_IMM:
+  case RULE_LOAD:
+  case RULE_INDEX_REG:
+  case RULE_ADDR_BASE_DISP:
+  case RULE_ADDR_BASE_INDEX:
+  case RULE_ADDR_FULL:
+  case RULE_LEA:
+  case RULE_ADD:
+  case RULE_SUB:
+  case RULE_MUL:
+  case RULE_COUNT:
+    break;
+  }
+  DZ_THROW("Rule %d doesn't make an address", rule);
+}
+
+// The variable an instruction writes, or TREE_NO_VARIABLE. Results that live
+// in a variable's memory are written there by the instruction defining them
+static uint32_t _written_variable(const TreeTiler *tiler,
+                                  const IrInstr *instr) {
+  if (instr->op == IR_STORE)
+    return instr->variable;
+  if (instr->dest != IR_NO_TEMP && instr->op != IR_LOAD)
+    return tiler->temps[instr->dest].variable;
+  return TREE_NO_VARIABLE;
+}
+
+// Labels the trees of a block bottom up, then reduces the roots from the last
+// one back, so a node's parent has been reduced before it's looked at. Roots
+// whose cheapest cover is an lea keep its address
+static void _tile_trees(TreeTiler *tiler) {
+  const IrBlock *block = tiler->block;
+  arrsetlen(tiler->labels, block->instr_count);
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    if (_is_tree_op(instr->op)) {
+      _label_node(tiler, i);
+    }
+    if (instr->dest != IR_NO_TEMP) {
+      tiler->last_def[instr->dest] = tiler->serial + i;
+    }
+    const uint32_t variable = _written_variable(tiler, instr);
+    if (variable != TREE_NO_VARIABLE) {
+      tiler->last_store[variable] = tiler->serial + i;
+    }
+  }
+  for (uint32_t i = block->instr_count; i-- > 0;) {
+    const IrInstr *instr = &block->instrs[i];
+    if (!_is_tree_op(instr->op) || tiler->temps[instr->dest].covered ||
+        tiler->labels[i].rule[NT_REG] != RULE_LEA ||
+        tiler->labels[i].cost[NT_REG] == NO_COST)
+      continue;
+    TreeAddress address = {.base = IR_NO_TEMP, .index = IR_NO_TEMP};
+    _reduce_node(tiler, i, NT_ADDR, &address);
+    tiler->temps[instr->dest].address = (uint32_t)arrlenu(tiler->addresses);
+    arrput(tiler->addresses, address);
+  }
+  tiler->serial += block->instr_count;
+}
+
+TreeAddress *tree_tile(const IR *ir, TreeTemp *temps,
+                       uint32_t variable_count) {
+  TreeTiler tiler = {.temps = temps,
+                     .addresses = NULL,
+                     .labels = NULL,
+                     .serial = 0,
+                     .last_def = NULL,
+                     .last_store = NULL};
+  for (uint32_t nt = 0; nt < NT_COUNT; nt++) {
+    tiler.empty.cost[nt] = NO_COST;
+  }
+  for (uint32_t nt = 0; nt < NT_COUNT; nt++) {
+    tiler.leaf_kinds[nt] = tiler.empty;
+    tiler.leaf_kinds[nt].cost[nt] = 0;
+    _close_chains(&tiler.leaf_kinds[nt]);
+  }
+  arrsetlen(tiler.last_def, ir->temp_count);
+  for (uint32_t t = 0; t < ir->temp_count; t++) {
+    tiler.last_def[t] = UINT32_MAX;
+    temps[t].covered = false;
+    temps[t].address = TREE_NO_ADDRESS;
+  }
+  arrsetlen(tiler.last_store, variable_count);
+  for (uint32_t v = 0; v < variable_count; v++) {
+    tiler.last_store[v] = UINT32_MAX;
+  }
+  for (IrBlockID b = 0; b < ir->block_count; b++) {
+    tiler.block = &ir->blocks[b];
+    tiler.block_id = b;
+    _tile_trees(&tiler);
+  }
+  arrfree(tiler.labels);
+  arrfree(tiler.last_def);
+  arrfree(tiler.last_store);
+  return tiler.addresses;
+}
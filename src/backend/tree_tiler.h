@@ -0,0 +1,57 @@
+#pragma once
+
+// -----------------------------
+// TREE TILER
+//
+// Additions, subtractions and multiplications whose
+// result is only read once, by another of them later
+// in the same block, form expression trees. Each tree
+// is tiled BURS style: its nodes are labelled bottom
+// up with the cheapest rule that reduces them to each
+// nonterminal of a grammar of x86 addressing modes, and
+// its root is reduced to a value in a register. Where
+// the cheapest cover is an lea, every node under it is
+// folded into the lea's address and never emitted, so
+// B * 5 + 7 is one lea [b+b*4+7], where selecting one
+// instruction at a time takes three. The generic rules
+// stand for the instruction selector's per instruction
+// code, which everything else is left to
+// -----------------------------
+
+#include "ir.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TREE_NO_VARIABLE UINT32_MAX
+#define TREE_NO_ADDRESS UINT32_MAX
+
+// What the tiler knows about a temporary. The instruction selector fills in
+// everything but covered and address, which tiling does
+typedef struct {
+  bool known;          // Defined once, by a const
+  int64_t value;       // For known temporaries
+  uint32_t variable;   // The variable whose memory it lives in, or
+                       // TREE_NO_VARIABLE
+  bool has_location;   // Lives in a register or stack slot
+  uint32_t defs;       // How often it's defined
+  uint32_t reads;      // How often it's read
+  IrBlockID block;     // Block of its first definition
+  uint32_t def;        // Position of its first definition in block
+  bool read_elsewhere; // Read outside block, or before it's defined
+  bool covered;        // Worked out by the lea of the tree it's in
+  uint32_t address;    // The lea working out the tree it's the root of, as an
+                       // index into the returned addresses, or
+                       // TREE_NO_ADDRESS
+} TreeTemp;
+
+// base+index*scale+disp, where the temporaries are in registers or memory
+typedef struct {
+  IrTemp base;
+  IrTemp index; // IR_NO_TEMP when scale is 0
+  uint8_t scale;
+  int32_t disp;
+} TreeAddress;
+
+// Tiles the trees of every block, with temps indexed by temporary. Returns the
+// addresses of the trees tiled as an lea, as an stb_ds array the caller frees
+TreeAddress *tree_tile(const IR *ir, TreeTemp *temps, uint32_t variable_count);
@@ -282,6 +282,12 @@ ParseResultHandle *argparse_parse(ArgParserHandle *parser, int argc,
           parsed_flag->is_present = true;
 
           if (flag_def->requires_value) {
+            // A value can be attached to a flag that starts the argument,
+            // like -O2
+            if (flag_idx == 0 && flags_len > 1) {
+              parsed_flag->value = strdup(flags + 1);
+              break;
+            }
             // If flag requires value, it must be the last flag in compound
             if (flag_idx != flags_len - 1) {
               result->success = false;
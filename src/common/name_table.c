@@ -5,8 +5,14 @@
 #include <stb_ds.h>
 #include <stdlib.h>
 
+// Each level of WHILE nesting multiplies the weight of a variable access by
+// 2^LOOP_WEIGHT_SHIFT, capped so the counts can't overflow in practice
+#define LOOP_WEIGHT_SHIFT 3
+#define MAX_LOOP_WEIGHT_SHIFT 24
+
 typedef struct {
   uint32_t counter;
+  uint32_t loop_depth; // How many WHILE statements the visitor is inside
   NameTable *table;
   NodeID *statement_stack; // Keeps track of statements as nodes are visited in
                            // a stack
@@ -34,16 +40,32 @@ static AST_TRAVERSAL_ACTION _exit_grammar(GrammarNode *grammar,
                                           const NodeID node,
                                           AstTraversalGenericContext gen_ctx,
                                           void *ctx_void) {
-  UNUSED(node);
-  UNUSED(gen_ctx);
   Ctx *ctx = (Ctx *)ctx_void;
   if (grammar->grammar == GRAMMAR_TYPE_STATEMENT) {
     NodeID _ = arrpop(ctx->statement_stack);
     UNUSED(_);
+    const NodeID first_child = ast_get_first_child(gen_ctx.ast, node);
+    if (first_child != NO_NODE && ast_node_is_token(gen_ctx.ast, first_child) &&
+        ast_node_get_token(gen_ctx.ast, first_child)->type == TOKEN_WHILE) {
+      ctx->loop_depth--;
+    }
   }
   return AST_TRAVERSAL_CONTINUE;
 }
 
+// Returns if the statement the visitor is currently in is a LABEL or GOTO,
+// meaning its identifier refers to a label rather than a variable
+static bool _in_label_statement(Ctx *ctx, AST *ast) {
+  const NodeID statement = get_statement_ancestor(ctx);
+  if (statement == NO_NODE)
+    return false;
+  const NodeID first_child = ast_get_first_child(ast, statement);
+  if (first_child == NO_NODE || !ast_node_is_token(ast, first_child))
+    return false;
+  const enum TOKEN type = ast_node_get_token(ast, first_child)->type;
+  return type == TOKEN_LABEL || type == TOKEN_GOTO;
+}
+
 AST_TRAVERSAL_ACTION visit_token(const Token *token, NodeID node_id,
                                  AstTraversalGenericContext gen_ctx,
                                  void *ctx_void) {
@@ -106,9 +128,71 @@ AST_TRAVERSAL_ACTION visit_token(const Token *token, NodeID node_id,
     ctx->counter++;
     return AST_TRAVERSAL_CONTINUE;
   }
+  if (token->type == TOKEN_WHILE) {
+    ctx->loop_depth++;
+    return AST_TRAVERSAL_CONTINUE;
+  }
+  // RESOLVE VARIABLE REFERENCE
+  // Stamps the variable's index into the token so the backend never has to
+  // hash the name, and counts the access for slot ordering. Unknown variables
+  // are left unresolved for the semantic analyzer to report
+  if (token->type == TOKEN_IDENT) {
+    if (_in_label_statement(ctx, gen_ctx.ast))
+      return AST_TRAVERSAL_CONTINUE;
+    const ptrdiff_t index = shgeti(table->variable_table, token->text);
+    if (index == -1)
+      return AST_TRAVERSAL_CONTINUE;
+    ast_node_get_token_mut(gen_ctx.ast, node_id)->symbol_index =
+        (uint32_t)index;
+    const uint32_t shift =
+        MIN(ctx->loop_depth * LOOP_WEIGHT_SHIFT, (uint32_t)MAX_LOOP_WEIGHT_SHIFT);
+    IdentifierInfo *info = &table->variable_table[index].value;
+    const uint32_t weight = 1u << shift;
+    info->access_count = info->access_count > UINT32_MAX - weight
+                             ? UINT32_MAX
+                             : info->access_count + weight;
+    return AST_TRAVERSAL_CONTINUE;
+  }
   return AST_TRAVERSAL_CONTINUE;
 }
 
+// A variable's access count, next to its index in the variable table
+typedef struct {
+  uint32_t access_count;
+  uint32_t index;
+} VariableOrder;
+
+// Orders variables by descending access count. Ties keep declaration order so
+// the layout is deterministic
+static int _compare_access_count(const void *a, const void *b) {
+  const VariableOrder *order_a = a;
+  const VariableOrder *order_b = b;
+  if (order_a->access_count != order_b->access_count)
+    return order_a->access_count > order_b->access_count ? -1 : 1;
+  return order_a->index < order_b->index ? -1
+                                         : (order_a->index > order_b->index);
+}
+
+// Assigns every variable a dense slot, so hot variables share cache lines in
+// the emitted data block
+static void _assign_variable_slots(NameTable *table) {
+  const uint32_t count = (uint32_t)shlenu(table->variable_table);
+  if (count == 0)
+    return;
+  VariableOrder *order = xmalloc(count * sizeof(VariableOrder));
+  for (uint32_t i = 0; i < count; i++) {
+    order[i] = (VariableOrder){
+        .access_count = table->variable_table[i].value.access_count,
+        .index = i,
+    };
+  }
+  qsort(order, count, sizeof(VariableOrder), _compare_access_count);
+  for (uint32_t slot = 0; slot < count; slot++) {
+    table->variable_table[order[slot].index].value.slot = slot;
+  }
+  free(order);
+}
+
 static AstTraversalVisitor variable_visitor = {
     .visit_grammar_enter = _enter_grammar,
     .visit_grammar_exit = _exit_grammar,
@@ -124,11 +208,13 @@ NameTable *name_table_collect_from_ast(AST *ast) {
   };
   Ctx ctx = (Ctx){
       .counter = 0,
+      .loop_depth = 0,
       .table = table,
       .statement_stack = NULL,
   };
   ast_traverse(ast, ast_head(ast), &variable_visitor, &ctx);
   arrfree(ctx.statement_stack);
+  _assign_variable_slots(table);
   return table;
 }
 
@@ -23,6 +23,10 @@
 typedef struct IdentifierInfo {
   FileLocation file_pos;
   NodeID parent_statement;
+  uint32_t slot; // Variables only. Dense index into the data block, where the
+                 // most frequently accessed variables get the lowest slots
+  uint32_t access_count; // Variables only. Static references, weighted by
+                         // how deeply nested in WHILE loops they are
 } IdentifierInfo;
 
 typedef struct IdentifierHash {
@@ -66,6 +70,16 @@ typedef struct {
 } NameTable;
 
 // Gets all string literals and all integer symbols from the ast
+// Every variable reference in the AST is resolved by setting its token's
+// symbol_index to the variable's index in variable_table, and each variable is
+// given a dense slot.
 // Must vall variables_destroy after
 NameTable *name_table_collect_from_ast(AST *ast);
+
+// Gets the data slot of a variable token that was resolved during collection
+static inline uint32_t name_table_variable_slot(const NameTable *table,
+                                                const Token *ident) {
+  DZ_ASSERT(ident->symbol_index != TOKEN_NO_SYMBOL);
+  return table->variable_table[ident->symbol_index].value.slot;
+}
 void name_table_destroy(NameTable *var_table);
@@ -113,3 +113,11 @@ void strip_trailing_newlines(char *str, const uint32_t n) {
     str[--len] = '\0';
   }
 }
+
+int64_t string_parse_decimal_wrapping(const char *str) {
+  uint64_t value = 0;
+  for (; *str >= '0' && *str <= '9'; str++) {
+    value = value * 10 + (uint64_t)(*str - '0');
+  }
+  return (int64_t)value;
+}
@@ -62,3 +62,7 @@ void strip_newline(const char *restrict str, char *restrict buffer,
 
 // Modify a string in place to get rid of tralining newlines (\n and \r)
 void strip_trailing_newlines(char *str, const uint32_t n);
+
+// Parses a string of decimal digits into an integer. Overflow wraps around,
+// the same way the target's 64 bit arithmetic does
+int64_t string_parse_decimal_wrapping(const char *str);
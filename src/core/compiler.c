@@ -16,6 +16,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Reads a number given to a flag like -O, or fallback when the flag isn't
+// given. Anything that isn't a small number comes back as UINT32_MAX, to be
+// reported once the compiler runs
+static uint32_t _parse_small_number(const char *number, uint32_t fallback) {
+  if (!number)
+    return fallback;
+  if (number[0] == '\0' || strlen(number) > 2)
+    return UINT32_MAX;
+  uint32_t value = 0;
+  for (const char *c = number; *c; c++) {
+    if (*c < '0' || *c > '9')
+      return UINT32_MAX;
+    value = value * 10 + (uint32_t)(*c - '0');
+  }
+  return value;
+}
+
 CompilerConfig compiler_config_init(ParseResult *result) {
   // code/filename
   const char *arg_filename_or_code_literal =
@@ -54,8 +71,16 @@ CompilerConfig compiler_config_init(ParseResult *result) {
       .triple = triple,
       .filename_or_code_literal = filename_or_code_literal,
       .is_code_literal = argparse_has_flag(result, "c"),
-      .emit_format = argparse_has_flag(result, "emit-asm") ? EMIT_X86_ASSEMBLY
-                                                           : EMIT_EXECUTABLE};
+      .compact_asm = argparse_has_flag(result, "compact-asm"),
+      .verify_object = argparse_has_flag(result, "verify-obj"),
+      .freestanding = argparse_has_flag(result, "freestanding"),
+      .optimization_level = _parse_small_number(
+          argparse_get_flag_value(result, "O"), DEFAULT_OPTIMIZATION_LEVEL),
+      .unroll_factor = _parse_small_number(
+          argparse_get_flag_value(result, "unroll"), DEFAULT_UNROLL_FACTOR),
+      .emit_format = argparse_has_flag(result, "emit-ir")    ? EMIT_IR
+                     : argparse_has_flag(result, "emit-asm") ? EMIT_X86_ASSEMBLY
+                                                             : EMIT_EXECUTABLE};
 }
 
 void compiler_config_free(CompilerConfig *config) {
@@ -102,18 +127,117 @@ FileReader get_filereader_from_config(const CompilerConfig *config) {
   return fr;
 }
 
-bool compiler_execute(const CompilerConfig *config) {
-  // Check if toolchain is available
-  if (system("gcc --version > /dev/null 2>&1") != EXIT_SUCCESS) {
-    if (HOST_INFO.os == OS_WINDOWS) {
-      compiler_error(
-          "GCC is not available on your system. Please install MinGW-64");
-    } else {
-      compiler_error("GCC is not available on your system. Please install GCC");
+// Emits the program's assembly into file with the given writer mode. Returns
+// the closed writer, for its stats
+BatchedWriter emit_assembly_to_file(const CompilerConfig *config, FILE *file,
+                                    BatchedWriterMode mode, const IR *ir,
+                                    NameTable *vars,
+                                    const EmitOptions *emit_options) {
+  BatchedWriter writer = batched_writer_init_mode(file, mode);
+  emit_x86(&config->target, &writer, ir, vars, emit_options);
+  batched_writer_close(&writer); // Failures are left in writer.error
+  return writer;
+}
+
+// Prints how many instructions each peephole rule removed or rewrote
+static void print_peephole_stats(const PeepholeStats *stats) {
+  printf("Peephole optimizer removed %" PRIu32 " instructions\n",
+         peephole_removed(stats));
+  for (uint32_t r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+    if (stats->removed[r] || stats->rewritten[r]) {
+      printf("\t%s: %" PRIu32 " removed, %" PRIu32 " rewritten\n",
+             PEEPHOLE_RULE_NAMES[r], stats->removed[r], stats->rewritten[r]);
     }
+  }
+}
+
+// Writes a listing of the program's IR to the output file. Returns false if it
+// couldn't be written
+static bool write_ir_to_file(const CompilerConfig *config, const IR *ir) {
+  FILE *file = fopen(config->out_file, "w");
+  if (!file) {
+    compiler_error("SYSTEM ERROR: Could not open output file %s for writing: %s",
+                   config->out_file, strerror(errno));
+    return false;
+  }
+  ir_dump(ir, file);
+  if (fclose(file) != 0) {
+    compiler_error("SYSTEM ERROR: Could not write output file %s: %s",
+                   config->out_file, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Targets whose objects are encoded by the compiler itself, leaving gcc to
+// only link them
+static bool _target_has_object_writer(const PlatformInfo *target) {
+  return target->os == OS_LINUX && target->arch == ARCH_X86_64;
+}
+
+// Encodes the program into an object file, written to a new temporary file
+// whose name is put in object_path. Returns false if it couldn't be written
+static bool encode_object_to_tmpfile(const CompilerConfig *config,
+                                     const IR *ir,
+                                     NameTable *vars,
+                                     const EmitOptions *emit_options,
+                                     char *object_path,
+                                     size_t object_path_size,
+                                     uint64_t *text_size) {
+  ObjectFile object = object_file_init();
+  emit_x86_object(&config->target, &object, ir, vars, emit_options);
+  *text_size = object_file_section_size(&object, OBJ_SECTION_TEXT);
+  FILE *file = create_named_tmpfile(object_path, object_path_size, ".o");
+  bool ok = file != NULL;
+  if (file) {
+    ok = object_file_write_elf(&object, file);
+    ok = fclose(file) == 0 && ok;
+  }
+  object_file_destroy(&object);
+  return ok;
+}
+
+// Assembles the program's assembly with gcc -c, and checks that it matches
+// the object the compiler encoded itself. Differences are reported
+static bool verify_object(const CompilerConfig *config, AssemblerInfo *cmd,
+                          const IR *ir, NameTable *vars,
+                          const EmitOptions *emit_options,
+                          const char *object_path) {
+  char asm_path[PATH_MAX];
+  char expected_path[PATH_MAX];
+  FILE *asm_file = create_named_tmpfile(asm_path, sizeof(asm_path), ".s");
+  if (!asm_file) {
+    compiler_error("SYSTEM ERROR: Could not create a temporary file: %s",
+                   strerror(errno));
     return false;
   }
+  BatchedWriter writer = emit_assembly_to_file(
+      config, asm_file, BATCHED_WRITER_SYNC, ir, vars, emit_options);
+  const bool written = fclose(asm_file) == 0 && !writer.error;
+  FILE *expected =
+      create_named_tmpfile(expected_path, sizeof(expected_path), ".o");
+  bool ok = false;
+  if (!written || !expected) {
+    compiler_error("SYSTEM ERROR: Could not create a temporary file: %s",
+                   strerror(writer.error ? writer.error : errno));
+  } else {
+    fclose(expected);
+    if (!assembler_assemble_object(cmd, asm_path, expected_path)) {
+      compiler_error("Verification failed: gcc -c could not assemble %s",
+                     asm_path);
+    } else if (!object_file_diff_elf(expected_path, object_path)) {
+      compiler_error("Verification failed: the built-in object writer's "
+                     "output differs from gcc -c");
+    } else {
+      ok = true;
+    }
+    remove(expected_path);
+  }
+  remove(asm_path);
+  return ok;
+}
 
+bool compiler_execute(const CompilerConfig *config) {
   // exit_code used in cleanup label
   static bool exit_code = true;
 
@@ -151,6 +275,20 @@ bool compiler_execute(const CompilerConfig *config) {
     print_supported_platforms("\t -");
     return false;
   }
+  if (config->freestanding && !_target_has_object_writer(&config->target)) {
+    compiler_error("--freestanding is only available for x86_64-linux");
+    return false;
+  }
+  if (config->optimization_level > MAX_OPTIMIZATION_LEVEL) {
+    compiler_error("Unknown optimization level. Use -O0, -O1 or -O2");
+    return false;
+  }
+  if (config->unroll_factor == 0 ||
+      config->unroll_factor > MAX_UNROLL_FACTOR) {
+    compiler_error("Unknown unroll factor. Use --unroll with 1 to %u",
+                   MAX_UNROLL_FACTOR);
+    return false;
+  }
 
   // Start compiler timer
   Timer compiler_timer;
@@ -168,9 +306,27 @@ bool compiler_execute(const CompilerConfig *config) {
     printf("Compiling to target %s\n", config->triple);
   }
 
+  // Targets with an object writer get their object encoded here, and gcc only
+  // has to link it
+  const bool encode_object = config->emit_format == EMIT_EXECUTABLE &&
+                             _target_has_object_writer(&config->target);
+  char object_path[PATH_MAX] = {0};
+  uint64_t text_size = 0;
+  BatchedWriter asm_writer = {0};
+
+  PeepholeStats peephole_stats = {0};
+  const EmitOptions emit_options = {
+      .compact = config->compact_asm,
+      .freestanding = config->freestanding,
+      .tile_trees = config->optimization_level >= 1,
+      .peephole = config->optimization_level >= 1,
+      .peephole_stats = &peephole_stats,
+  };
+
   // Actual parsing logic
   TokenArray tokens = lexer_parse(fr);
   AST ast = ast_parse(tokens);
+  IR ir = ir_init(NULL);
   ast_set_filename(&ast, filereader_get_filename_ref(fr));
   filereader_destroy(&fr);
   if (config->verbose) {
@@ -189,13 +345,41 @@ bool compiler_execute(const CompilerConfig *config) {
     goto cleanup;
   }
 
+  if (config->optimization_level >= 1) {
+    constant_folder_fold(&ast, vars, tokens);
+  }
+  ir = ir_build(&ast, vars);
+  if (!ir_verify(&ir, stderr)) {
+    compiler_error("Internal error: the program's IR is malformed");
+    name_table_destroy(vars);
+    exit_code = false;
+    goto cleanup;
+  }
+  if (config->optimization_level >= 1) {
+    ir_if_convert(&ir);
+    ir_rotate_loops(&ir);
+    if (config->optimization_level >= 2) {
+      ir_optimize(&ir, config->unroll_factor);
+    }
+    ir_thread_jumps(&ir);
+    if (!ir_verify(&ir, stderr)) {
+      compiler_error("Internal error: the optimizer made the program's IR "
+                     "malformed");
+      name_table_destroy(vars);
+      exit_code = false;
+      goto cleanup;
+    }
+  }
+
   // Debug print symbol tables
   if (config->verbose) {
     printf("%s SYMBOL TABLE %s\n", SEP, SEP);
     for (size_t i = 0; i < shlenu(vars->variable_table); i++) {
       IdentifierHash sym = vars->variable_table[i];
-      printf("Key: %s,\tPos: %" PRIu32 ":%" PRIu32 "\n", sym.key,
-             sym.value.file_pos.line, sym.value.file_pos.col);
+      printf("Key: %s,\tPos: %" PRIu32 ":%" PRIu32 ",\tSlot: %" PRIu32
+             ",\tAccesses: %" PRIu32 "\n",
+             sym.key, sym.value.file_pos.line, sym.value.file_pos.col,
+             sym.value.slot, sym.value.access_count);
     }
     printf("%s LABEL TABLE %s\n", SEP, SEP);
     for (size_t i = 0; i < shlenu(vars->label_table); i++) {
@@ -209,42 +393,115 @@ bool compiler_execute(const CompilerConfig *config) {
       printf("Key: %s,\tValue: %" PRIu32 "\n", lit.key, lit.value.label);
     }
 
+    printf("%s IR %s\n", SEP, SEP);
+    ir_dump(&ir, stdout);
+
     // Debug print generated ASM
     printf("%s EMITTED ASM %s\n", SEP, SEP);
-    emit_x86(&config->target, stdout, &ast, vars);
+    BatchedWriter stdout_writer = batched_writer_init(stdout);
+    emit_x86(&config->target, &stdout_writer, &ir, vars, &emit_options);
+    batched_writer_close(&stdout_writer);
     printf("%s END DEBUG OUTPUT %s\n", SEP, SEP);
   }
 
-  char tmp_asm_file[PATH_MAX];
+  if (config->emit_format == EMIT_IR) {
+    if (!write_ir_to_file(config, &ir)) {
+      exit_code = false;
+    }
+    name_table_destroy(vars);
+    goto cleanup;
+  }
+
+  AssemblerInfo cmd;
+  AssemblerProcess assembler;
+  Timer asssembler_timer;
   // Open file and emit asm
-  // IF the emit format is exec, create a temp file for the asm
+  // IF the emit format is exec, the assembler is started first, and the asm
+  // is streamed into it while it's being emitted
   if (config->emit_format == EMIT_EXECUTABLE) {
-    FILE *asm_file = create_named_tmpfile(tmp_asm_file, sizeof(tmp_asm_file));
-    if (!asm_file) {
-      compiler_error("SYSTEM ERROR: Could not create temporary file: %s",
-                     strerror(errno));
+    if (!assembler_init(&cmd, config)) {
+      compiler_error("Target is not supported");
+      name_table_destroy(vars);
       exit_code = false;
       goto cleanup;
     }
-    emit_x86(&config->target, asm_file, &ast, vars);
-    fclose(asm_file);
-    asm_file = NULL;
+    if (!assembler_is_available(&cmd)) {
+      compiler_error("Assmebler is not installed on the system");
+      assembler_print_help(&cmd);
+      name_table_destroy(vars);
+      exit_code = false;
+      goto cleanup;
+    }
+    if (encode_object) {
+      if (!encode_object_to_tmpfile(config, &ir, vars, &emit_options,
+                                    object_path, sizeof(object_path),
+                                    &text_size)) {
+        compiler_error("SYSTEM ERROR: Could not write object file %s: %s",
+                       object_path, strerror(errno));
+        name_table_destroy(vars);
+        exit_code = false;
+        goto cleanup;
+      }
+      if (config->verify_object &&
+          !verify_object(config, &cmd, &ir, vars, &emit_options,
+                         object_path)) {
+        name_table_destroy(vars);
+        exit_code = false;
+        goto cleanup;
+      }
+    } else {
+      timer_init(&asssembler_timer);
+      timer_start(&asssembler_timer);
+      if (!assembler_spawn(&cmd, config->out_file, &assembler)) {
+        compiler_error("SYSTEM ERROR: Could not start the assembler: %s",
+                       strerror(errno));
+        name_table_destroy(vars);
+        exit_code = false;
+        goto cleanup;
+      }
+      asm_writer = emit_assembly_to_file(config, assembler.input,
+                                         BATCHED_WRITER_PIPELINED, &ir, vars,
+                                         &emit_options);
+    }
   } else if (config->emit_format == EMIT_X86_ASSEMBLY) {
-    // IF the emit format is assembly, then open the out_file to emit to
-    FILE *asm_file = fopen(config->out_file, "w");
+    // IF the emit format is assembly, then open the out_file to emit to.
+    // It's opened for reading too, so it can be memory mapped
+    FILE *asm_file = fopen(config->out_file, "w+");
     if (!asm_file) {
       compiler_error(
           "SYSTEM ERROR: Could not open output file %s for writing: %s",
           config->out_file, strerror(errno));
+      name_table_destroy(vars);
       exit_code = false;
       goto cleanup;
     }
-    emit_x86(&config->target, asm_file, &ast, vars);
-    fclose(asm_file);
+    asm_writer =
+        emit_assembly_to_file(config, asm_file, BATCHED_WRITER_MAPPED, &ir,
+                              vars, &emit_options);
+    if (fclose(asm_file) != 0 && !asm_writer.error) {
+      asm_writer.error = errno;
+    }
     asm_file = NULL;
-    strncpy(tmp_asm_file, config->out_file, sizeof(tmp_asm_file) - 1);
+    if (asm_writer.error) {
+      compiler_error("SYSTEM ERROR: Could not write output file %s: %s",
+                     config->out_file, strerror(asm_writer.error));
+      name_table_destroy(vars);
+      exit_code = false;
+      goto cleanup;
+    }
   }
   name_table_destroy(vars);
+  if (config->verbose && encode_object) {
+    printf("Encoded %" PRIu64 " bytes of machine code\n", text_size);
+  } else if (config->verbose) {
+    printf("Emitted %zu bytes of assembly in %zu flushes, %zu of which "
+           "stalled on output (%.2fms)\n",
+           batched_writer_bytes_written(&asm_writer), asm_writer.stats.flushes,
+           asm_writer.stats.stalls, asm_writer.stats.stall_ms);
+  }
+  if (config->verbose && emit_options.peephole) {
+    print_peephole_stats(&peephole_stats);
+  }
 
   // Stop timer
   timer_stop(&compiler_timer);
@@ -257,25 +514,31 @@ bool compiler_execute(const CompilerConfig *config) {
     goto cleanup;
   }
 
-  Timer asssembler_timer;
-  timer_init(&asssembler_timer);
-  timer_start(&asssembler_timer);
-
-  // Invoke GCC on file
-  AssemblerInfo cmd;
-  if (!assembler_init(&cmd, config)) {
-    compiler_error("Target is not supported");
-    exit_code = false;
+  if (encode_object) {
+    Timer linker_timer;
+    timer_init(&linker_timer);
+    timer_start(&linker_timer);
+    if (!assembler_link(&cmd, object_path, config->out_file)) {
+      compiler_error("Linking failed");
+      exit_code = false;
+      goto cleanup;
+    }
+    timer_stop(&linker_timer);
+    printf("Linker finished in %.02f seconds\n",
+           timer_elapsed_seconds(&linker_timer));
     goto cleanup;
   }
-  if (!assembler_is_available(&cmd)) {
-    compiler_error("Assmebler is not installed on the system");
-    assembler_print_help(&cmd);
+
+  // The assembler has been running alongside the emitter. If it failed, it
+  // most likely stopped reading too, so its failure is what gets reported
+  if (!assembler_wait(&assembler)) {
+    compiler_error("Assembly failed");
     exit_code = false;
     goto cleanup;
   }
-  if (!assembler_invoke(&cmd, tmp_asm_file, config->out_file)) {
-    compiler_error("Assembly failed");
+  if (asm_writer.error) {
+    compiler_error("SYSTEM ERROR: Could not send assembly to the assembler: %s",
+                   strerror(asm_writer.error));
     exit_code = false;
     goto cleanup;
   }
@@ -286,6 +549,10 @@ bool compiler_execute(const CompilerConfig *config) {
          timer_elapsed_seconds(&asssembler_timer));
 
 cleanup:
+  if (object_path[0]) {
+    remove(object_path);
+  }
+  ir_destroy(&ir);
   ast_destroy(&ast);
   token_array_destroy(&tokens);
   er_free();
@@ -12,6 +12,7 @@
 typedef enum {
   EMIT_EXECUTABLE, // Default. Checks that an assembler is available
   EMIT_X86_ASSEMBLY,
+  EMIT_IR, // A listing of the IR, for debugging the backend
 } EMIT_FORMAT;
 
 typedef struct {
@@ -21,6 +22,15 @@ typedef struct {
   const bool verbose;  // Verbose option
   const EMIT_FORMAT emit_format; // The format which the compiler should emit
                                  // (just the assembly, or an executable)
+  const bool compact_asm;        // Emit compact assembly
+  const bool verify_object;      // Diff the built-in object writer's output
+                                 // against gcc -c
+  const bool freestanding;       // Static executable with no libc
+  const uint32_t optimization_level; // UINT32_MAX if the level given isn't
+                                     // a number
+  const uint32_t unroll_factor; // Copies of a counted loop's body per
+                                // iteration at -O2. UINT32_MAX if the factor
+                                // given isn't a number
   char *out_file;
   const PlatformInfo target;
   char *triple; // triple input by the user/host triple if none was provided
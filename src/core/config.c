@@ -3,6 +3,10 @@
 
 // DEFAULTS
 const char *DEFAULT_OUT_FILE = "a.out";
+const uint32_t DEFAULT_OPTIMIZATION_LEVEL = 1;
+const uint32_t MAX_OPTIMIZATION_LEVEL = 2;
+const uint32_t DEFAULT_UNROLL_FACTOR = 4;
+const uint32_t MAX_UNROLL_FACTOR = 16;
 
 // MISC CONSTANTS
 const char *SEP = "-------------------";
@@ -23,6 +27,28 @@ const FlagSpec FLAG_SPEC[] = {
     FLAG('i', "host-info", "Dump the host info triple"),
     FLAG('a', "emit-asm",
          "Emit the ASM \".s\" file instead of an executable file"),
+    FLAG(0, "emit-ir",
+         "Write a listing of the program's intermediate representation "
+         "instead of an executable file"),
+    FLAG_WITH_VALUE('O', "optimize",
+                    "Optimization level, 0 to 2. 0 emits the program as "
+                    "written, 1 (the default) folds constants, rotates loops, "
+                    "makes short IFs branchless and cleans up the emitted "
+                    "instructions, and 2 also optimizes the program globally "
+                    "in SSA form"),
+    FLAG_WITH_VALUE(0, "unroll",
+                    "How many copies of a counted loop's body each iteration "
+                    "runs at -O2, 1 to 16. 1 doesn't unroll loops, and the "
+                    "default is 4"),
+    FLAG('m', "compact-asm",
+         "Emit compact assembly with short numeric symbols. Smaller and faster "
+         "to assemble, but harder to read"),
+    FLAG(0, "verify-obj",
+         "Check the built-in object writer against gcc -c on the same "
+         "assembly, and fail if they differ"),
+    FLAG(0, "freestanding",
+         "Build a static executable that makes system calls itself instead "
+         "of using libc. Starts faster. Only available for x86_64-linux"),
 };
 
 const ArgSpec ARG_SPEC[] = {OPTIONAL_ARG(
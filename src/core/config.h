@@ -19,6 +19,10 @@ void print_supported_platforms(const char *prefix);
 
 // DEFAULTS
 extern const char *DEFAULT_OUT_FILE;
+extern const uint32_t DEFAULT_OPTIMIZATION_LEVEL;
+extern const uint32_t MAX_OPTIMIZATION_LEVEL;
+extern const uint32_t DEFAULT_UNROLL_FACTOR;
+extern const uint32_t MAX_UNROLL_FACTOR;
 
 // MISC CONSTANTS
 extern const char *SEP;
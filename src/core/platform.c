@@ -3,24 +3,32 @@
 #include <stdlib.h>
 
 const CallingConvention CC_SYSTEM_V_64 = {
-    .arg_r = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"},
-    .scratch_r = {"r10", "r11"},
-    .ret_r = "rax",
-    .rsp = "rsp",
-    .rbp = "rbp",
-    .rip = "rip",
+    .arg_r = {REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9},
+    .arg_count = 6,
+    .scratch_r = {REG_R10, REG_R11, REG_R8, REG_R9, REG_RCX},
+    .scratch_count = 5,
+    .saved_r = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15},
+    .saved_count = 5,
+    .ret_r = REG_RAX,
+    .rsp = REG_RSP,
+    .rbp = REG_RBP,
+    .rip = REG_RIP,
     .stack_alignment = 16,
     .shadow_space = 0,
     .ptr_size = 8,
 };
 
 const CallingConvention CC_MS_64 = {
-    .arg_r = {"rcx", "rdx", "r8", "r9"},
-    .scratch_r = {"r10", "r11"},
-    .ret_r = "rax",
-    .rsp = "rsp",
-    .rbp = "rbp",
-    .rip = "rip",
+    .arg_r = {REG_RCX, REG_RDX, REG_R8, REG_R9},
+    .arg_count = 4,
+    .scratch_r = {REG_R10, REG_R11, REG_R8, REG_R9, REG_RCX},
+    .scratch_count = 5,
+    .saved_r = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15},
+    .saved_count = 5,
+    .ret_r = REG_RAX,
+    .rsp = REG_RSP,
+    .rbp = REG_RBP,
+    .rip = REG_RIP,
     .stack_alignment = 16,
     .shadow_space = 32,
     .ptr_size = 8,
@@ -48,15 +48,50 @@ typedef struct {
   ABI abi;
 } PlatformInfo;
 
+// X macro definitions for x86-64 registers, in hardware encoding order, with
+// their 64 bit and low 8 bit names. rip can only be used to address memory
+#define X86_REGISTERS(X)                                                       \
+  X(REG_RAX, "rax", "al")                                                      \
+  X(REG_RCX, "rcx", "cl")                                                      \
+  X(REG_RDX, "rdx", "dl")                                                      \
+  X(REG_RBX, "rbx", "bl")                                                      \
+  X(REG_RSP, "rsp", "spl")                                                     \
+  X(REG_RBP, "rbp", "bpl")                                                     \
+  X(REG_RSI, "rsi", "sil")                                                     \
+  X(REG_RDI, "rdi", "dil")                                                     \
+  X(REG_R8, "r8", "r8b")                                                       \
+  X(REG_R9, "r9", "r9b")                                                       \
+  X(REG_R10, "r10", "r10b")                                                    \
+  X(REG_R11, "r11", "r11b")                                                    \
+  X(REG_R12, "r12", "r12b")                                                    \
+  X(REG_R13, "r13", "r13b")                                                    \
+  X(REG_R14, "r14", "r14b")                                                    \
+  X(REG_R15, "r15", "r15b")                                                    \
+  X(REG_RIP, "rip", "")
+
+// Generate register enum
+typedef enum {
+#define X(name, str, byte_str) name,
+  X86_REGISTERS(X)
+#undef X
+      REG_COUNT,
+} X86Reg;
+
 #define MAX_REGISTER 6
 
 typedef struct {
-  const char *arg_r[MAX_REGISTER];     // Argument registers
-  const char *scratch_r[MAX_REGISTER]; // Scratch registers
-  const char *ret_r;                   // Return reg
-  const char *rsp;                     // Stack pointer reg
-  const char *rbp;                     // Stack base pointer reg
-  const char *rip;                     // instruction reg
+  const X86Reg arg_r[MAX_REGISTER];     // Argument registers
+  const uint8_t arg_count;              // Number of argument registers
+  const X86Reg scratch_r[MAX_REGISTER]; // Scratch registers. Volatile, and
+                                        // never rax or rdx, which idiv needs
+  const uint8_t scratch_count;          // Number of scratch registers
+  const X86Reg saved_r[MAX_REGISTER];   // Callee-saved registers, which keep
+                                        // their value across calls
+  const uint8_t saved_count;            // Number of callee-saved registers
+  const X86Reg ret_r;                   // Return reg
+  const X86Reg rsp;                     // Stack pointer reg
+  const X86Reg rbp;                     // Stack base pointer reg
+  const X86Reg rip;                     // instruction reg
   const uint8_t stack_alignment;
   const uint8_t shadow_space;
   const uint8_t ptr_size;
@@ -1,7 +1,17 @@
 #include "system.h"
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
 
 // Generate a named temporary file
-FILE *create_named_tmpfile(char *filepath, size_t filepath_size) {
+FILE *create_named_tmpfile(char *filepath, size_t filepath_size,
+                           const char *suffix) {
 #if defined(_WIN32) || defined(_WIN64)
   char temp_dir[PATH_MAX];
   char temp_filename[PATH_MAX];
@@ -17,20 +27,182 @@ FILE *create_named_tmpfile(char *filepath, size_t filepath_size) {
   }
   strncpy(filepath, temp_filename, filepath_size - 1);
   filepath[filepath_size - 1] = '\0';
-  // Change extension to .s for assembly
+  // Swap the extension for the requested one
   char *ext = strrchr(filepath, '.');
   if (ext)
-    strcpy(ext, ".s");
-  else
-    strcat(filepath, ".s");
-  return fopen(filepath, "w");
+    *ext = '\0';
+  strncat(filepath, suffix, filepath_size - strlen(filepath) - 1);
+  return fopen(filepath, "wb+");
 #else
   // Unix/Linux/macOS
-  strncpy(filepath, "/tmp/compiler_XXXXXX.s", filepath_size - 1);
-  filepath[filepath_size - 1] = '\0';
-  int fd = mkstemps(filepath, 2); // 2 = length of ".s" suffix
+  const int len =
+      snprintf(filepath, filepath_size, "/tmp/compiler_XXXXXX%s", suffix);
+  if (len < 0 || (size_t)len >= filepath_size)
+    return NULL;
+  int fd = mkstemps(filepath, (int)strlen(suffix));
   if (fd == -1)
     return NULL;
-  return fdopen(fd, "w");
+  return fdopen(fd, "w+");
+#endif
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+#define PATH_LIST_SEPARATOR ';'
+#define DIR_SEPARATORS "/\\"
+#else
+#define PATH_LIST_SEPARATOR ':'
+#define DIR_SEPARATORS "/"
+#endif
+
+static bool _is_executable(const char *path) {
+#if defined(_WIN32) || defined(_WIN64)
+  return _access(path, 0) == 0;
+#else
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+         access(path, X_OK) == 0;
 #endif
 }
+
+bool system_find_executable(const char *name, char *path, size_t path_size) {
+  if (strpbrk(name, DIR_SEPARATORS)) {
+    snprintf(path, path_size, "%s", name);
+    return _is_executable(path);
+  }
+  const char *dirs = getenv("PATH");
+  if (!dirs) {
+    return false;
+  }
+  while (*dirs) {
+    const char *end = strchr(dirs, PATH_LIST_SEPARATOR);
+    const size_t dir_len = end ? (size_t)(end - dirs) : strlen(dirs);
+    // An empty entry means the current directory
+    const int len =
+        dir_len == 0
+            ? snprintf(path, path_size, "%s", name)
+            : snprintf(path, path_size, "%.*s/%s", (int)dir_len, dirs, name);
+    if (len > 0 && (size_t)len < path_size && _is_executable(path)) {
+      return true;
+    }
+#if defined(_WIN32) || defined(_WIN64)
+    if (len > 0 && (size_t)len + 4 < path_size) {
+      strcat(path, ".exe");
+      if (_is_executable(path)) {
+        return true;
+      }
+    }
+#endif
+    if (!end) {
+      break;
+    }
+    dirs = end + 1;
+  }
+  return false;
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+// Windows has no posix_spawn, so the child is started through the CRT, which
+// needs the arguments joined back into a quoted command line
+static void _join_command_line(const char *const argv[], char *command,
+                               size_t command_size) {
+  size_t pos = 0;
+  command[0] = '\0';
+  for (size_t i = 0; argv[i] && pos < command_size; i++) {
+    const int written = snprintf(command + pos, command_size - pos, "%s\"%s\"",
+                                 i == 0 ? "" : " ", argv[i]);
+    if (written < 0)
+      break;
+    pos += (size_t)written;
+  }
+}
+
+bool system_run_quiet(const char *const argv[]) {
+  char command[PATH_MAX * 2];
+  _join_command_line(argv, command, sizeof(command));
+  strncat(command, " > NUL 2>&1", sizeof(command) - strlen(command) - 1);
+  return system(command) == EXIT_SUCCESS;
+}
+
+FILE *system_spawn_with_input(const char *const argv[], ChildProcess *child) {
+  char command[PATH_MAX * 2];
+  _join_command_line(argv, command, sizeof(command));
+  child->pipe = _popen(command, "wb");
+  return child->pipe;
+}
+
+bool system_close_and_wait(FILE *input, ChildProcess *child) {
+  UNUSED(input);
+  return _pclose(child->pipe) == EXIT_SUCCESS;
+}
+
+#else
+
+static bool _wait_for_child(pid_t pid) {
+  int status = 0;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+bool system_run_quiet(const char *const argv[]) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  pid_t pid;
+  // posix_spawn never writes to argv, it's just declared without const
+  const int err = posix_spawn(&pid, argv[0], &actions, NULL,
+                              (char *const *)(uintptr_t)argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    errno = err;
+    return false;
+  }
+  return _wait_for_child(pid);
+}
+
+FILE *system_spawn_with_input(const char *const argv[], ChildProcess *child) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return NULL;
+  }
+  // Only the child's stdin should hold on to the read end, and the write end
+  // mustn't leak into any other children
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+  pid_t pid;
+  const int err = posix_spawn(&pid, argv[0], &actions, NULL,
+                              (char *const *)(uintptr_t)argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[0]);
+  if (err != 0) {
+    close(fds[1]);
+    errno = err;
+    return NULL;
+  }
+  FILE *input = fdopen(fds[1], "w");
+  if (!input) {
+    close(fds[1]);
+    _wait_for_child(pid);
+    return NULL;
+  }
+  child->pid = pid;
+  return input;
+}
+
+bool system_close_and_wait(FILE *input, ChildProcess *child) {
+  // The child only sees end of input once the pipe is closed
+  fclose(input);
+  return _wait_for_child(child->pid);
+}
+
+#endif
@@ -8,8 +8,39 @@
 // -----------------------------------
 
 #include "core.h"
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/types.h>
+#endif
 
-// Creates a named temporary file. The file pointer is returned, and the name
-// Is put inside filepath. You should allocate filepath with MAX_PATH
-// characters.
-FILE *create_named_tmpfile(char *filepath, size_t filepath_size);
+// Creates a named temporary file ending in suffix (e.g. ".o"), opened for
+// reading and writing. The file pointer is returned, and the name is put
+// inside filepath. You should allocate filepath with MAX_PATH characters.
+FILE *create_named_tmpfile(char *filepath, size_t filepath_size,
+                           const char *suffix);
+
+// A child process started by system_spawn_with_input
+typedef struct {
+#if defined(_WIN32) || defined(_WIN64)
+  FILE *pipe;
+#else
+  pid_t pid;
+#endif
+} ChildProcess;
+
+// Looks an executable up in PATH, like a shell would. If it's found, its full
+// path is put inside path and true is returned. Names containing a directory
+// separator are used as is
+bool system_find_executable(const char *name, char *path, size_t path_size);
+
+// Runs argv[0] with the NULL terminated argv, without going through a shell,
+// and with its output discarded. Returns if it ran and exited successfully
+bool system_run_quiet(const char *const argv[]);
+
+// Starts argv[0] with the NULL terminated argv, without going through a shell.
+// Its stdin is connected to a pipe, whose write end is returned. Returns NULL
+// if it couldn't be started
+FILE *system_spawn_with_input(const char *const argv[], ChildProcess *child);
+
+// Closes the input of a child started with system_spawn_with_input, and waits
+// for it to exit. Returns if it exited successfully
+bool system_close_and_wait(FILE *input, ChildProcess *child);
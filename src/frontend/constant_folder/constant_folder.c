@@ -0,0 +1,520 @@
+#include "constant_folder.h"
+#include "ast.h"
+#include "compiler_compatibility.h"
+#include "dz_debug.h"
+#include "string_util.h"
+#include "token.h"
+#include <inttypes.h>
+#include <stb_ds.h>
+#include <stdio.h>
+
+// What's known about a variable's value
+typedef struct {
+  int64_t value;
+  uint32_t stamp; // The value is known while this is above Folder.forgotten
+} Fact;
+
+// An operand of a chain of operators, an expression or a term, that's kept
+// once the chain is folded
+typedef struct {
+  NodeID op;      // Operator token before the operand. NO_NODE for the first
+  NodeID operand; // Term or unary
+  bool constant;
+  int64_t value; // Value of a constant operand
+  bool changed;  // Constants were merged into value, so operand is stale
+} ChainItem;
+
+typedef struct {
+  AST *ast;
+  TokenArray tokens;
+  Fact *facts;         // stb_ds array, indexed by variable symbol index
+  uint32_t stamp;      // Last stamp handed out to a fact
+  uint32_t forgotten;  // Facts stamped at or below this are no longer known
+  ChainItem *items;    // stb_ds array, used as a stack by nested chains
+  uint32_t *assigned;  // stb_ds array, used as a stack by nested bodies
+  FileLocation location; // Of the statement being folded, for new tokens
+} Folder;
+
+typedef enum {
+  CONDITION_UNKNOWN,
+  CONDITION_TRUE,
+  CONDITION_FALSE,
+} Condition;
+
+// ----------------------
+// Facts
+// ----------------------
+
+static bool _fact_get(const Folder *f, const Token *ident, int64_t *value) {
+  if (ident->symbol_index == TOKEN_NO_SYMBOL)
+    return false;
+  const Fact fact = f->facts[ident->symbol_index];
+  if (fact.stamp <= f->forgotten)
+    return false;
+  *value = fact.value;
+  return true;
+}
+
+static void _fact_set(Folder *f, uint32_t variable, int64_t value) {
+  if (variable != TOKEN_NO_SYMBOL) {
+    f->facts[variable] = (Fact){.value = value, .stamp = ++f->stamp};
+  }
+}
+
+static void _fact_forget(Folder *f, uint32_t variable) {
+  if (variable != TOKEN_NO_SYMBOL) {
+    f->facts[variable].stamp = 0;
+  }
+}
+
+// Forgets every fact at once, for places control can reach from anywhere
+static void _fact_forget_all(Folder *f) { f->forgotten = f->stamp; }
+
+// ----------------------
+// Arithmetic
+//
+// Done on unsigned values, so it wraps around like the
+// generated code does instead of overflowing
+// ----------------------
+
+static int64_t _wrap_add(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+
+static int64_t _wrap_sub(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a - (uint64_t)b);
+}
+
+static int64_t _wrap_mul(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a * (uint64_t)b);
+}
+
+static int64_t _wrap_neg(int64_t a) { return (int64_t)(0 - (uint64_t)a); }
+
+// Whether a / b can be folded. idiv faults on both of the others, and the
+// program should still fault when it runs
+static bool _can_divide(int64_t a, int64_t b) {
+  return b != 0 && !(a == INT64_MIN && b == -1);
+}
+
+// ----------------------
+// Constant Nodes
+// ----------------------
+
+static enum TOKEN _token_type(const Folder *f, NodeID node) {
+  return ast_node_get_token(f->ast, node)->type;
+}
+
+static NodeID _add_token(Folder *f, NodeID parent, enum TOKEN type) {
+  return ast_node_add_child_token(f->ast, parent,
+                                  token_create_simple(type, f->location));
+}
+
+// Makes unary_node the constant value, spelled ["-"] number
+static void _set_unary_constant(Folder *f, NodeID unary_node, int64_t value) {
+  AST *ast = f->ast;
+  ast_node_detach_children(ast, unary_node);
+  uint64_t magnitude = (uint64_t)value;
+  if (value < 0) {
+    _add_token(f, unary_node, TOKEN_MINUS);
+    magnitude = 0 - magnitude;
+  }
+  char text[24];
+  const int len = snprintf(text, sizeof(text), "%" PRIu64, magnitude);
+  const NodeID primary =
+      ast_node_add_child_grammar(ast, unary_node, GRAMMAR_TYPE_PRIMARY);
+  ast_node_add_child_token(ast, primary,
+                           token_create(f->tokens, TOKEN_NUMBER, text,
+                                        (uint32_t)len, f->location));
+}
+
+static void _set_term_constant(Folder *f, NodeID term_node, int64_t value) {
+  ast_node_detach_children(f->ast, term_node);
+  const NodeID unary =
+      ast_node_add_child_grammar(f->ast, term_node, GRAMMAR_TYPE_UNARY);
+  _set_unary_constant(f, unary, value);
+}
+
+static void _set_expression_constant(Folder *f, NodeID expr_node,
+                                     int64_t value) {
+  ast_node_detach_children(f->ast, expr_node);
+  const NodeID term =
+      ast_node_add_child_grammar(f->ast, expr_node, GRAMMAR_TYPE_TERM);
+  _set_term_constant(f, term, value);
+}
+
+// Whether a chain has a single operand, so a constant is already as simple as
+// it gets
+static bool _is_single(const Folder *f, NodeID chain_node) {
+  const NodeID first = ast_get_first_child(f->ast, chain_node);
+  return ast_get_next_sibling(f->ast, first) == NO_NODE;
+}
+
+// ----------------------
+// Expressions
+// ----------------------
+
+// Folds a unary, replacing a variable whose value is known with that value.
+// Returns whether it's constant, and stores its value
+// unary ::= ["+" | "-"] primary
+static bool _fold_unary(Folder *f, NodeID unary_node, int64_t *value) {
+  AST *ast = f->ast;
+  NodeID child = ast_get_first_child(ast, unary_node);
+  bool negate = false;
+  if (child != NO_NODE && ast_node_is_token(ast, child)) {
+    negate = _token_type(f, child) == TOKEN_MINUS;
+    child = ast_get_next_sibling(ast, child);
+  }
+  const NodeID leaf = ast_get_first_child(ast, child);
+  if (leaf == NO_NODE || !ast_node_is_token(ast, leaf))
+    return false;
+  const Token *token = ast_node_get_token(ast, leaf);
+  const bool is_variable = token->type == TOKEN_IDENT;
+  if (token->type == TOKEN_NUMBER) {
+    *value = string_parse_decimal_wrapping(token->text);
+  } else if (!is_variable || !_fact_get(f, token, value)) {
+    return false;
+  }
+  if (negate) {
+    *value = _wrap_neg(*value);
+  }
+  if (is_variable) {
+    _set_unary_constant(f, unary_node, *value);
+  }
+  return true;
+}
+
+// Folds a term. A constant prefix takes in the constants after it, and a
+// constant multiplier takes in the constant multipliers right after it, since
+// (x * a) * b == x * (a * b) even when it wraps. Constants after a division
+// are left alone, since truncation doesn't reassociate
+// term ::= unary {( "/" | "*" ) unary}
+static bool _fold_term(Folder *f, NodeID term_node, int64_t *value) {
+  AST *ast = f->ast;
+  const size_t base = arrlenu(f->items);
+  bool changed = false;
+  NodeID op = NO_NODE;
+  NodeID child = ast_get_first_child(ast, term_node);
+  while (child != NO_NODE) {
+    int64_t child_value = 0;
+    const bool constant = _fold_unary(f, child, &child_value);
+    const size_t count = arrlenu(f->items) - base;
+    ChainItem *last = count ? &arrlast(f->items) : NULL;
+    const bool is_mult = op != NO_NODE && _token_type(f, op) == TOKEN_MULT;
+    const bool merges =
+        constant && last && last->constant &&
+        ((count == 1 &&
+          (is_mult || _can_divide(last->value, child_value))) ||
+         (is_mult && last->op != NO_NODE &&
+          _token_type(f, last->op) == TOKEN_MULT));
+    if (merges) {
+      last->value = is_mult ? _wrap_mul(last->value, child_value)
+                            : last->value / child_value;
+      last->changed = true;
+      changed = true;
+    } else {
+      const ChainItem item = {.op = op,
+                              .operand = child,
+                              .constant = constant,
+                              .value = child_value,
+                              .changed = false};
+      arrput(f->items, item);
+    }
+    op = ast_get_next_sibling(ast, child);
+    child = ast_get_next_sibling(ast, op);
+  }
+
+  const size_t count = arrlenu(f->items) - base;
+  const bool constant = count == 1 && f->items[base].constant;
+  if (constant) {
+    *value = f->items[base].value;
+    if (changed || !_is_single(f, term_node)) {
+      _set_term_constant(f, term_node, *value);
+    }
+  } else if (changed) {
+    ast_node_detach_children(ast, term_node);
+    for (size_t i = base; i < arrlenu(f->items); i++) {
+      const ChainItem item = f->items[i];
+      if (item.op != NO_NODE) {
+        ast_node_append_child(ast, term_node, item.op);
+      }
+      if (item.changed) {
+        const NodeID unary =
+            ast_node_add_child_grammar(ast, term_node, GRAMMAR_TYPE_UNARY);
+        _set_unary_constant(f, unary, item.value);
+      } else {
+        ast_node_append_child(ast, term_node, item.operand);
+      }
+    }
+  }
+  arrsetlen(f->items, base);
+  return constant;
+}
+
+// Appends "+ value" or "- -value" to an expression, as a new term
+static void _append_constant_term(Folder *f, NodeID expr_node, int64_t value) {
+  const bool subtract = value < 0 && value != INT64_MIN;
+  _add_token(f, expr_node, subtract ? TOKEN_MINUS : TOKEN_PLUS);
+  const NodeID term =
+      ast_node_add_child_grammar(f->ast, expr_node, GRAMMAR_TYPE_TERM);
+  _set_term_constant(f, term, subtract ? _wrap_neg(value) : value);
+}
+
+// Folds an expression. Addition and subtraction wrap around, so they
+// reassociate freely, and every constant term is summed into one. That sum
+// goes last, or first if the expression would otherwise start with a minus.
+// Returns whether it's constant, and stores its value
+// expression ::= term {( "-" | "+" ) term}
+static bool _fold_expression(Folder *f, NodeID expr_node, int64_t *value) {
+  AST *ast = f->ast;
+  const size_t base = arrlenu(f->items);
+  int64_t sum = 0;
+  uint32_t constants = 0;
+  NodeID op = NO_NODE;
+  NodeID child = ast_get_first_child(ast, expr_node);
+  while (child != NO_NODE) {
+    int64_t term_value = 0;
+    if (_fold_term(f, child, &term_value)) {
+      const bool subtract = op != NO_NODE && _token_type(f, op) == TOKEN_MINUS;
+      sum = subtract ? _wrap_sub(sum, term_value) : _wrap_add(sum, term_value);
+      constants++;
+    } else {
+      const ChainItem item = {.op = op, .operand = child};
+      arrput(f->items, item);
+    }
+    op = ast_get_next_sibling(ast, child);
+    child = ast_get_next_sibling(ast, op);
+  }
+
+  const size_t count = arrlenu(f->items) - base;
+  if (count == 0) {
+    *value = sum;
+    if (!_is_single(f, expr_node)) {
+      _set_expression_constant(f, expr_node, sum);
+    }
+    return true;
+  }
+  // A single constant stays where it is, unless it's a 0 that can go
+  if (constants > 1 || (constants == 1 && sum == 0)) {
+    const ChainItem first = f->items[base];
+    const bool leading_minus =
+        first.op != NO_NODE && _token_type(f, first.op) == TOKEN_MINUS;
+    ast_node_detach_children(ast, expr_node);
+    if (leading_minus) {
+      const NodeID term =
+          ast_node_add_child_grammar(ast, expr_node, GRAMMAR_TYPE_TERM);
+      _set_term_constant(f, term, sum);
+    }
+    for (size_t i = base; i < arrlenu(f->items); i++) {
+      const ChainItem item = f->items[i];
+      // The first term's "+", if it had one, goes with the constants
+      if (item.op != NO_NODE && (i != base || leading_minus)) {
+        ast_node_append_child(ast, expr_node, item.op);
+      }
+      ast_node_append_child(ast, expr_node, item.operand);
+    }
+    if (!leading_minus && sum != 0) {
+      _append_constant_term(f, expr_node, sum);
+    }
+  }
+  arrsetlen(f->items, base);
+  return false;
+}
+
+// Folds both sides of a comparison, and decides it if they're both constant
+// comparison ::= expression ("==" | "!=" | ">" | ">=" | "<" | "<=") expression
+static Condition _fold_comparison(Folder *f, NodeID comparison_node) {
+  AST *ast = f->ast;
+  const NodeID left = ast_get_first_child(ast, comparison_node);
+  const NodeID op = ast_get_next_sibling(ast, left);
+  const NodeID right = ast_get_next_sibling(ast, op);
+  if (left == NO_NODE || op == NO_NODE || right == NO_NODE)
+    return CONDITION_UNKNOWN;
+  int64_t a = 0;
+  int64_t b = 0;
+  const bool left_constant = _fold_expression(f, left, &a);
+  const bool right_constant = _fold_expression(f, right, &b);
+  if (!left_constant || !right_constant)
+    return CONDITION_UNKNOWN;
+  const enum TOKEN type = _token_type(f, op);
+  bool holds = false;
+  if (type == TOKEN_EQEQ) {
+    holds = a == b;
+  } else if (type == TOKEN_NOTEQ) {
+    holds = a != b;
+  } else if (type == TOKEN_GT) {
+    holds = a > b;
+  } else if (type == TOKEN_GTE) {
+    holds = a >= b;
+  } else if (type == TOKEN_LT) {
+    holds = a < b;
+  } else if (type == TOKEN_LTE) {
+    holds = a <= b;
+  } else {
+    return CONDITION_UNKNOWN;
+  }
+  return holds ? CONDITION_TRUE : CONDITION_FALSE;
+}
+
+// ----------------------
+// Statements
+// ----------------------
+
+static bool _is_statement(AST *ast, NodeID node) {
+  return ast_node_is_grammar(ast, node) &&
+         ast_node_get_grammar(ast, node) == GRAMMAR_TYPE_STATEMENT;
+}
+
+// Pushes every variable a LET or INPUT among node and its siblings assigns,
+// nested blocks included, onto the assigned stack. Returns whether there's a
+// LABEL among them, which control could reach from anywhere
+static bool _collect_assignments(Folder *f, NodeID node) {
+  AST *ast = f->ast;
+  bool has_label = false;
+  for (; node != NO_NODE; node = ast_get_next_sibling(ast, node)) {
+    if (!_is_statement(ast, node))
+      continue;
+    const NodeID first = ast_get_first_child(ast, node);
+    if (first == NO_NODE || !ast_node_is_token(ast, first))
+      continue;
+    const enum TOKEN type = _token_type(f, first);
+    if (type == TOKEN_LET || type == TOKEN_INPUT) {
+      const NodeID ident = ast_get_next_sibling(ast, first);
+      arrput(f->assigned, ast_node_get_token(ast, ident)->symbol_index);
+    } else if (type == TOKEN_LABEL) {
+      has_label = true;
+    } else if (type == TOKEN_IF || type == TOKEN_WHILE) {
+      has_label |= _collect_assignments(f, first);
+    }
+  }
+  return has_label;
+}
+
+// Forgets what was collected onto the assigned stack from base on, or
+// everything if a block had a LABEL
+static void _forget_assignments(Folder *f, size_t base, bool has_label) {
+  if (has_label) {
+    _fact_forget_all(f);
+    return;
+  }
+  for (size_t i = base; i < arrlenu(f->assigned); i++) {
+    _fact_forget(f, f->assigned[i]);
+  }
+}
+
+static void _fold_statements(Folder *f, NodeID parent);
+
+// Folds a statement, and appends what's left of it to parent. Statements
+// that never run are dropped, and the body of an IF that always runs takes
+// its place
+static void _fold_statement(Folder *f, NodeID parent, NodeID statement) {
+  AST *ast = f->ast;
+  const NodeID first = ast_get_first_child(ast, statement);
+  if (first == NO_NODE || !ast_node_is_token(ast, first)) {
+    ast_node_append_child(ast, parent, statement);
+    return;
+  }
+  f->location = ast_node_get_token(ast, first)->file_pos;
+  const enum TOKEN type = _token_type(f, first);
+  const NodeID second = ast_get_next_sibling(ast, first);
+  int64_t value = 0;
+  if (type == TOKEN_LET) {
+    // "LET" ident "=" expression
+    const NodeID eq = ast_get_next_sibling(ast, second);
+    const NodeID expr = ast_get_next_sibling(ast, eq);
+    const uint32_t variable = ast_node_get_token(ast, second)->symbol_index;
+    if (_fold_expression(f, expr, &value)) {
+      _fact_set(f, variable, value);
+    } else {
+      _fact_forget(f, variable);
+    }
+  } else if (type == TOKEN_INPUT) {
+    _fact_forget(f, ast_node_get_token(ast, second)->symbol_index);
+  } else if (type == TOKEN_PRINT) {
+    if (ast_node_is_grammar(ast, second)) {
+      _fold_expression(f, second, &value);
+    }
+  } else if (type == TOKEN_LABEL) {
+    _fact_forget_all(f);
+  } else if (type == TOKEN_IF) {
+    // "IF" comparison "THEN" {statement} "ENDIF"
+    const Condition condition = _fold_comparison(f, second);
+    NodeID body = ast_get_next_sibling(ast, ast_get_next_sibling(ast, second));
+    if (condition == CONDITION_TRUE) {
+      // The body always runs, straight after what came before
+      while (body != NO_NODE && _is_statement(ast, body)) {
+        const NodeID next = ast_get_next_sibling(ast, body);
+        _fold_statement(f, parent, body);
+        body = next;
+      }
+      return;
+    }
+    const size_t base = arrlenu(f->assigned);
+    const bool has_label = _collect_assignments(f, body);
+    // A body that never runs can go, unless a GOTO could jump into it
+    if (condition == CONDITION_FALSE && !has_label) {
+      arrsetlen(f->assigned, base);
+      return;
+    }
+    _fold_statements(f, statement);
+    _forget_assignments(f, base, has_label);
+    arrsetlen(f->assigned, base);
+  } else if (type == TOKEN_WHILE) {
+    // "WHILE" comparison "REPEAT" {statement} "ENDWHILE"
+    const NodeID body =
+        ast_get_next_sibling(ast, ast_get_next_sibling(ast, second));
+    const size_t base = arrlenu(f->assigned);
+    const bool has_label = _collect_assignments(f, body);
+    // The condition also runs after the body
+    _forget_assignments(f, base, has_label);
+    const Condition condition = _fold_comparison(f, second);
+    if (condition == CONDITION_FALSE && !has_label) {
+      arrsetlen(f->assigned, base);
+      return;
+    }
+    _fold_statements(f, statement);
+    _forget_assignments(f, base, has_label);
+    arrsetlen(f->assigned, base);
+  }
+  ast_node_append_child(ast, parent, statement);
+}
+
+// Folds every statement among parent's children. Other children are kept as
+// they are
+static void _fold_statements(Folder *f, NodeID parent) {
+  AST *ast = f->ast;
+  NodeID child = ast_node_detach_children(ast, parent);
+  while (child != NO_NODE) {
+    const NodeID next = ast_get_next_sibling(ast, child);
+    if (_is_statement(ast, child)) {
+      _fold_statement(f, parent, child);
+    } else {
+      ast_node_append_child(ast, parent, child);
+    }
+    child = next;
+  }
+}
+
+void constant_folder_fold(AST *ast, const NameTable *table, TokenArray tokens) {
+  if (ast_is_empty(ast))
+    return;
+  Folder folder = {
+      .ast = ast,
+      .tokens = tokens,
+      .facts = NULL,
+      .stamp = 0,
+      .forgotten = 0,
+      .items = NULL,
+      .assigned = NULL,
+      .location = {0},
+  };
+  const size_t variable_count = shlenu(table->variable_table);
+  for (size_t i = 0; i < variable_count; i++) {
+    const Fact unknown = {.value = 0, .stamp = 0};
+    arrput(folder.facts, unknown);
+  }
+  _fold_statements(&folder, ast_head(ast));
+  arrfree(folder.facts);
+  arrfree(folder.items);
+  arrfree(folder.assigned);
+}
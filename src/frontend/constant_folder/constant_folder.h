@@ -0,0 +1,25 @@
+#pragma once
+
+// -------------------------------
+// CONSTANT FOLDER
+//
+// Works out what can be known about a program before it
+// runs, and rewrites the AST with it:
+//  - Constant subexpressions are folded, with the same
+//    64 bit wraparound the generated code has
+//  - Constants assigned by LET are propagated through
+//    straight-line code
+//  - IFs (and WHILEs) whose condition is decided at
+//    compile time are resolved
+// Division by zero is never folded, so it still
+// happens when the program runs
+// -------------------------------
+
+#include "../../ast/ast.h"
+#include "../../common/name_table.h"
+#include "../lexer/token.h"
+
+// Folds the AST in place. Text for the numbers it creates is allocated from
+// tokens, which has to live as long as the AST. Relies on every variable being
+// resolved, so it must only run once semantic_analyzer_check succeeds
+void constant_folder_fold(AST *ast, const NameTable *table, TokenArray tokens);
@@ -4,9 +4,11 @@
 // FRONTEND
 //
 // Handles parsing the raw BASIC code into tokens,
-// Turning it into a syntax tree, and looking for any errors
+// Turning it into a syntax tree, looking for any errors,
+// and folding what's known at compile time
 // -------------------------------------
 
+#include "constant_folder/constant_folder.h"
 #include "lexer/lexer.h"
 #include "lexer/token.h"
 #include "parser/parser.h"
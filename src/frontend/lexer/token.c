@@ -19,7 +19,10 @@ struct TokenArrayHandle {
 
 Token token_create(TokenArray ta, enum TOKEN type, const char *text,
                    uint32_t length, const FileLocation location) {
-  Token t = {.type = type, .text = NULL, .file_pos = location};
+  Token t = {.type = type,
+             .symbol_index = TOKEN_NO_SYMBOL,
+             .text = NULL,
+             .file_pos = location};
   if (text) {
     t.text = arena_allocate_string(&ta->arena, text, text + length);
   }
@@ -27,7 +30,10 @@ Token token_create(TokenArray ta, enum TOKEN type, const char *text,
 }
 
 Token token_create_simple(enum TOKEN type, const FileLocation location) {
-  Token t = {.type = type, .text = NULL, .file_pos = location};
+  Token t = {.type = type,
+             .symbol_index = TOKEN_NO_SYMBOL,
+             .text = NULL,
+             .file_pos = location};
   return t;
 }
 
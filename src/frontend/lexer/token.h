@@ -63,8 +63,14 @@ static inline bool filelocation_equals(FileLocation fl1, FileLocation fl2) {
   return fl1.col == fl2.col && fl1.line == fl2.line;
 }
 
+// Marks an identifier token that has not been resolved to a symbol
+#define TOKEN_NO_SYMBOL UINT32_MAX
+
 typedef struct {
   enum TOKEN type;
+  uint32_t symbol_index; // For identifiers, the index of the variable in the
+                         // name table once resolved. Sits in what would
+                         // otherwise be padding, so it's free
   char *text; // Optionally stores the actual text for this token (numbers,
               // identifiers, strings, etc.)
   struct FileLocation file_pos; // Stores where in the file the token is located
@@ -0,0 +1,234 @@
+#include "../src/backend/assembly.h"
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+// A toolchain cache in its own directory, found through XDG_CACHE_HOME
+typedef struct {
+  char root[64];
+  char dir[96];
+  char file[128];
+} ProbeCache;
+
+static ProbeCache probe_cache_create(const char *contents) {
+  ProbeCache cache = {0};
+  snprintf(cache.root, sizeof(cache.root), "/tmp/teeny-cache-XXXXXX");
+  cr_assert_not_null(mkdtemp(cache.root));
+  snprintf(cache.dir, sizeof(cache.dir), "%s/teeny", cache.root);
+  snprintf(cache.file, sizeof(cache.file), "%s/toolchains", cache.dir);
+  cr_assert_eq(mkdir(cache.dir, 0755), 0);
+  FILE *file = fopen(cache.file, "w");
+  cr_assert_not_null(file);
+  fputs(contents, file);
+  fclose(file);
+  setenv("XDG_CACHE_HOME", cache.root, 1);
+  return cache;
+}
+
+// Helper function to read the whole cache back. Caller must free
+static char *probe_cache_read(const ProbeCache *cache) {
+  FILE *file = fopen(cache->file, "r");
+  cr_assert_not_null(file);
+  char *contents = calloc(4096, 1);
+  const size_t len = fread(contents, 1, 4095, file);
+  contents[len] = '\0';
+  fclose(file);
+  return contents;
+}
+
+static void probe_cache_destroy(const ProbeCache *cache) {
+  remove(cache->file);
+  rmdir(cache->dir);
+  rmdir(cache->root);
+  unsetenv("XDG_CACHE_HOME");
+}
+
+static long long mtime_of(const char *path) {
+  struct stat st;
+  cr_assert_eq(stat(path, &st), 0);
+  return (long long)st.st_mtime;
+}
+
+// Helper function to format a cache line for a toolchain
+static void entry(char *line, size_t size, int available, long long mtime,
+                  const char *path) {
+  snprintf(line, size, "%d %lld %s\n", available, mtime, path);
+}
+
+static bool is_available(const char *gcc_command) {
+  AssemblerInfo cmd = {.gcc_command = gcc_command};
+  return assembler_is_available(&cmd);
+}
+
+// Helper function to put a shell script standing in for gcc next to the
+// cache, so probing it doesn't touch the real one. Probes with --version
+// always succeed. Returns its path, which the caller must remove
+static char *fake_assembler_create(const ProbeCache *cache, const char *body) {
+  char *path = malloc(128);
+  snprintf(path, 128, "%s/fake-gcc", cache->root);
+  FILE *file = fopen(path, "w");
+  cr_assert_not_null(file);
+  fprintf(file,
+          "#!/bin/sh\n"
+          "[ \"$1\" = --version ] && exit 0\n"
+          "%s",
+          body);
+  fclose(file);
+  cr_assert_eq(chmod(path, 0755), 0);
+  return path;
+}
+
+static void on_sigpipe(int signum) { (void)signum; }
+
+// Helper function to get the SIGPIPE handler the process has right now
+static void (*sigpipe_handler(void))(int) {
+  struct sigaction current;
+  cr_assert_eq(sigaction(SIGPIPE, NULL, &current), 0);
+  return current.sa_handler;
+}
+
+// =========================
+// PROBE CACHE TESTS
+// =========================
+
+Test(ProbeCache, skips_corrupt_lines) {
+  // /bin/false never probes successfully, so only the cache can say otherwise
+  char valid[256];
+  entry(valid, sizeof(valid), 1, mtime_of("/bin/false"), "/bin/false");
+  char contents[512];
+  snprintf(contents, sizeof(contents),
+           "garbage\n"
+           "1 not-a-time /bin/false\n"
+           "\n"
+           "1\n"
+           "%s",
+           valid);
+  const ProbeCache cache = probe_cache_create(contents);
+
+  cr_assert(is_available("/bin/false"),
+            "The valid entry should be found past the corrupt ones");
+
+  probe_cache_destroy(&cache);
+}
+
+Test(ProbeCache, probes_stale_entries_again) {
+  char contents[256];
+  entry(contents, sizeof(contents), 1, mtime_of("/bin/false") - 1,
+        "/bin/false");
+  const ProbeCache cache = probe_cache_create(contents);
+
+  cr_assert(!is_available("/bin/false"),
+            "An entry for an older toolchain shouldn't be trusted");
+  char *after = probe_cache_read(&cache);
+  cr_assert_str_eq(after, contents, "A failed probe shouldn't be recorded");
+  free(after);
+
+  probe_cache_destroy(&cache);
+}
+
+Test(ProbeCache, only_records_successful_probes) {
+  const long long mtime = mtime_of("/bin/true");
+  char failed[256];
+  entry(failed, sizeof(failed), 0, mtime, "/bin/true");
+  const ProbeCache cache = probe_cache_create(failed);
+
+  cr_assert(is_available("/bin/true"),
+            "A recorded failure should be probed again");
+  char expected[256];
+  entry(expected, sizeof(expected), 1, mtime, "/bin/true");
+  char *after = probe_cache_read(&cache);
+  cr_assert_str_eq(after, expected,
+                   "The failure should be replaced by the success");
+  free(after);
+
+  cr_assert(!is_available("/bin/false"));
+  after = probe_cache_read(&cache);
+  cr_assert_str_eq(after, expected, "Failures shouldn't be recorded");
+  free(after);
+
+  probe_cache_destroy(&cache);
+}
+
+// =========================
+// ASSEMBLER PROCESS TESTS
+// =========================
+
+Test(AssemblerProcess, streams_assembly_into_the_assembler) {
+  const ProbeCache cache = probe_cache_create("");
+  // The output file is the last argument
+  char *fake = fake_assembler_create(&cache, "for arg; do out=$arg; done\n"
+                                             "cat > \"$out\"\n");
+  char output[128];
+  snprintf(output, sizeof(output), "%s/program", cache.root);
+  AssemblerInfo cmd = {.gcc_command = fake,
+                       .assembler_flags = "",
+                       .linker_flags = "",
+                       .output_ext = ""};
+  cr_assert(assembler_is_available(&cmd));
+  signal(SIGPIPE, on_sigpipe);
+
+  AssemblerProcess process;
+  cr_assert(assembler_spawn(&cmd, output, &process));
+  cr_assert_eq(sigpipe_handler(), SIG_IGN,
+               "SIGPIPE should be ignored while the assembler runs");
+  fputs("main:\n\tret\n", process.input);
+  cr_assert(assembler_wait(&process));
+  cr_assert_null(process.input);
+  cr_assert_eq(sigpipe_handler(), on_sigpipe,
+               "The process' own handler should be put back");
+
+  FILE *file = fopen(output, "r");
+  cr_assert_not_null(file);
+  char assembled[64] = {0};
+  cr_assert_gt(fread(assembled, 1, sizeof(assembled) - 1, file), 0);
+  fclose(file);
+  cr_assert_str_eq(assembled, "main:\n\tret\n",
+                   "The assembler should get everything written to it");
+
+  signal(SIGPIPE, SIG_DFL);
+  remove(output);
+  remove(fake);
+  free(fake);
+  probe_cache_destroy(&cache);
+}
+
+Test(AssemblerProcess, reports_an_assembler_that_died) {
+  const ProbeCache cache = probe_cache_create("");
+  // Exits without reading any of its input
+  char *fake = fake_assembler_create(&cache, "exit 1\n");
+  AssemblerInfo cmd = {.gcc_command = fake,
+                       .assembler_flags = "",
+                       .linker_flags = "",
+                       .output_ext = ""};
+  cr_assert(assembler_is_available(&cmd));
+  signal(SIGPIPE, SIG_DFL);
+
+  AssemblerProcess process;
+  cr_assert(assembler_spawn(&cmd, "/dev/null", &process));
+  // Far more than a pipe holds, so the writes outlive the assembler
+  static char chunk[65536];
+  memset(chunk, '#', sizeof(chunk));
+  bool failed = false;
+  for (int i = 0; i < 64 && !failed; i++) {
+    failed = fwrite(chunk, 1, sizeof(chunk), process.input) != sizeof(chunk) ||
+             fflush(process.input) != 0;
+  }
+  cr_assert(failed, "Writing to a dead assembler should fail");
+  cr_assert_eq(errno, EPIPE, "It should fail with EPIPE, not a signal");
+  cr_assert(!assembler_wait(&process), "The assembler's failure is reported");
+  cr_assert_eq(sigpipe_handler(), SIG_DFL,
+               "The process' own handler should be put back");
+
+  remove(fake);
+  free(fake);
+  probe_cache_destroy(&cache);
+}
@@ -25,7 +25,7 @@ Test(parser, test_verify_structure) {
 
   // LET statement tokens and expression
   ast_node_add_child_token(&ast, let_stmt, token_create_simple(TOKEN_LET, fl));
-  Token ident_x = {TOKEN_IDENT, NULL, fl}; // Use NULL for text in mock
+  Token ident_x = token_create_simple(TOKEN_IDENT, fl); // NULL text in mock
   ast_node_add_child_token(&ast, let_stmt, ident_x);
   ast_node_add_child_token(&ast, let_stmt, token_create_simple(TOKEN_EQ, fl));
 
@@ -38,7 +38,7 @@ Test(parser, test_verify_structure) {
   NodeID unary1 = ast_node_add_child_grammar(&ast, term1, GRAMMAR_TYPE_UNARY);
   NodeID primary1 =
       ast_node_add_child_grammar(&ast, unary1, GRAMMAR_TYPE_PRIMARY);
-  Token num_10 = {TOKEN_NUMBER, NULL, fl}; // Use NULL for text in mock
+  Token num_10 = token_create_simple(TOKEN_NUMBER, fl); // NULL text in mock
   ast_node_add_child_token(&ast, primary1, num_10);
 
   // + operator
@@ -49,7 +49,7 @@ Test(parser, test_verify_structure) {
   NodeID unary2 = ast_node_add_child_grammar(&ast, term2, GRAMMAR_TYPE_UNARY);
   NodeID primary2 =
       ast_node_add_child_grammar(&ast, unary2, GRAMMAR_TYPE_PRIMARY);
-  Token num_20 = {TOKEN_NUMBER, NULL, fl}; // Use NULL for text in mock
+  Token num_20 = token_create_simple(TOKEN_NUMBER, fl); // NULL text in mock
   ast_node_add_child_token(&ast, primary2, num_20);
 
   // Statement 2: PRINT x
@@ -68,7 +68,7 @@ Test(parser, test_verify_structure) {
       ast_node_add_child_grammar(&ast, print_term, GRAMMAR_TYPE_UNARY);
   NodeID print_primary =
       ast_node_add_child_grammar(&ast, print_unary, GRAMMAR_TYPE_PRIMARY);
-  Token ident_x_print = {TOKEN_IDENT, NULL, fl}; // Use NULL for text in mock
+  Token ident_x_print = token_create_simple(TOKEN_IDENT, fl); // NULL text in mock
   ast_node_add_child_token(&ast, print_primary, ident_x_print);
 
   // Verify the structure
@@ -0,0 +1,225 @@
+#include "../src/backend/batched_writer.h"
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+// Writes through a fresh writer into a temporary file, and returns everything
+// that reached the file. Caller must free
+typedef void (*WriteFn)(BatchedWriter *writer);
+
+static char *capture_mode(WriteFn write_fn, BatchedWriterMode mode) {
+  FILE *file = tmpfile();
+  cr_assert_not_null(file);
+  BatchedWriter *writer = malloc(sizeof(BatchedWriter));
+  *writer = batched_writer_init_mode(file, mode);
+  write_fn(writer);
+  batched_writer_close(writer);
+  const size_t written = batched_writer_bytes_written(writer);
+  free(writer);
+
+  char *out = calloc(written + 1, 1);
+  rewind(file);
+  cr_assert_eq(fread(out, 1, written, file), written);
+  fclose(file);
+  return out;
+}
+
+static char *capture(WriteFn write_fn) {
+  return capture_mode(write_fn, BATCHED_WRITER_SYNC);
+}
+
+static void write_ints(BatchedWriter *writer) {
+  const int64_t values[] = {0,    1,     -1,        9,         10,
+                            -10,  99,    100,       12345,     -98765,
+                            1000, 10000, INT32_MAX, INT32_MIN, INT64_MAX,
+                            INT64_MIN};
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    batched_writer_write_int(writer, values[i]);
+    batched_writer_write_char(writer, ' ');
+  }
+  batched_writer_write_uint(writer, UINT64_MAX);
+}
+
+Test(batched_writer, int_matches_printf) {
+  char *out = capture(write_ints);
+  cr_assert_str_eq(out, "0 1 -1 9 10 -10 99 100 12345 -98765 1000 10000 "
+                        "2147483647 -2147483648 9223372036854775807 "
+                        "-9223372036854775808 18446744073709551615");
+  free(out);
+}
+
+static void write_padded_and_symbols(BatchedWriter *writer) {
+  const PaddedString reg = PADDED_STRING("r10b");
+  const PaddedString mnemonic = PADDED_STRING("\tmovzx ");
+  batched_writer_write_padded(writer, &mnemonic);
+  batched_writer_write_padded(writer, &reg);
+  batched_writer_write_len(writer, ", ", 2);
+  batched_writer_write_symbol(writer, ".LI", 3, 42);
+  batched_writer_write_symbol(writer, "_static_", 8, 0);
+}
+
+Test(batched_writer, padded_strings_and_symbols) {
+  char *out = capture(write_padded_and_symbols);
+  cr_assert_str_eq(out, "\tmovzx r10b, .LI42_static_0");
+  free(out);
+}
+
+// Enough numbers to cross several buffer flushes
+#define MANY_INTS 100000
+
+static void write_many_ints(BatchedWriter *writer) {
+  for (int64_t i = 0; i < MANY_INTS; i++) {
+    batched_writer_write_int(writer, i * 7919 - 5000000);
+    batched_writer_write_char(writer, '\n');
+  }
+}
+
+static void check_many_ints(char *out) {
+  const char *line = out;
+  for (int64_t i = 0; i < MANY_INTS; i++) {
+    char expected[32];
+    const int len =
+        snprintf(expected, sizeof(expected), "%lld\n",
+                 (long long)(i * 7919 - 5000000));
+    cr_assert_eq(strncmp(line, expected, (size_t)len), 0,
+                 "Mismatch at number %lld", (long long)i);
+    line += len;
+  }
+  cr_assert_eq(*line, '\0');
+  free(out);
+}
+
+Test(batched_writer, ints_survive_flushes) {
+  check_many_ints(capture(write_many_ints));
+}
+
+Test(batched_writer, pipelined_output_stays_in_order) {
+  check_many_ints(capture_mode(write_many_ints, BATCHED_WRITER_PIPELINED));
+}
+
+Test(batched_writer, mapped_output_is_trimmed) {
+  // tmpfile() is opened for reading and writing, so it can be mapped
+  check_many_ints(capture_mode(write_many_ints, BATCHED_WRITER_MAPPED));
+}
+
+// Bigger than every buffer in the pipeline put together
+#define HUGE_STRING_SIZE                                                       \
+  (BATCHED_WRITER_BUFFER_SIZE * (BATCHED_WRITER_PIPELINE_DEPTH + 1) + 17)
+
+static void write_huge_string(BatchedWriter *writer) {
+  char *huge = malloc(HUGE_STRING_SIZE + 1);
+  for (size_t i = 0; i < HUGE_STRING_SIZE; i++) {
+    huge[i] = (char)('a' + i % 26);
+  }
+  huge[HUGE_STRING_SIZE] = '\0';
+  batched_writer_write_char(writer, '<');
+  batched_writer_write(writer, huge);
+  batched_writer_write_char(writer, '>');
+  free(huge);
+}
+
+Test(batched_writer, huge_strings_are_chunked) {
+  const BatchedWriterMode modes[] = {
+      BATCHED_WRITER_SYNC, BATCHED_WRITER_PIPELINED, BATCHED_WRITER_MAPPED};
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    char *out = capture_mode(write_huge_string, modes[m]);
+    cr_assert_eq(strlen(out), HUGE_STRING_SIZE + 2);
+    cr_assert_eq(out[0], '<');
+    for (size_t i = 0; i < HUGE_STRING_SIZE; i++) {
+      cr_assert_eq(out[i + 1], (char)('a' + i % 26), "Mismatch at %zu", i);
+    }
+    cr_assert_eq(out[HUGE_STRING_SIZE + 1], '>');
+    free(out);
+  }
+}
+
+// Past the first few mappings, so the file has to grow and be remapped
+#define PAST_MAPPING_SIZE (5 * 1024 * 1024 + 3)
+#define PAST_MAPPING_CHUNK (300 * 1024)
+
+// Writes PAST_MAPPING_SIZE bytes in chunks, with single characters in between
+// so the chunks straddle the end of the mapping
+static void write_past_mapping(BatchedWriter *writer) {
+  char *chunk = malloc(PAST_MAPPING_CHUNK);
+  size_t written = 0;
+  while (written < PAST_MAPPING_SIZE) {
+    const size_t len = PAST_MAPPING_SIZE - written < PAST_MAPPING_CHUNK
+                           ? PAST_MAPPING_SIZE - written
+                           : PAST_MAPPING_CHUNK;
+    for (size_t i = 0; i < len; i++) {
+      chunk[i] = (char)('a' + (written + i) % 26);
+    }
+    batched_writer_write_len(writer, chunk, len / 2);
+    batched_writer_write_char(writer, chunk[len / 2]);
+    batched_writer_write_len(writer, chunk + len / 2 + 1, len - len / 2 - 1);
+    written += len;
+  }
+  free(chunk);
+}
+
+Test(batched_writer, mapped_output_grows_past_the_first_mapping) {
+  char *out = capture_mode(write_past_mapping, BATCHED_WRITER_MAPPED);
+  for (size_t i = 0; i < PAST_MAPPING_SIZE; i++) {
+    cr_assert_eq(out[i], (char)('a' + i % 26), "Mismatch at %zu", i);
+  }
+  cr_assert_eq(out[PAST_MAPPING_SIZE], '\0');
+  free(out);
+}
+
+Test(batched_writer, mapped_output_starts_small) {
+  FILE *file = tmpfile();
+  cr_assert_not_null(file);
+  BatchedWriter writer = batched_writer_init_mode(file, BATCHED_WRITER_MAPPED);
+  batched_writer_write(&writer, "small");
+  // Short outputs shouldn't reserve a large file while they're written
+  struct stat st;
+  cr_assert_eq(fstat(fileno(file), &st), 0);
+  cr_assert_gt(st.st_size, 0, "The output should be mapped");
+  cr_assert_leq(st.st_size, 1024 * 1024);
+  cr_assert(batched_writer_close(&writer));
+  cr_assert_eq(fstat(fileno(file), &st), 0);
+  cr_assert_eq(st.st_size, 5);
+  fclose(file);
+}
+
+Test(batched_writer, mapped_output_reports_running_out_of_space) {
+  // A file size limit between two sizes of the mapping stands in
+  // for a full disk. Going over it fails writes with EFBIG instead of killing
+  // the process with SIGXFSZ
+  const size_t limit = 3 * 1024 * 1024;
+  struct rlimit old_limit;
+  cr_assert_eq(getrlimit(RLIMIT_FSIZE, &old_limit), 0);
+  struct rlimit new_limit = {.rlim_cur = limit, .rlim_max = old_limit.rlim_max};
+  void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+  cr_assert_eq(setrlimit(RLIMIT_FSIZE, &new_limit), 0);
+
+  FILE *file = tmpfile();
+  cr_assert_not_null(file);
+  BatchedWriter writer = batched_writer_init_mode(file, BATCHED_WRITER_MAPPED);
+  write_past_mapping(&writer);
+  const bool ok = batched_writer_close(&writer);
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+  signal(SIGXFSZ, old_handler);
+
+  cr_assert(!ok, "Running out of space should be reported");
+  cr_assert_eq(writer.error, EFBIG);
+  // What was written into the mapping before it ran out is kept
+  cr_assert_eq(fseek(file, 0, SEEK_END), 0);
+  const long size = ftell(file);
+  cr_assert_geq(size, 2 * 1024 * 1024);
+  cr_assert_leq(size, (long)limit);
+  rewind(file);
+  char *out = malloc((size_t)size);
+  cr_assert_eq(fread(out, 1, (size_t)size, file), (size_t)size);
+  for (long i = 0; i < size; i++) {
+    cr_assert_eq(out[i], (char)('a' + i % 26), "Mismatch at %ld", i);
+  }
+  free(out);
+  fclose(file);
+}
@@ -0,0 +1,60 @@
+#include "../src/core/compiler.h"
+#include "../src/core/config.h"
+#include "test_util.h"
+#include <criterion/criterion.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+// Helper function to parse the compiler's own arguments into a config
+static CompilerConfig parse_config(int argc, const char **argv) {
+  ArgParser *parser = argparse_create(&PARSER_SPEC);
+  cr_assert_not_null(parser);
+  ParseResult *result = argparse_parse(parser, argc, argv);
+  cr_assert_not_null(result);
+  cr_assert(argparse_is_success(result), "Arguments should parse: %s",
+            argparse_get_error(result));
+  const CompilerConfig config = compiler_config_init(result);
+  argparse_free_result(result);
+  argparse_free_parser(parser);
+  return config;
+}
+
+// =========================
+// FREESTANDING TESTS
+// =========================
+
+Test(CompilerConfig, freestanding_is_off_by_default) {
+  const char *argv[] = {"teeny", "program.basic"};
+  CompilerConfig config = parse_config(2, argv);
+
+  cr_assert(!config.freestanding);
+
+  compiler_config_free(&config);
+}
+
+Test(CompilerConfig, reads_freestanding) {
+  const char *argv[] = {"teeny", "--freestanding", "-O2", "program.basic"};
+  CompilerConfig config = parse_config(4, argv);
+
+  cr_assert(config.freestanding, "--freestanding should be set");
+  cr_assert_eq(config.optimization_level, 2,
+               "Other flags should still be read");
+  cr_assert_str_eq(config.filename_or_code_literal, "program.basic");
+
+  compiler_config_free(&config);
+}
+
+Test(CompilerConfig, rejects_freestanding_without_an_object_writer) {
+  const char *argv[] = {"teeny", "--freestanding", "-t", "x86_64-windows",
+                        "-c", "PRINT 1"};
+  CompilerConfig config = parse_config(6, argv);
+  cr_assert(config.freestanding);
+
+  bool ok = true;
+  MUTED_OUTPUT { ok = compiler_execute(&config); }
+  cr_assert(!ok, "Only x86_64-linux can be built freestanding");
+
+  compiler_config_free(&config);
+}
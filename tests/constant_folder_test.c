@@ -0,0 +1,188 @@
+#include "../src/ast/ast_utils.h"
+#include "../src/common/file_reader.h"
+#include "../src/common/name_table.h"
+#include "../src/frontend/constant_folder/constant_folder.h"
+#include "../src/frontend/lexer/lexer.h"
+#include "../src/frontend/parser/parser.h"
+#include "../src/frontend/semantic_analyzer/semantic_analyzer.h"
+#include <criterion/criterion.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+// Helper function to parse, check and fold a program
+static void fold_string(const char *input, AST *ast, TokenArray *ta,
+                        NameTable **table) {
+  FileReader fr = filereader_init_from_string(input);
+  *ta = lexer_parse(fr);
+  filereader_destroy(&fr);
+  *ast = ast_parse(*ta);
+  *table = name_table_collect_from_ast(ast);
+  cr_assert(semantic_analyzer_check(ast, *table),
+            "Test program should pass semantic analysis");
+  constant_folder_fold(ast, *table, *ta);
+}
+
+// Helper function to cleanup test data
+static void cleanup_test_data(AST *ast, TokenArray *ta, NameTable *table) {
+  name_table_destroy(table);
+  ast_destroy(ast);
+  token_array_destroy(ta);
+}
+
+// =========================
+// EXPRESSION TESTS
+// =========================
+
+Test(ConstantFolder, folds_arithmetic) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("LET x = 2 * 3 + 4\n", &ast, &ta, &table);
+
+  cr_assert(ast_verify_structure(&ast,
+                                 "PROGRAM(STATEMENT(LET,IDENT(x),EQ,EXPRESSION("
+                                 "TERM(UNARY(PRIMARY(NUMBER(10)))))))"),
+            "Constant arithmetic should fold to a single number");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+Test(ConstantFolder, folds_negative_result) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("LET x = 3 - 10\n", &ast, &ta, &table);
+
+  cr_assert(ast_verify_structure(&ast,
+                                 "PROGRAM(STATEMENT(LET,IDENT(x),EQ,EXPRESSION("
+                                 "TERM(UNARY(MINUS,PRIMARY(NUMBER(7)))))))"),
+            "Negative results should fold to a unary minus");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+Test(ConstantFolder, keeps_division_by_zero) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("LET x = 7 / 0\n", &ast, &ta, &table);
+
+  cr_assert(ast_verify_structure(&ast,
+                                 "PROGRAM(STATEMENT(LET,IDENT(x),EQ,EXPRESSION("
+                                 "TERM(UNARY(PRIMARY(NUMBER(7))),DIV,UNARY("
+                                 "PRIMARY(NUMBER(0)))))))"),
+            "Division by zero should be left for the program to hit");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+// =========================
+// PROPAGATION TESTS
+// =========================
+
+Test(ConstantFolder, propagates_let) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("LET x = 5\nPRINT x + 1\n", &ast, &ta, &table);
+
+  cr_assert(ast_verify_structure(&ast,
+                                 "PROGRAM(STATEMENT(LET,IDENT(x),EQ,EXPRESSION("
+                                 "TERM(UNARY(PRIMARY(NUMBER(5)))))),"
+                                 "STATEMENT(PRINT,EXPRESSION(TERM(UNARY("
+                                 "PRIMARY(NUMBER(6)))))))"),
+            "A variable set by LET should be replaced by its value");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+Test(ConstantFolder, input_stops_propagation) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("LET x = 5\nINPUT x\nPRINT x\n", &ast, &ta, &table);
+
+  cr_assert(ast_verify_structure(&ast,
+                                 "PROGRAM(STATEMENT(LET,IDENT(x),EQ,EXPRESSION("
+                                 "TERM(UNARY(PRIMARY(NUMBER(5)))))),"
+                                 "STATEMENT(INPUT,IDENT(x)),"
+                                 "STATEMENT(PRINT,EXPRESSION(TERM(UNARY("
+                                 "PRIMARY(IDENT(x)))))))"),
+            "A variable read by INPUT should no longer be known");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+Test(ConstantFolder, label_stops_propagation) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("LET x = 5\nLABEL top\nPRINT x\nLET x = 6\nGOTO top\n", &ast,
+              &ta, &table);
+
+  cr_assert(ast_verify_structure(&ast,
+                                 "PROGRAM(STATEMENT(LET,IDENT(x),EQ,EXPRESSION("
+                                 "TERM(UNARY(PRIMARY(NUMBER(5)))))),"
+                                 "STATEMENT(LABEL,IDENT(top)),"
+                                 "STATEMENT(PRINT,EXPRESSION(TERM(UNARY("
+                                 "PRIMARY(IDENT(x)))))),"
+                                 "STATEMENT(LET,IDENT(x),EQ,EXPRESSION("
+                                 "TERM(UNARY(PRIMARY(NUMBER(6)))))),"
+                                 "STATEMENT(GOTO,IDENT(top)))"),
+            "Nothing should be known after a LABEL");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+// =========================
+// CONTROL FLOW TESTS
+// =========================
+
+Test(ConstantFolder, removes_false_if) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("LET x = 1\nIF x > 2 THEN\nPRINT x\nENDIF\n", &ast, &ta,
+              &table);
+
+  cr_assert(ast_verify_structure(&ast,
+                                 "PROGRAM(STATEMENT(LET,IDENT(x),EQ,EXPRESSION("
+                                 "TERM(UNARY(PRIMARY(NUMBER(1)))))))"),
+            "An IF that is never taken should be removed");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+Test(ConstantFolder, inlines_true_if) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("IF 1 < 2 THEN\nPRINT \"yes\"\nENDIF\n", &ast, &ta, &table);
+
+  cr_assert(ast_verify_structure(&ast, "PROGRAM(STATEMENT(PRINT,STRING(yes)))"),
+            "An IF that is always taken should be replaced by its body");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+Test(ConstantFolder, loop_body_forgets_assignments) {
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  fold_string("LET i = 0\nWHILE i < 3 REPEAT\nLET i = i + 1\nENDWHILE\n",
+              &ast, &ta, &table);
+
+  cr_assert(ast_verify_structure(
+                &ast, "PROGRAM(STATEMENT(LET,IDENT(i),EQ,EXPRESSION("
+                      "TERM(UNARY(PRIMARY(NUMBER(0)))))),"
+                      "STATEMENT(WHILE,COMPARISON(EXPRESSION(TERM(UNARY("
+                      "PRIMARY(IDENT(i))))),LT,EXPRESSION(TERM(UNARY(PRIMARY("
+                      "NUMBER(3)))))),REPEAT,STATEMENT(LET,IDENT(i),EQ,"
+                      "EXPRESSION(TERM(UNARY(PRIMARY(IDENT(i)))),PLUS,TERM("
+                      "UNARY(PRIMARY(NUMBER(1)))))),ENDWHILE))"),
+            "Variables assigned in a loop should not be known inside it");
+
+  cleanup_test_data(&ast, &ta, table);
+}
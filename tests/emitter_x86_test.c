@@ -0,0 +1,479 @@
+#include "../src/backend/assembly.h"
+#include "../src/backend/emitter-x86.h"
+#include "../src/backend/ir.h"
+#include "../src/common/file_reader.h"
+#include "../src/common/name_table.h"
+#include "../src/frontend/lexer/lexer.h"
+#include "../src/frontend/parser/parser.h"
+#include "../src/frontend/semantic_analyzer/semantic_analyzer.h"
+#include <criterion/criterion.h>
+#include <poll.h>
+#include <stb_ds.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+// A program linked into its own directory, with room for its input and output
+typedef struct {
+  char dir[64];
+  char object[96];
+  char executable[96];
+  char input[96];
+  char output[96];
+} Program;
+
+typedef struct {
+  TokenArray ta;
+  AST ast;
+  NameTable *table;
+  IR ir;
+} Lowered;
+
+// Helper function to parse, check and lower a program, as written
+static Lowered lower_program(const char *source) {
+  Lowered l = {0};
+  FileReader fr = filereader_init_from_string(source);
+  l.ta = lexer_parse(fr);
+  filereader_destroy(&fr);
+  l.ast = ast_parse(l.ta);
+  l.table = name_table_collect_from_ast(&l.ast);
+  cr_assert(semantic_analyzer_check(&l.ast, l.table),
+            "Test program should pass semantic analysis");
+  l.ir = ir_build(&l.ast, l.table);
+  cr_assert(ir_verify(&l.ir, stderr), "Built IR should verify");
+  return l;
+}
+
+static void cleanup_lowered(Lowered *l) {
+  ir_destroy(&l->ir);
+  name_table_destroy(l->table);
+  ast_destroy(&l->ast);
+  token_array_destroy(&l->ta);
+}
+
+// Helper function to encode a program into an object, without linking it
+static ObjectFile encode_program(const char *source, bool freestanding) {
+  Lowered l = lower_program(source);
+  const EmitOptions options = {.freestanding = freestanding};
+  ObjectFile object = object_file_init();
+  emit_x86_object(&HOST_INFO, &object, &l.ir, l.table, &options);
+  cleanup_lowered(&l);
+  return object;
+}
+
+static const ObjSymbol *find_symbol(const ObjectFile *object,
+                                    const char *name) {
+  for (size_t i = 0; i < arrlenu(object->symbols); i++) {
+    const ObjSymbol *symbol = &object->symbols[i];
+    if (symbol->name && strcmp(symbol->name, name) == 0)
+      return symbol;
+  }
+  return NULL;
+}
+
+// Helper function to compile a program into an executable through the object
+// writer, the way the compiler builds one for x86_64-linux
+static Program build_program(const char *source, bool freestanding) {
+  Program p = {0};
+  snprintf(p.dir, sizeof(p.dir), "/tmp/teeny-emit-XXXXXX");
+  cr_assert_not_null(mkdtemp(p.dir));
+  snprintf(p.object, sizeof(p.object), "%s/program.o", p.dir);
+  snprintf(p.executable, sizeof(p.executable), "%s/program", p.dir);
+  snprintf(p.input, sizeof(p.input), "%s/input", p.dir);
+  snprintf(p.output, sizeof(p.output), "%s/output", p.dir);
+
+  ObjectFile object = encode_program(source, freestanding);
+  FILE *file = fopen(p.object, "wb");
+  cr_assert_not_null(file);
+  cr_assert(object_file_write_elf(&object, file));
+  cr_assert_eq(fclose(file), 0);
+  object_file_destroy(&object);
+
+  AssemblerInfo cmd = {.gcc_command = "gcc",
+                       .assembler_flags = "",
+                       .linker_flags = "",
+                       .output_ext = "",
+                       .freestanding = freestanding};
+  cr_assert(assembler_is_available(&cmd), "gcc is needed to link programs");
+  cr_assert(assembler_link(&cmd, p.object, p.executable),
+            "The program should link");
+  return p;
+}
+
+static void destroy_program(const Program *p) {
+  remove(p->object);
+  remove(p->executable);
+  remove(p->input);
+  remove(p->output);
+  rmdir(p->dir);
+}
+
+// Helper function to run a program on the given stdin, and read back all it
+// wrote to stdout. stdin and stdout are regular files, so every read but the
+// last fills the whole input buffer. Caller must free
+static char *run_program(const Program *p, const char *input,
+                         size_t input_len, size_t *output_len) {
+  FILE *file = fopen(p->input, "wb");
+  cr_assert_not_null(file);
+  cr_assert_eq(fwrite(input, 1, input_len, file), input_len);
+  cr_assert_eq(fclose(file), 0);
+
+  fflush(stdout);
+  const pid_t pid = fork();
+  cr_assert_neq(pid, -1);
+  if (pid == 0) {
+    if (!freopen(p->input, "rb", stdin) || !freopen(p->output, "wb", stdout))
+      _exit(127);
+    execl(p->executable, p->executable, (char *)NULL);
+    _exit(127);
+  }
+  int status = 0;
+  cr_assert_eq(waitpid(pid, &status, 0), pid);
+  cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+            "The program should exit normally");
+
+  file = fopen(p->output, "rb");
+  cr_assert_not_null(file);
+  fseek(file, 0, SEEK_END);
+  const size_t size = (size_t)ftell(file);
+  rewind(file);
+  char *output = calloc(size + 1, 1);
+  cr_assert_eq(fread(output, 1, size, file), size);
+  fclose(file);
+  if (output_len)
+    *output_len = size;
+  return output;
+}
+
+// Helper function to check a program's whole output for an input string
+static void check_output(const char *source, const char *input,
+                         const char *expected) {
+  const Program p = build_program(source, false);
+  char *output = run_program(&p, input, strlen(input), NULL);
+  cr_assert_str_eq(output, expected, "Got:\n%s\nExpected:\n%s", output,
+                   expected);
+  free(output);
+  destroy_program(&p);
+}
+
+// Helper function to read from fd until needle shows up in what was read, or
+// timeout_ms passes without anything new. Returns whether it showed up
+static bool wait_for_output(int fd, const char *needle, int timeout_ms) {
+  char seen[256] = {0};
+  size_t len = 0;
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  while (!strstr(seen, needle)) {
+    if (len + 1 >= sizeof(seen) || poll(&pfd, 1, timeout_ms) <= 0)
+      return false;
+    const ssize_t got = read(fd, seen + len, sizeof(seen) - 1 - len);
+    if (got <= 0)
+      return false;
+    len += (size_t)got;
+  }
+  return true;
+}
+
+// =========================
+// PRINT RUNTIME TESTS
+// =========================
+
+Test(EmitterRuntime, flushes_output_at_exit) {
+  static const char *source = "PRINT \"hello\"\nLET x = 42\nPRINT x\n";
+  for (int freestanding = 0; freestanding <= 1; freestanding++) {
+    const Program p = build_program(source, freestanding);
+    char *output = run_program(&p, "", 0, NULL);
+    cr_assert_str_eq(output, "hello\n42\n",
+                     "Buffered output should be written when the program "
+                     "ends (freestanding: %d)",
+                     freestanding);
+    free(output);
+    destroy_program(&p);
+  }
+}
+
+Test(EmitterRuntime, flushes_output_before_input) {
+  const Program p = build_program(
+      "PRINT \"number?\"\nLET x = 0\nINPUT x\nPRINT x + 1\n", false);
+  int to_program[2];
+  int from_program[2];
+  cr_assert_eq(pipe(to_program), 0);
+  cr_assert_eq(pipe(from_program), 0);
+  fflush(stdout);
+  const pid_t pid = fork();
+  cr_assert_neq(pid, -1);
+  if (pid == 0) {
+    dup2(to_program[0], STDIN_FILENO);
+    dup2(from_program[1], STDOUT_FILENO);
+    close(to_program[0]);
+    close(to_program[1]);
+    close(from_program[0]);
+    close(from_program[1]);
+    execl(p.executable, p.executable, (char *)NULL);
+    _exit(127);
+  }
+  close(to_program[0]);
+  close(from_program[1]);
+
+  // The program is blocked on INPUT, so the prompt can only have arrived if
+  // it was flushed first
+  const bool prompted = wait_for_output(from_program[0], "number?\n", 5000);
+  cr_assert_eq(write(to_program[1], "41\n", 3), 3);
+  close(to_program[1]);
+  const bool answered = wait_for_output(from_program[0], "42\n", 5000);
+  close(from_program[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  cr_assert(prompted, "The prompt should be written before INPUT blocks");
+  cr_assert(answered, "The program should print its answer");
+  cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  destroy_program(&p);
+}
+
+Test(EmitterRuntime, flushes_when_the_buffer_fills) {
+  // Well over the 64KB output buffer, through both print_integer and
+  // print_string
+  const Program p = build_program("LET i = 0\n"
+                                  "WHILE i < 20000 REPEAT\n"
+                                  "PRINT \"line\"\n"
+                                  "PRINT i\n"
+                                  "LET i = i + 1\n"
+                                  "ENDWHILE\n",
+                                  false);
+  size_t output_len = 0;
+  char *output = run_program(&p, "", 0, &output_len);
+
+  char *expected = calloc(20000 * 12 + 1, 1);
+  size_t expected_len = 0;
+  for (int i = 0; i < 20000; i++) {
+    expected_len += (size_t)sprintf(expected + expected_len, "line\n%d\n", i);
+  }
+  cr_assert_gt(expected_len, 2 * 65536);
+  cr_assert_eq(output_len, expected_len, "Got %zu bytes, expected %zu",
+               output_len, expected_len);
+  cr_assert_str_eq(output, expected, "Output should survive every flush");
+  free(expected);
+  free(output);
+  destroy_program(&p);
+}
+
+Test(EmitterRuntime, prints_integers_like_printf) {
+  // Like printf("%d\n"), only the low 32 bits are printed. The extremes of the
+  // 32 bit range are where the multiply by DIV10_MAGIC could go wrong
+  check_output("LET x = 0\n"
+               "INPUT x\nPRINT x\n"
+               "INPUT x\nPRINT x\n"
+               "INPUT x\nPRINT x\n"
+               "INPUT x\nPRINT x\n"
+               "INPUT x\nPRINT x\n"
+               "INPUT x\nPRINT x\n"
+               "INPUT x\nPRINT x\n"
+               "PRINT x - 1\n"
+               "PRINT x * 65536 * 65536\n"
+               "PRINT x * 65536 * 65536 - 1\n"
+               "PRINT x * 65536 * 65536 + 123\n",
+               "0 -1 7 -10 1000000000 2147483647 -2147483648",
+               "0\n-1\n7\n-10\n1000000000\n2147483647\n-2147483648\n"
+               // INT32_MIN - 1 keeps INT32_MAX in its low 32 bits
+               "2147483647\n"
+               // INT64_MIN, INT64_MAX and INT64_MIN + 123
+               "0\n-1\n123\n");
+}
+
+// =========================
+// INPUT RUNTIME TESTS
+// =========================
+
+// Helper function to make a program that reads and prints count numbers
+static char *echo_program(int count) {
+  char *source = calloc((size_t)count * 32 + 16, 1);
+  strcpy(source, "LET x = 0\n");
+  for (int i = 0; i < count; i++) {
+    strcat(source, "INPUT x\nPRINT x\n");
+  }
+  return source;
+}
+
+Test(EmitterRuntime, reads_tokens_across_the_input_refill) {
+  // Both tokens straddle the end of the 64KB input buffer, the second one
+  // right after its sign
+  char *source = echo_program(2);
+  const Program p = build_program(source, false);
+  static const size_t paddings[] = {65536 - 3, 65536 - 1};
+  static const char *tokens[] = {"12345 9\n", "-7 9\n"};
+  static const char *expected[] = {"12345\n9\n", "-7\n9\n"};
+  for (uint32_t i = 0; i < 2; i++) {
+    const size_t token_len = strlen(tokens[i]);
+    char *input = malloc(paddings[i] + token_len);
+    memset(input, ' ', paddings[i]);
+    memcpy(input + paddings[i], tokens[i], token_len);
+    char *output = run_program(&p, input, paddings[i] + token_len, NULL);
+    cr_assert_str_eq(output, expected[i], "Got:\n%s", output);
+    free(output);
+    free(input);
+  }
+  destroy_program(&p);
+  free(source);
+}
+
+Test(EmitterRuntime, cuts_tokens_at_100_characters) {
+  // The rest of a long token is left for the next INPUT, like scanf("%100s")
+  char input[512] = "5";
+  memset(input + 1, 'a', 99);
+  strcat(input, "7 ");
+  memset(input + strlen(input), '0', 100);
+  strcat(input, "42 ");
+  memset(input + strlen(input), '1', 100);
+  strcat(input, "3\n");
+  char *source = echo_program(6);
+  check_output(source, input, "5\n7\n0\n42\n0\n3\n");
+  free(source);
+}
+
+Test(EmitterRuntime, reads_numbers_outside_of_int32_as_zero) {
+  char *source = echo_program(7);
+  check_output(source,
+               "2147483647 -2147483648 2147483648 -2147483649 "
+               "99999999999999999999999 +2147483647 00000000000000000000012\n",
+               "2147483647\n-2147483648\n0\n0\n0\n2147483647\n12\n");
+  free(source);
+}
+
+Test(EmitterRuntime, reads_the_first_character_without_a_number) {
+  char *source = echo_program(7);
+  // Characters are signed, so bytes past ASCII come out negative
+  check_output(source, "abc -x + +5 12abc \xc3\xa9 -",
+               "97\n45\n43\n5\n12\n-61\n45\n");
+  free(source);
+}
+
+Test(EmitterRuntime, reads_zero_at_the_end_of_input) {
+  char *source = echo_program(3);
+  check_output(source, "7", "7\n0\n0\n");
+  check_output(source, " \t\r\n\v\f ", "0\n0\n0\n");
+  check_output(source, "", "0\n0\n0\n");
+  free(source);
+}
+
+// =========================
+// FREESTANDING TESTS
+// =========================
+
+#define RUNTIME_PROGRAM "PRINT \"hi\"\nLET x = 0\nINPUT x\nPRINT x\n"
+
+Test(EmitterFreestanding, references_nothing_from_libc) {
+  ObjectFile object = encode_program(RUNTIME_PROGRAM, true);
+
+  for (size_t i = 0; i < arrlenu(object.symbols); i++) {
+    const ObjSymbol *symbol = &object.symbols[i];
+    cr_assert(symbol->name == NULL || symbol->section != OBJ_SECTION_UNDEF,
+              "%s shouldn't have to come from libc", symbol->name);
+    cr_assert(!symbol->global || strcmp(symbol->name, "_start") == 0,
+              "Only _start should be global, not %s", symbol->name);
+  }
+  const ObjSymbol *start = find_symbol(&object, "_start");
+  cr_assert_not_null(start, "The program should start at _start");
+  cr_assert_eq(start->section, OBJ_SECTION_TEXT);
+  cr_assert_null(find_symbol(&object, "main"));
+
+  object_file_destroy(&object);
+}
+
+Test(EmitterFreestanding, hosted_programs_call_into_libc) {
+  ObjectFile object = encode_program(RUNTIME_PROGRAM, false);
+
+  static const char *libc[] = {"write", "read"};
+  for (uint32_t i = 0; i < 2; i++) {
+    const ObjSymbol *symbol = find_symbol(&object, libc[i]);
+    cr_assert_not_null(symbol, "%s should be called", libc[i]);
+    cr_assert_eq(symbol->section, OBJ_SECTION_UNDEF);
+  }
+  cr_assert_null(find_symbol(&object, "_start"));
+  cr_assert_not_null(find_symbol(&object, "main"));
+
+  object_file_destroy(&object);
+}
+
+Test(EmitterFreestanding, runs_without_libc) {
+  const Program p = build_program(RUNTIME_PROGRAM, true);
+  char *output = run_program(&p, "  -123 ", 7, NULL);
+  cr_assert_str_eq(output, "hi\n-123\n");
+  free(output);
+  output = run_program(&p, "", 0, NULL);
+  cr_assert_str_eq(output, "hi\n0\n", "EOF should read as 0");
+  free(output);
+  destroy_program(&p);
+}
+
+// =========================
+// STRING LITERAL TESTS
+// =========================
+
+// Helper function to emit a program's assembly. Caller must free
+static char *emit_assembly(const char *source) {
+  Lowered l = lower_program(source);
+  FILE *file = tmpfile();
+  cr_assert_not_null(file);
+  const EmitOptions options = {0};
+  BatchedWriter writer = batched_writer_init(file);
+  emit_x86(&HOST_INFO, &writer, &l.ir, l.table, &options);
+  batched_writer_close(&writer);
+  cr_assert_eq(writer.error, 0);
+  cleanup_lowered(&l);
+
+  const size_t size = batched_writer_bytes_written(&writer);
+  char *assembly = calloc(size + 1, 1);
+  rewind(file);
+  cr_assert_eq(fread(assembly, 1, size, file), size);
+  fclose(file);
+  return assembly;
+}
+
+static uint32_t count_occurrences(const char *text, const char *needle) {
+  uint32_t count = 0;
+  for (const char *at = strstr(text, needle); at;
+       at = strstr(at + 1, needle)) {
+    count++;
+  }
+  return count;
+}
+
+Test(EmitterStrings, fuses_adjacent_string_prints) {
+  char *assembly = emit_assembly("PRINT \"a\"\nPRINT \"b\"\nPRINT \"c\"\n"
+                                 "LET x = 1\n"
+                                 "PRINT \"d\"\nPRINT x\n"
+                                 "PRINT \"a\"\nPRINT \"b\"\nPRINT \"c\"\n");
+
+  cr_assert_eq(count_occurrences(assembly, "call print_string"), 3,
+               "Each run should be one call:\n%s", assembly);
+  cr_assert_eq(count_occurrences(assembly, ".string \"a\\nb\\nc\"\n"), 1,
+               "Identical runs should share one string:\n%s", assembly);
+  cr_assert_eq(count_occurrences(assembly, ".string \"d\"\n"), 1);
+  cr_assert_eq(count_occurrences(assembly, ".string"), 2,
+               "Literals that only went into a run shouldn't be "
+               "emitted:\n%s",
+               assembly);
+
+  free(assembly);
+}
+
+Test(EmitterStrings, runs_stop_at_labels) {
+  // Jumping to the label prints only its half of the strings
+  char *assembly = emit_assembly("PRINT \"a\"\nLABEL half\nPRINT \"b\"\n");
+
+  cr_assert_eq(count_occurrences(assembly, "call print_string"), 2);
+  cr_assert_eq(count_occurrences(assembly, ".string \"a\"\n"), 1);
+  cr_assert_eq(count_occurrences(assembly, ".string \"b\"\n"), 1);
+
+  free(assembly);
+}
+
+Test(EmitterStrings, fused_runs_print_every_line) {
+  check_output("PRINT \"first\"\nPRINT \"\"\nPRINT \"third\"\n", "",
+               "first\n\nthird\n");
+}
@@ -0,0 +1,399 @@
+#include "../src/backend/encoder-x86.h"
+#include <criterion/criterion.h>
+#include <stb_ds.h>
+#include <string.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+#define R(r) {.kind = OPERAND_REG, .reg = REG_##r}
+#define B(r) {.kind = OPERAND_BYTE_REG, .reg = REG_##r}
+#define I(v) {.kind = OPERAND_IMM, .value = (v)}
+#define M(size, base, disp)                                                    \
+  {.kind = OPERAND_MEM, .ptr = PTR_##size, .reg = REG_##base, .value = (disp)}
+#define MX(size, base, idx, s, disp)                                           \
+  {.kind = OPERAND_MEM,                                                        \
+   .ptr = PTR_##size,                                                          \
+   .reg = REG_##base,                                                          \
+   .index = REG_##idx,                                                         \
+   .scale = (s),                                                               \
+   .value = (disp)}
+#define RIP(size, sym, disp)                                                   \
+  {.kind = OPERAND_MEM,                                                        \
+   .ptr = PTR_##size,                                                          \
+   .reg = REG_RIP,                                                             \
+   .symbol = sym,                                                              \
+   .value = (disp)}
+#define SYM(sym) {.kind = OPERAND_SYMBOL, .symbol = sym}
+#define NAMED(str) {.kind = SYMBOL_NAMED, .name = (str)}
+#define LABEL(n) {.kind = SYMBOL_INTERNAL_LABEL, .id = (n)}
+#define BYTES(...)                                                             \
+  .bytes = {__VA_ARGS__}, .len = sizeof((uint8_t[]){__VA_ARGS__})
+
+// An instruction, and the bytes GNU as encodes it as
+typedef struct {
+  const char *text;
+  X86Op op;
+  uint32_t operand_count;
+  Operand operands[X86_MAX_OPERANDS];
+  uint8_t bytes[16];
+  uint8_t len;
+} EncodingCase;
+
+// Helper function to encode an instruction on its own, and check the bytes
+static void check_encoding(const EncodingCase *c) {
+  ObjectFile object = object_file_init();
+  X86Encoder encoder = encoder_x86_init(&object);
+  encoder_x86_op(&encoder, c->op, c->operands, c->operand_count);
+  encoder_x86_finish(&encoder);
+
+  const uint8_t *text = object.bytes[OBJ_SECTION_TEXT];
+  cr_assert_eq(arrlenu(text), c->len, "%s: %zu bytes instead of %u", c->text,
+               arrlenu(text), c->len);
+  for (uint32_t i = 0; i < c->len; i++) {
+    cr_assert_eq(text[i], c->bytes[i], "%s: byte %u is %02x instead of %02x",
+                 c->text, i, text[i], c->bytes[i]);
+  }
+  cr_assert_eq(arrlenu(object.relocations), 0, "%s: nothing to relocate",
+               c->text);
+
+  encoder_x86_destroy(&encoder);
+  object_file_destroy(&object);
+}
+
+static void check_encodings(const EncodingCase *cases, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    check_encoding(&cases[i]);
+  }
+}
+
+// Helper function to encode the operands of one instruction
+static void op(X86Encoder *encoder, X86Op x86_op, uint32_t count,
+               const Operand *operands) {
+  encoder_x86_op(encoder, x86_op, operands, count);
+}
+
+// =========================
+// INSTRUCTION TESTS
+// =========================
+
+Test(EncoderX86, encodes_moves) {
+  static const EncodingCase cases[] = {
+      {"mov rax, rbx", OP_MOV, 2, {R(RAX), R(RBX)}, BYTES(0x48, 0x89, 0xd8)},
+      {"mov r12, [rbp-8]",
+       OP_MOV,
+       2,
+       {R(R12), M(NONE, RBP, -8)},
+       BYTES(0x4c, 0x8b, 0x65, 0xf8)},
+      {"mov QWORD PTR [rsp+16], r9",
+       OP_MOV,
+       2,
+       {M(QWORD, RSP, 16), R(R9)},
+       BYTES(0x4c, 0x89, 0x4c, 0x24, 0x10)},
+      {"mov rax, 42",
+       OP_MOV,
+       2,
+       {R(RAX), I(42)},
+       BYTES(0x48, 0xc7, 0xc0, 0x2a, 0x00, 0x00, 0x00)},
+      {"mov rcx, -1",
+       OP_MOV,
+       2,
+       {R(RCX), I(-1)},
+       BYTES(0x48, 0xc7, 0xc1, 0xff, 0xff, 0xff, 0xff)},
+      {"movabs rcx, 0x123456789",
+       OP_MOV,
+       2,
+       {R(RCX), I(0x123456789)},
+       BYTES(0x48, 0xb9, 0x89, 0x67, 0x45, 0x23, 0x01, 0x00, 0x00, 0x00)},
+      {"mov BYTE PTR [rdi+rcx], sil",
+       OP_MOV,
+       2,
+       {MX(BYTE, RDI, RCX, 1, 0), B(RSI)},
+       BYTES(0x40, 0x88, 0x34, 0x0f)},
+      {"mov BYTE PTR [rax], r10b",
+       OP_MOV,
+       2,
+       {M(BYTE, RAX, 0), B(R10)},
+       BYTES(0x44, 0x88, 0x10)},
+      {"mov QWORD PTR [r13], 0",
+       OP_MOV,
+       2,
+       {M(QWORD, R13, 0), I(0)},
+       BYTES(0x49, 0xc7, 0x45, 0x00, 0x00, 0x00, 0x00, 0x00)},
+      {"mov QWORD PTR [r12+8], rax",
+       OP_MOV,
+       2,
+       {M(QWORD, R12, 8), R(RAX)},
+       BYTES(0x49, 0x89, 0x44, 0x24, 0x08)},
+      {"movzx rax, al",
+       OP_MOVZX,
+       2,
+       {R(RAX), B(RAX)},
+       BYTES(0x48, 0x0f, 0xb6, 0xc0)},
+      {"movzx rdx, BYTE PTR [rsi+rcx]",
+       OP_MOVZX,
+       2,
+       {R(RDX), MX(BYTE, RSI, RCX, 1, 0)},
+       BYTES(0x48, 0x0f, 0xb6, 0x14, 0x0e)},
+      {"movsx rax, BYTE PTR [rbx]",
+       OP_MOVSX,
+       2,
+       {R(RAX), M(BYTE, RBX, 0)},
+       BYTES(0x48, 0x0f, 0xbe, 0x03)},
+      {"movsxd rax, DWORD PTR [rdx+rax*4]",
+       OP_MOVSXD,
+       2,
+       {R(RAX), MX(DWORD, RDX, RAX, 4, 0)},
+       BYTES(0x48, 0x63, 0x04, 0x82)},
+      {"push rbx", OP_PUSH, 1, {R(RBX)}, BYTES(0x53)},
+      {"push r12", OP_PUSH, 1, {R(R12)}, BYTES(0x41, 0x54)},
+      {"pop r15", OP_POP, 1, {R(R15)}, BYTES(0x41, 0x5f)},
+  };
+  check_encodings(cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+Test(EncoderX86, encodes_addressing_modes) {
+  static const EncodingCase cases[] = {
+      {"lea rax, [rbx+rcx*4+8]",
+       OP_LEA,
+       2,
+       {R(RAX), MX(NONE, RBX, RCX, 4, 8)},
+       BYTES(0x48, 0x8d, 0x44, 0x8b, 0x08)},
+      {"lea r8, [r9+r10*8-1000]",
+       OP_LEA,
+       2,
+       {R(R8), MX(NONE, R9, R10, 8, -1000)},
+       BYTES(0x4f, 0x8d, 0x84, 0xd1, 0x18, 0xfc, 0xff, 0xff)},
+      {"lea rax, [rbp+rbp*2]",
+       OP_LEA,
+       2,
+       {R(RAX), MX(NONE, RBP, RBP, 2, 0)},
+       BYTES(0x48, 0x8d, 0x44, 0x6d, 0x00)},
+      {"sub r14, [rbp-256]",
+       OP_SUB,
+       2,
+       {R(R14), M(NONE, RBP, -256)},
+       BYTES(0x4c, 0x2b, 0xb5, 0x00, 0xff, 0xff, 0xff)},
+  };
+  check_encodings(cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+Test(EncoderX86, encodes_arithmetic) {
+  static const EncodingCase cases[] = {
+      {"add rax, rbx", OP_ADD, 2, {R(RAX), R(RBX)}, BYTES(0x48, 0x01, 0xd8)},
+      {"add rax, 5",
+       OP_ADD,
+       2,
+       {R(RAX), I(5)},
+       BYTES(0x48, 0x83, 0xc0, 0x05)},
+      {"add rax, 1000",
+       OP_ADD,
+       2,
+       {R(RAX), I(1000)},
+       BYTES(0x48, 0x05, 0xe8, 0x03, 0x00, 0x00)},
+      {"add rcx, 1000",
+       OP_ADD,
+       2,
+       {R(RCX), I(1000)},
+       BYTES(0x48, 0x81, 0xc1, 0xe8, 0x03, 0x00, 0x00)},
+      {"sub QWORD PTR [rbp-16], 1",
+       OP_SUB,
+       2,
+       {M(QWORD, RBP, -16), I(1)},
+       BYTES(0x48, 0x83, 0x6d, 0xf0, 0x01)},
+      {"xor rax, rax", OP_XOR, 2, {R(RAX), R(RAX)}, BYTES(0x48, 0x31, 0xc0)},
+      {"cmp rdi, [rbp-8]",
+       OP_CMP,
+       2,
+       {R(RDI), M(NONE, RBP, -8)},
+       BYTES(0x48, 0x3b, 0x7d, 0xf8)},
+      {"cmp r15, -129",
+       OP_CMP,
+       2,
+       {R(R15), I(-129)},
+       BYTES(0x49, 0x81, 0xff, 0x7f, 0xff, 0xff, 0xff)},
+      {"imul rbx", OP_IMUL, 1, {R(RBX)}, BYTES(0x48, 0xf7, 0xeb)},
+      {"imul rax, rcx",
+       OP_IMUL,
+       2,
+       {R(RAX), R(RCX)},
+       BYTES(0x48, 0x0f, 0xaf, 0xc1)},
+      {"imul rax, rcx, 10",
+       OP_IMUL,
+       3,
+       {R(RAX), R(RCX), I(10)},
+       BYTES(0x48, 0x6b, 0xc1, 0x0a)},
+      {"imul r11, r11, 1000",
+       OP_IMUL,
+       3,
+       {R(R11), R(R11), I(1000)},
+       BYTES(0x4d, 0x69, 0xdb, 0xe8, 0x03, 0x00, 0x00)},
+      {"idiv rcx", OP_IDIV, 1, {R(RCX)}, BYTES(0x48, 0xf7, 0xf9)},
+      {"idiv QWORD PTR [rbp-8]",
+       OP_IDIV,
+       1,
+       {M(QWORD, RBP, -8)},
+       BYTES(0x48, 0xf7, 0x7d, 0xf8)},
+      {"cqo", OP_CQO, 0, {{0}}, BYTES(0x48, 0x99)},
+      {"neg rax", OP_NEG, 1, {R(RAX)}, BYTES(0x48, 0xf7, 0xd8)},
+      {"inc rax", OP_INC, 1, {R(RAX)}, BYTES(0x48, 0xff, 0xc0)},
+      {"dec r10", OP_DEC, 1, {R(R10)}, BYTES(0x49, 0xff, 0xca)},
+      {"test rax, rax", OP_TEST, 2, {R(RAX), R(RAX)}, BYTES(0x48, 0x85, 0xc0)},
+      {"shl rax, 1", OP_SHL, 2, {R(RAX), I(1)}, BYTES(0x48, 0xd1, 0xe0)},
+      {"shr rdx, 63",
+       OP_SHR,
+       2,
+       {R(RDX), I(63)},
+       BYTES(0x48, 0xc1, 0xea, 0x3f)},
+      {"sar rax, 3", OP_SAR, 2, {R(RAX), I(3)}, BYTES(0x48, 0xc1, 0xf8, 0x03)},
+  };
+  check_encodings(cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+Test(EncoderX86, encodes_conditions_and_fixed_instructions) {
+  static const EncodingCase cases[] = {
+      {"setl al", OP_SETL, 1, {B(RAX)}, BYTES(0x0f, 0x9c, 0xc0)},
+      {"sete sil", OP_SETE, 1, {B(RSI)}, BYTES(0x40, 0x0f, 0x94, 0xc6)},
+      {"setg r8b", OP_SETG, 1, {B(R8)}, BYTES(0x41, 0x0f, 0x9f, 0xc0)},
+      {"cmovl rax, rbx",
+       OP_CMOVL,
+       2,
+       {R(RAX), R(RBX)},
+       BYTES(0x48, 0x0f, 0x4c, 0xc3)},
+      {"cmovge r12, [rbp-8]",
+       OP_CMOVGE,
+       2,
+       {R(R12), M(NONE, RBP, -8)},
+       BYTES(0x4c, 0x0f, 0x4d, 0x65, 0xf8)},
+      {"rep movsb", OP_REP_MOVSB, 0, {{0}}, BYTES(0xf3, 0xa4)},
+      {"leave", OP_LEAVE, 0, {{0}}, BYTES(0xc9)},
+      {"ret", OP_RET, 0, {{0}}, BYTES(0xc3)},
+      {"syscall", OP_SYSCALL, 0, {{0}}, BYTES(0x0f, 0x05)},
+  };
+  check_encodings(cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+// =========================
+// SYMBOL TESTS
+// =========================
+
+Test(EncoderX86, references_undefined_symbols_through_relocations) {
+  ObjectFile object = object_file_init();
+  X86Encoder encoder = encoder_x86_init(&object);
+  const Operand load[] = {R(RAX), RIP(NONE, NAMED("value"), 0)};
+  const Operand store[] = {RIP(QWORD, NAMED("value"), 8), I(5)};
+  const Operand call[] = {SYM(NAMED("exit"))};
+  op(&encoder, OP_MOV, 2, load);
+  op(&encoder, OP_MOV, 2, store);
+  op(&encoder, OP_CALL, 1, call);
+  encoder_x86_finish(&encoder);
+
+  // mov rax, [rip+value]; mov QWORD PTR [rip+value+8], 5; call exit
+  static const uint8_t expected[] = {
+      0x48, 0x8b, 0x05, 0x00, 0x00, 0x00, 0x00, 0x48, 0xc7, 0x05, 0x00, 0x00,
+      0x00, 0x00, 0x05, 0x00, 0x00, 0x00, 0xe8, 0x00, 0x00, 0x00, 0x00};
+  cr_assert_eq(arrlenu(object.bytes[OBJ_SECTION_TEXT]), sizeof(expected));
+  cr_assert_arr_eq(object.bytes[OBJ_SECTION_TEXT], expected, sizeof(expected));
+
+  const ObjRelocation *relocs = object.relocations;
+  cr_assert_eq(arrlenu(relocs), 3);
+  cr_assert_eq(relocs[0].offset, 3);
+  cr_assert_eq(relocs[0].type, OBJ_RELOC_PC32);
+  cr_assert_eq(relocs[0].addend, -4);
+  cr_assert_eq(relocs[1].offset, 10);
+  cr_assert_eq(relocs[1].type, OBJ_RELOC_PC32);
+  cr_assert_eq(relocs[1].addend, 8 - 4 - 4,
+               "The addend should skip the immediate after the field");
+  cr_assert_eq(relocs[1].symbol, relocs[0].symbol);
+  cr_assert_eq(relocs[2].offset, 19);
+  cr_assert_eq(relocs[2].type, OBJ_RELOC_PLT32);
+  cr_assert_eq(relocs[2].addend, -4);
+
+  const ObjSymbol *value = &object.symbols[relocs[0].symbol];
+  const ObjSymbol *exit_symbol = &object.symbols[relocs[2].symbol];
+  cr_assert_str_eq(value->name, "value");
+  cr_assert_str_eq(exit_symbol->name, "exit");
+  cr_assert_eq(value->section, OBJ_SECTION_UNDEF);
+  cr_assert(value->global && exit_symbol->global,
+            "Undefined symbols are left for the linker");
+
+  encoder_x86_destroy(&encoder);
+  object_file_destroy(&object);
+}
+
+Test(EncoderX86, references_local_data_through_its_section) {
+  ObjectFile object = object_file_init();
+  X86Encoder encoder = encoder_x86_init(&object);
+  const Symbol literal = {.kind = SYMBOL_LITERAL, .id = 3};
+  const Symbol variables = {.kind = SYMBOL_VARIABLES};
+  encoder_x86_section(&encoder, OBJ_SECTION_RODATA);
+  encoder_x86_bytes(&encoder, "abc", 4);
+  encoder_x86_label(&encoder, &literal);
+  encoder_x86_bytes(&encoder, "xyz", 4);
+  encoder_x86_reserve(&encoder, &variables, 24, 8);
+  encoder_x86_section(&encoder, OBJ_SECTION_TEXT);
+  const Operand lea[] = {R(RDI), RIP(NONE, literal, 0)};
+  const Operand load[] = {R(RAX), RIP(NONE, variables, 16)};
+  op(&encoder, OP_LEA, 2, lea);
+  op(&encoder, OP_MOV, 2, load);
+  encoder_x86_finish(&encoder);
+
+  cr_assert_eq(object_file_section_size(&object, OBJ_SECTION_RODATA), 8);
+  cr_assert_eq(object_file_section_size(&object, OBJ_SECTION_BSS), 24);
+  cr_assert_eq(object.bss_align, 8);
+  const ObjRelocation *relocs = object.relocations;
+  cr_assert_eq(arrlenu(relocs), 2);
+  const ObjSymbol *rodata = &object.symbols[relocs[0].symbol];
+  cr_assert_null(rodata->name, "Local data goes through a section symbol");
+  cr_assert_eq(rodata->section, OBJ_SECTION_RODATA);
+  cr_assert_eq(relocs[0].addend, 4 - 4, "The literal is 4 bytes in");
+  const ObjSymbol *bss = &object.symbols[relocs[1].symbol];
+  cr_assert_null(bss->name);
+  cr_assert_eq(bss->section, OBJ_SECTION_BSS);
+  cr_assert_eq(relocs[1].addend, 16 - 4);
+
+  encoder_x86_destroy(&encoder);
+  object_file_destroy(&object);
+}
+
+Test(EncoderX86, jumps_start_short_and_grow_when_out_of_range) {
+  ObjectFile object = object_file_init();
+  X86Encoder encoder = encoder_x86_init(&object);
+  const Symbol start = LABEL(0);
+  const Symbol near = LABEL(1);
+  const Symbol far = LABEL(2);
+  const Operand to_start[] = {SYM(start)};
+  const Operand to_near[] = {SYM(near)};
+  const Operand to_far[] = {SYM(far)};
+  uint8_t padding[200];
+  memset(padding, 0x90, sizeof(padding));
+
+  encoder_x86_label(&encoder, &start);
+  op(&encoder, OP_JMP, 1, to_near);
+  encoder_x86_label(&encoder, &near);
+  op(&encoder, OP_JNE, 1, to_far);
+  encoder_x86_bytes(&encoder, padding, sizeof(padding));
+  encoder_x86_label(&encoder, &far);
+  op(&encoder, OP_JMP, 1, to_start);
+  op(&encoder, OP_CALL, 1, to_far);
+  encoder_x86_finish(&encoder);
+
+  const uint8_t *text = object.bytes[OBJ_SECTION_TEXT];
+  cr_assert_eq(arrlenu(text), 2 + 6 + 200 + 5 + 5);
+  static const uint8_t jmp_near[] = {0xeb, 0x00};
+  cr_assert_arr_eq(text, jmp_near, 2, "jmp to the next byte stays short");
+  // 0f 85 rel32 jne over the padding
+  static const uint8_t jne_far[] = {0x0f, 0x85, 0xc8, 0x00, 0x00, 0x00};
+  cr_assert_arr_eq(text + 2, jne_far, 6, "jne past 127 bytes is long");
+  // e9 rel32 jmp back to the start, 213 bytes back from its end
+  static const uint8_t jmp_start[] = {0xe9, 0x2b, 0xff, 0xff, 0xff};
+  cr_assert_arr_eq(text + 208, jmp_start, 5);
+  // The call to far is resolved locally, against far's moved offset
+  static const uint8_t call_far[] = {0xe8, 0xf6, 0xff, 0xff, 0xff};
+  cr_assert_arr_eq(text + 213, call_far, 5);
+  cr_assert_eq(arrlenu(object.relocations), 0);
+
+  encoder_x86_destroy(&encoder);
+  object_file_destroy(&object);
+}
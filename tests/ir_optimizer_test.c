@@ -0,0 +1,379 @@
+#include "../src/backend/ir_optimizer.h"
+#include "../src/backend/ir_ssa.h"
+#include "../src/common/file_reader.h"
+#include "../src/common/name_table.h"
+#include "../src/frontend/constant_folder/constant_folder.h"
+#include "../src/frontend/lexer/lexer.h"
+#include "../src/frontend/parser/parser.h"
+#include "../src/frontend/semantic_analyzer/semantic_analyzer.h"
+#include <criterion/criterion.h>
+#include <stb_ds.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+typedef struct {
+  TokenArray ta;
+  AST ast;
+  NameTable *table;
+  IR ir;
+} Lowered;
+
+// Helper function to parse, check and lower a program, folding constants
+// first like -O1 and up do
+static Lowered lower_string_folding(const char *input, bool fold) {
+  Lowered l = {0};
+  FileReader fr = filereader_init_from_string(input);
+  l.ta = lexer_parse(fr);
+  filereader_destroy(&fr);
+  l.ast = ast_parse(l.ta);
+  l.table = name_table_collect_from_ast(&l.ast);
+  cr_assert(semantic_analyzer_check(&l.ast, l.table),
+            "Test program should pass semantic analysis");
+  if (fold) {
+    constant_folder_fold(&l.ast, l.table, l.ta);
+  }
+  l.ir = ir_build(&l.ast, l.table);
+  return l;
+}
+
+static Lowered lower_string(const char *input) {
+  return lower_string_folding(input, true);
+}
+
+// Helper function to lower and optimize a program, checking the result
+static Lowered optimize_string(const char *input) {
+  Lowered l = lower_string(input);
+  ir_optimize(&l.ir, 4);
+  cr_assert(ir_verify(&l.ir, stderr), "Optimized IR should verify");
+  return l;
+}
+
+// Helper function to cleanup test data
+static void cleanup_lowered(Lowered *l) {
+  ir_destroy(&l->ir);
+  name_table_destroy(l->table);
+  ast_destroy(&l->ast);
+  token_array_destroy(&l->ta);
+}
+
+// Helper function to count the instructions with an opcode
+static uint32_t count_ops(const IR *ir, IrOpcode op) {
+  uint32_t count = 0;
+  for (uint32_t b = 0; b < ir->block_count; b++) {
+    for (uint32_t i = 0; i < ir->blocks[b].instr_count; i++) {
+      count += ir->blocks[b].instrs[i].op == op;
+    }
+  }
+  return count;
+}
+
+// Helper function to count the blocks ending in a branch
+static uint32_t count_branches(const IR *ir) {
+  uint32_t count = 0;
+  for (uint32_t b = 0; b < ir->block_count; b++) {
+    count += ir->blocks[b].term.kind == IR_TERM_BRANCH;
+  }
+  return count;
+}
+
+// =========================
+// SSA TESTS
+// =========================
+
+Test(IROptimizer, dominators_of_loop) {
+  Lowered l = lower_string("LET x = 0\nINPUT x\nWHILE x > 0 REPEAT\n"
+                           "LET x = x - 1\nENDWHILE\nPRINT x\n");
+
+  // Entry, header, body, exit
+  IrDominators doms = ir_dominators_compute(&l.ir);
+  cr_assert_eq(doms.idom[1], 0, "The entry should dominate the header");
+  cr_assert_eq(doms.idom[2], 1, "The header should dominate the body");
+  cr_assert_eq(doms.idom[3], 1, "The header should dominate the exit");
+  cr_assert(ir_dominates(&doms, 0, 2), "Dominance should be transitive");
+  cr_assert(!ir_dominates(&doms, 2, 3),
+            "The body shouldn't dominate the exit it can be skipped on");
+
+  ir_dominators_destroy(&doms);
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, loop_depths_of_nested_loops) {
+  Lowered l = lower_string("LET x = 0\nLET y = 0\nWHILE x < 3 REPEAT\n"
+                           "WHILE y < 3 REPEAT\nLET y = y + 1\nENDWHILE\n"
+                           "LET x = x + 1\nENDWHILE\nPRINT x\n");
+
+  // Entry, outer header, outer body, inner header, inner body, outer latch,
+  // exit
+  IrDominators doms = ir_dominators_compute(&l.ir);
+  uint32_t *depths = ir_loop_depths(&l.ir, &doms);
+  cr_assert_eq(depths[0], 0, "The entry isn't in a loop");
+  cr_assert_eq(depths[1], 1, "The outer header is in the outer loop");
+  cr_assert_eq(depths[3], 2, "The inner header is in both loops");
+  cr_assert_eq(depths[4], 2, "The inner body is in both loops");
+  cr_assert_eq(depths[l.ir.block_count - 1], 0, "The exit isn't in a loop");
+
+  arrfree(depths);
+  ir_dominators_destroy(&doms);
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, ssa_promotes_variables) {
+  Lowered l = lower_string("LET x = 0\nINPUT x\nWHILE x > 0 REPEAT\n"
+                           "LET x = x - 1\nENDWHILE\nPRINT x\n");
+
+  ir_to_ssa(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "SSA form should verify");
+  cr_assert_eq(count_ops(&l.ir, IR_LOAD), 0, "Loads should be gone");
+  cr_assert_eq(count_ops(&l.ir, IR_STORE), 0, "Stores should be gone");
+  cr_assert_eq(l.ir.blocks[1].instrs[0].op, IR_PHI,
+               "The loop header should merge x with a phi");
+
+  ir_from_ssa(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "IR out of SSA form should verify");
+  cr_assert_eq(count_ops(&l.ir, IR_PHI), 0, "Phis should become copies");
+
+  cleanup_lowered(&l);
+}
+
+// =========================
+// OPTIMIZATION TESTS
+// =========================
+
+Test(IROptimizer, propagates_constants_through_merges) {
+  Lowered l = optimize_string("LET x = 1\nLET y = 0\nINPUT y\n"
+                              "IF y > 0 THEN\nLET x = 1\nENDIF\n"
+                              "IF x == 1 THEN\nPRINT 5\nENDIF\n");
+
+  cr_assert_eq(count_branches(&l.ir), 1,
+               "Only the branch on the input should be left");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, numbers_repeated_values) {
+  Lowered l = optimize_string("LET a = 0\nINPUT a\nPRINT a * a + 1\n"
+                              "PRINT a * a + 1\n");
+
+  cr_assert_eq(count_ops(&l.ir, IR_MUL), 1,
+               "The second product should reuse the first");
+  cr_assert_eq(count_ops(&l.ir, IR_ADD), 1,
+               "The second sum should reuse the first");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, removes_dead_stores) {
+  Lowered l = optimize_string("LET a = 0\nINPUT a\nLET b = a * 3\n"
+                              "LET b = a\nPRINT b\n");
+
+  cr_assert_eq(count_ops(&l.ir, IR_MUL), 0,
+               "A value that's overwritten before it's read should go");
+  cr_assert_eq(count_ops(&l.ir, IR_INPUT), 1, "Input should stay");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, rotates_while_loops) {
+  Lowered l = lower_string("LET i = 0\nWHILE i < 10 REPEAT\nLET i = i + 1\n"
+                           "ENDWHILE\nPRINT i\n");
+
+  ir_rotate_loops(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "Rotated IR should verify");
+  cr_assert_eq(count_branches(&l.ir), 2,
+               "The guard and the bottom of the loop should both test");
+  // Entry, guard, preheader, body, exit
+  const IrBlock *body = &l.ir.blocks[3];
+  cr_assert_eq(body->term.kind, IR_TERM_BRANCH,
+               "The body should end by testing the condition");
+  cr_assert_eq(body->term.targets[0], 3,
+               "The body should branch straight back to itself");
+  cr_assert_eq(l.ir.blocks[1].term.targets[0], 2,
+               "The guard should enter through the preheader");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, rotates_programs_without_temporaries) {
+  Lowered l = lower_string("PRINT \"a\"\n");
+  cr_assert_eq(l.ir.temp_count, 0, "Printing a string needs no temporaries");
+
+  ir_rotate_loops(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "Rotated IR should verify");
+  cr_assert_eq(count_branches(&l.ir), 0, "There's no loop to rotate");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, hoists_loop_invariants) {
+  Lowered l = lower_string("LET a = 0\nLET s = 0\nLET i = 0\nINPUT a\n"
+                           "WHILE i < a REPEAT\nLET s = s + a * a\n"
+                           "LET i = i + 1\nENDWHILE\nPRINT s\n");
+
+  ir_rotate_loops(&l.ir);
+  ir_optimize(&l.ir, 4);
+  cr_assert(ir_verify(&l.ir, stderr), "Optimized IR should verify");
+  IrDominators doms = ir_dominators_compute(&l.ir);
+  uint32_t *depths = ir_loop_depths(&l.ir, &doms);
+  uint32_t products_in_loop = 0;
+  for (uint32_t b = 0; b < l.ir.block_count; b++) {
+    for (uint32_t i = 0; i < l.ir.blocks[b].instr_count; i++) {
+      products_in_loop +=
+          depths[b] && l.ir.blocks[b].instrs[i].op == IR_MUL;
+    }
+  }
+  cr_assert_eq(products_in_loop, 0, "a * a should move out of the loop");
+  cr_assert_eq(count_ops(&l.ir, IR_MUL), 1, "a * a should still be worked out");
+
+  arrfree(depths);
+  ir_dominators_destroy(&doms);
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, sums_counted_loops_in_closed_form) {
+  Lowered l = lower_string("LET a = 0\nLET s = 0\nLET i = 0\nINPUT a\n"
+                           "WHILE i < 100 REPEAT\nLET s = s + i * 2 + a\n"
+                           "LET i = i + 1\nENDWHILE\nPRINT s\nPRINT i\n");
+
+  ir_rotate_loops(&l.ir);
+  ir_optimize(&l.ir, 4);
+  cr_assert(ir_verify(&l.ir, stderr), "Optimized IR should verify");
+  cr_assert_eq(count_branches(&l.ir), 0, "The loop should be gone");
+  cr_assert_eq(count_ops(&l.ir, IR_MUL), 1, "a should be added 100 times");
+  bool found_sum = false;
+  bool found_counter = false;
+  for (uint32_t b = 0; b < l.ir.block_count; b++) {
+    for (uint32_t i = 0; i < l.ir.blocks[b].instr_count; i++) {
+      const IrInstr *instr = &l.ir.blocks[b].instrs[i];
+      found_sum |= instr->op == IR_CONST && instr->value == 9900;
+      found_counter |= instr->op == IR_CONST && instr->value == 100;
+    }
+  }
+  cr_assert(found_sum, "The doubled counters should add up to 9900");
+  cr_assert(found_counter, "The counter should end at 100");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, unrolls_counted_loops) {
+  Lowered l = lower_string("LET i = 0\nLET j = 0\n"
+                           "WHILE i < 102 REPEAT\nPRINT i\n"
+                           "LET i = i + 1\nENDWHILE\n"
+                           "WHILE j < 3 REPEAT\nPRINT j\nLET j = j + 1\n"
+                           "ENDWHILE\n");
+
+  ir_rotate_loops(&l.ir);
+  ir_optimize(&l.ir, 4);
+  cr_assert(ir_verify(&l.ir, stderr), "Optimized IR should verify");
+  cr_assert_eq(count_branches(&l.ir), 1, "Only the long loop should be left");
+  cr_assert_eq(count_ops(&l.ir, IR_PRINT_INT), 2 + 4 + 3,
+               "Two iterations should be peeled, four unrolled, and the "
+               "short loop peeled whole");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, steps_products_of_counters) {
+  Lowered l = lower_string("LET n = 0\nLET i = 0\nINPUT n\n"
+                           "WHILE i < n REPEAT\nPRINT i * 5\n"
+                           "LET i = i + 1\nENDWHILE\n");
+
+  ir_rotate_loops(&l.ir);
+  ir_optimize(&l.ir, 4);
+  cr_assert(ir_verify(&l.ir, stderr), "Optimized IR should verify");
+  cr_assert_eq(count_ops(&l.ir, IR_MUL), 0, "i * 5 should be stepped by 5");
+  cr_assert_eq(count_ops(&l.ir, IR_PRINT_INT), 1,
+               "A loop that runs an unknown number of times isn't unrolled");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, keeps_division_that_may_trap) {
+  Lowered l = optimize_string("LET a = 0\nINPUT a\nLET b = 7 / a\n"
+                              "LET c = a / 2\n");
+
+  cr_assert_eq(count_ops(&l.ir, IR_DIV), 1,
+               "Only the division that can't trap should go");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, converts_single_let_ifs) {
+  Lowered l = lower_string("LET a = 0\nLET m = 0\nINPUT a\n"
+                           "IF a > 3 THEN\nLET m = a * 2\nENDIF\n"
+                           "IF a < 0 THEN\nPRINT a\nENDIF\n"
+                           "IF a == 1 THEN\nLET m = 7 / a\nENDIF\nPRINT m\n");
+
+  ir_if_convert(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "Converted IR should verify");
+  cr_assert_eq(count_ops(&l.ir, IR_SELECT), 1,
+               "The IF that only stores a product should select");
+  cr_assert_eq(count_branches(&l.ir), 2,
+               "IFs that print or may trap should keep their branch");
+
+  ir_optimize(&l.ir, 4);
+  cr_assert(ir_verify(&l.ir, stderr), "Optimized IR should verify");
+  cr_assert_eq(count_ops(&l.ir, IR_SELECT), 1, "The select should survive SSA");
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, threads_goto_chains) {
+  Lowered l = lower_string("LET x = 0\nINPUT x\nGOTO a\nPRINT 1\nLABEL a\n"
+                           "GOTO b\nPRINT 2\nLABEL b\nPRINT x\n");
+
+  ir_thread_jumps(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "Threaded IR should verify");
+  cr_assert_eq(count_ops(&l.ir, IR_PRINT_INT), 1,
+               "Code after a GOTO should be deleted");
+  cr_assert_eq(l.ir.block_count, 1,
+               "The chain should collapse into the entry");
+
+  cleanup_lowered(&l);
+}
+
+// Jumps every which way, with GOTOs straight after GOTOs and a WHILE straight
+// after a GOTO, over more blocks than the IR starts out with room for
+#define GOTO_HEAVY_PROGRAM                                                     \
+  "LET x = 0\nLET y = 0\nINPUT x\nLABEL top\n"                                \
+  "IF x > 100 THEN\nGOTO done\nENDIF\n"                                      \
+  "IF y > 3 THEN\nGOTO odd\nENDIF\n"                                         \
+  "GOTO even\nGOTO odd\nGOTO top\n"                                           \
+  "LABEL odd\nLET x = x + 3\nGOTO top\nGOTO even\n"                          \
+  "WHILE y < 2 REPEAT\nLET y = y + 1\nENDWHILE\n"                             \
+  "LABEL even\nLET y = y + 1\nGOTO top\nGOTO done\nGOTO odd\n"              \
+  "WHILE x < 5 REPEAT\nLET x = x + 2\nENDWHILE\n"                             \
+  "LABEL done\nPRINT x\nPRINT y\n"
+
+Test(IROptimizer, goto_heavy_programs_survive_o0) {
+  // -O0 lowers straight from the parse, without folding anything
+  Lowered l = lower_string_folding(GOTO_HEAVY_PROGRAM, false);
+
+  cr_assert_gt(l.ir.block_count, 16);
+  cr_assert(ir_verify(&l.ir, stderr), "Built IR should verify");
+  cr_assert_eq(count_ops(&l.ir, IR_PRINT_INT), 2);
+
+  cleanup_lowered(&l);
+}
+
+Test(IROptimizer, goto_heavy_programs_survive_o2) {
+  Lowered l = lower_string(GOTO_HEAVY_PROGRAM);
+  cr_assert_gt(l.ir.block_count, 16);
+  cr_assert(ir_verify(&l.ir, stderr), "Built IR should verify");
+
+  // The -O2 pipeline, in the order the compiler runs it
+  ir_if_convert(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "If-converted IR should verify");
+  ir_rotate_loops(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "Rotated IR should verify");
+  ir_optimize(&l.ir, 4);
+  cr_assert(ir_verify(&l.ir, stderr), "Optimized IR should verify");
+  ir_thread_jumps(&l.ir);
+  cr_assert(ir_verify(&l.ir, stderr), "Threaded IR should verify");
+  cr_assert_eq(count_ops(&l.ir, IR_INPUT), 1, "The input decides the output");
+  cr_assert_eq(count_ops(&l.ir, IR_PRINT_INT), 2);
+  cr_assert_gt(count_branches(&l.ir), 0, "The loop over top should remain");
+
+  cleanup_lowered(&l);
+}
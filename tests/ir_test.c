@@ -0,0 +1,183 @@
+#include "../src/backend/ir.h"
+#include "../src/common/file_reader.h"
+#include "../src/common/name_table.h"
+#include "../src/frontend/constant_folder/constant_folder.h"
+#include "../src/frontend/lexer/lexer.h"
+#include "../src/frontend/parser/parser.h"
+#include "../src/frontend/semantic_analyzer/semantic_analyzer.h"
+#include <criterion/criterion.h>
+#include <string.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+typedef struct {
+  TokenArray ta;
+  AST ast;
+  NameTable *table;
+  IR ir;
+} Lowered;
+
+// Helper function to parse, check, fold and lower a program
+static Lowered lower_string(const char *input) {
+  Lowered l = {0};
+  FileReader fr = filereader_init_from_string(input);
+  l.ta = lexer_parse(fr);
+  filereader_destroy(&fr);
+  l.ast = ast_parse(l.ta);
+  l.table = name_table_collect_from_ast(&l.ast);
+  cr_assert(semantic_analyzer_check(&l.ast, l.table),
+            "Test program should pass semantic analysis");
+  constant_folder_fold(&l.ast, l.table, l.ta);
+  l.ir = ir_build(&l.ast, l.table);
+  return l;
+}
+
+// Helper function to cleanup test data
+static void cleanup_lowered(Lowered *l) {
+  ir_destroy(&l->ir);
+  name_table_destroy(l->table);
+  ast_destroy(&l->ast);
+  token_array_destroy(&l->ta);
+}
+
+// =========================
+// LOWERING TESTS
+// =========================
+
+Test(IR, straight_line_is_one_block) {
+  Lowered l = lower_string("LET x = 0\nINPUT x\nPRINT x + 1\n");
+
+  cr_assert(ir_verify(&l.ir, stderr), "Built IR should verify");
+  cr_assert_eq(l.ir.block_count, 1, "Straight-line code should be one block");
+  cr_assert_eq(l.ir.blocks[0].term.kind, IR_TERM_EXIT,
+               "The last block should exit");
+
+  cleanup_lowered(&l);
+}
+
+Test(IR, while_forms_a_loop) {
+  Lowered l = lower_string("LET x = 0\nINPUT x\nWHILE x > 0 REPEAT\n"
+                           "LET x = x - 1\nENDWHILE\n");
+
+  cr_assert(ir_verify(&l.ir, stderr), "Built IR should verify");
+  cr_assert_eq(l.ir.block_count, 4,
+               "WHILE should give entry, header, body and exit blocks");
+  const IrBlock *header = &l.ir.blocks[1];
+  cr_assert_eq(header->term.kind, IR_TERM_BRANCH,
+               "The loop header should branch");
+  cr_assert_eq(header->term.cond, IR_COND_GT);
+  cr_assert_eq(header->pred_count, 2,
+               "The header should be entered from before and from the body");
+  cr_assert_eq(l.ir.blocks[2].term.kind, IR_TERM_JUMP);
+  cr_assert_eq(l.ir.blocks[2].term.targets[0], 1,
+               "The body should jump back to the header");
+
+  cleanup_lowered(&l);
+}
+
+Test(IR, goto_targets_label_block) {
+  Lowered l = lower_string("LET x = 0\nINPUT x\nLABEL top\nPRINT x\n"
+                           "IF x < 5 THEN\nGOTO top\nENDIF\n");
+
+  cr_assert(ir_verify(&l.ir, stderr), "Built IR should verify");
+  IrBlockID top = IR_NO_BLOCK;
+  for (IrBlockID i = 0; i < l.ir.block_count; i++) {
+    if (l.ir.blocks[i].label != IR_NO_LABEL) {
+      top = i;
+    }
+  }
+  cr_assert_neq(top, IR_NO_BLOCK, "LABEL should start a block");
+  cr_assert_eq(l.ir.blocks[top].pred_count, 2,
+               "The label should be reached by fallthrough and by GOTO");
+
+  cleanup_lowered(&l);
+}
+
+Test(IR, back_to_back_gotos_outgrow_the_block_array) {
+  // Each GOTO after a GOTO starts a block nothing reaches, so the block array
+  // is regrown while those jumps are being terminated
+  char program[1024] = "LET x = 1\nINPUT x\nLABEL top\n";
+  for (int i = 0; i < 40; i++) {
+    strcat(program, "GOTO top\n");
+  }
+  strcat(program, "PRINT x\n");
+  Lowered l = lower_string(program);
+
+  cr_assert_gt(l.ir.block_count, 32, "Every GOTO should end a block");
+  cr_assert(ir_verify(&l.ir, stderr), "Built IR should verify");
+
+  cleanup_lowered(&l);
+}
+
+Test(IR, fuses_string_prints) {
+  Lowered l = lower_string("PRINT \"a\"\nPRINT \"b\"\n");
+
+  cr_assert(ir_verify(&l.ir, stderr), "Built IR should verify");
+  cr_assert_eq(l.ir.blocks[0].instr_count, 1,
+               "Consecutive string PRINTs should become one instruction");
+  const IrInstr *print = &l.ir.blocks[0].instrs[0];
+  cr_assert_eq(print->op, IR_PRINT_STR);
+  cr_assert_str_eq(print->text, "a\nb");
+
+  cleanup_lowered(&l);
+}
+
+Test(IR, swapped_conditions_mirror_their_operands) {
+  cr_assert_eq(ir_condition_swap(IR_COND_LT), IR_COND_GT,
+               "a < b should be b > a");
+  cr_assert_eq(ir_condition_swap(IR_COND_GE), IR_COND_LE,
+               "a >= b should be b <= a");
+  cr_assert_eq(ir_condition_swap(IR_COND_EQ), IR_COND_EQ,
+               "Equality shouldn't change");
+  for (uint32_t c = 0; c < IR_COND_COUNT; c++) {
+    cr_assert_eq(ir_condition_swap(ir_condition_swap((IrCondition)c)), c,
+                 "Swapping twice should give the condition back");
+  }
+}
+
+// =========================
+// VERIFIER TESTS
+// =========================
+
+Test(IR, verify_rejects_unterminated_block) {
+  IR ir = ir_init(NULL);
+  ir_add_block(&ir);
+
+  cr_assert(!ir_verify(&ir, NULL),
+            "A block without a terminator should be rejected");
+
+  ir_destroy(&ir);
+}
+
+Test(IR, verify_rejects_undefined_temp) {
+  IR ir = ir_init(NULL);
+  const IrBlockID block = ir_add_block(&ir);
+  const IrTemp undefined = ir_new_temp(&ir);
+  IrInstr *print = ir_append(&ir, block, IR_PRINT_INT);
+  print->args[0] = undefined;
+  ir.blocks[block].term.kind = IR_TERM_EXIT;
+
+  cr_assert(!ir_verify(&ir, NULL),
+            "Reading a temporary nothing defines should be rejected");
+
+  ir_destroy(&ir);
+}
+
+Test(IR, verify_rejects_use_before_def) {
+  IR ir = ir_init(NULL);
+  const IrBlockID block = ir_add_block(&ir);
+  const IrTemp t = ir_new_temp(&ir);
+  IrInstr *print = ir_append(&ir, block, IR_PRINT_INT);
+  print->args[0] = t;
+  IrInstr *constant = ir_append(&ir, block, IR_CONST);
+  constant->dest = t;
+  constant->value = 1;
+  ir.blocks[block].term.kind = IR_TERM_EXIT;
+
+  cr_assert(!ir_verify(&ir, NULL),
+            "Reading a temporary before its definition should be rejected");
+
+  ir_destroy(&ir);
+}
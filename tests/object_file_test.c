@@ -0,0 +1,279 @@
+#include "../src/backend/encoder-x86.h"
+#include <criterion/criterion.h>
+#include <elf.h>
+#include <stb_ds.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+// A written ELF object, read back into memory
+typedef struct {
+  uint8_t *file;
+  size_t size;
+  const Elf64_Ehdr *header;
+  const Elf64_Shdr *sections;
+  const char *section_names;
+} ElfFile;
+
+static const Symbol MAIN = {.kind = SYMBOL_NAMED, .name = "main"};
+static const Symbol HELPER = {.kind = SYMBOL_NAMED, .name = "_helper"};
+static const Symbol EXIT = {.kind = SYMBOL_NAMED, .name = "exit"};
+static const Symbol LITERAL = {.kind = SYMBOL_LITERAL, .id = 0};
+static const Symbol VARIABLES = {.kind = SYMBOL_VARIABLES};
+
+// Helper function to encode a small program the way the emitter lays one
+// out: a string literal, a block of variables, a global main that calls a
+// local helper and exit
+static void encode_program(ObjectFile *object) {
+  X86Encoder encoder = encoder_x86_init(object);
+  encoder_x86_section(&encoder, OBJ_SECTION_RODATA);
+  encoder_x86_bytes(&encoder, "pad", 4);
+  encoder_x86_label(&encoder, &LITERAL);
+  encoder_x86_bytes(&encoder, "hi\n", 4);
+  encoder_x86_reserve(&encoder, &VARIABLES, 16, 8);
+  encoder_x86_section(&encoder, OBJ_SECTION_TEXT);
+  encoder_x86_label(&encoder, &HELPER);
+  encoder_x86_op(&encoder, OP_RET, NULL, 0);
+  encoder_x86_global(&encoder, &MAIN);
+  encoder_x86_label(&encoder, &MAIN);
+  const Operand lea[] = {
+      {.kind = OPERAND_REG, .reg = REG_RDI},
+      {.kind = OPERAND_MEM, .reg = REG_RIP, .symbol = LITERAL}};
+  const Operand load[] = {
+      {.kind = OPERAND_REG, .reg = REG_RAX},
+      {.kind = OPERAND_MEM, .reg = REG_RIP, .symbol = VARIABLES, .value = 8}};
+  const Operand call_helper[] = {{.kind = OPERAND_SYMBOL, .symbol = HELPER}};
+  const Operand call_exit[] = {{.kind = OPERAND_SYMBOL, .symbol = EXIT}};
+  encoder_x86_op(&encoder, OP_LEA, lea, 2);
+  encoder_x86_op(&encoder, OP_MOV, load, 2);
+  encoder_x86_op(&encoder, OP_CALL, call_helper, 1);
+  encoder_x86_op(&encoder, OP_CALL, call_exit, 1);
+  encoder_x86_finish(&encoder);
+  encoder_x86_destroy(&encoder);
+}
+
+// Helper function to write an object and read the file back
+static ElfFile write_elf(const ObjectFile *object) {
+  FILE *file = tmpfile();
+  cr_assert_not_null(file);
+  cr_assert(object_file_write_elf(object, file));
+  ElfFile elf = {0};
+  cr_assert_eq(fseek(file, 0, SEEK_END), 0);
+  elf.size = (size_t)ftell(file);
+  rewind(file);
+  elf.file = malloc(elf.size);
+  cr_assert_eq(fread(elf.file, 1, elf.size, file), elf.size);
+  fclose(file);
+  cr_assert_geq(elf.size, sizeof(Elf64_Ehdr));
+  elf.header = (const Elf64_Ehdr *)(void *)elf.file;
+  cr_assert_leq(elf.header->e_shoff + elf.header->e_shnum * sizeof(Elf64_Shdr),
+                elf.size);
+  elf.sections = (const Elf64_Shdr *)(void *)(elf.file + elf.header->e_shoff);
+  elf.section_names =
+      (const char *)elf.file + elf.sections[elf.header->e_shstrndx].sh_offset;
+  return elf;
+}
+
+static const Elf64_Shdr *find_section(const ElfFile *elf, const char *name,
+                                      uint32_t *index) {
+  for (uint32_t i = 1; i < elf->header->e_shnum; i++) {
+    if (strcmp(elf->section_names + elf->sections[i].sh_name, name) == 0) {
+      if (index)
+        *index = i;
+      return &elf->sections[i];
+    }
+  }
+  cr_assert_fail("No %s section", name);
+  return NULL;
+}
+
+static const void *section_bytes(const ElfFile *elf,
+                                 const Elf64_Shdr *section) {
+  return elf->file + section->sh_offset;
+}
+
+// Looks a symbol up by name, returning its index
+static uint32_t find_symbol(const ElfFile *elf, const char *name) {
+  const Elf64_Shdr *symtab = find_section(elf, ".symtab", NULL);
+  const Elf64_Sym *symbols = section_bytes(elf, symtab);
+  const char *names = (const char *)elf->file +
+                      elf->sections[symtab->sh_link].sh_offset;
+  for (uint32_t i = 0; i < symtab->sh_size / sizeof(Elf64_Sym); i++) {
+    if (strcmp(names + symbols[i].st_name, name) == 0)
+      return i;
+  }
+  cr_assert_fail("No symbol %s", name);
+  return 0;
+}
+
+// =========================
+// ELF TESTS
+// =========================
+
+Test(ObjectFile, writes_an_x86_64_relocatable) {
+  ObjectFile object = object_file_init();
+  encode_program(&object);
+  ElfFile elf = write_elf(&object);
+
+  cr_assert_arr_eq(elf.header->e_ident, ELFMAG, SELFMAG);
+  cr_assert_eq(elf.header->e_ident[EI_CLASS], ELFCLASS64);
+  cr_assert_eq(elf.header->e_ident[EI_DATA], ELFDATA2LSB);
+  cr_assert_eq(elf.header->e_type, ET_REL);
+  cr_assert_eq(elf.header->e_machine, EM_X86_64);
+  cr_assert_eq(elf.header->e_shentsize, sizeof(Elf64_Shdr));
+  // In the same order gas lays them out
+  static const char *const names[] = {
+      "",        ".text",           ".rela.text", ".data",   ".bss",
+      ".rodata", ".note.GNU-stack", ".symtab",    ".strtab", ".shstrtab"};
+  cr_assert_eq(elf.header->e_shnum, sizeof(names) / sizeof(names[0]));
+  for (uint32_t i = 0; i < elf.header->e_shnum; i++) {
+    cr_assert_str_eq(elf.section_names + elf.sections[i].sh_name, names[i]);
+  }
+
+  const Elf64_Shdr *text = find_section(&elf, ".text", NULL);
+  cr_assert_eq(text->sh_type, SHT_PROGBITS);
+  cr_assert_eq(text->sh_flags, SHF_ALLOC | SHF_EXECINSTR);
+  cr_assert_eq(text->sh_size, arrlenu(object.bytes[OBJ_SECTION_TEXT]));
+  cr_assert_arr_eq(section_bytes(&elf, text), object.bytes[OBJ_SECTION_TEXT],
+                   text->sh_size);
+  const Elf64_Shdr *rodata = find_section(&elf, ".rodata", NULL);
+  cr_assert_eq(rodata->sh_flags, SHF_ALLOC);
+  cr_assert_arr_eq(section_bytes(&elf, rodata), "pad\0hi\n", 8);
+  const Elf64_Shdr *bss = find_section(&elf, ".bss", NULL);
+  cr_assert_eq(bss->sh_type, SHT_NOBITS);
+  cr_assert_eq(bss->sh_flags, SHF_ALLOC | SHF_WRITE);
+  cr_assert_eq(bss->sh_size, 16);
+  cr_assert_eq(bss->sh_addralign, 8);
+  const Elf64_Shdr *note = find_section(&elf, ".note.GNU-stack", NULL);
+  cr_assert_eq(note->sh_flags, 0, "The stack shouldn't be executable");
+
+  free(elf.file);
+  object_file_destroy(&object);
+}
+
+Test(ObjectFile, puts_local_symbols_before_globals) {
+  ObjectFile object = object_file_init();
+  encode_program(&object);
+  ElfFile elf = write_elf(&object);
+
+  uint32_t strtab_index = 0;
+  find_section(&elf, ".strtab", &strtab_index);
+  const Elf64_Shdr *symtab = find_section(&elf, ".symtab", NULL);
+  cr_assert_eq(symtab->sh_link, strtab_index);
+  cr_assert_eq(symtab->sh_entsize, sizeof(Elf64_Sym));
+  const Elf64_Sym *symbols = section_bytes(&elf, symtab);
+  const uint32_t count = (uint32_t)(symtab->sh_size / sizeof(Elf64_Sym));
+  const uint32_t first_global = symtab->sh_info;
+  cr_assert_eq(symbols[0].st_info, 0, "The first symbol should be null");
+  for (uint32_t i = 1; i < count; i++) {
+    cr_assert_eq(ELF64_ST_BIND(symbols[i].st_info),
+                 i < first_global ? STB_LOCAL : STB_GLOBAL,
+                 "sh_info should split the locals from the globals at %u", i);
+  }
+
+  // A section symbol for every section
+  uint32_t text_index = 0;
+  find_section(&elf, ".text", &text_index);
+  uint32_t section_symbols = 0;
+  for (uint32_t i = 1; i < first_global; i++) {
+    section_symbols += ELF64_ST_TYPE(symbols[i].st_info) == STT_SECTION;
+  }
+  cr_assert_eq(section_symbols, 4);
+
+  const Elf64_Sym *helper = &symbols[find_symbol(&elf, "_helper")];
+  cr_assert_eq(ELF64_ST_BIND(helper->st_info), STB_LOCAL);
+  cr_assert_eq(helper->st_shndx, text_index);
+  cr_assert_eq(helper->st_value, 0);
+  const Elf64_Sym *main_symbol = &symbols[find_symbol(&elf, "main")];
+  cr_assert_eq(ELF64_ST_BIND(main_symbol->st_info), STB_GLOBAL);
+  cr_assert_eq(main_symbol->st_shndx, text_index);
+  cr_assert_eq(main_symbol->st_value, 1, "main comes right after the ret");
+  const Elf64_Sym *exit_symbol = &symbols[find_symbol(&elf, "exit")];
+  cr_assert_eq(ELF64_ST_BIND(exit_symbol->st_info), STB_GLOBAL);
+  cr_assert_eq(exit_symbol->st_shndx, SHN_UNDEF);
+
+  free(elf.file);
+  object_file_destroy(&object);
+}
+
+Test(ObjectFile, writes_relocations_against_the_right_symbols) {
+  ObjectFile object = object_file_init();
+  encode_program(&object);
+  ElfFile elf = write_elf(&object);
+
+  uint32_t symtab_index = 0;
+  uint32_t text_index = 0;
+  uint32_t rodata_index = 0;
+  uint32_t bss_index = 0;
+  find_section(&elf, ".symtab", &symtab_index);
+  find_section(&elf, ".text", &text_index);
+  find_section(&elf, ".rodata", &rodata_index);
+  find_section(&elf, ".bss", &bss_index);
+  const Elf64_Sym *symbols =
+      section_bytes(&elf, find_section(&elf, ".symtab", NULL));
+  const Elf64_Shdr *rela = find_section(&elf, ".rela.text", NULL);
+  cr_assert_eq(rela->sh_type, SHT_RELA);
+  cr_assert_eq(rela->sh_link, symtab_index);
+  cr_assert_eq(rela->sh_info, text_index);
+  cr_assert_eq(rela->sh_flags, SHF_INFO_LINK);
+  cr_assert_eq(rela->sh_entsize, sizeof(Elf64_Rela));
+
+  // lea rdi, [rip+literal] at 1, mov rax, [rip+variables+8] at 8, the call to
+  // the helper resolved in place at 15, and call exit at 20
+  const Elf64_Rela *relocs = section_bytes(&elf, rela);
+  cr_assert_eq(rela->sh_size / sizeof(Elf64_Rela), 3);
+
+  cr_assert_eq(relocs[0].r_offset, 1 + 3);
+  cr_assert_eq(ELF64_R_TYPE(relocs[0].r_info), R_X86_64_PC32);
+  const Elf64_Sym *literal = &symbols[ELF64_R_SYM(relocs[0].r_info)];
+  cr_assert_eq(ELF64_ST_TYPE(literal->st_info), STT_SECTION);
+  cr_assert_eq(literal->st_shndx, rodata_index);
+  cr_assert_eq(relocs[0].r_addend, 4 - 4);
+
+  cr_assert_eq(relocs[1].r_offset, 8 + 3);
+  cr_assert_eq(ELF64_R_TYPE(relocs[1].r_info), R_X86_64_PC32);
+  const Elf64_Sym *variables = &symbols[ELF64_R_SYM(relocs[1].r_info)];
+  cr_assert_eq(variables->st_shndx, bss_index);
+  cr_assert_eq(relocs[1].r_addend, 8 - 4);
+
+  cr_assert_eq(relocs[2].r_offset, 20 + 1);
+  cr_assert_eq(ELF64_R_TYPE(relocs[2].r_info), R_X86_64_PLT32);
+  cr_assert_eq(ELF64_R_SYM(relocs[2].r_info), find_symbol(&elf, "exit"));
+  cr_assert_eq(relocs[2].r_addend, -4);
+
+  free(elf.file);
+  object_file_destroy(&object);
+}
+
+Test(ObjectFile, diff_compares_what_the_linker_sees) {
+  char expected_path[] = "/tmp/teeny-expected-XXXXXX";
+  char actual_path[] = "/tmp/teeny-actual-XXXXXX";
+  const int expected_fd = mkstemp(expected_path);
+  const int actual_fd = mkstemp(actual_path);
+  cr_assert(expected_fd >= 0 && actual_fd >= 0);
+  FILE *expected = fdopen(expected_fd, "w+b");
+  FILE *actual = fdopen(actual_fd, "w+b");
+
+  ObjectFile object = object_file_init();
+  encode_program(&object);
+  cr_assert(object_file_write_elf(&object, expected));
+  fflush(expected);
+  // The same program with a different string literal
+  object.bytes[OBJ_SECTION_RODATA][4] = 'H';
+  cr_assert(object_file_write_elf(&object, actual));
+  fflush(actual);
+
+  cr_assert(object_file_diff_elf(expected_path, expected_path));
+  cr_assert(!object_file_diff_elf(expected_path, actual_path),
+            "A changed .rodata byte should be reported");
+
+  object_file_destroy(&object);
+  fclose(expected);
+  fclose(actual);
+  remove(expected_path);
+  remove(actual_path);
+}
@@ -0,0 +1,134 @@
+#include "../src/backend/peephole.h"
+#include <criterion/criterion.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+static Operand reg(X86Reg r) {
+  return (Operand){.kind = OPERAND_REG, .reg = r};
+}
+
+static Operand imm(int64_t value) {
+  return (Operand){.kind = OPERAND_IMM, .value = value};
+}
+
+// Helper function to make a variable's memory operand, e.g. _vars[rip+8]
+static Operand variable(int64_t offset, PtrSize ptr) {
+  return (Operand){.kind = OPERAND_MEM,
+                   .reg = REG_RIP,
+                   .ptr = ptr,
+                   .symbol = {.kind = SYMBOL_VARIABLES},
+                   .value = offset};
+}
+
+static Operand label(uint32_t id) {
+  return (Operand){.kind = OPERAND_SYMBOL,
+                   .symbol = {.kind = SYMBOL_INTERNAL_LABEL, .id = id}};
+}
+
+static X86Instr op1(X86Op op, Operand a1) {
+  return (X86Instr){.op = op, .operand_count = 1, .operands = {a1}};
+}
+
+static X86Instr op2(X86Op op, Operand a1, Operand a2) {
+  return (X86Instr){.op = op, .operand_count = 2, .operands = {a1, a2}};
+}
+
+// =========================
+// RULE TESTS
+// =========================
+
+Test(Peephole, drops_reloads_of_a_store) {
+  X86Instr instrs[] = {
+      op2(OP_MOV, variable(8, PTR_QWORD), reg(REG_RAX)),
+      op2(OP_MOV, reg(REG_RAX), variable(8, PTR_QWORD)),
+      op2(OP_MOV, reg(REG_R10), variable(8, PTR_NONE)),
+  };
+  PeepholeStats stats = {0};
+  const uint32_t count = peephole_optimize(instrs, 3, NULL, &stats);
+  cr_assert_eq(count, 2, "The load into the stored register should go");
+  cr_assert_eq(stats.removed[PEEPHOLE_RELOAD], 1);
+  cr_assert_eq(instrs[1].operands[1].kind, OPERAND_REG,
+               "The load into another register should copy rax");
+  cr_assert_eq(instrs[1].operands[1].reg, REG_RAX);
+}
+
+Test(Peephole, forwards_stores_to_compares) {
+  X86Instr instrs[] = {
+      op2(OP_MOV, variable(16, PTR_QWORD), reg(REG_RAX)),
+      op2(OP_CMP, variable(16, PTR_QWORD), imm(0)),
+  };
+  PeepholeStats stats = {0};
+  const uint32_t count = peephole_optimize(instrs, 2, NULL, &stats);
+  cr_assert_eq(count, 2, "The store itself has to stay");
+  cr_assert_eq(instrs[1].op, OP_TEST,
+               "Comparing the forwarded register with 0 should test it");
+  cr_assert_eq(instrs[1].operands[0].reg, REG_RAX);
+  cr_assert_eq(instrs[1].operands[1].reg, REG_RAX);
+  cr_assert_eq(stats.rewritten[PEEPHOLE_STORE_FORWARD], 1);
+  cr_assert_eq(stats.rewritten[PEEPHOLE_COMPARE_ZERO], 1);
+}
+
+Test(Peephole, leaves_other_memory_and_sizes_alone) {
+  X86Instr instrs[] = {
+      op2(OP_MOV, variable(8, PTR_QWORD), reg(REG_RAX)),
+      op2(OP_MOV, reg(REG_RAX), variable(16, PTR_QWORD)),
+      op2(OP_MOV, variable(8, PTR_DWORD), reg(REG_RAX)),
+      op2(OP_MOV, reg(REG_R10), variable(8, PTR_DWORD)),
+      op2(OP_ADD, variable(8, PTR_QWORD), reg(REG_RAX)),
+  };
+  PeepholeStats stats = {0};
+  cr_assert_eq(peephole_optimize(instrs, 5, NULL, &stats), 5,
+               "Nothing here is redundant");
+  cr_assert_eq(peephole_removed(&stats), 0);
+}
+
+Test(Peephole, removes_overwritten_moves) {
+  X86Instr instrs[] = {
+      op2(OP_MOV, reg(REG_RAX), imm(3)),
+      op2(OP_MOV, reg(REG_RAX), reg(REG_RAX)),
+      op2(OP_MOV, reg(REG_RAX), variable(8, PTR_QWORD)),
+      op2(OP_MOV, reg(REG_R10), reg(REG_RAX)),
+      op2(OP_MOV, reg(REG_R10), variable(0, PTR_QWORD)),
+  };
+  PeepholeStats stats = {0};
+  const uint32_t count = peephole_optimize(instrs, 5, NULL, &stats);
+  cr_assert_eq(stats.removed[PEEPHOLE_SELF_MOVE], 1);
+  cr_assert_eq(stats.removed[PEEPHOLE_DEAD_MOVE], 2);
+  cr_assert_eq(count, 2, "Only the last load of each register is needed");
+  cr_assert_eq(instrs[0].operands[0].reg, REG_RAX);
+  cr_assert_eq(instrs[0].operands[1].value, 8);
+}
+
+Test(Peephole, cancels_push_pop_pairs) {
+  X86Instr instrs[] = {
+      op1(OP_PUSH, reg(REG_RAX)),
+      op1(OP_PUSH, reg(REG_RCX)),
+      op1(OP_POP, reg(REG_RCX)),
+      op1(OP_POP, reg(REG_R10)),
+  };
+  PeepholeStats stats = {0};
+  const uint32_t count = peephole_optimize(instrs, 4, NULL, &stats);
+  cr_assert_eq(count, 1, "The pairs should become one move");
+  cr_assert_eq(instrs[0].op, OP_MOV);
+  cr_assert_eq(instrs[0].operands[0].reg, REG_R10);
+  cr_assert_eq(instrs[0].operands[1].reg, REG_RAX);
+  cr_assert_eq(stats.removed[PEEPHOLE_PUSH_POP], 3);
+}
+
+Test(Peephole, drops_jumps_to_the_next_label) {
+  X86Instr instrs[] = {
+      op1(OP_JE, label(2)),
+      op1(OP_JMP, label(1)),
+  };
+  const Symbol next = label(1).symbol;
+  const Symbol other = label(2).symbol;
+  PeepholeStats stats = {0};
+  cr_assert_eq(peephole_optimize(instrs, 2, &other, &stats), 2,
+               "A jump somewhere else should stay");
+  cr_assert_eq(peephole_optimize(instrs, 2, &next, &stats), 1,
+               "A jump to the label right after it should go");
+  cr_assert_eq(instrs[0].op, OP_JE, "Conditional jumps should stay");
+  cr_assert_eq(stats.removed[PEEPHOLE_JUMP_TO_NEXT], 1);
+}
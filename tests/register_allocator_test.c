@@ -0,0 +1,218 @@
+#include "../src/backend/register_allocator.h"
+#include <criterion/criterion.h>
+#include <stb_ds.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+static const CallingConvention *const CC = &CC_SYSTEM_V_64;
+
+static IrTemp input(IR *ir, IrBlockID block) {
+  IrInstr *instr = ir_append(ir, block, IR_INPUT);
+  instr->dest = ir_new_temp(ir);
+  return instr->dest;
+}
+
+static void print(IR *ir, IrBlockID block, IrTemp temp) {
+  ir_append(ir, block, IR_PRINT_INT)->args[0] = temp;
+}
+
+// Helper function to read every argument, like code that folds nothing
+static uint32_t all_args(const void *context, const IrInstr *instr,
+                         IrTemp reads[IR_MAX_ARGS]) {
+  (void)context;
+  const uint32_t count = ir_opcode_arg_count(instr->op);
+  for (uint32_t a = 0; a < count; a++) {
+    reads[a] = instr->args[a];
+  }
+  return count;
+}
+
+// Helper function to allocate with every temporary needing a location
+static Allocation allocate(IR *ir) {
+  ir_compute_predecessors(ir);
+  bool *has_location = NULL;
+  arrsetlen(has_location, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    has_location[t] = true;
+  }
+  const Allocation allocation =
+      register_allocate(ir, CC, has_location, all_args, NULL);
+  arrfree(has_location);
+  return allocation;
+}
+
+static bool is_saved_register(X86Reg reg) {
+  for (uint32_t r = 0; r < CC->saved_count; r++) {
+    if (CC->saved_r[r] == reg)
+      return true;
+  }
+  return false;
+}
+
+// =========================
+// ALLOCATION TESTS
+// =========================
+
+Test(RegisterAllocator, gives_local_temporaries_scratch_registers) {
+  IR ir = ir_init(NULL);
+  ir_add_block(&ir);
+  ir.blocks[0].term.kind = IR_TERM_EXIT;
+  const IrTemp a = input(&ir, 0);
+  IrInstr *add = ir_append(&ir, 0, IR_ADD);
+  add->dest = ir_new_temp(&ir);
+  add->args[0] = a;
+  add->args[1] = a;
+  const IrTemp sum = add->dest;
+  print(&ir, 0, sum);
+
+  Allocation allocation = allocate(&ir);
+  cr_assert_eq(allocation.saved_registers, 0,
+               "Nothing is live across a call");
+  cr_assert_eq(allocation.frame_size, 0, "Nothing should be on the stack");
+  cr_assert(!allocation.locations[a].on_stack);
+  cr_assert_eq(allocation.locations[a].reg, CC->scratch_r[0]);
+  cr_assert_eq(allocation.locations[sum].reg, allocation.locations[a].reg,
+               "The sum should take the register of its first argument");
+
+  arrfree(allocation.locations);
+  ir_destroy(&ir);
+}
+
+Test(RegisterAllocator, spills_when_scratch_registers_run_out) {
+  IR ir = ir_init(NULL);
+  ir_add_block(&ir);
+  ir.blocks[0].term.kind = IR_TERM_EXIT;
+  // Every load is live until the sums, and nothing is live across a call
+  const uint32_t count = CC->scratch_count + 2;
+  IrTemp loads[MAX_REGISTER + 2];
+  for (uint32_t i = 0; i < count; i++) {
+    IrInstr *load = ir_append(&ir, 0, IR_LOAD);
+    load->dest = ir_new_temp(&ir);
+    load->variable = i;
+    loads[i] = load->dest;
+  }
+  IrTemp sum = loads[0];
+  for (uint32_t i = 1; i < count; i++) {
+    IrInstr *add = ir_append(&ir, 0, IR_ADD);
+    add->dest = ir_new_temp(&ir);
+    add->args[0] = sum;
+    add->args[1] = loads[i];
+    sum = add->dest;
+  }
+  print(&ir, 0, sum);
+
+  Allocation allocation = allocate(&ir);
+  cr_assert_eq(allocation.saved_registers, 0,
+               "Local values shouldn't take callee-saved registers");
+  uint32_t used = 0;
+  uint32_t spilled = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const TempLocation *location = &allocation.locations[loads[i]];
+    if (location->on_stack) {
+      spilled++;
+      continue;
+    }
+    cr_assert(!is_saved_register(location->reg));
+    for (uint32_t r = 0; r < CC->scratch_count; r++) {
+      if (CC->scratch_r[r] == location->reg) {
+        cr_assert_eq(used >> r & 1, 0, "Live values can't share a register");
+        used |= 1u << r;
+      }
+    }
+  }
+  cr_assert_eq(used, (1u << CC->scratch_count) - 1,
+               "Every scratch register should be used");
+  cr_assert_eq(spilled, 2, "What doesn't fit should go to the stack");
+  cr_assert_eq(allocation.frame_size, 2 * STACK_SLOT_SIZE);
+
+  arrfree(allocation.locations);
+  ir_destroy(&ir);
+}
+
+Test(RegisterAllocator, spills_when_callee_saved_registers_run_out) {
+  IR ir = ir_init(NULL);
+  ir_add_block(&ir);
+  ir.blocks[0].term.kind = IR_TERM_EXIT;
+  // Every input is live across the inputs after it
+  const uint32_t count = CC->saved_count + 3;
+  IrTemp temps[MAX_REGISTER + 3];
+  for (uint32_t i = 0; i < count; i++) {
+    temps[i] = input(&ir, 0);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    print(&ir, 0, temps[i]);
+  }
+
+  Allocation allocation = allocate(&ir);
+  cr_assert_eq(allocation.saved_registers, (1u << CC->saved_count) - 1,
+               "Every callee-saved register should be used");
+  uint32_t used = 0;
+  uint32_t spilled = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const TempLocation *location = &allocation.locations[temps[i]];
+    if (location->on_stack) {
+      spilled++;
+      // The callee-saved registers are saved in the first slots
+      cr_assert_lt(location->offset,
+                   -(int32_t)(CC->saved_count * STACK_SLOT_SIZE));
+      continue;
+    }
+    cr_assert(is_saved_register(location->reg),
+              "Values live across a call need a callee-saved register");
+    for (uint32_t r = 0; r < CC->saved_count; r++) {
+      if (CC->saved_r[r] == location->reg) {
+        cr_assert_eq(used >> r & 1, 0, "Live values can't share a register");
+        used |= 1u << r;
+      }
+    }
+  }
+  cr_assert_eq(spilled, 3, "What doesn't fit should go to the stack");
+  cr_assert_eq(allocation.frame_size,
+               ((CC->saved_count + 3) * STACK_SLOT_SIZE + 15) & ~15u,
+               "The frame should hold the saved registers and the spills, "
+               "16 byte aligned");
+
+  arrfree(allocation.locations);
+  ir_destroy(&ir);
+}
+
+Test(RegisterAllocator, keeps_values_loops_use_in_registers) {
+  IR ir = ir_init(NULL);
+  const IrBlockID entry = ir_add_block(&ir);
+  const IrBlockID loop = ir_add_block(&ir);
+  const IrBlockID exit = ir_add_block(&ir);
+  const uint32_t count = CC->saved_count + 1;
+  IrTemp temps[MAX_REGISTER + 1];
+  for (uint32_t i = 0; i < count; i++) {
+    temps[i] = input(&ir, entry);
+  }
+  // Only the last input is used in the loop, and it's mentioned least
+  const IrTemp counter = temps[count - 1];
+  ir.blocks[entry].term = (IrTerminator){.kind = IR_TERM_JUMP,
+                                         .targets = {loop, IR_NO_BLOCK}};
+  print(&ir, loop, counter);
+  ir.blocks[loop].term = (IrTerminator){.kind = IR_TERM_BRANCH,
+                                        .cond = IR_COND_NE,
+                                        .args = {counter, counter},
+                                        .targets = {loop, exit}};
+  for (uint32_t i = 0; i < count - 1; i++) {
+    print(&ir, exit, temps[i]);
+    print(&ir, exit, temps[i]);
+  }
+  ir.blocks[exit].term.kind = IR_TERM_EXIT;
+
+  Allocation allocation = allocate(&ir);
+  cr_assert(!allocation.locations[counter].on_stack,
+            "The value the loop uses should keep its register");
+  cr_assert(is_saved_register(allocation.locations[counter].reg));
+  uint32_t spilled = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    spilled += allocation.locations[temps[i]].on_stack;
+  }
+  cr_assert_eq(spilled, 1, "One of the others should go to the stack");
+
+  arrfree(allocation.locations);
+  ir_destroy(&ir);
+}
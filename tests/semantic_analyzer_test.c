@@ -5,6 +5,7 @@
 #include "../src/frontend/parser/parser.h"
 #include "../src/frontend/semantic_analyzer/semantic_analyzer.h"
 #include <criterion/criterion.h>
+#include <stb_ds.h>
 
 // =========================
 // HELPER FUNCTIONS
@@ -877,3 +878,84 @@ Test(SemanticAnalyzer, stress_test_many_labels) {
 
   cleanup_test_data(&ast, &ta, table);
 }
+
+// =========================
+// VARIABLE SLOT LAYOUT TESTS
+// =========================
+
+Test(SemanticAnalyzer, variable_slots_are_dense) {
+  const char *program = "LET a = 1\n"
+                        "LET b = 2\n"
+                        "LET c = 3\n";
+
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  setup_test_data(program, &ast, &ta, &table);
+
+  bool seen[3] = {false, false, false};
+  for (size_t i = 0; i < shlenu(table->variable_table); i++) {
+    const uint32_t slot = table->variable_table[i].value.slot;
+    cr_assert_lt(slot, 3, "Slot %u should be below the variable count", slot);
+    cr_assert(!seen[slot], "Slot %u should only be assigned once", slot);
+    seen[slot] = true;
+  }
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+Test(SemanticAnalyzer, variable_slots_ordered_by_access_frequency) {
+  const char *program = "LET cold = 0\n"
+                        "LET warm = 0\n"
+                        "LET hot = 0\n"
+                        "LET warm = warm + 1\n"
+                        "WHILE hot < 10 REPEAT\n"
+                        "  LET hot = hot + 1\n"
+                        "ENDWHILE\n";
+
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  setup_test_data(program, &ast, &ta, &table);
+
+  cr_assert_eq(shget(table->variable_table, "hot").slot, 0,
+               "Variable accessed in a loop should get the first slot");
+  cr_assert_eq(shget(table->variable_table, "warm").slot, 1);
+  cr_assert_eq(shget(table->variable_table, "cold").slot, 2,
+               "Variable accessed once should get the last slot");
+
+  cleanup_test_data(&ast, &ta, table);
+}
+
+Test(SemanticAnalyzer, variable_tokens_resolved_to_table_index) {
+  const char *program = "LET x = 5\n"
+                        "LABEL x_label\n"
+                        "PRINT x\n"
+                        "GOTO x_label\n";
+
+  AST ast;
+  TokenArray ta = NULL;
+  NameTable *table;
+  setup_test_data(program, &ast, &ta, &table);
+
+  const ptrdiff_t x_index = shgeti(table->variable_table, "x");
+  uint32_t resolved = 0;
+  for (uint32_t node = 0; node < ast.node_array_size; node++) {
+    if (!ast_node_is_token(&ast, node))
+      continue;
+    const Token *token = ast_node_get_token(&ast, node);
+    if (token->type != TOKEN_IDENT)
+      continue;
+    if (strcmp(token->text, "x") == 0) {
+      cr_assert_eq(token->symbol_index, (uint32_t)x_index,
+                   "Variable references should be resolved");
+      resolved++;
+    } else {
+      cr_assert_eq(token->symbol_index, TOKEN_NO_SYMBOL,
+                   "Label references should not be resolved as variables");
+    }
+  }
+  cr_assert_eq(resolved, 2, "Both references to x should be resolved");
+
+  cleanup_test_data(&ast, &ta, table);
+}
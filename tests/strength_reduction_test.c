@@ -0,0 +1,195 @@
+#include "../src/backend/strength_reduction.h"
+#include <criterion/criterion.h>
+#include <stb_ds.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+// Helper function to shift like sar
+static int64_t sar(int64_t value, uint32_t shift) { return value >> shift; }
+
+// Helper function to shift like shr
+static int64_t shr(int64_t value, uint32_t shift) {
+  return (int64_t)((uint64_t)value >> shift);
+}
+
+// Helper function to add and negate with wraparound, like x86 does
+static int64_t wrap_add(int64_t a, int64_t b) {
+  return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+
+static int64_t wrap_neg(int64_t value) { return (int64_t)-(uint64_t)value; }
+
+// Helper function to run a multiply plan the way the emitted code does
+static int64_t run_multiply(const MultiplyPlan *plan, int64_t x, int64_t f) {
+  if (plan->zero)
+    return 0;
+  if (plan->multiply)
+    return (int64_t)((uint64_t)x * (uint64_t)f);
+  int64_t y = x;
+  if (plan->scale)
+    y = wrap_add(x, (int64_t)((uint64_t)x * plan->scale));
+  y = (int64_t)((uint64_t)y << plan->shift);
+  return plan->negate ? wrap_neg(y) : y;
+}
+
+// Helper function to run a divide plan the way the emitted code does
+static int64_t run_divide(const DividePlan *plan, int64_t x, int64_t d) {
+  switch (plan->kind) {
+  case DIVIDE_IDIV:
+    return x / d;
+  case DIVIDE_COPY:
+    return x;
+  case DIVIDE_SHIFT: {
+    const int64_t bias = shr(sar(x, 63), 64 - plan->shift);
+    const int64_t q = sar(wrap_add(x, bias), plan->shift);
+    return plan->negate ? wrap_neg(q) : q;
+  }
+  case DIVIDE_MAGIC: {
+    // One operand imul leaves the high half of the product in rdx
+    const __int128 product = (__int128)plan->multiplier * x;
+    int64_t q = (int64_t)(product >> 64);
+    if (plan->adjust > 0)
+      q = wrap_add(q, x);
+    if (plan->adjust < 0)
+      q = wrap_add(q, wrap_neg(x));
+    q = sar(q, plan->shift);
+    return wrap_add(q, shr(q, 63));
+  }
+  }
+  return 0;
+}
+
+// Helper function to list the values most likely to break a plan: small ones,
+// the ends of the range, and powers of two and their neighbours
+static int64_t *edge_values(void) {
+  int64_t *values = NULL;
+  for (int64_t v = -300; v <= 300; v++) {
+    arrput(values, v);
+  }
+  for (uint32_t shift = 8; shift < 63; shift++) {
+    const int64_t power = (int64_t)1 << shift;
+    const int64_t near[] = {power - 1, power, power + 1};
+    for (uint32_t i = 0; i < 3; i++) {
+      arrput(values, near[i]);
+      arrput(values, -near[i]);
+    }
+  }
+  const int64_t extremes[] = {INT64_MIN,     INT64_MIN + 1, INT64_MAX,
+                              INT64_MAX - 1, 1000000007,    -1000000007,
+                              INT32_MIN,     INT32_MAX,     (int64_t)UINT32_MAX,
+                              3037000499,    -3037000499,   6148914691236517205};
+  for (uint32_t i = 0; i < sizeof(extremes) / sizeof(*extremes); i++) {
+    arrput(values, extremes[i]);
+  }
+  return values;
+}
+
+// =========================
+// MULTIPLICATION TESTS
+// =========================
+
+Test(StrengthReduction, plans_cheap_products) {
+  const MultiplyPlan by_8 = strength_reduce_multiply(8);
+  cr_assert(!by_8.multiply && by_8.shift == 3 && !by_8.scale,
+            "x * 8 should be a shift");
+  const MultiplyPlan by_40 = strength_reduce_multiply(40);
+  cr_assert(!by_40.multiply && by_40.scale == 4 && by_40.shift == 3,
+            "x * 40 should be an lea and a shift");
+  cr_assert(strength_reduce_multiply(7).multiply, "x * 7 should multiply");
+  cr_assert(strength_reduce_multiply(-40).multiply,
+            "Three steps shouldn't beat a multiply");
+  cr_assert(strength_reduce_multiply(0).zero, "x * 0 should be 0");
+}
+
+Test(StrengthReduction, products_match_multiplication) {
+  int64_t *values = edge_values();
+  for (size_t f = 0; f < arrlenu(values); f++) {
+    const MultiplyPlan plan = strength_reduce_multiply(values[f]);
+    for (size_t x = 0; x < arrlenu(values); x++) {
+      const int64_t expected =
+          (int64_t)((uint64_t)values[x] * (uint64_t)values[f]);
+      const int64_t actual = run_multiply(&plan, values[x], values[f]);
+      cr_assert_eq(actual, expected, "%lld * %lld should be %lld, not %lld",
+                   (long long)values[x], (long long)values[f],
+                   (long long)expected, (long long)actual);
+    }
+  }
+  arrfree(values);
+}
+
+// =========================
+// DIVISION TESTS
+// =========================
+
+Test(StrengthReduction, leaves_trapping_division_to_idiv) {
+  cr_assert_eq(strength_reduce_divide(0).kind, DIVIDE_IDIV,
+               "Dividing by 0 should still trap");
+  cr_assert_eq(strength_reduce_divide(-1).kind, DIVIDE_IDIV,
+               "INT64_MIN / -1 should still trap");
+  cr_assert_eq(strength_reduce_divide(1).kind, DIVIDE_COPY,
+               "Dividing by 1 should copy");
+  cr_assert_eq(strength_reduce_divide(INT64_MIN).kind, DIVIDE_SHIFT,
+               "INT64_MIN is a negative power of two");
+}
+
+Test(StrengthReduction, known_magic_numbers) {
+  const DividePlan by_3 = strength_reduce_divide(3);
+  cr_assert_eq(by_3.kind, DIVIDE_MAGIC);
+  cr_assert_eq(by_3.multiplier, 0x5555555555555556);
+  cr_assert_eq(by_3.shift, 0);
+  cr_assert_eq(by_3.adjust, 0);
+
+  const DividePlan by_7 = strength_reduce_divide(7);
+  cr_assert_eq(by_7.multiplier, (int64_t)0x4924924924924925);
+  cr_assert_eq(by_7.shift, 1);
+  cr_assert_eq(by_7.adjust, 0);
+}
+
+Test(StrengthReduction, quotients_match_division) {
+  int64_t *values = edge_values();
+  for (size_t d = 0; d < arrlenu(values); d++) {
+    const int64_t divisor = values[d];
+    if (divisor == 0)
+      continue;
+    const DividePlan plan = strength_reduce_divide(divisor);
+    for (size_t x = 0; x < arrlenu(values); x++) {
+      const int64_t dividend = values[x];
+      if (dividend == INT64_MIN && divisor == -1)
+        continue;
+      const int64_t expected = dividend / divisor;
+      const int64_t actual = run_divide(&plan, dividend, divisor);
+      cr_assert_eq(actual, expected, "%lld / %lld should be %lld, not %lld",
+                   (long long)dividend, (long long)divisor,
+                   (long long)expected, (long long)actual);
+    }
+  }
+  arrfree(values);
+}
+
+Test(StrengthReduction, quotients_round_toward_zero_near_multiples) {
+  int64_t *values = edge_values();
+  for (size_t d = 0; d < arrlenu(values); d++) {
+    const int64_t divisor = values[d];
+    if (divisor == 0 || divisor == -1)
+      continue;
+    const DividePlan plan = strength_reduce_divide(divisor);
+    // The dividends on either side of the largest multiples of the divisor,
+    // where an off by one multiplier shows up first
+    const int64_t top = INT64_MAX / divisor * divisor;
+    const int64_t bottom = INT64_MIN / divisor * divisor;
+    const int64_t dividends[] = {top,    top - 1,    wrap_add(top, 1),
+                                 bottom, bottom + 1, wrap_add(bottom, -1),
+                                 divisor, wrap_neg(divisor)};
+    for (uint32_t i = 0; i < sizeof(dividends) / sizeof(*dividends); i++) {
+      if (dividends[i] == INT64_MIN && divisor == -1)
+        continue;
+      const int64_t expected = dividends[i] / divisor;
+      cr_assert_eq(run_divide(&plan, dividends[i], divisor), expected,
+                   "%lld / %lld should be %lld", (long long)dividends[i],
+                   (long long)divisor, (long long)expected);
+    }
+  }
+  arrfree(values);
+}
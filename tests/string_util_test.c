@@ -394,4 +394,21 @@ Test(special_chars, high_ascii) {
   cr_assert_eq((unsigned char)str[15], 0xFD, "Should preserve high ASCII");
 
   free(str);
-}
\ No newline at end of file
+}
+// === DECIMAL PARSING TESTS ===
+
+Test(parse_decimal, simple_numbers) {
+  cr_assert_eq(string_parse_decimal_wrapping("0"), 0);
+  cr_assert_eq(string_parse_decimal_wrapping("42"), 42);
+  cr_assert_eq(string_parse_decimal_wrapping("007"), 7,
+               "Leading zeros are still decimal");
+  cr_assert_eq(string_parse_decimal_wrapping("9223372036854775807"),
+               INT64_MAX);
+}
+
+Test(parse_decimal, wraps_on_overflow) {
+  cr_assert_eq(string_parse_decimal_wrapping("9223372036854775808"),
+               INT64_MIN);
+  cr_assert_eq(string_parse_decimal_wrapping("18446744073709551615"), -1);
+  cr_assert_eq(string_parse_decimal_wrapping("18446744073709551616"), 0);
+}
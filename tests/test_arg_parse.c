@@ -382,6 +382,37 @@ Test(arg_parse, test_compound_flag_value_not_last_error) {
   argparse_free_parser(parser);
 }
 
+Test(arg_parse, test_attached_flag_value) {
+  static const FlagSpec flags[] = {
+      FLAG('v', "verbose", "Enable verbose output"),
+      FLAG_WITH_VALUE('O', "optimize", "Optimization level")};
+  static const ArgSpec args[] = {};
+  static const ParserSpec spec = {.program_name = "test",
+                                  .description = "Test program",
+                                  .flags = flags,
+                                  .flag_count = 2,
+                                  .args = args,
+                                  .arg_count = 0};
+
+  ArgParser *parser = argparse_create(&spec);
+  cr_assert_not_null(parser, "Parser creation failed");
+
+  // Test a value attached to the flag: -O2
+  const char **argv = create_argv(3, "test", "-O2", "-v");
+  ParseResult *result = argparse_parse(parser, 3, argv);
+  cr_assert_not_null(result, "Parse result is null");
+  cr_assert(argparse_is_success(result), "Parse should succeed");
+  cr_assert(argparse_has_flag(result, "O"), "Should have -O flag");
+  cr_assert_str_eq(argparse_get_flag_value(result, "O"), "2",
+                   "Attached value should be the rest of the argument");
+  cr_assert(argparse_has_flag(result, "v"), "Should have -v flag");
+
+  // Cleanup
+  free_argv(argv);
+  argparse_free_result(result);
+  argparse_free_parser(parser);
+}
+
 // === Edge Cases and Boundary Tests ===
 
 Test(arg_parse, test_empty_arguments) {
@@ -0,0 +1,166 @@
+#include "../src/backend/tree_tiler.h"
+#include <criterion/criterion.h>
+#include <stb_ds.h>
+
+// =========================
+// HELPER FUNCTIONS
+// =========================
+
+// Helper function to make an IR with a single block to fill in
+static IR single_block(void) {
+  IR ir = ir_init(NULL);
+  ir_add_block(&ir);
+  ir.blocks[0].term.kind = IR_TERM_EXIT;
+  return ir;
+}
+
+static IrTemp input(IR *ir) {
+  IrInstr *instr = ir_append(ir, 0, IR_INPUT);
+  instr->dest = ir_new_temp(ir);
+  return instr->dest;
+}
+
+static IrTemp constant(IR *ir, int64_t value) {
+  IrInstr *instr = ir_append(ir, 0, IR_CONST);
+  instr->dest = ir_new_temp(ir);
+  instr->value = value;
+  return instr->dest;
+}
+
+static IrTemp binary(IR *ir, IrOpcode op, IrTemp left, IrTemp right) {
+  IrInstr *instr = ir_append(ir, 0, op);
+  instr->dest = ir_new_temp(ir);
+  instr->args[0] = left;
+  instr->args[1] = right;
+  return instr->dest;
+}
+
+static void print(IR *ir, IrTemp temp) {
+  ir_append(ir, 0, IR_PRINT_INT)->args[0] = temp;
+}
+
+// Helper function to describe the temporaries of a single block the way the
+// instruction selector does, with constants as immediates and everything else
+// in a register
+static TreeTemp *describe(const IR *ir) {
+  TreeTemp *temps = NULL;
+  arrsetlen(temps, ir->temp_count);
+  for (IrTemp t = 0; t < ir->temp_count; t++) {
+    temps[t] = (TreeTemp){.variable = TREE_NO_VARIABLE, .block = 0};
+  }
+  const IrBlock *block = &ir->blocks[0];
+  for (uint32_t i = 0; i < block->instr_count; i++) {
+    const IrInstr *instr = &block->instrs[i];
+    for (uint32_t a = 0; a < ir_opcode_arg_count(instr->op); a++) {
+      temps[instr->args[a]].reads++;
+    }
+    if (instr->dest == IR_NO_TEMP)
+      continue;
+    TreeTemp *temp = &temps[instr->dest];
+    temp->defs++;
+    temp->def = i;
+    temp->known = instr->op == IR_CONST;
+    temp->value = instr->value;
+    temp->has_location = !temp->known;
+  }
+  return temps;
+}
+
+// =========================
+// TILING TESTS
+// =========================
+
+Test(TreeTiler, tiles_scaled_sums_into_one_lea) {
+  IR ir = single_block();
+  const IrTemp a = input(&ir);
+  const IrTemp b = input(&ir);
+  const IrTemp scaled = binary(&ir, IR_MUL, b, constant(&ir, 4));
+  const IrTemp sum = binary(&ir, IR_ADD, a, scaled);
+  const IrTemp root = binary(&ir, IR_ADD, sum, constant(&ir, 8));
+  print(&ir, root);
+
+  TreeTemp *temps = describe(&ir);
+  TreeAddress *addresses = tree_tile(&ir, temps, 0);
+  cr_assert_eq(arrlenu(addresses), 1, "a + b * 4 + 8 should be a single lea");
+  cr_assert_eq(temps[root].address, 0);
+  cr_assert(temps[scaled].covered && temps[sum].covered,
+            "The nodes under the lea shouldn't be emitted");
+  cr_assert_eq(addresses[0].base, a);
+  cr_assert_eq(addresses[0].index, b);
+  cr_assert_eq(addresses[0].scale, 4);
+  cr_assert_eq(addresses[0].disp, 8);
+
+  arrfree(addresses);
+  arrfree(temps);
+  ir_destroy(&ir);
+}
+
+Test(TreeTiler, tiles_products_by_three_five_and_nine) {
+  IR ir = single_block();
+  const IrTemp b = input(&ir);
+  const IrTemp product = binary(&ir, IR_MUL, b, constant(&ir, 5));
+  const IrTemp root = binary(&ir, IR_SUB, product, constant(&ir, 7));
+  print(&ir, root);
+
+  TreeTemp *temps = describe(&ir);
+  TreeAddress *addresses = tree_tile(&ir, temps, 0);
+  cr_assert_eq(arrlenu(addresses), 1, "b * 5 - 7 should be a single lea");
+  cr_assert(temps[product].covered);
+  cr_assert_eq(addresses[0].base, b);
+  cr_assert_eq(addresses[0].index, b, "b * 5 is b + b * 4");
+  cr_assert_eq(addresses[0].scale, 4);
+  cr_assert_eq(addresses[0].disp, -7);
+
+  arrfree(addresses);
+  arrfree(temps);
+  ir_destroy(&ir);
+}
+
+Test(TreeTiler, leaves_plain_adds_and_other_products_alone) {
+  IR ir = single_block();
+  const IrTemp a = input(&ir);
+  const IrTemp b = input(&ir);
+  // a lives in a variable's memory, and the sum is stored back to it
+  const IrTemp in_place = binary(&ir, IR_ADD, a, b);
+  const IrTemp product = binary(&ir, IR_MUL, b, constant(&ir, 7));
+  print(&ir, product);
+
+  TreeTemp *temps = describe(&ir);
+  temps[a].variable = 0;
+  temps[a].has_location = false;
+  temps[in_place].variable = 0;
+  temps[in_place].has_location = false;
+  TreeAddress *addresses = tree_tile(&ir, temps, 1);
+  cr_assert_eq(arrlenu(addresses), 0, "Nothing here is cheaper as an lea");
+  cr_assert_eq(temps[in_place].address, TREE_NO_ADDRESS,
+               "Adding to a variable in place is a single add");
+  cr_assert_eq(temps[product].address, TREE_NO_ADDRESS,
+               "No addressing mode multiplies by 7");
+
+  arrfree(addresses);
+  arrfree(temps);
+  ir_destroy(&ir);
+}
+
+Test(TreeTiler, keeps_nodes_read_more_than_once) {
+  IR ir = single_block();
+  const IrTemp a = input(&ir);
+  const IrTemp b = input(&ir);
+  const IrTemp scaled = binary(&ir, IR_MUL, b, constant(&ir, 8));
+  const IrTemp root = binary(&ir, IR_ADD, a, scaled);
+  print(&ir, root);
+  print(&ir, scaled);
+
+  TreeTemp *temps = describe(&ir);
+  TreeAddress *addresses = tree_tile(&ir, temps, 0);
+  cr_assert(!temps[scaled].covered,
+            "A node something else reads has to be emitted");
+  cr_assert_eq(arrlenu(addresses), 1);
+  cr_assert_eq(addresses[0].index, scaled,
+               "The root should read the node's register instead");
+  cr_assert_eq(addresses[0].scale, 1);
+
+  arrfree(addresses);
+  arrfree(temps);
+  ir_destroy(&ir);
+}